@@ -0,0 +1,2583 @@
+#include "sophia-cc.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+
+using namespace sophia;
+
+/**
+ * Benchmark parameters.
+ */
+
+typedef struct {
+  size_t records;
+  size_t keysize;
+  size_t valuesize;
+  int read_percent;
+} BenchConfig;
+
+/**
+ * Latency samples, in nanoseconds.
+ */
+
+typedef struct {
+  uint64_t *samples;
+  size_t count;
+  size_t capacity;
+} Latencies;
+
+#define BENCH(name) \
+  static void Bench##name(Sophia *sp, const BenchConfig *config)
+
+#define RUN_BENCH(name, config) \
+  Bench##name(sp, config)
+
+#define SOPHIA_ASSERT(rc) \
+  if (SOPHIA_SUCCESS != rc) { \
+    fprintf( \
+        stderr \
+      , "Error: %s (%d / %s at line %d)\n" \
+      , sp->Error(rc) \
+      , rc \
+      , __PRETTY_FUNCTION__ \
+      , __LINE__ \
+    ); \
+    exit(1); \
+  }
+
+/**
+ * Emit JSON instead of a table.
+ */
+
+static bool json = false;
+
+/**
+ * Results reported so far.
+ */
+
+static size_t reported = 0;
+
+/**
+ * Most reader threads to run.
+ */
+
+static size_t max_threads = 0;
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+
+static uint64_t
+Nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Heap allocations counted since CountAllocations(), for
+ * allocations per lookup.  Counting interposes glibc's
+ * allocator, so it covers sophia's own allocations too.
+ */
+
+static std::atomic<bool> counting_allocations(false);
+static std::atomic<uint64_t> allocations(0);
+
+#ifdef __GLIBC__
+#define BENCH_ALLOCATIONS 1
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static inline void
+CountAllocation() {
+  if (counting_allocations.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+extern "C" void *
+malloc(size_t size) noexcept {
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+extern "C" void *
+calloc(size_t n, size_t size) noexcept {
+  CountAllocation();
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *
+realloc(void *ptr, size_t size) noexcept {
+  CountAllocation();
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+/**
+ * Start counting heap allocations.
+ */
+
+static void
+CountAllocations() {
+  allocations = 0;
+  counting_allocations = true;
+}
+
+/**
+ * Stop counting heap allocations.
+ */
+
+static void
+StopAllocations() {
+  counting_allocations = false;
+}
+
+/**
+ * Report the heap allocations counted per op of the `ops`
+ * operations of `name`.
+ */
+
+static void
+ReportAllocations(const char *name, size_t ops) {
+#ifdef BENCH_ALLOCATIONS
+  if (!json) {
+    printf(
+        "  %-32s %12.2f allocs/op\n"
+      , name
+      , ops ? (double) allocations / ops : 0
+    );
+  }
+#else
+  (void) name;
+  (void) ops;
+#endif
+}
+
+/**
+ * Prepare `latencies` for about `n` samples.
+ */
+
+static void
+LatenciesInit(Latencies *latencies, size_t n) {
+  latencies->capacity = n ? n : 1;
+  latencies->count = 0;
+  latencies->samples = (uint64_t *) malloc(
+    latencies->capacity * sizeof(uint64_t)
+  );
+  if (!latencies->samples) exit(1);
+}
+
+/**
+ * Record a sample of `ns`.
+ */
+
+static inline void
+Record(Latencies *latencies, uint64_t ns) {
+  if (latencies->count == latencies->capacity) {
+    latencies->capacity *= 2;
+    latencies->samples = (uint64_t *) realloc(
+        latencies->samples
+      , latencies->capacity * sizeof(uint64_t)
+    );
+    if (!latencies->samples) exit(1);
+  }
+  latencies->samples[latencies->count++] = ns;
+}
+
+/**
+ * Quantile `q` of sorted `latencies`.
+ */
+
+static uint64_t
+Percentile(const Latencies *latencies, double q) {
+  size_t i = (size_t) (q * latencies->count);
+  if (i >= latencies->count) i = latencies->count - 1;
+  return latencies->samples[i];
+}
+
+/**
+ * Free `latencies`.
+ */
+
+static void
+LatenciesFree(Latencies *latencies) {
+  free(latencies->samples);
+  latencies->samples = NULL;
+  latencies->count = 0;
+}
+
+/**
+ * Report `ops` operations of `name` which took `elapsed`
+ * nanoseconds, with percentiles when `latencies` were
+ * recorded.
+ */
+
+static void
+Report(
+    const BenchConfig *config
+  , const char *name
+  , size_t ops
+  , uint64_t elapsed
+  , Latencies *latencies
+) {
+  double seconds = elapsed / 1e9;
+  double rate = seconds > 0 ? ops / seconds : 0;
+  bool percentiles = latencies && latencies->count;
+
+  if (percentiles) {
+    std::sort(
+        latencies->samples
+      , latencies->samples + latencies->count
+    );
+  }
+
+  if (json) {
+    printf(
+        "%s\n  {\"name\": \"%s\", \"records\": %zu, \"key_size\": %zu"
+        ", \"value_size\": %zu, \"read_percent\": %d, \"ops\": %zu"
+        ", \"seconds\": %.6f, \"ops_per_sec\": %.1f"
+      , reported ? "," : ""
+      , name
+      , config->records
+      , config->keysize
+      , config->valuesize
+      , config->read_percent
+      , ops
+      , seconds
+      , rate
+    );
+    if (percentiles) {
+      printf(
+          ", \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}"
+        , (unsigned long long) Percentile(latencies, 0.5)
+        , (unsigned long long) Percentile(latencies, 0.99)
+        , (unsigned long long) Percentile(latencies, 0.999)
+      );
+    } else {
+      printf(", \"p50_ns\": null, \"p99_ns\": null, \"p999_ns\": null}");
+    }
+  } else {
+    printf("  %-32s %12.0f ops/s", name, rate);
+    if (percentiles) {
+      printf(
+          " %9.2f %9.2f %9.2f us"
+        , Percentile(latencies, 0.5) / 1e3
+        , Percentile(latencies, 0.99) / 1e3
+        , Percentile(latencies, 0.999) / 1e3
+      );
+    }
+    printf("\n");
+  }
+
+  reported++;
+}
+
+/**
+ * Print the table header for `config`.
+ */
+
+static void
+Header(const BenchConfig *config) {
+  if (json) return;
+  printf(
+      "\n  records=%zu key=%zuB value=%zuB\n\n"
+      "  %-32s %18s %9s %9s %9s\n"
+    , config->records
+    , config->keysize
+    , config->valuesize
+    , ""
+    , ""
+    , "p50"
+    , "p99"
+    , "p999"
+  );
+}
+
+/**
+ * Write key `i` of `keysize` (NUL included) to `key`.
+ */
+
+static inline void
+MakeKey(char *key, size_t i, size_t keysize) {
+  snprintf(key, keysize, "key%0*zu", (int) (keysize - 4), i);
+}
+
+/**
+ * Allocate a value of `valuesize`.
+ */
+
+static char *
+MakeValue(size_t valuesize) {
+  char *value = (char *) malloc(valuesize);
+  if (!value) exit(1);
+  memset(value, 'v', valuesize);
+  value[valuesize - 1] = '\0';
+  return value;
+}
+
+/**
+ * Load every record without measuring.
+ */
+
+BENCH(Load) {
+  char key[256];
+  char *value = MakeValue(config->valuesize);
+  WriteBatch batch;
+
+  for (size_t i = 0; i < config->records; i++) {
+    MakeKey(key, i, config->keysize);
+    SOPHIA_ASSERT(batch.Set(key, config->keysize, value, config->valuesize));
+    if (10000 == batch.Count()) {
+      SOPHIA_ASSERT(sp->Write(batch));
+      batch.Clear();
+    }
+  }
+  if (batch.Count()) SOPHIA_ASSERT(sp->Write(batch));
+  free(value);
+}
+
+/**
+ * Sophia::Set of every record, in key order.
+ */
+
+BENCH(Set) {
+  char key[256];
+  char *value = MakeValue(config->valuesize);
+  Latencies latencies;
+  LatenciesInit(&latencies, config->records);
+
+  uint64_t start = Nanos();
+  for (size_t i = 0; i < config->records; i++) {
+    MakeKey(key, i, config->keysize);
+    uint64_t t = Nanos();
+    SOPHIA_ASSERT(sp->Set(key, config->keysize, value, config->valuesize));
+    Record(&latencies, Nanos() - t);
+  }
+  Report(config, "Set", config->records, Nanos() - start, &latencies);
+
+  LatenciesFree(&latencies);
+  free(value);
+}
+
+/**
+ * Sophia::Get of random records.
+ */
+
+BENCH(Get) {
+  char key[256];
+  Latencies latencies;
+  LatenciesInit(&latencies, config->records);
+
+  uint64_t start = Nanos();
+  for (size_t i = 0; i < config->records; i++) {
+    MakeKey(key, (size_t) rand() % config->records, config->keysize);
+    uint64_t t = Nanos();
+    char *value = sp->Get(key, config->keysize);
+    Record(&latencies, Nanos() - t);
+    if (!value) exit(1);
+    free(value);
+  }
+  Report(config, "Get", config->records, Nanos() - start, &latencies);
+
+  LatenciesFree(&latencies);
+}
+
+/**
+ * Random Gets and Sets in `read_percent` proportion.
+ */
+
+BENCH(Mixed) {
+  char key[256];
+  char name[64];
+  char *value = MakeValue(config->valuesize);
+  Latencies latencies;
+  LatenciesInit(&latencies, config->records);
+
+  uint64_t start = Nanos();
+  for (size_t i = 0; i < config->records; i++) {
+    MakeKey(key, (size_t) rand() % config->records, config->keysize);
+    uint64_t t = Nanos();
+    if (rand() % 100 < config->read_percent) {
+      free(sp->Get(key, config->keysize));
+    } else {
+      SOPHIA_ASSERT(sp->Set(key, config->keysize, value, config->valuesize));
+    }
+    Record(&latencies, Nanos() - t);
+  }
+  sprintf(name, "Mixed %d%% reads", config->read_percent);
+  Report(config, name, config->records, Nanos() - start, &latencies);
+
+  LatenciesFree(&latencies);
+  free(value);
+}
+
+/**
+ * Full Iterator scan.
+ */
+
+BENCH(Iterator) {
+  IteratorResult result;
+  Latencies latencies;
+  size_t rows = 0;
+  LatenciesInit(&latencies, config->records);
+
+  Iterator it(sp);
+  SOPHIA_ASSERT(it.Begin());
+  uint64_t start = Nanos();
+  for (;;) {
+    uint64_t t = Nanos();
+    if (!it.Next(&result)) break;
+    Record(&latencies, Nanos() - t);
+    rows++;
+  }
+  Report(config, "Iterator::Next", rows, Nanos() - start, &latencies);
+  SOPHIA_ASSERT(it.End());
+
+  LatenciesFree(&latencies);
+}
+
+/**
+ * Transaction::Commit of 100 Sets each.
+ */
+
+BENCH(Commit) {
+  char key[256];
+  char *value = MakeValue(config->valuesize);
+  size_t commits = config->records / 100 ? config->records / 100 : 1;
+  Latencies latencies;
+  LatenciesInit(&latencies, commits);
+
+  Transaction t(sp);
+  uint64_t start = Nanos();
+  for (size_t c = 0; c < commits; c++) {
+    SOPHIA_ASSERT(t.Begin());
+    for (size_t i = 0; i < 100; i++) {
+      MakeKey(key, (size_t) rand() % config->records, config->keysize);
+      SOPHIA_ASSERT(t.Set(key, config->keysize, value, config->valuesize));
+    }
+    uint64_t begin = Nanos();
+    SOPHIA_ASSERT(t.Commit());
+    Record(&latencies, Nanos() - begin);
+  }
+  Report(
+      config
+    , "Transaction::Commit (100 ops)"
+    , commits
+    , Nanos() - start
+    , &latencies
+  );
+
+  LatenciesFree(&latencies);
+  free(value);
+}
+
+/**
+ * Sophia::Count.
+ */
+
+BENCH(Count) {
+  size_t count;
+  Latencies latencies;
+  LatenciesInit(&latencies, 5);
+
+  uint64_t start = Nanos();
+  for (int i = 0; i < 5; i++) {
+    uint64_t t = Nanos();
+    SOPHIA_ASSERT(sp->Count(&count));
+    Record(&latencies, Nanos() - t);
+  }
+  Report(config, "Count", 5, Nanos() - start, &latencies);
+  if (count != config->records) exit(1);
+
+  LatenciesFree(&latencies);
+}
+
+/**
+ * Sophia::Delete of every other record.
+ */
+
+BENCH(Delete) {
+  char key[256];
+  size_t deletes = 0;
+  Latencies latencies;
+  LatenciesInit(&latencies, config->records / 2);
+
+  uint64_t start = Nanos();
+  for (size_t i = 0; i < config->records; i += 2) {
+    MakeKey(key, i, config->keysize);
+    uint64_t t = Nanos();
+    SOPHIA_ASSERT(sp->Delete(key, config->keysize));
+    Record(&latencies, Nanos() - t);
+    deletes++;
+  }
+  Report(config, "Delete", deletes, Nanos() - start, &latencies);
+
+  LatenciesFree(&latencies);
+}
+
+/**
+ * Sophia::Clear of the remaining records, in keys/s.
+ */
+
+BENCH(Clear) {
+  uint64_t start = Nanos();
+  SOPHIA_ASSERT(sp->Clear());
+  Report(config, "Clear (keys)", config->records / 2, Nanos() - start, NULL);
+}
+
+/**
+ * Point lookups through `Get(key)`, `Get(key, Value)`
+ * and `Get(key, Value)` into a reused caller buffer, with
+ * the heap allocations each makes per lookup.
+ */
+
+BENCH(GetValue) {
+  char key[256];
+  size_t bytes = 0;
+  size_t n = config->records;
+  uint64_t start;
+
+  CountAllocations();
+  start = Nanos();
+  for (size_t i = 0; i < n; i++) {
+    MakeKey(key, i, config->keysize);
+    char *value = sp->Get(key, config->keysize);
+    bytes += strlen(value) + 1;
+    free(value);
+  }
+  StopAllocations();
+  Report(config, "Get", n, Nanos() - start, NULL);
+  ReportAllocations("Get", n);
+
+  Value value;
+  CountAllocations();
+  start = Nanos();
+  for (size_t i = 0; i < n; i++) {
+    MakeKey(key, i, config->keysize);
+    SOPHIA_ASSERT(sp->Get(key, config->keysize, value));
+    bytes += value.Size();
+  }
+  StopAllocations();
+  Report(config, "Get(Value)", n, Nanos() - start, NULL);
+  ReportAllocations("Get(Value)", n);
+
+  char *buffer = MakeValue(config->valuesize);
+  Value buffered(buffer, config->valuesize);
+  CountAllocations();
+  start = Nanos();
+  for (size_t i = 0; i < n; i++) {
+    MakeKey(key, i, config->keysize);
+    SOPHIA_ASSERT(sp->Get(key, config->keysize, buffered));
+    bytes += buffered.Size();
+  }
+  StopAllocations();
+  Report(config, "Get(Value, buffer)", n, Nanos() - start, NULL);
+  ReportAllocations("Get(Value, buffer)", n);
+  free(buffer);
+
+  if (0 == bytes) exit(1);
+}
+
+/**
+ * `MultiGet` versus a loop of `Get` for batches of
+ * 10, 1k and 100k random keys.
+ */
+
+BENCH(MultiGet) {
+  size_t batches[] = { 10, 1000, 100000 };
+  size_t n = config->records;
+  size_t keysize = config->keysize;
+  char name[64];
+
+  for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+    size_t batch = batches[b];
+    size_t rounds = batch >= n ? 1 : n / batch;
+    char *storage = (char *) malloc(batch * keysize);
+    const char **keys = (const char **) malloc(batch * sizeof(char *));
+    size_t *keysizes = (size_t *) malloc(batch * sizeof(size_t));
+    MultiGetResult result;
+    uint64_t start;
+
+    for (size_t i = 0; i < batch; i++) {
+      keys[i] = storage + i * keysize;
+      keysizes[i] = keysize;
+      MakeKey(storage + i * keysize, (size_t) rand() % n, keysize);
+    }
+
+    start = Nanos();
+    for (size_t r = 0; r < rounds; r++) {
+      for (size_t i = 0; i < batch; i++) free(sp->Get(keys[i], keysize));
+    }
+    sprintf(name, "Get x %zu", batch);
+    Report(config, name, rounds * batch, Nanos() - start, NULL);
+
+    start = Nanos();
+    for (size_t r = 0; r < rounds; r++) {
+      SOPHIA_ASSERT(sp->MultiGet(keys, keysizes, batch, result));
+    }
+    sprintf(name, "MultiGet(%zu)", batch);
+    Report(config, name, rounds * batch, Nanos() - start, NULL);
+
+    free(keysizes);
+    free(keys);
+    free(storage);
+  }
+}
+
+/**
+ * Full scans: a heap-allocated result per row (what
+ * Next() used to do), the iterator-owned result, a
+ * caller-owned result and range-for.
+ */
+
+BENCH(Scan) {
+  size_t rows;
+  size_t bytes = 0;
+  uint64_t start;
+  IteratorResult *res;
+  IteratorResult row;
+
+  Iterator heap(sp);
+  SOPHIA_ASSERT(heap.Begin());
+  rows = 0;
+  start = Nanos();
+  while ((res = heap.Next())) {
+    IteratorResult *copy = new IteratorResult(*res);
+    bytes += copy->keysize;
+    delete copy;
+    rows++;
+  }
+  Report(config, "Scan (heap result)", rows, Nanos() - start, NULL);
+  SOPHIA_ASSERT(heap.End());
+
+  Iterator owned(sp);
+  SOPHIA_ASSERT(owned.Begin());
+  rows = 0;
+  start = Nanos();
+  while ((res = owned.Next())) {
+    bytes += res->keysize;
+    rows++;
+  }
+  Report(config, "Scan Next()", rows, Nanos() - start, NULL);
+  SOPHIA_ASSERT(owned.End());
+
+  Iterator caller(sp);
+  SOPHIA_ASSERT(caller.Begin());
+  rows = 0;
+  start = Nanos();
+  while (caller.Next(&row)) {
+    bytes += row.keysize;
+    rows++;
+  }
+  Report(config, "Scan Next(result)", rows, Nanos() - start, NULL);
+  SOPHIA_ASSERT(caller.End());
+
+  Iterator range(sp);
+  rows = 0;
+  start = Nanos();
+  for (const IteratorResult &r : range) {
+    bytes += r.keysize;
+    rows++;
+  }
+  Report(config, "Scan range-for", rows, Nanos() - start, NULL);
+  SOPHIA_ASSERT(range.End());
+
+  if (0 == bytes || config->records > rows) exit(1);
+}
+
+/**
+ * ScanPrefix() callback counting rows.
+ */
+
+static bool
+CountRow(const IteratorResult *result, void *data) {
+  (*(size_t *) data) += result->keysize ? 1 : 0;
+  return true;
+}
+
+/**
+ * Scans of one 100-key `user:N:` prefix as the database
+ * grows, through ScanPrefix() and through a plain
+ * Iterator filtered by prefix, which reads to the end.
+ */
+
+BENCH(ScanPrefix) {
+  size_t n = config->records;
+  size_t sizes[] = { n / 100, n / 10, n };
+  size_t users = 0;
+  size_t rows = 0;
+  char key[32];
+  char prefix[32];
+  char name[64];
+  WriteBatch batch;
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (; users * 100 < sizes[s] || 0 == users; users++) {
+      for (int i = 0; i < 100; i++) {
+        sprintf(key, "user:%08zu:%03d", users, i);
+        SOPHIA_ASSERT(batch.Set(key, "value"));
+      }
+      SOPHIA_ASSERT(sp->Write(batch));
+      batch.Clear();
+    }
+
+    size_t scans = 1000;
+    uint64_t start = Nanos();
+    for (size_t i = 0; i < scans; i++) {
+      sprintf(prefix, "user:%08zu:", (size_t) rand() % users);
+      SOPHIA_ASSERT(sp->ScanPrefix(prefix, strlen(prefix), CountRow, &rows));
+    }
+    sprintf(name, "ScanPrefix (%zu keys)", users * 100);
+    Report(config, name, scans, Nanos() - start, NULL);
+
+    scans = 10;
+    start = Nanos();
+    for (size_t i = 0; i < scans; i++) {
+      IteratorResult *res;
+      sprintf(prefix, "user:%08zu:", (size_t) rand() % users);
+      Iterator it(sp, SPGTE, prefix, strlen(prefix));
+      SOPHIA_ASSERT(it.Begin());
+      while ((res = it.Next())) {
+        if (0 == strncmp(prefix, res->key, strlen(prefix))) rows++;
+      }
+      SOPHIA_ASSERT(it.End());
+    }
+    sprintf(name, "Iterator+strncmp (%zu keys)", users * 100);
+    Report(config, name, scans, Nanos() - start, NULL);
+  }
+
+  SOPHIA_ASSERT(sp->DeleteRange("user:", "user;"));
+  if (0 == rows) exit(1);
+}
+
+/**
+ * Write every record to a BulkFile and load it through
+ * BulkLoader.
+ */
+
+BENCH(BulkLoad) {
+  char key[256];
+  char *value = MakeValue(config->valuesize);
+  FILE *file = fopen("benchdb.records", "wb");
+  if (!file) exit(1);
+
+  for (size_t i = 0; i < config->records; i++) {
+    MakeKey(key, i, config->keysize);
+    SOPHIA_ASSERT(BulkFile::Write(
+        file
+      , key
+      , config->keysize
+      , value
+      , config->valuesize
+    ));
+  }
+  fclose(file);
+  free(value);
+
+  BulkLoader loader(sp, 100000);
+  SOPHIA_ASSERT(loader.Load("benchdb.records"));
+  Report(
+      config
+    , "BulkLoader"
+    , loader.Records()
+    , (uint64_t) (loader.Seconds() * 1e9)
+    , NULL
+  );
+  if (!json) {
+    printf(
+        "  %-32s %12.1f MB/s\n"
+      , "BulkLoader"
+      , loader.BytesPerSecond() / (1024 * 1024)
+    );
+  }
+  unlink("benchdb.records");
+}
+
+/**
+ * Reader thread state.
+ */
+
+typedef struct {
+  Sophia *sp;
+  const BenchConfig *config;
+  unsigned int seed;
+  Latencies latencies;
+} Reader;
+
+/**
+ * Sophia::Get of `records` random records.
+ */
+
+static void *
+Read(void *data) {
+  Reader *reader = (Reader *) data;
+  const BenchConfig *config = reader->config;
+  char key[256];
+
+  for (size_t i = 0; i < config->records; i++) {
+    size_t n = (size_t) rand_r(&reader->seed) % config->records;
+    MakeKey(key, n, config->keysize);
+    uint64_t t = Nanos();
+    char *value = reader->sp->Get(key, config->keysize);
+    Record(&reader->latencies, Nanos() - t);
+    if (!value) exit(1);
+    free(value);
+  }
+
+  return NULL;
+}
+
+/**
+ * Concurrent Sophia::Get from 1 up to `max_threads`
+ * threads, doubling each run.  Every thread reads
+ * `records` keys, so perfect scaling multiplies ops/s by
+ * the thread count.
+ */
+
+BENCH(Threads) {
+  char name[64];
+  Reader *readers = (Reader *) calloc(max_threads, sizeof(Reader));
+  pthread_t *threads = (pthread_t *) calloc(max_threads, sizeof(pthread_t));
+  if (!readers || !threads) exit(1);
+
+  RUN_BENCH(Load, config);
+
+  size_t n = 0;
+  while (n < max_threads) {
+    // 1, 2, 4, .. and always finish on max_threads
+    n = n ? std::min(n * 2, max_threads) : 1;
+
+    Latencies latencies;
+    LatenciesInit(&latencies, n * config->records);
+
+    uint64_t start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      readers[i].sp = sp;
+      readers[i].config = config;
+      readers[i].seed = (unsigned int) rand();
+      LatenciesInit(&readers[i].latencies, config->records);
+      if (pthread_create(&threads[i], NULL, Read, &readers[i])) exit(1);
+    }
+    for (size_t i = 0; i < n; i++) pthread_join(threads[i], NULL);
+    uint64_t elapsed = Nanos() - start;
+
+    for (size_t i = 0; i < n; i++) {
+      for (size_t j = 0; j < readers[i].latencies.count; j++) {
+        Record(&latencies, readers[i].latencies.samples[j]);
+      }
+      LatenciesFree(&readers[i].latencies);
+    }
+    sprintf(name, "Get x %zu thread%s", n, 1 == n ? "" : "s");
+    Report(config, name, n * config->records, elapsed, &latencies);
+    LatenciesFree(&latencies);
+  }
+
+  SOPHIA_ASSERT(sp->Clear());
+  free(threads);
+  free(readers);
+}
+
+/**
+ * Writer thread state.
+ */
+
+typedef struct {
+  Sophia *sp;
+  GroupCommitWriter *group;
+  const BenchConfig *config;
+  const char *value;
+  size_t first;
+  size_t count;
+  Latencies latencies;
+} Writer;
+
+/**
+ * Set `count` records from `first`, directly or through
+ * the group-commit writer.
+ */
+
+static void *
+Write(void *data) {
+  Writer *writer = (Writer *) data;
+  const BenchConfig *config = writer->config;
+  size_t keysize = config->keysize;
+  size_t valuesize = config->valuesize;
+  char key[256];
+
+  for (size_t i = writer->first; i < writer->first + writer->count; i++) {
+    SophiaReturnCode rc;
+    MakeKey(key, i, keysize);
+    uint64_t t = Nanos();
+    if (writer->group) {
+      rc = writer->group->Set(key, keysize, writer->value, valuesize);
+    } else {
+      rc = writer->sp->Set(key, keysize, writer->value, valuesize);
+    }
+    Record(&writer->latencies, Nanos() - t);
+    if (SOPHIA_SUCCESS != rc) exit(1);
+  }
+
+  return NULL;
+}
+
+/**
+ * Sophia::Set versus GroupCommitWriter::Set from 1 to 64
+ * writer threads sharing `records` writes.
+ */
+
+BENCH(GroupCommit) {
+  size_t counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+  char name[64];
+  char *value = MakeValue(config->valuesize);
+  Writer writers[64];
+  pthread_t threads[64];
+
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    size_t n = counts[c];
+
+    for (int grouped = 0; grouped < 2; grouped++) {
+      GroupCommitWriter group(sp);
+      Latencies latencies;
+      LatenciesInit(&latencies, config->records);
+      SOPHIA_ASSERT(sp->Clear());
+      if (grouped) SOPHIA_ASSERT(group.Start());
+
+      uint64_t start = Nanos();
+      for (size_t i = 0; i < n; i++) {
+        writers[i].sp = sp;
+        writers[i].group = grouped ? &group : NULL;
+        writers[i].config = config;
+        writers[i].value = value;
+        writers[i].first = i * (config->records / n);
+        writers[i].count = config->records / n;
+        LatenciesInit(&writers[i].latencies, writers[i].count);
+        if (pthread_create(&threads[i], NULL, Write, &writers[i])) exit(1);
+      }
+      for (size_t i = 0; i < n; i++) pthread_join(threads[i], NULL);
+      uint64_t elapsed = Nanos() - start;
+      SOPHIA_ASSERT(group.Stop());
+
+      for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < writers[i].latencies.count; j++) {
+          Record(&latencies, writers[i].latencies.samples[j]);
+        }
+        LatenciesFree(&writers[i].latencies);
+      }
+      sprintf(
+          name
+        , "%s x %zu thread%s"
+        , grouped ? "GroupCommitWriter::Set" : "Set"
+        , n
+        , 1 == n ? "" : "s"
+      );
+      Report(config, name, latencies.count, elapsed, &latencies);
+      LatenciesFree(&latencies);
+    }
+  }
+
+  SOPHIA_ASSERT(sp->Clear());
+  free(value);
+}
+
+/**
+ * Background writer state.
+ */
+
+typedef struct {
+  Sophia *sp;
+  const BenchConfig *config;
+  std::atomic<bool> stop;
+} Background;
+
+/**
+ * Rewrite random records in batches of 1000 until
+ * stopped, so readers keep meeting a held write lock.
+ */
+
+static void *
+WriteBackground(void *data) {
+  Background *background = (Background *) data;
+  const BenchConfig *config = background->config;
+  char *value = MakeValue(config->valuesize);
+  char key[256];
+  WriteBatch batch;
+
+  while (!background->stop) {
+    for (int i = 0; i < 1000; i++) {
+      MakeKey(key, (size_t) rand() % config->records, config->keysize);
+      SophiaReturnCode rc;
+      rc = batch.Set(key, config->keysize, value, config->valuesize);
+      if (SOPHIA_SUCCESS != rc) exit(1);
+    }
+    if (SOPHIA_SUCCESS != background->sp->Write(batch)) exit(1);
+    batch.Clear();
+  }
+
+  free(value);
+  return NULL;
+}
+
+/**
+ * Count completed GetAsync() calls.
+ */
+
+static void
+CountGet(AsyncGetResult result, void *data) {
+  if (SOPHIA_SUCCESS != result.rc || !result.value) exit(1);
+  (*(std::atomic<size_t> *) data)++;
+}
+
+/**
+ * Tick latency of an event loop serving one random Get per
+ * tick while a background thread writes, with blocking
+ * Get and with AsyncSophia::GetAsync.
+ */
+
+BENCH(Async) {
+  char key[256];
+  pthread_t thread;
+  Background background;
+
+  RUN_BENCH(Load, config);
+  background.sp = sp;
+  background.config = config;
+  background.stop = false;
+  if (pthread_create(&thread, NULL, WriteBackground, &background)) exit(1);
+
+  Latencies latencies;
+  LatenciesInit(&latencies, config->records);
+  uint64_t start = Nanos();
+  for (size_t i = 0; i < config->records; i++) {
+    MakeKey(key, (size_t) rand() % config->records, config->keysize);
+    uint64_t t = Nanos();
+    char *value = sp->Get(key, config->keysize);
+    Record(&latencies, Nanos() - t);
+    if (!value) exit(1);
+    free(value);
+  }
+  Report(
+      config
+    , "Event loop tick, Get"
+    , config->records
+    , Nanos() - start
+    , &latencies
+  );
+  LatenciesFree(&latencies);
+
+  AsyncSophia async(sp, 4, 1024);
+  std::atomic<size_t> completed(0);
+  SOPHIA_ASSERT(async.Start());
+  LatenciesInit(&latencies, config->records);
+  start = Nanos();
+  for (size_t i = 0; i < config->records; i++) {
+    MakeKey(key, (size_t) rand() % config->records, config->keysize);
+    uint64_t t = Nanos();
+    SOPHIA_ASSERT(async.GetAsync(key, config->keysize, CountGet, &completed));
+    Record(&latencies, Nanos() - t);
+  }
+  SOPHIA_ASSERT(async.Stop());
+  Report(
+      config
+    , "Event loop tick, GetAsync"
+    , config->records
+    , Nanos() - start
+    , &latencies
+  );
+  LatenciesFree(&latencies);
+  if (config->records != completed) exit(1);
+
+  background.stop = true;
+  pthread_join(thread, NULL);
+  SOPHIA_ASSERT(sp->Clear());
+}
+
+#ifdef SOPHIA_COROUTINES
+
+/**
+ * Requests in flight per load generator round.
+ */
+
+#define CONCURRENT_REQUESTS 10000
+
+/**
+ * Load generator round state.
+ */
+
+typedef struct {
+  const BenchConfig *config;
+  uint64_t start;
+  uint64_t *samples;
+  std::atomic<size_t> done;
+} Round;
+
+/**
+ * Serve request `i` of `round`, reading record `n`
+ * through `target`.
+ */
+
+template <typename Target>
+static co::Task
+Request(Target *target, Round *round, size_t i, size_t n) {
+  char key[256];
+  MakeKey(key, n, round->config->keysize);
+  AsyncGetResult result = co_await co::Get(
+      target
+    , key
+    , round->config->keysize
+  );
+  round->samples[i] = Nanos() - round->start;
+  if (SOPHIA_SUCCESS != result.rc || !result.value) exit(1);
+  round->done++;
+}
+
+/**
+ * Rounds of 10k concurrent Get requests, served by a
+ * blocking loop, by coroutines awaiting inline and by
+ * coroutines awaiting an AsyncSophia.  Latency is measured
+ * from the start of the round, so it includes the time a
+ * request waits to be served.
+ */
+
+BENCH(Coroutine) {
+  size_t concurrent = std::min((size_t) CONCURRENT_REQUESTS, config->records);
+  size_t rounds = config->records / concurrent;
+  const char *names[] = {
+      "Blocking Get (10k in flight)"
+    , "co_await Get(Sophia)"
+    , "co_await Get(AsyncSophia)"
+  };
+  AsyncSophia async(sp, max_threads, concurrent);
+  Round round;
+
+  RUN_BENCH(Load, config);
+  SOPHIA_ASSERT(async.Start());
+  round.config = config;
+
+  for (int mode = 0; mode < 3; mode++) {
+    Latencies latencies;
+    LatenciesInit(&latencies, rounds * concurrent);
+    round.samples = (uint64_t *) malloc(concurrent * sizeof(uint64_t));
+    if (!round.samples) exit(1);
+
+    uint64_t start = Nanos();
+    for (size_t r = 0; r < rounds; r++) {
+      round.start = Nanos();
+      round.done = 0;
+      for (size_t i = 0; i < concurrent; i++) {
+        size_t n = (size_t) rand() % config->records;
+        if (0 == mode) {
+          char key[256];
+          MakeKey(key, n, config->keysize);
+          char *value = sp->Get(key, config->keysize);
+          round.samples[i] = Nanos() - round.start;
+          if (!value) exit(1);
+          free(value);
+          round.done++;
+        } else if (1 == mode) {
+          Request(sp, &round, i, n);
+        } else {
+          Request(&async, &round, i, n);
+        }
+      }
+      while (concurrent != round.done) sched_yield();
+      for (size_t i = 0; i < concurrent; i++) {
+        Record(&latencies, round.samples[i]);
+      }
+    }
+    Report(config, names[mode], latencies.count, Nanos() - start, &latencies);
+
+    LatenciesFree(&latencies);
+    free(round.samples);
+  }
+
+  SOPHIA_ASSERT(async.Stop());
+  SOPHIA_ASSERT(sp->Clear());
+}
+
+#endif
+
+/**
+ * Zipfian key sampler: a cumulative distribution over
+ * `n` ranks searched with a uniform draw.
+ */
+
+typedef struct {
+  double *cdf;
+  size_t n;
+} Zipf;
+
+static void
+ZipfInit(Zipf *zipf, size_t n, double theta) {
+  double sum = 0;
+  zipf->n = n;
+  zipf->cdf = (double *) malloc(n * sizeof(double));
+  if (!zipf->cdf) exit(1);
+  for (size_t i = 0; i < n; i++) {
+    sum += 1.0 / pow((double) (i + 1), theta);
+    zipf->cdf[i] = sum;
+  }
+  for (size_t i = 0; i < n; i++) zipf->cdf[i] /= sum;
+}
+
+static inline size_t
+ZipfNext(const Zipf *zipf, unsigned int *seed) {
+  double u = (double) rand_r(seed) / ((double) RAND_MAX + 1);
+  const double *rank = std::lower_bound(zipf->cdf, zipf->cdf + zipf->n, u);
+  size_t i = (size_t) (rank - zipf->cdf);
+  // scatter hot ranks across the keyspace
+  return (i * 2654435761u) % zipf->n;
+}
+
+/**
+ * Sophia::Get of Zipf(0.99) records, uncached and then
+ * through caches holding 1% and 10% of the data set.
+ */
+
+BENCH(Cache) {
+  char key[256];
+  char name[64];
+  size_t budgets[] = { 0, 1, 10 };
+  size_t data = config->records
+    * (config->keysize + config->valuesize + 64);
+  Zipf zipf;
+
+  RUN_BENCH(Load, config);
+  ZipfInit(&zipf, config->records, 0.99);
+
+  for (size_t b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+    ValueCacheStats stats;
+    Latencies latencies;
+    unsigned int seed = 42;
+    LatenciesInit(&latencies, config->records);
+    SOPHIA_ASSERT(sp->Cache(data * budgets[b] / 100));
+
+    uint64_t start = Nanos();
+    for (size_t i = 0; i < config->records; i++) {
+      MakeKey(key, ZipfNext(&zipf, &seed), config->keysize);
+      uint64_t t = Nanos();
+      char *value = sp->Get(key, config->keysize);
+      Record(&latencies, Nanos() - t);
+      if (!value) exit(1);
+      free(value);
+    }
+    uint64_t elapsed = Nanos() - start;
+
+    sp->CacheStats(&stats);
+    size_t lookups = stats.hits + stats.misses;
+    if (budgets[b]) {
+      sprintf(
+          name
+        , "Get zipf, %zu%% cache, %.0f%% hit"
+        , budgets[b]
+        , lookups ? 100.0 * stats.hits / lookups : 0.0
+      );
+    } else {
+      sprintf(name, "Get zipf, no cache");
+    }
+    Report(config, name, config->records, elapsed, &latencies);
+    LatenciesFree(&latencies);
+  }
+
+  SOPHIA_ASSERT(sp->Cache(0));
+  SOPHIA_ASSERT(sp->Clear());
+  free(zipf.cdf);
+}
+
+/**
+ * Sophia::Get of absent records, without and with a
+ * Bloom filter, and the cost of opening with the filter
+ * rebuilt by a scan or loaded from its sidecar.
+ */
+
+BENCH(Filter) {
+  char key[256];
+  char name[64];
+  BloomFilterStats stats;
+
+  RUN_BENCH(Load, config);
+
+  for (int filtered = 0; filtered < 2; filtered++) {
+    Latencies latencies;
+    LatenciesInit(&latencies, config->records);
+
+    if (filtered) {
+      // scan, then save and load the sidecar
+      SOPHIA_ASSERT(sp->Close());
+      SOPHIA_ASSERT(sp->Filter(config->records));
+      uint64_t start = Nanos();
+      SOPHIA_ASSERT(sp->Open());
+      uint64_t elapsed = Nanos() - start;
+      Report(config, "Open, filter scan", config->records, elapsed, NULL);
+      SOPHIA_ASSERT(sp->Close());
+      start = Nanos();
+      SOPHIA_ASSERT(sp->Open());
+      elapsed = Nanos() - start;
+      Report(config, "Open, filter sidecar", config->records, elapsed, NULL);
+    }
+
+    uint64_t start = Nanos();
+    for (size_t i = 0; i < config->records; i++) {
+      MakeKey(key, config->records + i, config->keysize);
+      uint64_t t = Nanos();
+      char *value = sp->Get(key, config->keysize);
+      Record(&latencies, Nanos() - t);
+      if (value) exit(1);
+    }
+    uint64_t elapsed = Nanos() - start;
+
+    sp->FilterStats(&stats);
+    if (filtered) {
+      sprintf(
+          name
+        , "Get absent, filter %.1f%% fp %zuK"
+        , 100 * stats.false_positive_rate
+        , stats.bytes / 1024
+      );
+    } else {
+      sprintf(name, "Get absent, no filter");
+    }
+    Report(config, name, config->records, elapsed, &latencies);
+    LatenciesFree(&latencies);
+  }
+
+  SOPHIA_ASSERT(sp->Filter(0));
+  SOPHIA_ASSERT(sp->Clear());
+}
+
+/**
+ * Number of keyspaces in the keyspaces suite.
+ */
+
+#define BENCH_KEYSPACES 100
+
+/**
+ * Open, fill, read and close 100 keyspaces as separate
+ * databases, then as handles of one Environment.
+ */
+
+BENCH(Keyspaces) {
+  char key[256];
+  char name[64];
+  char paths[BENCH_KEYSPACES][32];
+  Sophia *dbs[BENCH_KEYSPACES];
+  Database *handles[BENCH_KEYSPACES];
+  char *value = MakeValue(config->valuesize);
+  size_t n = config->records;
+
+  if (mkdir("benchks", 0755) && EEXIST != errno) exit(1);
+
+  for (int shared = 0; shared < 2; shared++) {
+    const char *kind = shared ? "keyspaces" : "dbs";
+    Environment *env = shared ? new Environment("benchenv") : NULL;
+
+    uint64_t start = Nanos();
+    if (shared) {
+      SOPHIA_ASSERT(env->Open());
+      for (size_t i = 0; i < BENCH_KEYSPACES; i++) {
+        sprintf(paths[i], "%03zu", i);
+        if (!(handles[i] = env->Handle(paths[i]))) exit(1);
+      }
+    } else {
+      for (size_t i = 0; i < BENCH_KEYSPACES; i++) {
+        sprintf(paths[i], "benchks/%03zu", i);
+        dbs[i] = new Sophia(paths[i]);
+        SOPHIA_ASSERT(dbs[i]->Open());
+      }
+    }
+    sprintf(name, "Open %d %s", BENCH_KEYSPACES, kind);
+    Report(config, name, BENCH_KEYSPACES, Nanos() - start, NULL);
+
+    // records spread round-robin over the keyspaces
+    start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      size_t k = i % BENCH_KEYSPACES;
+      MakeKey(key, i, config->keysize);
+      SOPHIA_ASSERT(shared
+        ? handles[k]->Set(key, config->keysize, value, config->valuesize)
+        : dbs[k]->Set(key, config->keysize, value, config->valuesize)
+      );
+    }
+    sprintf(name, "Set over %d %s", BENCH_KEYSPACES, kind);
+    Report(config, name, n, Nanos() - start, NULL);
+
+    start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      size_t r = (size_t) rand() % n;
+      size_t k = r % BENCH_KEYSPACES;
+      MakeKey(key, r, config->keysize);
+      char *found = shared
+        ? handles[k]->Get(key, config->keysize)
+        : dbs[k]->Get(key, config->keysize);
+      if (!found) exit(1);
+      free(found);
+    }
+    sprintf(name, "Get over %d %s", BENCH_KEYSPACES, kind);
+    Report(config, name, n, Nanos() - start, NULL);
+
+    start = Nanos();
+    if (shared) {
+      for (size_t i = 0; i < BENCH_KEYSPACES; i++) {
+        SOPHIA_ASSERT(handles[i]->Clear());
+      }
+      SOPHIA_ASSERT(env->Close());
+      delete env;
+    } else {
+      for (size_t i = 0; i < BENCH_KEYSPACES; i++) {
+        SOPHIA_ASSERT(dbs[i]->Clear());
+        SOPHIA_ASSERT(dbs[i]->Close());
+        delete dbs[i];
+      }
+    }
+    sprintf(name, "Clear+close %d %s", BENCH_KEYSPACES, kind);
+    Report(config, name, BENCH_KEYSPACES, Nanos() - start, NULL);
+  }
+
+  free(value);
+}
+
+/**
+ * Integer records stored as decimal strings, as the tests
+ * do, then through TypedDB's binary codecs.
+ */
+
+BENCH(Typed) {
+  TypedDB<uint64_t, uint64_t> db(sp);
+  char key[32];
+  char value[32];
+  size_t n = config->records;
+
+  uint64_t start = Nanos();
+  for (size_t i = 0; i < n; i++) {
+    sprintf(key, "%020zu", i);
+    sprintf(value, "%zu", i * 7);
+    SOPHIA_ASSERT(sp->Set(key, value));
+  }
+  Report(config, "Set decimal strings", n, Nanos() - start, NULL);
+
+  start = Nanos();
+  for (size_t i = 0; i < n; i++) {
+    sprintf(key, "%020zu", (size_t) rand() % n);
+    char *found = sp->Get(key);
+    if (!found) exit(1);
+    volatile uint64_t parsed = strtoull(found, NULL, 10);
+    (void) parsed;
+    free(found);
+  }
+  Report(config, "Get decimal strings", n, Nanos() - start, NULL);
+  SOPHIA_ASSERT(sp->Clear());
+
+  start = Nanos();
+  for (size_t i = 0; i < n; i++) {
+    SOPHIA_ASSERT(db.Set(i, i * 7));
+  }
+  Report(config, "Set TypedDB<uint64_t, uint64_t>", n, Nanos() - start, NULL);
+
+  start = Nanos();
+  for (size_t i = 0; i < n; i++) {
+    uint64_t found;
+    bool exists;
+    SOPHIA_ASSERT(db.Get((uint64_t) rand() % n, &found, &exists));
+    if (!exists) exit(1);
+  }
+  Report(config, "Get TypedDB<uint64_t, uint64_t>", n, Nanos() - start, NULL);
+  SOPHIA_ASSERT(sp->Clear());
+}
+
+/**
+ * Rows per range in the fixed-key scan runs.
+ */
+
+#define BENCH_SCAN_ROWS 100
+
+/**
+ * Point lookups and range scans with 16-digit hex string
+ * keys through the generic API, then with the same ids
+ * packed into FixedKeyDB<8> keys.
+ */
+
+BENCH(FixedKey) {
+  FixedKeyDB<8> db(sp);
+  IteratorResult result;
+  char *value = MakeValue(config->valuesize);
+  char start[32];
+  char end[32];
+  char key[32];
+  size_t n = config->records;
+  size_t scans = n / BENCH_SCAN_ROWS;
+
+  for (int fixed = 0; fixed < 2; fixed++) {
+    const char *kind = fixed ? "FixedKeyDB<8>" : "generic";
+    char name[64];
+
+    for (size_t i = 0; i < n; i++) {
+      if (fixed) {
+        FixedKeyDB<8>::Pack(i, key);
+        SOPHIA_ASSERT(db.Set(key, value, config->valuesize));
+      } else {
+        sprintf(key, "%016zx", i);
+        SOPHIA_ASSERT(sp->Set(key, strlen(key) + 1, value, config->valuesize));
+      }
+    }
+
+    uint64_t start_ns = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      size_t id = (size_t) rand() % n;
+      char *found;
+      if (fixed) {
+        FixedKeyDB<8>::Pack(id, key);
+        found = db.Get(key);
+      } else {
+        sprintf(key, "%016zx", id);
+        found = sp->Get(key);
+      }
+      if (!found) exit(1);
+      free(found);
+    }
+    sprintf(name, "Get %s", kind);
+    Report(config, name, n, Nanos() - start_ns, NULL);
+
+    size_t rows = 0;
+    start_ns = Nanos();
+    for (size_t i = 0; i < scans; i++) {
+      size_t first = (size_t) rand() % (n - BENCH_SCAN_ROWS);
+      if (fixed) {
+        FixedKeyDB<8>::Pack(first, start);
+        FixedKeyDB<8>::Pack(first + BENCH_SCAN_ROWS, end);
+        FixedKeyIterator<8> it(sp, SPGTE, start, end);
+        SOPHIA_ASSERT(it.Begin());
+        while (it.Next(&result)) rows++;
+        SOPHIA_ASSERT(it.End());
+      } else {
+        sprintf(start, "%016zx", first);
+        sprintf(end, "%016zx", first + BENCH_SCAN_ROWS);
+        Iterator it(sp, SPGTE, start, end);
+        SOPHIA_ASSERT(it.Begin());
+        while (it.Next(&result)) rows++;
+        SOPHIA_ASSERT(it.End());
+      }
+    }
+    if (scans * BENCH_SCAN_ROWS != rows) exit(1);
+    sprintf(name, "Scan %d rows %s", BENCH_SCAN_ROWS, kind);
+    Report(config, name, rows, Nanos() - start_ns, NULL);
+
+    SOPHIA_ASSERT(sp->Clear());
+  }
+
+  free(value);
+}
+
+/**
+ * Fill `value` of `valuesize` with a JSON array of user
+ * records starting at id `i`, compressible the way
+ * typical documents are.
+ */
+
+static void
+MakeDocument(char *value, size_t i, size_t valuesize) {
+  char doc[160];
+  size_t n = 0;
+
+  value[n++] = '[';
+  for (size_t id = i; n < valuesize; id++) {
+    int len = sprintf(
+        doc
+      , "{\"id\":%zu,\"name\":\"user%zu\",\"email\":\"user%zu@example.com\","
+        "\"active\":%s,\"score\":%zu},"
+      , id
+      , id * 7
+      , id
+      , id % 3 ? "true" : "false"
+      , id * 31 % 1000
+    );
+    size_t take = std::min((size_t) len, valuesize - n);
+    memcpy(value + n, doc, take);
+    n += take;
+  }
+  value[valuesize - 1] = '\0';
+}
+
+/**
+ * Size of the compress suite dictionary.
+ */
+
+#define BENCH_DICTIONARY_SIZE 4096
+
+/**
+ * Set, Get and scan of JSON documents stored as is, then
+ * compressed by the built-in codec, without and with a
+ * dictionary built from sample documents.
+ */
+
+BENCH(Compress) {
+  static const char *kinds[] = { "raw", "lz", "lz+dictionary" };
+  static const char *paths[] = { NULL, "benchcompress", "benchdict" };
+  char key[256];
+  char name[64];
+  char *value = (char *) malloc(config->valuesize);
+  char *dictionary = (char *) malloc(BENCH_DICTIONARY_SIZE);
+  IteratorResult result;
+  ValueCompressionStats stats;
+  size_t n = config->records;
+
+  if (!value || !dictionary) exit(1);
+
+  // sample documents past the ids written
+  for (size_t i = 0; i < BENCH_DICTIONARY_SIZE; i += 512) {
+    MakeDocument(dictionary + i, n + i, 512);
+  }
+
+  for (int mode = 0; mode < 3; mode++) {
+    // dictionaries persist, so that run gets its own database
+    Sophia *db = mode ? new Sophia(paths[mode]) : sp;
+
+    if (mode) {
+      SOPHIA_ASSERT(db->Compression(true, 16));
+      SOPHIA_ASSERT(db->Open());
+    }
+    if (2 == mode) {
+      SOPHIA_ASSERT(db->CompressionDictionary(
+          dictionary
+        , BENCH_DICTIONARY_SIZE
+      ));
+    }
+
+    uint64_t start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      MakeKey(key, i, config->keysize);
+      MakeDocument(value, i, config->valuesize);
+      SOPHIA_ASSERT(db->Set(key, config->keysize, value, config->valuesize));
+    }
+    if (mode) {
+      db->CompressionStats(&stats);
+      sprintf(name, "Set %s, %.2fx", kinds[mode], stats.ratio);
+    } else {
+      sprintf(name, "Set %s", kinds[mode]);
+    }
+    Report(config, name, n, Nanos() - start, NULL);
+
+    start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      MakeKey(key, (size_t) rand() % n, config->keysize);
+      char *found = db->Get(key, config->keysize);
+      if (!found) exit(1);
+      free(found);
+    }
+    sprintf(name, "Get %s", kinds[mode]);
+    Report(config, name, n, Nanos() - start, NULL);
+
+    size_t rows = 0;
+    start = Nanos();
+    Iterator it(db);
+    SOPHIA_ASSERT(it.Begin());
+    while (it.Next(&result)) rows++;
+    SOPHIA_ASSERT(it.End());
+    if (n != rows) exit(1);
+    sprintf(name, "Scan %s", kinds[mode]);
+    Report(config, name, rows, Nanos() - start, NULL);
+
+    SOPHIA_ASSERT(db->Clear());
+    if (mode) {
+      SOPHIA_ASSERT(db->Close());
+      delete db;
+    }
+  }
+
+  free(dictionary);
+  free(value);
+}
+
+/**
+ * Set, Get, scan and concurrent Get without and with
+ * Sophia::Instrument(), naming the instrumented runs
+ * with their overhead.  Build with `-DSOPHIA_NO_STATS`
+ * to compare against the compiled out wrapper.
+ */
+
+BENCH(Stats) {
+  static const char *ops[] = { "Set", "Get", "Scan", "Get x threads" };
+  uint64_t baseline[4] = { 0, 0, 0, 0 };
+  Reader *readers = (Reader *) calloc(max_threads, sizeof(Reader));
+  pthread_t *threads = (pthread_t *) calloc(max_threads, sizeof(pthread_t));
+  char *value = MakeValue(config->valuesize);
+  IteratorResult result;
+  char key[256];
+  char name[64];
+  size_t n = config->records;
+
+  if (!readers || !threads) exit(1);
+
+  for (int instrumented = 0; instrumented < 2; instrumented++) {
+    uint64_t elapsed[4];
+
+    SOPHIA_ASSERT(sp->Instrument(instrumented));
+
+    uint64_t start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      MakeKey(key, i, config->keysize);
+      SOPHIA_ASSERT(sp->Set(key, config->keysize, value, config->valuesize));
+    }
+    elapsed[0] = Nanos() - start;
+
+    start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      MakeKey(key, (size_t) rand() % n, config->keysize);
+      char *found = sp->Get(key, config->keysize);
+      if (!found) exit(1);
+      free(found);
+    }
+    elapsed[1] = Nanos() - start;
+
+    size_t rows = 0;
+    start = Nanos();
+    Iterator it(sp);
+    SOPHIA_ASSERT(it.Begin());
+    while (it.Next(&result)) rows++;
+    SOPHIA_ASSERT(it.End());
+    if (n != rows) exit(1);
+    elapsed[2] = Nanos() - start;
+
+    start = Nanos();
+    for (size_t i = 0; i < max_threads; i++) {
+      readers[i].sp = sp;
+      readers[i].config = config;
+      readers[i].seed = (unsigned int) rand();
+      LatenciesInit(&readers[i].latencies, n);
+      if (pthread_create(&threads[i], NULL, Read, &readers[i])) exit(1);
+    }
+    for (size_t i = 0; i < max_threads; i++) pthread_join(threads[i], NULL);
+    elapsed[3] = Nanos() - start;
+    for (size_t i = 0; i < max_threads; i++) {
+      LatenciesFree(&readers[i].latencies);
+    }
+
+    for (int op = 0; op < 4; op++) {
+      size_t count = 3 == op ? max_threads * n : n;
+      if (instrumented) {
+        sprintf(
+            name
+          , "%s, instrumented %+.1f%%"
+          , ops[op]
+          , 100.0 * ((double) elapsed[op] / baseline[op] - 1)
+        );
+      } else {
+        baseline[op] = elapsed[op];
+        sprintf(name, "%s", ops[op]);
+      }
+      Report(config, name, count, elapsed[op], NULL);
+    }
+
+    SOPHIA_ASSERT(sp->Clear());
+  }
+
+  SOPHIA_ASSERT(sp->Instrument(false));
+  free(value);
+  free(threads);
+  free(readers);
+}
+
+/**
+ * Sophia::Get without tracing, tracing with a threshold
+ * no Get reaches, tracing every Get, and tracing every
+ * Get while logging to `benchdb.trace`.
+ */
+
+BENCH(Trace) {
+  static const char *runs[] = {
+      "Get"
+    , "Get, traced none"
+    , "Get, traced all"
+    , "Get, traced all, logged"
+  };
+  char key[256];
+
+  RUN_BENCH(Load, config);
+
+  for (int run = 0; run < 4; run++) {
+    if (run) SOPHIA_ASSERT(sp->Trace(true, 1 == run ? UINT64_MAX : 0));
+    // not tracing when built with SOPHIA_NO_STATS
+    if (3 == run && SOPHIA_SUCCESS != sp->TraceLog("benchdb.trace", 10)) {
+      break;
+    }
+
+    uint64_t start = Nanos();
+    for (size_t i = 0; i < config->records; i++) {
+      MakeKey(key, (size_t) rand() % config->records, config->keysize);
+      char *value = sp->Get(key, config->keysize);
+      if (!value) exit(1);
+      free(value);
+    }
+    uint64_t elapsed = Nanos() - start;
+
+    SOPHIA_ASSERT(sp->Trace(false));
+    Report(config, runs[run], config->records, elapsed, NULL);
+  }
+
+  unlink("benchdb.trace");
+  SOPHIA_ASSERT(sp->Clear());
+}
+
+/**
+ * Exporter thread state: the range of records it writes
+ * to its own snapshot file.
+ */
+
+typedef struct {
+  Sophia *sp;
+  const BenchConfig *config;
+  size_t first;
+  size_t last;
+  char path[64];
+} Exporter;
+
+/**
+ * Sophia::ExportSnapshot of records `first` up to `last`,
+ * leaving either side open at the edges.
+ */
+
+static void *
+Export(void *data) {
+  Exporter *exporter = (Exporter *) data;
+  const BenchConfig *config = exporter->config;
+  char start[256];
+  char end[256];
+
+  MakeKey(start, exporter->first, config->keysize);
+  MakeKey(end, exporter->last, config->keysize);
+  SophiaReturnCode rc = exporter->sp->ExportSnapshot(
+      exporter->path
+    , exporter->first ? start : NULL
+    , exporter->first ? config->keysize : 0
+    , exporter->last < config->records ? end : NULL
+    , exporter->last < config->records ? config->keysize : 0
+  );
+  if (SOPHIA_SUCCESS != rc) exit(1);
+  return NULL;
+}
+
+/**
+ * Report `bytes` moved in `elapsed` nanoseconds.
+ */
+
+static void
+ReportThroughput(
+    const BenchConfig *config
+  , const char *name
+  , size_t bytes
+  , uint64_t elapsed
+) {
+  Report(config, name, config->records, elapsed, NULL);
+  if (!json) {
+    printf("  %-32s %12.2f GB/s\n", name, bytes / (elapsed / 1e9) / 1e9);
+  }
+}
+
+/**
+ * Export every record to a snapshot, from one thread and
+ * then `max_threads` threads over disjoint ranges, verify
+ * the snapshot and import it into the emptied database.
+ */
+
+BENCH(Snapshot) {
+  Exporter *exporters = (Exporter *) calloc(max_threads, sizeof(Exporter));
+  pthread_t *threads = (pthread_t *) calloc(max_threads, sizeof(pthread_t));
+  char name[64];
+  if (!exporters || !threads) exit(1);
+
+  RUN_BENCH(Load, config);
+
+  uint64_t start = Nanos();
+  SOPHIA_ASSERT(sp->ExportSnapshot("benchdb.snapshot"));
+  uint64_t elapsed = Nanos() - start;
+
+  SnapshotFile snapshot("benchdb.snapshot");
+  SOPHIA_ASSERT(snapshot.Open());
+  size_t bytes = snapshot.Bytes();
+  if (config->records != snapshot.Records()) exit(1);
+  ReportThroughput(config, "ExportSnapshot", bytes, elapsed);
+
+  start = Nanos();
+  for (size_t i = 0; i < max_threads; i++) {
+    exporters[i].sp = sp;
+    exporters[i].config = config;
+    exporters[i].first = i * config->records / max_threads;
+    exporters[i].last = (i + 1) * config->records / max_threads;
+    sprintf(exporters[i].path, "benchdb.snapshot.%zu", i);
+    if (pthread_create(&threads[i], NULL, Export, &exporters[i])) exit(1);
+  }
+  for (size_t i = 0; i < max_threads; i++) pthread_join(threads[i], NULL);
+  elapsed = Nanos() - start;
+  sprintf(
+      name
+    , "ExportSnapshot x %zu thread%s"
+    , max_threads
+    , 1 == max_threads ? "" : "s"
+  );
+  ReportThroughput(config, name, bytes, elapsed);
+  for (size_t i = 0; i < max_threads; i++) unlink(exporters[i].path);
+
+  start = Nanos();
+  SOPHIA_ASSERT(snapshot.Verify());
+  elapsed = Nanos() - start;
+  ReportThroughput(config, "SnapshotFile::Verify", bytes, elapsed);
+  snapshot.Close();
+
+  SOPHIA_ASSERT(sp->Clear());
+  start = Nanos();
+  SOPHIA_ASSERT(sp->ImportSnapshot("benchdb.snapshot"));
+  elapsed = Nanos() - start;
+  ReportThroughput(config, "ImportSnapshot", bytes, elapsed);
+
+  unlink("benchdb.snapshot");
+  SOPHIA_ASSERT(sp->Clear());
+  free(threads);
+  free(exporters);
+}
+
+/**
+ * Sophia::ParallelScan() row counters, one cache line
+ * apart per shard.
+ */
+
+static bool
+CountShardRow(const IteratorResult *, size_t shard, void *data) {
+  ((size_t *) data)[shard * 8]++;
+  return true;
+}
+
+/**
+ * Full scan through one Iterator, then Sophia::
+ * ParallelScan() from 1 up to `max_threads` threads,
+ * doubling each run, and ordered on `max_threads`.
+ */
+
+BENCH(ParallelScan) {
+  size_t shards = max_threads * 8;
+  size_t *rows = (size_t *) calloc(shards * 8, sizeof(size_t));
+  IteratorResult result;
+  char name[64];
+  if (!rows) exit(1);
+
+  RUN_BENCH(Load, config);
+
+  size_t count = 0;
+  uint64_t start = Nanos();
+  Iterator it(sp);
+  SOPHIA_ASSERT(it.Begin());
+  while (it.Next(&result)) count++;
+  SOPHIA_ASSERT(it.End());
+  Report(config, "Iterator", count, Nanos() - start, NULL);
+  if (config->records != count) exit(1);
+
+  size_t n = 0;
+  for (int ordered = 0; ordered < 2; ordered++) {
+    while (n < max_threads) {
+      // 1, 2, 4, .. and always finish on max_threads
+      n = ordered ? max_threads : n ? std::min(n * 2, max_threads) : 1;
+
+      memset(rows, 0, shards * 8 * sizeof(size_t));
+      start = Nanos();
+      SOPHIA_ASSERT(sp->ParallelScan(
+          NULL
+        , 0
+        , NULL
+        , 0
+        , n
+        , CountShardRow
+        , rows
+        , ordered
+      ));
+      uint64_t elapsed = Nanos() - start;
+
+      count = 0;
+      for (size_t i = 0; i < shards; i++) count += rows[i * 8];
+      if (config->records != count) exit(1);
+      sprintf(
+          name
+        , "ParallelScan%s x %zu thread%s"
+        , ordered ? ", ordered" : ""
+        , n
+        , 1 == n ? "" : "s"
+      );
+      Report(config, name, count, elapsed, NULL);
+    }
+    n = 0;
+  }
+
+  SOPHIA_ASSERT(sp->Clear());
+  free(rows);
+}
+
+/**
+ * Index the 6 byte field of the values at the offset
+ * `data` points to.
+ */
+
+static bool
+IndexField(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+  , IndexKeys *keys
+  , void *data
+) {
+  size_t offset = *(size_t *) data;
+
+  (void) key;
+  (void) keysize;
+  return valuesize >= offset + 6 && SOPHIA_SUCCESS == keys->Add(
+      value + offset
+    , 6
+  );
+}
+
+/**
+ * Write the value of record `i` in `round` to `value` of
+ * `valuesize` (>= 16): one of 1000 groups, which moves
+ * every round, and one of 97 buckets, which doesn't.
+ */
+
+static void
+MakeIndexedValue(char *value, size_t i, size_t round, size_t valuesize) {
+  char fields[16];
+
+  snprintf(
+      fields
+    , sizeof(fields)
+    , "%06zu,%06zu,"
+    , (i + round) % 1000
+    , i % 97
+  );
+  memset(value, 'v', valuesize);
+  memcpy(value, fields, 14);
+  value[valuesize - 1] = '\0';
+}
+
+/**
+ * Set, replacing Set, Transaction::Commit and Delete
+ * with no, one and two SecondaryIndexes, naming the
+ * indexed runs with their overhead, then IndexIterator
+ * lookups and Sophia::RebuildIndex().
+ */
+
+BENCH(Index) {
+  static const char *ops[] = {
+      "Set"
+    , "Set, replacing"
+    , "Commit (100 ops)"
+    , "Delete"
+  };
+  static size_t offsets[] = { 0, 7 };
+  SecondaryIndex groups("groups", IndexField, &offsets[0]);
+  SecondaryIndex buckets("buckets", IndexField, &offsets[1]);
+  SecondaryIndex *indexes[] = { &groups, &buckets };
+  uint64_t baseline[4] = { 0, 0, 0, 0 };
+  size_t valuesize = std::max(config->valuesize, (size_t) 16);
+  char *value = MakeValue(valuesize);
+  char key[256];
+  char name[64];
+  size_t n = config->records;
+  size_t commits = n / 100 ? n / 100 : 1;
+  Transaction t(sp);
+
+  for (size_t indexed = 0; indexed <= 2; indexed++) {
+    uint64_t elapsed[4];
+
+    if (indexed) SOPHIA_ASSERT(sp->AddIndex(indexes[indexed - 1]));
+
+    uint64_t start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      MakeKey(key, i, config->keysize);
+      MakeIndexedValue(value, i, 0, valuesize);
+      SOPHIA_ASSERT(sp->Set(key, config->keysize, value, valuesize));
+    }
+    elapsed[0] = Nanos() - start;
+
+    start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      MakeKey(key, i, config->keysize);
+      MakeIndexedValue(value, i, 1, valuesize);
+      SOPHIA_ASSERT(sp->Set(key, config->keysize, value, valuesize));
+    }
+    elapsed[1] = Nanos() - start;
+
+    start = Nanos();
+    for (size_t c = 0; c < commits; c++) {
+      SOPHIA_ASSERT(t.Begin());
+      for (size_t j = 0; j < 100; j++) {
+        size_t i = (size_t) rand() % n;
+        MakeKey(key, i, config->keysize);
+        MakeIndexedValue(value, i, 2 + c, valuesize);
+        SOPHIA_ASSERT(t.Set(key, config->keysize, value, valuesize));
+      }
+      SOPHIA_ASSERT(t.Commit());
+    }
+    elapsed[2] = Nanos() - start;
+
+    start = Nanos();
+    for (size_t i = 0; i < n; i++) {
+      MakeKey(key, i, config->keysize);
+      SOPHIA_ASSERT(sp->Delete(key, config->keysize));
+    }
+    elapsed[3] = Nanos() - start;
+
+    for (int op = 0; op < 4; op++) {
+      size_t count = 2 == op ? commits : n;
+      if (indexed) {
+        sprintf(
+            name
+          , "%s, %zu index%s %+.1f%%"
+          , ops[op]
+          , indexed
+          , 1 == indexed ? "" : "es"
+          , 100.0 * ((double) elapsed[op] / baseline[op] - 1)
+        );
+      } else {
+        baseline[op] = elapsed[op];
+        sprintf(name, "%s", ops[op]);
+      }
+      Report(config, name, count, elapsed[op], NULL);
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    MakeKey(key, i, config->keysize);
+    MakeIndexedValue(value, i, 0, valuesize);
+    SOPHIA_ASSERT(sp->Set(key, config->keysize, value, valuesize));
+  }
+
+  // every group once, reading records and not
+  for (int values = 1; values >= 0; values--) {
+    char group[8];
+    size_t entries = 0;
+    uint64_t start = Nanos();
+    for (size_t g = 0; g < 1000; g++) {
+      snprintf(group, sizeof(group), "%06zu", g);
+      IndexIterator it(sp, &groups, group, 6, values);
+      SOPHIA_ASSERT(it.Begin());
+      while (it.Next()) entries++;
+      SOPHIA_ASSERT(it.End());
+    }
+    if (n != entries) exit(1);
+    Report(
+        config
+      , values ? "IndexIterator" : "IndexIterator, keys only"
+      , entries
+      , Nanos() - start
+      , NULL
+    );
+  }
+
+  uint64_t start = Nanos();
+  SOPHIA_ASSERT(sp->RebuildIndex(&groups));
+  Report(config, "RebuildIndex", n, Nanos() - start, NULL);
+
+  SOPHIA_ASSERT(sp->RemoveIndex(&groups));
+  SOPHIA_ASSERT(sp->RemoveIndex(&buckets));
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->RebuildIndex(&groups));
+  SOPHIA_ASSERT(sp->RebuildIndex(&buckets));
+  free(value);
+}
+
+/**
+ * Parse a comma-separated list of up to `max` numbers.
+ */
+
+static size_t
+ParseList(char *arg, size_t *list, size_t max) {
+  size_t n = 0;
+  for (char *p = strtok(arg, ","); p && n < max; p = strtok(NULL, ",")) {
+    list[n++] = strtoul(p, NULL, 10);
+  }
+  return n;
+}
+
+static void
+Usage() {
+  fprintf(
+      stderr
+    , "\n  Usage: sophia-bench [options] [suite..]\n\n"
+      "  Suites: core, api, load, threads, group, async, coro, cache,\n"
+      "  filter, keyspaces, typed, fixed, compress, stats, trace,\n"
+      "  snapshot, scan, index (default: core api).  coro needs a\n"
+      "  C++20 build.\n\n"
+      "  Options:\n\n"
+      "    --json                emit results as a JSON array\n"
+      "    --records <n>         records per run\n"
+      "    --key-sizes <a,b>     key sizes, in bytes (>= 16)\n"
+      "    --value-sizes <a,b>   value sizes, in bytes\n"
+      "    --read-percents <a,b> read share of the mixed runs\n"
+      "    --threads <n>         most reader threads (default: cores)\n\n"
+      "  The threads, group, async, coro, stats, snapshot and scan\n"
+      "  suites open the database in ThreadSafe() mode, so other suites\n"
+      "  run along with them include locking costs.\n\n"
+  );
+  exit(1);
+}
+
+int
+main(int argc, char **argv) {
+  size_t records = 0;
+  size_t keysizes[8] = { 16, 128 };
+  size_t nkeysizes = 2;
+  size_t valuesizes[8] = { 32, 1024 };
+  size_t nvaluesizes = 2;
+  size_t reads[8] = { 50, 95 };
+  size_t nreads = 2;
+  bool core = false;
+  bool api = false;
+  bool load = false;
+  bool threads = false;
+  bool group = false;
+  bool async = false;
+  bool coro = false;
+  bool cache = false;
+  bool filter = false;
+  bool keyspaces = false;
+  bool typed = false;
+  bool fixed = false;
+  bool compress = false;
+  bool stats = false;
+  bool trace = false;
+  bool snapshot = false;
+  bool scan = false;
+  bool index = false;
+
+  for (int i = 1; i < argc; i++) {
+    bool more = i + 1 < argc;
+    if (0 == strcmp("--json", argv[i])) {
+      json = true;
+    } else if (0 == strcmp("--records", argv[i]) && more) {
+      records = strtoul(argv[++i], NULL, 10);
+    } else if (0 == strcmp("--key-sizes", argv[i]) && more) {
+      nkeysizes = ParseList(argv[++i], keysizes, 8);
+    } else if (0 == strcmp("--value-sizes", argv[i]) && more) {
+      nvaluesizes = ParseList(argv[++i], valuesizes, 8);
+    } else if (0 == strcmp("--read-percents", argv[i]) && more) {
+      nreads = ParseList(argv[++i], reads, 8);
+    } else if (0 == strcmp("--threads", argv[i]) && more) {
+      max_threads = strtoul(argv[++i], NULL, 10);
+    } else if (0 == strcmp("core", argv[i])) {
+      core = true;
+    } else if (0 == strcmp("api", argv[i])) {
+      api = true;
+    } else if (0 == strcmp("load", argv[i])) {
+      load = true;
+    } else if (0 == strcmp("threads", argv[i])) {
+      threads = true;
+    } else if (0 == strcmp("group", argv[i])) {
+      group = true;
+    } else if (0 == strcmp("async", argv[i])) {
+      async = true;
+    } else if (0 == strcmp("coro", argv[i])) {
+      coro = true;
+    } else if (0 == strcmp("cache", argv[i])) {
+      cache = true;
+    } else if (0 == strcmp("filter", argv[i])) {
+      filter = true;
+    } else if (0 == strcmp("keyspaces", argv[i])) {
+      keyspaces = true;
+    } else if (0 == strcmp("typed", argv[i])) {
+      typed = true;
+    } else if (0 == strcmp("fixed", argv[i])) {
+      fixed = true;
+    } else if (0 == strcmp("compress", argv[i])) {
+      compress = true;
+    } else if (0 == strcmp("stats", argv[i])) {
+      stats = true;
+    } else if (0 == strcmp("trace", argv[i])) {
+      trace = true;
+    } else if (0 == strcmp("snapshot", argv[i])) {
+      snapshot = true;
+    } else if (0 == strcmp("scan", argv[i])) {
+      scan = true;
+    } else if (0 == strcmp("index", argv[i])) {
+      index = true;
+    } else {
+      Usage();
+    }
+  }
+
+  if (!core && !api && !load && !threads && !group && !async && !coro
+   && !cache && !filter && !keyspaces && !typed && !fixed && !compress
+   && !stats && !trace && !snapshot && !scan && !index) {
+    core = api = true;
+  }
+  if (0 == max_threads) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    max_threads = cores > 0 ? (size_t) cores : 1;
+  }
+  for (size_t k = 0; k < nkeysizes; k++) {
+    if (keysizes[k] < 16 || keysizes[k] > 256) Usage();
+  }
+  for (size_t v = 0; v < nvaluesizes; v++) {
+    if (0 == valuesizes[v]) Usage();
+  }
+
+  srand(time(0));
+  Sophia *sp = new Sophia("benchdb");
+  if (json) printf("[");
+
+  if (load) {
+    BenchConfig config = {
+        records ? records : 10000000
+      , keysizes[0]
+      , valuesizes[0]
+      , 0
+    };
+    Header(&config);
+    RUN_BENCH(BulkLoad, &config);
+  }
+
+  if (threads || group || async || coro || stats || snapshot || scan) {
+    sp->ThreadSafe();
+  }
+  SOPHIA_ASSERT(sp->Open());
+
+  if (core) {
+    for (size_t k = 0; k < nkeysizes; k++) {
+      for (size_t v = 0; v < nvaluesizes; v++) {
+        BenchConfig config = {
+            records ? records : 100000
+          , keysizes[k]
+          , valuesizes[v]
+          , 0
+        };
+        Header(&config);
+        SOPHIA_ASSERT(sp->Clear());
+        RUN_BENCH(Set, &config);
+        RUN_BENCH(Get, &config);
+        for (size_t r = 0; r < nreads; r++) {
+          config.read_percent = (int) reads[r];
+          RUN_BENCH(Mixed, &config);
+        }
+        config.read_percent = 0;
+        RUN_BENCH(Iterator, &config);
+        RUN_BENCH(Commit, &config);
+        RUN_BENCH(Count, &config);
+        RUN_BENCH(Delete, &config);
+        RUN_BENCH(Clear, &config);
+      }
+    }
+  }
+
+  if (api) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 0
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Load, &config);
+    RUN_BENCH(GetValue, &config);
+    RUN_BENCH(MultiGet, &config);
+    RUN_BENCH(Scan, &config);
+    RUN_BENCH(ScanPrefix, &config);
+    SOPHIA_ASSERT(sp->Clear());
+  }
+
+  if (threads) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 100
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Threads, &config);
+  }
+
+  if (group) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 0
+    };
+    Header(&config);
+    RUN_BENCH(GroupCommit, &config);
+  }
+
+  if (async) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 100
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Async, &config);
+  }
+
+  if (coro) {
+#ifdef SOPHIA_COROUTINES
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 100
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Coroutine, &config);
+#else
+    fprintf(stderr, "  coro: built without C++20 coroutine support\n");
+#endif
+  }
+
+  if (cache) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 100
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Cache, &config);
+  }
+
+  if (filter) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 100
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Filter, &config);
+  }
+
+  if (keyspaces) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 0
+    };
+    Header(&config);
+    RUN_BENCH(Keyspaces, &config);
+  }
+
+  if (typed) {
+    BenchConfig config = {
+        records ? records : 100000
+      , 20
+      , 8
+      , 0
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Typed, &config);
+  }
+
+  if (fixed) {
+    BenchConfig config = {
+        records ? records : 100000
+      , 8
+      , valuesizes[0]
+      , 100
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(FixedKey, &config);
+  }
+
+  for (size_t v = 0; compress && v < nvaluesizes; v++) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[v]
+      , 0
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Compress, &config);
+  }
+
+  if (stats) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 100
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Stats, &config);
+  }
+
+  if (trace) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 100
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Trace, &config);
+  }
+
+  for (size_t v = 0; snapshot && v < nvaluesizes; v++) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[v]
+      , 0
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Snapshot, &config);
+  }
+
+  if (scan) {
+    BenchConfig config = {
+        records ? records : 1000000
+      , keysizes[0]
+      , valuesizes[0]
+      , 0
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(ParallelScan, &config);
+  }
+
+  if (index) {
+    BenchConfig config = {
+        records ? records : 100000
+      , keysizes[0]
+      , valuesizes[0]
+      , 0
+    };
+    Header(&config);
+    SOPHIA_ASSERT(sp->Clear());
+    RUN_BENCH(Index, &config);
+  }
+
+  if (json) printf("\n]\n");
+  else printf("\n");
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+  return 0;
+}
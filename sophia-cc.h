@@ -3,8 +3,34 @@
 #define SOPHIA_CC_H 1
 
 #include <list.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 #include <sophia.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <future>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#define SOPHIA_COROUTINES 1
+#endif
+
+/**
+ * Operation stats and tracing are compiled in unless
+ * `SOPHIA_NO_STATS` is defined; without them
+ * Sophia::Instrument() and Sophia::Trace() do nothing and
+ * the wrapper pays no cost.
+ */
+
+#ifndef SOPHIA_NO_STATS
+#define SOPHIA_STATS 1
+#endif
 
 namespace sophia {
 
@@ -28,93 +54,163 @@ typedef enum {
   , SOPHIA_TRANSACTION_NOT_OPEN_ERROR = -10
 
   , SOPHIA_DATABASE_NOT_OPEN_ERROR = - 11
+  , SOPHIA_ALLOC_ERROR = -12
+  , SOPHIA_FILE_ERROR = -13
+  , SOPHIA_FORMAT_ERROR = -14
+  , SOPHIA_THREAD_ERROR = -15
+  , SOPHIA_WRITER_STOPPED_ERROR = -16
+  , SOPHIA_POOL_STOPPED_ERROR = -17
+  , SOPHIA_NOT_THREAD_SAFE_ERROR = -18
+  , SOPHIA_WRONG_ENVIRONMENT_ERROR = -19
+  , SOPHIA_COMPRESSION_ERROR = -20
+  , SOPHIA_NOT_TRACING_ERROR = -21
+  , SOPHIA_CHECKSUM_ERROR = -22
+  , SOPHIA_INDEX_ERROR = -23
+  , SOPHIA_READ_ONLY_ERROR = -24
 
   , SOPHIA_ENV_ERROR = -200
   , SOPHIA_DB_ERROR = -300
 } SophiaReturnCode;
 
-// forward def
-typedef struct TransactionOperation TransactionOperation;
-
 /**
  * Iterator->Next() result.
+ *
+ * Points into the cursor, so it is only valid until the
+ * iterator moves or ends.
  */
 
 typedef struct {
   const char *key;
+  size_t keysize;
   const char *value;
+  size_t valuesize;
 } IteratorResult;
 
 // forward defs
 class Transaction;
 class Iterator;
+class Sophia;
+class Database;
+class Environment;
 
 /**
- * Sophia wrapper.
+ * Sophia::Get() result.
+ *
+ * Holds the value buffer returned by `sp_get` along with
+ * its size, and frees it when destroyed or reused.  When
+ * constructed over a caller-supplied `buffer`, values which
+ * fit are copied into it and sophia's copy is freed.  That
+ * is only a convenience: `sp_get` still allocates every
+ * value, and the extra copy makes it a little slower than
+ * a plain Value.
  */
 
-class Sophia {
+class Value {
   public:
 
+    Value();
+    Value(char *buffer, size_t capacity);
+    ~Value();
+
     /**
-     * Sophia db.
+     * Value data, or `NULL` if the key was not found.
+     *
+     * Valid until the next lookup into this value.
      */
 
-    void *db;
+    const char *
+    Data() const;
 
     /**
-     * Sophia env.
+     * Value size.
      */
 
-    void *env;
+    size_t
+    Size() const;
 
     /**
-     * Sophia cursors.
+     * Release ownership of the value, leaving this
+     * instance empty.  Returns `NULL` when the data lives
+     * in the caller-supplied buffer.
+     *
+     * `free` the result when done.
      */
 
-    list_t *cursors;
+    char *
+    Release();
 
     /**
-     * Create a new Sophia instance for db `path`.
+     * Free any owned data and empty the value.
      */
 
-    Sophia(const char *path);
+    void
+    Reset();
+
+  private:
+
+    friend class Sophia;
 
     /**
-     * Destroy.
+     * Current data.
      */
 
-    ~Sophia();
+    char *data;
 
     /**
-     * Check if the db is open.
+     * Current data size.
      */
 
-    bool
-    IsOpen();
+    size_t size;
 
     /**
-     * Open/create the database.
+     * Whether `data` was allocated by sophia.
      */
 
-    SophiaReturnCode
-    Open(
-        bool create_if_missing = true
-      , bool read_only = false
-      , int page_size = 2048
-      , int merge_watermark = 100000
-      , bool gc = true
-    );
+    bool owned;
 
     /**
-     * Close the database.
+     * Caller-supplied buffer.
      */
 
-    SophiaReturnCode
-    Close();
+    char *buffer;
 
     /**
-     * Set `key` of `keysize` to `value` of `valuesize`.
+     * Caller-supplied buffer capacity.
+     */
+
+    size_t capacity;
+
+    /**
+     * Take the `ref` of `refsize` returned by `sp_get`.
+     */
+
+    void
+    Assign(char *ref, size_t refsize);
+
+    // not copyable
+    Value(const Value &);
+    Value &operator=(const Value &);
+};
+
+/**
+ * Batch of pending sets/deletes.
+ *
+ * Operations are stored back to back as length-prefixed
+ * records in a single growable arena, so keys and values
+ * may contain NUL bytes and a batch costs no allocations
+ * once its arena is large enough.  `Clear()` keeps the
+ * arena for reuse.
+ */
+
+class WriteBatch {
+  public:
+
+    WriteBatch();
+    ~WriteBatch();
+
+    /**
+     * Add a set of `key` of `keysize` to `value` of
+     * `valuesize`.
      */
 
     SophiaReturnCode
@@ -126,287 +222,4956 @@ class Sophia {
     );
 
     /**
-     * Set `key` = `value` using the default
-     * (`strlen(ptr) + 1`) algorithm to calculate
-     * key/value sizes.
+     * Add a set of `key` = `value` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate key/value
+     * sizes.
      */
 
     SophiaReturnCode
     Set(const char *key, const char *value);
 
     /**
-     * Get the value of `key` using the given `keysize`.
-     *
-     * `free` the result when done.
-     */
-
-    char *
-    Get(const char *key, size_t keysize);
-
-    /**
-     * Get the value of `key` using the default
-     * (`strlen(ptr) + 1`) algorithm to calculate
-     * key size.
-     *
-     * `free` the result when done.
+     * Add a delete of `key` of `keysize`.
      */
 
-    char *
-    Get(const char *key);
+    SophiaReturnCode
+    Delete(const char *key, size_t keysize);
 
     /**
-     * Get the error string associated with return code `rc`.
-     *
-     * Do not destroy the result.
+     * Add a delete of `key` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate key size.
      */
 
-    const char *
-    Error(SophiaReturnCode rc);
+    SophiaReturnCode
+    Delete(const char *key);
 
     /**
-     * Delete `key` of `keysize`.
+     * Grow the arena to hold at least `bytes` of records.
      */
 
     SophiaReturnCode
-    Delete(const char *key, size_t keysize);
+    Reserve(size_t bytes);
 
     /**
-     * Delete `key` using the default (`strlen(ptr) + 1`)
-     * algorithm to calculate key size.
+     * Remove all operations, keeping the arena.
      */
 
-    SophiaReturnCode
-    Delete(const char *key);
+    void
+    Clear();
 
     /**
-     * Put the number of keys in `n`.
+     * Number of operations.
      */
 
-    SophiaReturnCode
-    Count(size_t *n);
+    size_t
+    Count() const;
 
     /**
-     * Clear *all* keys in the database.
+     * Number of arena bytes used.
      */
 
-    SophiaReturnCode
-    Clear();
+    size_t
+    Size() const;
 
   private:
 
+    friend class Sophia;
+
     /**
-     * Open flag.
+     * Record arena.
      */
 
-    bool open;
+    char *arena;
 
     /**
-     * Path to db.
+     * Used arena bytes.
      */
 
-    const char *path;
-};
-
-/**
- * Transaction wrapper.
- */
-
-class Transaction {
-  public:
-
-    Transaction(Sophia *sp);
-    ~Transaction();
+    size_t size;
 
     /**
-     * Begin the transaction.
+     * Allocated arena bytes.
      */
 
-    SophiaReturnCode
-    Begin();
+    size_t capacity;
 
     /**
-     * Create a pending set (`key` = `value`) using the
-     * default (`strlen(ptr) + 1`) algorithm to calculate
-     * key/value sizes.
+     * Number of records.
      */
 
-    SophiaReturnCode
-    Set(const char *key, const char *value);
+    size_t count;
 
     /**
-     * Create a pending set (`key` = `value`) using the
-     * given key/value sizes.
+     * Append a record.
      */
 
     SophiaReturnCode
-    Set(
-        const char *key
+    Append(
+        int type
+      , const char *key
       , size_t keysize
       , const char *value
       , size_t valuesize
     );
 
+    // not copyable
+    WriteBatch(const WriteBatch &);
+    WriteBatch &operator=(const WriteBatch &);
+};
+
+// forward def
+typedef struct MultiGetEntry MultiGetEntry;
+
+/**
+ * Sophia::MultiGet() result.
+ *
+ * Values are copied into a single arena owned by the
+ * result and are indexed in the order the keys were given.
+ * Reusing a result across calls reuses its memory.
+ */
+
+class MultiGetResult {
+  public:
+
+    MultiGetResult();
+    ~MultiGetResult();
+
     /**
-     * Create a pending delete (`key` = `NULL`) using the
-     * default (`strlen(ptr) + 1`) algorithm to calculate
-     * key size.
+     * Number of requested keys.
      */
 
-    SophiaReturnCode
-    Delete(const char *key);
+    size_t
+    Count() const;
 
     /**
-     * Create a pending delete (`key` = `NULL`) using the
-     * given key size.
+     * Value of the `i`th requested key, or `NULL` if it
+     * was not found.
+     *
+     * Valid until the next MultiGet() into this result.
      */
 
-    SophiaReturnCode
-    Delete(const char *key, size_t keysize);
+    const char *
+    Data(size_t i) const;
 
     /**
-     * Commit the transaction.
+     * Value size of the `i`th requested key.
      */
 
-    SophiaReturnCode
-    Commit();
+    size_t
+    Size(size_t i) const;
 
     /**
-     * Rollback the transaction.
+     * Empty the result, keeping its memory.
      */
 
-    SophiaReturnCode
-    Rollback();
+    void
+    Reset();
 
   private:
 
+    friend class Sophia;
+
     /**
-     * Pointer to the Sophia class.
+     * Value arena.
      */
 
-    Sophia *sp;
+    char *arena;
 
     /**
-     * All pending operations.
+     * Used arena bytes.
      */
 
-    list_t *operations;
+    size_t arenasize;
 
     /**
-     * Add an operation to the stack.
+     * Allocated arena bytes.
      */
 
-    SophiaReturnCode
-    AddOperation(TransactionOperation *operation);
-};
-
-/**
- * Iterator.
- */
-
-class Iterator {
-  public:
+    size_t arenacapacity;
 
-    Iterator(Sophia *sp);
-    Iterator(Sophia *sp, sporder order);
-    Iterator(
-        Sophia *sp
-      , sporder order
-      , const char *start
-    );
-    Iterator(
-        Sophia *sp
-      , sporder order
-      , const char *start
-      , size_t keysize
-    );
-    Iterator(
-        Sophia *sp
-      , sporder order
-      , const char *start
-      , const char *end
-    );
-    Iterator(
-        Sophia *sp
-      , sporder order
-      , const char *start
-      , size_t keysize
-      , const char *end
-      , size_t endsize
-    );
+    /**
+     * Per-key entries.
+     */
 
-    ~Iterator();
+    MultiGetEntry *entries;
 
     /**
-     * Begin the iterator.
+     * Number of entries.
      */
 
-    SophiaReturnCode
-    Begin();
+    size_t count;
 
     /**
-     * Get the next result.
+     * Allocated entries.
      */
 
-    IteratorResult *
-    Next();
+    size_t capacity;
 
     /**
-     * End the iterator.
+     * Size the result for `n` keys.
      */
 
     SophiaReturnCode
-    End();
-
-  private:
+    Prepare(size_t n);
 
     /**
-     * Owner Sophia instance.
+     * Copy `value` of `valuesize` into the arena as the
+     * result of key `i`.
      */
 
-    Sophia *sp;
+    SophiaReturnCode
+    Store(size_t i, const char *value, size_t valuesize);
 
     /**
-     * Iterator order.
+     * Make room for `valuesize` bytes in the arena as the
+     * result of key `i`, returning where to put them or
+     * `NULL`.
      */
 
-    sporder order;
+    char *
+    Reserve(size_t i, size_t valuesize);
 
-    /**
-     * Cursor.
-     */
+    // not copyable
+    MultiGetResult(const MultiGetResult &);
+    MultiGetResult &operator=(const MultiGetResult &);
+};
 
-    void *cursor;
+/**
+ * Sophia::ScanPrefix() callback, given each row.  Return
+ * `false` to stop the scan.
+ */
 
-    /**
-     * Cursor node in Sophia's list.
-     */
+typedef bool (*ScanCallback)(const IteratorResult *result, void *data);
 
-    list_node_t *cursor_node;
+/**
+ * Sophia::ParallelScan() callback, given each row and the
+ * index of its shard.  Return `false` to stop the scan.
+ */
 
-    /**
-     * Start key.
-     */
+typedef bool (*ParallelScanCallback)(
+    const IteratorResult *result
+  , size_t shard
+  , void *data
+);
 
-    const char *start;
+/**
+ * Sophia::DeleteRange() progress callback, given the
+ * number of keys deleted so far.
+ */
 
-    /**
-     * Start keysize.
-     */
+typedef void (*DeleteRangeProgress)(size_t deleted, void *data);
 
-    size_t startsize;
+/**
+ * Sophia::CacheStats() result.
+ */
 
-    /**
-     * End key.
-     */
+typedef struct {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t entries;
 
-    const char *end;
+  /**
+   * Bytes held, including per-entry overhead.
+   */
 
-    /**
-     * End keysize.
-     */
+  size_t bytes;
 
-    size_t endsize;
-};
+  /**
+   * Byte budget.
+   */
+
+  size_t capacity;
+} ValueCacheStats;
+
+// forward def
+class ValueCache;
+
+/**
+ * Sophia::FilterStats() result.
+ */
+
+typedef struct {
+  size_t lookups;
+
+  /**
+   * Lookups answered without reading the database.
+   */
+
+  size_t negatives;
+
+  /**
+   * Lookups the filter passed for keys which didn't
+   * exist.
+   */
+
+  size_t false_positives;
+
+  /**
+   * Measured share of absent keys the filter passed.
+   */
+
+  double false_positive_rate;
+
+  /**
+   * Rate predicted by the filter's current fill.
+   */
+
+  double expected_false_positive_rate;
+
+  size_t bits;
+  size_t hashes;
+
+  /**
+   * Memory used by the filter bits.
+   */
+
+  size_t bytes;
+} BloomFilterStats;
+
+// forward def
+class BloomFilter;
+
+/**
+ * Value codec for Sophia::Compression().
+ *
+ * `id` is stored with every value the codec compresses,
+ * so it must never be reused for another format; ids `0`
+ * to `2` belong to the wrapper.  `compress` writes at most
+ * `capacity` bytes (at least `bound(size)`) to `dst` and
+ * returns how many, or `0` to store the value as is.
+ * `decompress` must fill exactly `rawsize` bytes of `dst`
+ * and may run on several threads at once.  Both are given
+ * the database dictionary (`NULL` if none) and `data`.
+ */
+
+typedef struct {
+  unsigned char id;
+
+  size_t (*bound)(size_t size, void *data);
+
+  size_t (*compress)(
+      const char *src
+    , size_t size
+    , char *dst
+    , size_t capacity
+    , const char *dictionary
+    , size_t dictionarysize
+    , void *data
+  );
+
+  bool (*decompress)(
+      const char *src
+    , size_t size
+    , char *dst
+    , size_t rawsize
+    , const char *dictionary
+    , size_t dictionarysize
+    , void *data
+  );
+
+  void *data;
+} CompressionCodec;
+
+/**
+ * Sophia::CompressionStats() result, counting the values
+ * written by this instance.
+ */
+
+typedef struct {
+  size_t values;
+
+  /**
+   * Values stored compressed.
+   */
+
+  size_t compressed;
+
+  /**
+   * Value bytes given to writes.
+   */
+
+  size_t raw_bytes;
+
+  /**
+   * Value bytes stored, headers included.
+   */
+
+  size_t stored_bytes;
+
+  /**
+   * `raw_bytes / stored_bytes`.
+   */
+
+  double ratio;
+
+  /**
+   * Size of the database dictionary.
+   */
+
+  size_t dictionary_bytes;
+} ValueCompressionStats;
+
+// forward def
+class ValueCompressor;
+
+/**
+ * Operations counted by Sophia::Instrument().
+ */
+
+typedef enum {
+    SOPHIA_OP_GET = 0
+  , SOPHIA_OP_MULTIGET
+  , SOPHIA_OP_SET
+  , SOPHIA_OP_DELETE
+  , SOPHIA_OP_WRITE
+  , SOPHIA_OP_COUNT
+  , SOPHIA_OP_ITERATOR_NEXT
+} SophiaOperation;
+
+/**
+ * Number of SophiaOperations.
+ */
+
+#define SOPHIA_OPERATIONS 7
+
+/**
+ * Number of latency histogram buckets: 8 per power of two
+ * of nanoseconds, so bucket bounds are within 12.5% of
+ * any latency they hold.
+ */
+
+#define SOPHIA_LATENCY_BUCKETS 320
+
+/**
+ * Number of error counters per operation: slot `i` counts
+ * return code `-i` for `i` below 30, slot 30
+ * `SOPHIA_ENV_ERROR`, slot 31 `SOPHIA_DB_ERROR` and slot
+ * 0 any other code.  See ErrorSlot().
+ */
+
+#define SOPHIA_ERROR_SLOTS 32
+
+/**
+ * Counters of one operation in a SophiaStats.
+ */
+
+typedef struct {
+  uint64_t count;
+
+  /**
+   * Key and value bytes passed in or returned.
+   */
+
+  uint64_t bytes;
+
+  /**
+   * Calls which failed, in total and by return code.
+   */
+
+  uint64_t errors;
+  uint64_t error_codes[SOPHIA_ERROR_SLOTS];
+
+  /**
+   * Latencies, in nanoseconds.  Percentiles are the
+   * upper bound of their histogram bucket.
+   */
+
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+
+  /**
+   * Latency histogram; bucket `i` holds latencies from
+   * LatencyBucketFloor(i) up to LatencyBucketFloor(i + 1).
+   */
+
+  uint64_t buckets[SOPHIA_LATENCY_BUCKETS];
+} OperationStats;
+
+/**
+ * Sophia::Stats() result.
+ */
+
+typedef struct {
+  /**
+   * Whether instrumentation is on.
+   */
+
+  bool enabled;
+
+  OperationStats operations[SOPHIA_OPERATIONS];
+} SophiaStats;
+
+/**
+ * Lower-case name of `op`, as used by the stats dumpers.
+ */
+
+const char *
+OperationName(SophiaOperation op);
+
+/**
+ * Slot of `rc` in OperationStats::error_codes.
+ */
+
+size_t
+ErrorSlot(SophiaReturnCode rc);
+
+/**
+ * Smallest latency, in nanoseconds, held by histogram
+ * bucket `i`.
+ */
+
+uint64_t
+LatencyBucketFloor(size_t i);
+
+/**
+ * Write `stats` to `buffer` of `size` in the Prometheus
+ * text exposition format, with metric names starting with
+ * `prefix`.  Like `snprintf`, returns the length of the
+ * whole text, which was cut short if not below `size`.
+ */
+
+size_t
+StatsPrometheus(
+    const SophiaStats *stats
+  , char *buffer
+  , size_t size
+  , const char *prefix = "sophia"
+);
+
+/**
+ * Write `stats` to `buffer` of `size` as a JSON object.
+ * Returns the length like StatsPrometheus().
+ */
+
+size_t
+StatsJSON(const SophiaStats *stats, char *buffer, size_t size);
+
+/**
+ * Bytes of key kept by a SlowOperation.
+ */
+
+#define SOPHIA_TRACE_KEY_PREFIX 24
+
+/**
+ * An operation recorded by Sophia::Trace().
+ */
+
+typedef struct {
+  /**
+   * Position in the trace; gaps are operations which were
+   * overwritten before being read.
+   */
+
+  uint64_t sequence;
+
+  SophiaOperation op;
+  SophiaReturnCode rc;
+
+  /**
+   * When the operation finished, in nanoseconds since the
+   * epoch, and how long it took in nanoseconds.
+   */
+
+  uint64_t time;
+  uint64_t duration;
+
+  /**
+   * Key and value sizes.  MultiGet() gives its first key
+   * and the size of all values, Write() only the batch
+   * size as `valuesize` and Count() neither.
+   */
+
+  size_t keysize;
+  size_t valuesize;
+
+  /**
+   * Cursors open when the operation finished, including
+   * its own for Iterator::Next().
+   */
+
+  size_t cursors;
+
+  /**
+   * The first `SOPHIA_TRACE_KEY_PREFIX` bytes of the key,
+   * or all of it if shorter.
+   */
+
+  char key[SOPHIA_TRACE_KEY_PREFIX];
+} SlowOperation;
+
+/**
+ * Write `operation` to `buffer` of `size` as one logfmt
+ * line, without a newline.  Returns the length like
+ * StatsPrometheus().
+ */
+
+size_t
+SlowOperationText(const SlowOperation *operation, char *buffer, size_t size);
+
+/**
+ * Index keys an IndexExtractor finds in one record.
+ *
+ * Keys are copied back to back into a growable arena,
+ * which Clear() keeps for reuse.
+ */
+
+class IndexKeys {
+  public:
+
+    IndexKeys();
+    ~IndexKeys();
+
+    /**
+     * Add index key `key` of `keysize`.
+     */
+
+    SophiaReturnCode
+    Add(const char *key, size_t keysize);
+
+    /**
+     * Add index key `key` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate key size.
+     */
+
+    SophiaReturnCode
+    Add(const char *key);
+
+    /**
+     * Check if `key` of `keysize` was added.
+     */
+
+    bool
+    Contains(const char *key, size_t keysize) const;
+
+    /**
+     * Number of keys added.
+     */
+
+    size_t
+    Count() const;
+
+    /**
+     * Remove all keys, keeping the arena.
+     */
+
+    void
+    Clear();
+
+  private:
+
+    friend class Sophia;
+
+    /**
+     * Key arena: each key follows its `size_t` size.
+     */
+
+    char *arena;
+
+    /**
+     * Used arena bytes.
+     */
+
+    size_t size;
+
+    /**
+     * Allocated arena bytes.
+     */
+
+    size_t capacity;
+
+    /**
+     * Number of keys.
+     */
+
+    size_t count;
+
+    /**
+     * Whether an Add() failed to allocate.
+     */
+
+    bool failed;
+
+    // not copyable
+    IndexKeys(const IndexKeys &);
+    IndexKeys &operator=(const IndexKeys &);
+};
+
+/**
+ * SecondaryIndex extractor: add the index keys of the
+ * record `key` = `value` to `keys`, if any.  Return
+ * `false` to refuse the record, failing its write with
+ * `SOPHIA_INDEX_ERROR`.
+ *
+ * Called with the database locked for writing, so it
+ * must not call back into it.
+ */
+
+typedef bool (*IndexExtractor)(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+  , IndexKeys *keys
+  , void *data
+);
+
+/**
+ * Sophia::RebuildIndex() progress callback, given the
+ * number of records indexed so far.
+ */
+
+typedef void (*RebuildIndexProgress)(size_t indexed, void *data);
+
+/**
+ * Secondary index over the records of a Sophia instance.
+ *
+ * Once added with Sophia::AddIndex(), every write through
+ * the instance also writes the entries mapping the index
+ * keys of its records back to their keys, in the same
+ * transaction.  Entries are reserved keys named after the
+ * index, so it must keep its name across runs; an
+ * IndexIterator reads them.
+ */
+
+class SecondaryIndex {
+  public:
+
+    /**
+     * Create index `name`, calling `extractor` with
+     * `data` for the index keys of every record written.
+     */
+
+    SecondaryIndex(
+        const char *name
+      , IndexExtractor extractor
+      , void *data = NULL
+    );
+
+    ~SecondaryIndex();
+
+    /**
+     * Index name.
+     */
+
+    const char *
+    Name() const;
+
+  private:
+
+    friend class Sophia;
+    friend class IndexIterator;
+
+    /**
+     * Index name.
+     */
+
+    const char *name;
+
+    /**
+     * Prefix of the index entries, or `NULL` when it
+     * couldn't be allocated.
+     */
+
+    char *prefix;
+
+    /**
+     * Entry prefix size.
+     */
+
+    size_t prefixsize;
+
+    /**
+     * Index key extractor.
+     */
+
+    IndexExtractor extractor;
+
+    /**
+     * Extractor data.
+     */
+
+    void *data;
+
+    // not copyable
+    SecondaryIndex(const SecondaryIndex &);
+    SecondaryIndex &operator=(const SecondaryIndex &);
+};
+
+/**
+ * IndexIterator->Next() result.
+ *
+ * Points into the iterator, so it is only valid until the
+ * iterator moves or ends.  `value` is `NULL` when the
+ * iterator doesn't read records.
+ */
+
+typedef struct {
+  const char *indexkey;
+  size_t indexkeysize;
+  const char *key;
+  size_t keysize;
+  const char *value;
+  size_t valuesize;
+} IndexResult;
+
+// forward defs
+class Instrumentation;
+class SlowOperationTracer;
+class IndexScratch;
+
+/**
+ * Number of CursorRegistry shards.
+ */
+
+#define SOPHIA_CURSOR_SHARDS 16
+
+/**
+ * Registry of the open cursors of a Sophia instance, so
+ * Close() can destroy any left behind.
+ *
+ * Cursors are spread over independently locked shards by
+ * address, so threads opening and closing cursors rarely
+ * contend.
+ */
+
+class CursorRegistry {
+  public:
+
+    CursorRegistry();
+    ~CursorRegistry();
+
+    /**
+     * Register `cursor`, putting its node in `node`.
+     * On failure `cursor` is destroyed.
+     */
+
+    SophiaReturnCode
+    Add(void *cursor, list_node_t **node);
+
+    /**
+     * Unregister and destroy the cursor of `node`.
+     */
+
+    void
+    Remove(list_node_t *node);
+
+    /**
+     * Destroy every registered cursor.
+     */
+
+    void
+    Clear();
+
+    /**
+     * Number of registered cursors.
+     */
+
+    size_t
+    Count();
+
+  private:
+
+    /**
+     * Cursor lists.
+     */
+
+    list_t *lists[SOPHIA_CURSOR_SHARDS];
+
+    /**
+     * Per-list locks.
+     */
+
+    pthread_mutex_t locks[SOPHIA_CURSOR_SHARDS];
+
+    /**
+     * Shard holding `cursor`.
+     */
+
+    size_t
+    Shard(void *cursor) const;
+
+    // not copyable
+    CursorRegistry(const CursorRegistry &);
+    CursorRegistry &operator=(const CursorRegistry &);
+};
+
+/**
+ * Sophia wrapper.
+ *
+ * Not thread-safe unless ThreadSafe() is enabled before
+ * Open().
+ */
+
+class Sophia {
+  public:
+
+    /**
+     * Sophia db.
+     */
+
+    void *db;
+
+    /**
+     * Sophia env.
+     */
+
+    void *env;
+
+    /**
+     * Sophia cursors.
+     */
+
+    CursorRegistry cursors;
+
+    /**
+     * Create a new Sophia instance for db `path`.
+     */
+
+    Sophia(const char *path);
+
+    /**
+     * Destroy.
+     */
+
+    ~Sophia();
+
+    /**
+     * Check if the db is open.
+     */
+
+    bool
+    IsOpen();
+
+    /**
+     * Check if ThreadSafe() is enabled.
+     */
+
+    bool
+    IsThreadSafe();
+
+    /**
+     * Open/create the database.
+     */
+
+    SophiaReturnCode
+    Open(
+        bool create_if_missing = true
+      , bool read_only = false
+      , int page_size = 2048
+      , int merge_watermark = 100000
+      , bool gc = true
+    );
+
+    /**
+     * Close the database.  If the database closed but its
+     * filter could not be saved, that error is returned.
+     */
+
+    SophiaReturnCode
+    Close();
+
+    /**
+     * Set `key` of `keysize` to `value` of `valuesize`.
+     */
+
+    SophiaReturnCode
+    Set(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    /**
+     * Set `key` = `value` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate
+     * key/value sizes.
+     */
+
+    SophiaReturnCode
+    Set(const char *key, const char *value);
+
+    /**
+     * Get the value of `key` using the given `keysize`.
+     *
+     * `free` the result when done.
+     */
+
+    char *
+    Get(const char *key, size_t keysize);
+
+    /**
+     * Get the value of `key` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate
+     * key size.
+     *
+     * `free` the result when done.
+     */
+
+    char *
+    Get(const char *key);
+
+    /**
+     * Get the value of `key` of `keysize` into `value`.
+     *
+     * Unlike `Get(key, keysize)`, the value size is kept
+     * and the result is freed by `value`.  A missing key
+     * leaves `value.Data()` as `NULL`.
+     */
+
+    SophiaReturnCode
+    Get(const char *key, size_t keysize, Value &value);
+
+    /**
+     * Get the value of `key` into `value` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate key size.
+     */
+
+    SophiaReturnCode
+    Get(const char *key, Value &value);
+
+    /**
+     * Get the values of `count` `keys` of `keysizes` into
+     * `result`.
+     *
+     * Keys are sorted and deduplicated, then read in key
+     * order through a single cursor which is only re-seeked
+     * across sparse gaps.
+     */
+
+    SophiaReturnCode
+    MultiGet(
+        const char **keys
+      , const size_t *keysizes
+      , size_t count
+      , MultiGetResult &result
+    );
+
+    /**
+     * Get the values of `count` `keys` into `result` using
+     * the default (`strlen(ptr) + 1`) algorithm to calculate
+     * key sizes.
+     */
+
+    SophiaReturnCode
+    MultiGet(const char **keys, size_t count, MultiGetResult &result);
+
+    /**
+     * Get the error string associated with return code `rc`.
+     *
+     * Do not destroy the result.
+     */
+
+    const char *
+    Error(SophiaReturnCode rc);
+
+    /**
+     * Delete `key` of `keysize`.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key, size_t keysize);
+
+    /**
+     * Delete `key` using the default (`strlen(ptr) + 1`)
+     * algorithm to calculate key size.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key);
+
+    /**
+     * Apply every operation in `batch` within a single
+     * transaction.
+     */
+
+    SophiaReturnCode
+    Write(const WriteBatch &batch);
+
+    /**
+     * Call `callback` with `data` for every key starting
+     * with `prefix` of `prefixsize`, in key order.
+     */
+
+    SophiaReturnCode
+    ScanPrefix(
+        const char *prefix
+      , size_t prefixsize
+      , ScanCallback callback
+      , void *data = NULL
+    );
+
+    /**
+     * Call `callback` with `data` for every key from
+     * `start` (inclusive) to `end` (exclusive), scanning
+     * shards of the range with `nthreads` threads, one
+     * cursor each.  A `NULL` bound leaves that side of the
+     * range open.
+     *
+     * Shards are split at the `nsplits` `splits` when
+     * given; splits out of order or out of range are
+     * skipped.  Otherwise the range is cut into 8 shards
+     * per thread at keys interpolated between its first
+     * and last key, and threads take the next shard as
+     * they finish one, which evens out skew.
+     *
+     * Unordered, the callback runs on the scanning threads
+     * at once, and `shard` tells them apart.  `ordered`
+     * calls it on the calling thread in key order instead,
+     * buffering a few chunks of rows per shard being
+     * scanned.  Either way it must not write.
+     *
+     * If the engine refuses a cursor while the scan holds
+     * others, that thread hands its shard back and the
+     * scan goes on with fewer threads.  More than one
+     * thread requires ThreadSafe() mode.
+     */
+
+    SophiaReturnCode
+    ParallelScan(
+        const char *start
+      , size_t startsize
+      , const char *end
+      , size_t endsize
+      , size_t nthreads
+      , ParallelScanCallback callback
+      , void *data = NULL
+      , bool ordered = false
+      , const char *const *splits = NULL
+      , const size_t *splitsizes = NULL
+      , size_t nsplits = 0
+    );
+
+    /**
+     * Put the number of keys in `n`.
+     *
+     * O(1) when the count is tracked, otherwise a full scan.
+     */
+
+    SophiaReturnCode
+    Count(size_t *n);
+
+    /**
+     * Put an estimate of the number of keys in `n`.
+     *
+     * When the count is tracked this never scans, even if
+     * the tracked count is stale after an unclean shutdown.
+     * Otherwise it falls back to Count().
+     */
+
+    SophiaReturnCode
+    EstimateCount(size_t *n);
+
+    /**
+     * Recount the keys with a full scan, repairing the
+     * tracked count, and put the result in `n`.
+     */
+
+    SophiaReturnCode
+    Recount(size_t *n = NULL);
+
+    /**
+     * Maintain an exact key count on every write, so
+     * Count() doesn't have to scan.
+     *
+     * The count is kept in a reserved key (keys starting
+     * with `"\0\0sophia-cc:"` are reserved and hidden from
+     * scans).  It costs one lookup per written key, and an
+     * unclean shutdown makes the next Count() rescan, as
+     * does a writable session without tracking.  Enabling
+     * it on an open database also makes the next Count()
+     * rescan.
+     */
+
+    void
+    TrackCount(bool track = true);
+
+    /**
+     * Allow the instance to be shared between threads.
+     * Has no effect on an open database.
+     *
+     * Reads (`Get`, `MultiGet`, `Count` and iterators) run
+     * concurrently; writes (`Set`, `Delete`, `Write`,
+     * `DeleteRange`, `Clear` and `Transaction::Commit`)
+     * are serialized and wait for every open iterator to
+     * end, since sophia refuses writes while a cursor is
+     * open.  A thread must therefore not write while it
+     * holds an open iterator.  `Open`, `Close` and the
+     * configuration methods must not race other calls.
+     */
+
+    void
+    ThreadSafe(bool threadsafe = true);
+
+    /**
+     * Cache up to `bytes` of values in front of Get() and
+     * MultiGet(), spread over `shards` independently locked
+     * shards with CLOCK eviction.  `0` disables the cache.
+     *
+     * Writes through this instance keep the cache coherent;
+     * writes by other instances or processes are not seen.
+     * Reopening the database empties it.
+     */
+
+    SophiaReturnCode
+    Cache(size_t bytes, size_t shards = 16);
+
+    /**
+     * Put the cache counters in `stats`, all zero when the
+     * cache is disabled.
+     */
+
+    void
+    CacheStats(ValueCacheStats *stats);
+
+    /**
+     * Keep a Bloom filter of the keys, sized for `keys`
+     * keys at `fp_rate` false positives, so Get() and
+     * MultiGet() answer most absent keys without reading
+     * the database.  `0` disables the filter.
+     *
+     * The filter is built by a full scan, on Open() or
+     * right away when the database is open.  A clean
+     * Close() saves it to `<path>.filter` and the next
+     * Open() loads it instead of scanning, unless the
+     * database was written to in between.  Deleted keys
+     * stay in the filter until it is rebuilt, which
+     * calling Filter() again on an open database does.
+     *
+     * Writes by programs not using this wrapper are not
+     * seen.
+     */
+
+    SophiaReturnCode
+    Filter(size_t keys, double fp_rate = 0.01);
+
+    /**
+     * Put the filter counters in `stats`, all zero when
+     * the filter is disabled.
+     */
+
+    void
+    FilterStats(BloomFilterStats *stats);
+
+    /**
+     * Compress values of at least `min_size` bytes with
+     * `codec`, or the built-in LZ77 codec when `NULL`,
+     * before they are stored.  Values which don't shrink
+     * are stored as is.
+     *
+     * Every value then carries a small header naming its
+     * codec, so values written before are still read and
+     * compression can be turned off again at any time.
+     * Headers are used from the first Open() with
+     * compression on, which fails with
+     * `SOPHIA_COMPRESSION_ERROR` if the database already
+     * holds values without them; so does enabling
+     * compression on such an open database.
+     */
+
+    SophiaReturnCode
+    Compression(
+        bool enable = true
+      , size_t min_size = 64
+      , const CompressionCodec *codec = NULL
+    );
+
+    /**
+     * Let values written by `codec` be read without
+     * compressing new values with it.
+     */
+
+    SophiaReturnCode
+    RegisterCodec(const CompressionCodec *codec);
+
+    /**
+     * Store `dictionary` of `size` (at most 65535 bytes)
+     * in the open, compressed database, so small values
+     * sharing its content compress well.  Samples of
+     * typical values make a good dictionary.  It can't be
+     * changed once set: setting another fails with
+     * `SOPHIA_COMPRESSION_ERROR`.
+     */
+
+    SophiaReturnCode
+    CompressionDictionary(const char *dictionary, size_t size);
+
+    /**
+     * Put the compression counters in `stats`, all zero
+     * when compression was never enabled.
+     */
+
+    void
+    CompressionStats(ValueCompressionStats *stats);
+
+    /**
+     * Time and count every Get(), MultiGet(), Set(),
+     * Delete(), Write() (so Transaction::Commit()),
+     * Count() and Iterator::Next() call.  Counters are
+     * striped by thread, so threads rarely share a cache
+     * line.  Disabling drops the counters.
+     *
+     * A configuration method: don't race other calls.
+     * Does nothing when built with `SOPHIA_NO_STATS`.
+     */
+
+    SophiaReturnCode
+    Instrument(bool enable = true);
+
+    /**
+     * Put a snapshot of the operation counters in `stats`,
+     * all zero when instrumentation is off.
+     */
+
+    void
+    Stats(SophiaStats *stats);
+
+    /**
+     * Record every operation counted by Instrument() which
+     * takes `threshold_ns` or longer, with its key prefix,
+     * sizes and open cursors, in a ring of the last
+     * `capacity` (rounded up to a power of two).
+     * Recording is lock-free, and operations under the
+     * threshold only pay for reading the clock.
+     * Disabling stops TraceLog() and drops the ring.
+     *
+     * A configuration method: don't race other calls.
+     * Does nothing when built with `SOPHIA_NO_STATS`.
+     */
+
+    SophiaReturnCode
+    Trace(
+        bool enable
+      , uint64_t threshold_ns = 1000000
+      , size_t capacity = 1024
+    );
+
+    /**
+     * Copy up to `max` of the latest slow operations to
+     * `operations`, oldest first.  Returns how many were
+     * copied, none when not tracing.
+     */
+
+    size_t
+    SlowOperations(SlowOperation *operations, size_t max);
+
+    /**
+     * Append slow operations to the file at `path` from a
+     * background thread every `interval_ms`, as one
+     * SlowOperationText() line each.  A `NULL` path stops
+     * it, flushing what is left.
+     *
+     * A configuration method like Trace(), which must be
+     * enabled first.
+     */
+
+    SophiaReturnCode
+    TraceLog(const char *path, unsigned int interval_ms = 1000);
+
+    /**
+     * Clear *all* keys in the database.
+     */
+
+    SophiaReturnCode
+    Clear();
+
+    /**
+     * Delete every key from `start` (inclusive) to `end`
+     * (exclusive).  A `NULL` bound leaves that side of the
+     * range open.
+     *
+     * Keys are read in chunks of `chunk_size` and each chunk
+     * is deleted in its own transaction, so memory use does
+     * not depend on the size of the range.  `progress` is
+     * called with `data` after every chunk.
+     */
+
+    SophiaReturnCode
+    DeleteRange(
+        const char *start
+      , size_t startsize
+      , const char *end
+      , size_t endsize
+      , DeleteRangeProgress progress = NULL
+      , void *data = NULL
+      , size_t chunk_size = 1000
+    );
+
+    /**
+     * Delete every key from `start` to `end` using the
+     * default (`strlen(ptr) + 1`) algorithm to calculate
+     * key sizes.
+     */
+
+    SophiaReturnCode
+    DeleteRange(const char *start, const char *end);
+
+    /**
+     * Write every key from `start` (inclusive) to `end`
+     * (exclusive) to a SnapshotFile at `path`, in blocks
+     * of about `block_size` bytes.  A `NULL` bound leaves
+     * that side of the range open.  Values are written
+     * uncompressed.
+     *
+     * The scan holds a single cursor, so it sees a
+     * consistent view.  Disjoint ranges of a ThreadSafe()
+     * database can be exported from several threads at
+     * once, one file each.  The file is written aside and
+     * renamed into place once complete.
+     */
+
+    SophiaReturnCode
+    ExportSnapshot(
+        const char *path
+      , const char *start = NULL
+      , size_t startsize = 0
+      , const char *end = NULL
+      , size_t endsize = 0
+      , size_t block_size = 65536
+    );
+
+    /**
+     * Verify the SnapshotFile at `path` and load it with a
+     * BulkLoader, which reopens the database.  Nothing is
+     * written if a checksum doesn't match.
+     */
+
+    SophiaReturnCode
+    ImportSnapshot(const char *path);
+
+    /**
+     * Maintain `index` on every write from now on: Set(),
+     * Delete(), Write() (so Transaction::Commit()) and
+     * DeleteRange() look up the records they replace and
+     * update its entries within their own transaction.
+     * The index is not owned, and isn't built from the
+     * records already stored; see RebuildIndex().
+     *
+     * A configuration method: don't race other calls.
+     */
+
+    SophiaReturnCode
+    AddIndex(SecondaryIndex *index);
+
+    /**
+     * Stop maintaining `index`.  Its entries are kept, and
+     * go stale with the next write.
+     */
+
+    SophiaReturnCode
+    RemoveIndex(SecondaryIndex *index);
+
+    /**
+     * Drop every entry of `index` and index every record
+     * again with a full scan, `chunk_size` records per
+     * transaction.
+     *
+     * Writers get a turn between chunks.  Add the index
+     * first, so their writes are indexed as well.
+     */
+
+    SophiaReturnCode
+    RebuildIndex(
+        SecondaryIndex *index
+      , RebuildIndexProgress progress = NULL
+      , void *data = NULL
+      , size_t chunk_size = 1000
+    );
+
+  private:
+
+    friend class Transaction;
+    friend class Iterator;
+    friend class IndexIterator;
+    friend class BulkLoader;
+
+    /**
+     * Open flag.
+     */
+
+    bool open;
+
+    /**
+     * Path to db.
+     */
+
+    const char *path;
+
+    /**
+     * Options given to the last Open().
+     */
+
+    bool create_if_missing;
+    bool read_only;
+    int page_size;
+    int merge_watermark;
+    bool gc;
+
+    /**
+     * Whether writes maintain `count`.
+     */
+
+    bool counting;
+
+    /**
+     * Whether `count` is exact.
+     */
+
+    bool counted;
+
+    /**
+     * Tracked key count.
+     */
+
+    size_t count;
+
+    /**
+     * Writes since `count` was last persisted.
+     */
+
+    size_t count_writes;
+
+    /**
+     * Whether calls are synchronized.
+     */
+
+    bool threadsafe;
+
+    /**
+     * Reader/writer lock, used when `threadsafe`.
+     */
+
+    pthread_rwlock_t lock;
+
+    /**
+     * Value cache, or `NULL`.
+     */
+
+    ValueCache *cache;
+
+    /**
+     * Key filter, or `NULL`.
+     */
+
+    BloomFilter *filter;
+
+    /**
+     * Whether `filter` holds every key, so Close() may
+     * save it.
+     */
+
+    bool filtered;
+
+    /**
+     * Value codecs, or `NULL`.
+     */
+
+    ValueCompressor *compressor;
+
+    /**
+     * Whether stored values carry a codec header.
+     */
+
+    bool framed;
+
+    /**
+     * Operation counters, or `NULL`.
+     */
+
+    Instrumentation *instruments;
+
+    /**
+     * Slow operation ring, or `NULL`.
+     */
+
+    SlowOperationTracer *tracer;
+
+    /**
+     * Maintained secondary indexes.
+     */
+
+    SecondaryIndex **indexes;
+
+    /**
+     * Number of `indexes`.
+     */
+
+    size_t nindexes;
+
+    /**
+     * Buffers indexed writes reuse under the write lock,
+     * or `NULL`.
+     */
+
+    IndexScratch *scratch;
+
+    /**
+     * Lock to take, or `NULL` when not `threadsafe`.
+     */
+
+    pthread_rwlock_t *
+    RWLock();
+
+    /**
+     * Put the change in key count `batch` would make
+     * in `delta`.
+     */
+
+    SophiaReturnCode
+    CountDelta(const WriteBatch &batch, long *delta);
+
+    /**
+     * Apply a committed change of `delta` keys over
+     * `writes` writes to the tracked count.
+     */
+
+    void
+    AddCount(long delta, size_t writes);
+
+    /**
+     * Persist the tracked count, flagged `clean` when it
+     * is known to be exact on the next Open().
+     */
+
+    SophiaReturnCode
+    SaveCount(bool clean);
+
+    /**
+     * Apply every operation in `batch` within a single
+     * transaction.  An `existing` batch only deletes keys
+     * known to exist.
+     */
+
+    SophiaReturnCode
+    Commit(const WriteBatch &batch, bool existing);
+
+    /**
+     * Drop every key written by `batch` from the cache and
+     * add the keys it sets to the filter.
+     */
+
+    void
+    Committed(const WriteBatch &batch);
+
+    /**
+     * Load the filter saved by the last clean Close(),
+     * or rebuild it, and flag it in use until Close().
+     */
+
+    SophiaReturnCode
+    OpenFilter();
+
+    /**
+     * Save the filter and stamp it clean.
+     */
+
+    SophiaReturnCode
+    SaveFilter();
+
+    /**
+     * Rebuild `filter` with a full scan.
+     */
+
+    SophiaReturnCode
+    RebuildFilter(BloomFilter *filter);
+
+    /**
+     * Find out whether values carry codec headers, adding
+     * them to an empty database when compression is on,
+     * and load the dictionary.
+     */
+
+    SophiaReturnCode
+    OpenCompression();
+
+    /**
+     * Strip the codec header from `ref` of `*size` read by
+     * `sp_get`, returning the value to `free` and putting
+     * its size in `*size`.  Takes `ref`; returns `NULL` on
+     * a malformed or undecodable value.
+     */
+
+    char *
+    Unframe(char *ref, size_t *size);
+
+    /**
+     * Uninstrumented bodies of the public operations.
+     * DoGet() puts the value size in `size`.
+     */
+
+    SophiaReturnCode
+    DoSet(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    char *
+    DoGet(const char *key, size_t keysize, size_t *size);
+
+    SophiaReturnCode
+    DoGet(const char *key, size_t keysize, Value &value);
+
+    SophiaReturnCode
+    DoMultiGet(
+        const char **keys
+      , const size_t *keysizes
+      , size_t count
+      , MultiGetResult &result
+    );
+
+    SophiaReturnCode
+    DoDelete(const char *key, size_t keysize);
+
+    SophiaReturnCode
+    DoCount(size_t *n);
+
+    /**
+     * Apply the operations in `batch` to the open
+     * transaction, framing values unless they are
+     * wrapper metadata.
+     */
+
+    SophiaReturnCode
+    Apply(const WriteBatch &batch, bool metadata = false);
+
+    /**
+     * Put the index entry writes `batch` makes in
+     * `entries`, from the records it replaces.
+     */
+
+    SophiaReturnCode
+    IndexEntries(const WriteBatch &batch, WriteBatch *entries);
+};
+
+/**
+ * Transaction wrapper.
+ *
+ * Operations are buffered until Commit(), which applies
+ * them in a single sophia transaction.
+ */
+
+class Transaction {
+  public:
+
+    Transaction(Sophia *sp);
+    ~Transaction();
+
+    /**
+     * Begin the transaction.
+     */
+
+    SophiaReturnCode
+    Begin();
+
+    /**
+     * Create a pending set (`key` = `value`) using the
+     * default (`strlen(ptr) + 1`) algorithm to calculate
+     * key/value sizes.
+     */
+
+    SophiaReturnCode
+    Set(const char *key, const char *value);
+
+    /**
+     * Create a pending set (`key` = `value`) using the
+     * given key/value sizes.
+     */
+
+    SophiaReturnCode
+    Set(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    /**
+     * Create a pending delete (`key` = `NULL`) using the
+     * default (`strlen(ptr) + 1`) algorithm to calculate
+     * key size.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key);
+
+    /**
+     * Create a pending delete (`key` = `NULL`) using the
+     * given key size.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key, size_t keysize);
+
+    /**
+     * Commit the transaction.
+     */
+
+    SophiaReturnCode
+    Commit();
+
+    /**
+     * Rollback the transaction.
+     */
+
+    SophiaReturnCode
+    Rollback();
+
+  private:
+
+    friend class Database;
+
+    /**
+     * Pointer to the Sophia class.
+     */
+
+    Sophia *sp;
+
+    /**
+     * All pending operations.
+     */
+
+    WriteBatch batch;
+
+    /**
+     * Whether operations may be added.
+     */
+
+    bool open;
+};
+
+/**
+ * Iterator.
+ */
+
+class Iterator {
+  public:
+
+    Iterator(Sophia *sp);
+    Iterator(Sophia *sp, sporder order);
+    Iterator(
+        Sophia *sp
+      , sporder order
+      , const char *start
+    );
+    Iterator(
+        Sophia *sp
+      , sporder order
+      , const char *start
+      , size_t keysize
+    );
+    Iterator(
+        Sophia *sp
+      , sporder order
+      , const char *start
+      , const char *end
+    );
+    Iterator(
+        Sophia *sp
+      , sporder order
+      , const char *start
+      , size_t keysize
+      , const char *end
+      , size_t endsize
+    );
+
+    /**
+     * Iterate from `start` to `end` in the direction of
+     * `order`, including either bound as asked.  This
+     * overrides the start bound implied by `order`
+     * (`SPGT`/`SPLT` exclude it, `SPGTE`/`SPLTE` include
+     * it).  The end bound is otherwise exclusive.
+     */
+
+    Iterator(
+        Sophia *sp
+      , sporder order
+      , const char *start
+      , size_t startsize
+      , bool start_inclusive
+      , const char *end
+      , size_t endsize
+      , bool end_inclusive
+    );
+
+    virtual ~Iterator();
+
+    /**
+     * Begin the iterator.  An iterator already begun fails
+     * with `SOPHIA_CURSOR_ALREADY_OPEN_ERROR`; End() it
+     * first.
+     */
+
+    SophiaReturnCode
+    Begin();
+
+    /**
+     * Get the next result, or `NULL` at the end.
+     *
+     * The result is owned by the iterator and reused by
+     * every call; don't `delete` it.  Reaching the end
+     * bound releases the cursor straight away, and so
+     * does a compressed value which can't be decoded.
+     */
+
+    IteratorResult *
+    Next();
+
+    /**
+     * Put the next result in `result`.  Returns `false`
+     * at the end.
+     */
+
+    bool
+    Next(IteratorResult *result);
+
+    /**
+     * End the iterator.
+     */
+
+    SophiaReturnCode
+    End();
+
+    /**
+     * Input iterator over the results, for range-for:
+     *
+     *   for (const IteratorResult &res : iterator) ...
+     */
+
+    class Position {
+      public:
+
+        Position(Iterator *it, IteratorResult *result);
+
+        const IteratorResult &
+        operator*() const;
+
+        const IteratorResult *
+        operator->() const;
+
+        Position &
+        operator++();
+
+        bool
+        operator!=(const Position &other) const;
+
+        bool
+        operator==(const Position &other) const;
+
+      private:
+
+        /**
+         * Iterator being walked.
+         */
+
+        Iterator *it;
+
+        /**
+         * Current result, `NULL` at the end.
+         */
+
+        IteratorResult *result;
+    };
+
+    /**
+     * Begin the iterator if needed and return its first
+     * result.
+     */
+
+    Position
+    begin();
+
+    /**
+     * Past-the-end position.
+     */
+
+    Position
+    end();
+
+  protected:
+
+    /**
+     * Required key prefix.
+     */
+
+    const char *prefix;
+
+    /**
+     * Required key prefix size.
+     */
+
+    size_t prefixsize;
+
+  private:
+
+    friend class IndexIterator;
+
+    /**
+     * Result reused by Next().
+     */
+
+    IteratorResult result;
+
+    /**
+     * Owner Sophia instance.
+     */
+
+    Sophia *sp;
+
+    /**
+     * Iterator order.
+     */
+
+    sporder order;
+
+    /**
+     * Cursor.
+     */
+
+    void *cursor;
+
+    /**
+     * Cursor node in Sophia's registry.
+     */
+
+    list_node_t *cursor_node;
+
+    /**
+     * Read lock held from Begin() to End(), or `NULL`.
+     */
+
+    pthread_rwlock_t *locked;
+
+    /**
+     * Start key.
+     */
+
+    const char *start;
+
+    /**
+     * Start keysize.
+     */
+
+    size_t startsize;
+
+    /**
+     * End key.
+     */
+
+    const char *endkey;
+
+    /**
+     * End keysize.
+     */
+
+    size_t endsize;
+
+    /**
+     * Whether the end key is part of the range.
+     */
+
+    bool end_inclusive;
+
+    /**
+     * Decompressed value of the current result.
+     */
+
+    char *decoded;
+
+    /**
+     * Allocated `decoded` bytes.
+     */
+
+    size_t decodedcapacity;
+
+    /**
+     * Whether rows are wrapper metadata, read as stored
+     * instead of skipped.
+     */
+
+    bool metadata;
+
+    /**
+     * Check if `key` is past the end bound.
+     */
+
+    bool
+    PastEnd(const char *key, size_t keysize) const;
+
+    /**
+     * Uninstrumented body of Next().
+     */
+
+    bool
+    Fetch(IteratorResult *result);
+};
+
+/**
+ * Iterator over the keys starting with a prefix.
+ *
+ * Seeks straight to the prefix and ends at the first key
+ * without it, so a scan only reads matching rows.
+ */
+
+class PrefixIterator : public Iterator {
+  public:
+
+    PrefixIterator(
+        Sophia *sp
+      , const char *prefix
+      , size_t prefixsize
+    );
+
+    /**
+     * Use `strlen(prefix)` as the prefix size.  Unlike
+     * full keys, the terminating NUL is not included.
+     */
+
+    PrefixIterator(Sophia *sp, const char *prefix);
+};
+
+/**
+ * Iterator over the entries of a SecondaryIndex, in index
+ * key order, then key order.
+ *
+ * Entries are read by an Iterator, which holds the read
+ * lock of a ThreadSafe() database from Begin() to End().
+ * Each record is then read by key unless `values` is
+ * `false`, and entries whose record is gone are skipped.
+ */
+
+class IndexIterator {
+  public:
+
+    /**
+     * Iterate the entries of index key `key` of `keysize`.
+     */
+
+    IndexIterator(
+        Sophia *sp
+      , SecondaryIndex *index
+      , const char *key
+      , size_t keysize
+      , bool values = true
+    );
+
+    /**
+     * Iterate the entries from index key `start`
+     * (inclusive) to `end` (exclusive).  A `NULL` bound
+     * leaves that side of the index open.
+     */
+
+    IndexIterator(
+        Sophia *sp
+      , SecondaryIndex *index
+      , const char *start
+      , size_t startsize
+      , const char *end
+      , size_t endsize
+      , bool values = true
+    );
+
+    ~IndexIterator();
+
+    /**
+     * Begin the iterator.
+     */
+
+    SophiaReturnCode
+    Begin();
+
+    /**
+     * Get the next result, or `NULL` at the end.  The
+     * result is owned by the iterator and reused.
+     */
+
+    IndexResult *
+    Next();
+
+    /**
+     * Put the next result in `result`.  Returns `false`
+     * at the end.
+     */
+
+    bool
+    Next(IndexResult *result);
+
+    /**
+     * End the iterator.
+     */
+
+    SophiaReturnCode
+    End();
+
+  private:
+
+    /**
+     * Owner Sophia instance.
+     */
+
+    Sophia *sp;
+
+    /**
+     * Index read.
+     */
+
+    SecondaryIndex *index;
+
+    /**
+     * Index key bounds, and whether `start` is an exact
+     * match.
+     */
+
+    const char *start;
+    size_t startsize;
+    const char *end;
+    size_t endsize;
+    bool exact;
+
+    /**
+     * Whether records are read.
+     */
+
+    bool values;
+
+    /**
+     * Entry iterator, from Begin() to End().
+     */
+
+    Iterator *entries;
+
+    /**
+     * Encoded entry bounds `entries` reads between.
+     */
+
+    char *bounds;
+
+    /**
+     * Result reused by Next().
+     */
+
+    IndexResult result;
+
+    /**
+     * Decoded index key of the current result.
+     */
+
+    char *indexkey;
+
+    /**
+     * Allocated `indexkey` bytes.
+     */
+
+    size_t indexkeycapacity;
+
+    /**
+     * Record of the current result, or `NULL`.
+     */
+
+    char *value;
+
+    // not copyable
+    IndexIterator(const IndexIterator &);
+    IndexIterator &operator=(const IndexIterator &);
+};
+
+/**
+ * Named keyspace ("column family") of an Environment.
+ *
+ * Keys are stored in the environment's database behind a
+ * `<name>\0` prefix, which the handle adds and strips, so
+ * keyspaces share one sophia environment, its files and
+ * its merge threads.  A Transaction on the environment's
+ * engine spans every keyspace and commits atomically.
+ *
+ * Handles are owned by their Environment.
+ */
+
+class Database {
+  public:
+
+    /**
+     * Keyspace name.
+     */
+
+    const char *
+    Name();
+
+    /**
+     * Set `key` = `value` using the given sizes.
+     */
+
+    SophiaReturnCode
+    Set(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    /**
+     * Set `key` = `value` using the default (`strlen(ptr)
+     * + 1`) algorithm to calculate key/value sizes.
+     */
+
+    SophiaReturnCode
+    Set(const char *key, const char *value);
+
+    /**
+     * Get the value of `key` of `keysize`, like
+     * Sophia::Get().
+     */
+
+    char *
+    Get(const char *key, size_t keysize);
+
+    /**
+     * Get the value of `key` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate key size.
+     */
+
+    char *
+    Get(const char *key);
+
+    /**
+     * Get the value of `key` of `keysize` into `value`.
+     */
+
+    SophiaReturnCode
+    Get(const char *key, size_t keysize, Value &value);
+
+    /**
+     * Get the value of `key` into `value` using the
+     * default (`strlen(ptr) + 1`) algorithm to calculate
+     * key size.
+     */
+
+    SophiaReturnCode
+    Get(const char *key, Value &value);
+
+    /**
+     * Delete `key` of `keysize`.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key, size_t keysize);
+
+    /**
+     * Delete `key` using the default (`strlen(ptr) + 1`)
+     * algorithm to calculate key size.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key);
+
+    /**
+     * Look up `count` keys at once, like
+     * Sophia::MultiGet().
+     */
+
+    SophiaReturnCode
+    MultiGet(
+        const char **keys
+      , const size_t *keysizes
+      , size_t count
+      , MultiGetResult &result
+    );
+
+    /**
+     * Look up `count` keys using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate key sizes.
+     */
+
+    SophiaReturnCode
+    MultiGet(const char **keys, size_t count, MultiGetResult &result);
+
+    /**
+     * Add a pending set of `key` = `value` in this keyspace
+     * to `transaction`, which must be on the engine of
+     * this handle's environment.
+     */
+
+    SophiaReturnCode
+    Set(
+        Transaction *transaction
+      , const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    /**
+     * Add a pending delete of `key` in this keyspace to
+     * `transaction`.
+     */
+
+    SophiaReturnCode
+    Delete(Transaction *transaction, const char *key, size_t keysize);
+
+    /**
+     * Call `callback` with `data` for every row from
+     * `start` (inclusive) to `end` (exclusive), keys
+     * stripped of the keyspace prefix.  A `NULL` bound
+     * leaves that side open to the keyspace's edge.
+     */
+
+    SophiaReturnCode
+    Scan(
+        const char *start
+      , size_t startsize
+      , const char *end
+      , size_t endsize
+      , ScanCallback callback
+      , void *data
+    );
+
+    /**
+     * Put the number of keys in the keyspace in `n`.  This
+     * is a scan of the keyspace.
+     */
+
+    SophiaReturnCode
+    Count(size_t *n);
+
+    /**
+     * Delete every key in the keyspace.
+     */
+
+    SophiaReturnCode
+    Clear();
+
+  private:
+
+    friend class Environment;
+
+    Database(Sophia *sp, const char *name, size_t size);
+    ~Database();
+
+    /**
+     * Engine of the owning environment.
+     */
+
+    Sophia *sp;
+
+    /**
+     * Key prefix: the name and its NUL.
+     */
+
+    char *prefix;
+
+    /**
+     * Prefix size.
+     */
+
+    size_t prefixsize;
+
+    /**
+     * Exclusive end of the keyspace: the prefix with its
+     * NUL bumped to `\1`.
+     */
+
+    char *limit;
+
+    // not copyable
+    Database(const Database &);
+    Database &operator=(const Database &);
+};
+
+/**
+ * Sophia environment shared by many named keyspaces.
+ *
+ * sophia 1.1 opens exactly one database per environment,
+ * so keyspaces are ranges of that database rather than
+ * databases of their own.  The engine is a Sophia
+ * instance, which can be configured (ThreadSafe(),
+ * Cache(), Filter(), ..) and used for transactions over
+ * several keyspaces.  Its own keys share the database
+ * with the keyspaces, so keep to handles once keyspaces
+ * are in use.
+ */
+
+class Environment {
+  public:
+
+    Environment(const char *path);
+    ~Environment();
+
+    /**
+     * Open the environment, like Sophia::Open().
+     */
+
+    SophiaReturnCode
+    Open(
+        bool create_if_missing = true
+      , bool read_only = false
+      , int page_size = 2048
+      , int merge_watermark = 100000
+      , bool gc = true
+    );
+
+    /**
+     * Close the environment.  Handles stay valid and work
+     * again once it is reopened.
+     */
+
+    SophiaReturnCode
+    Close();
+
+    /**
+     * Check if the environment is open.
+     */
+
+    bool
+    IsOpen();
+
+    /**
+     * Underlying engine.
+     */
+
+    Sophia *
+    Engine();
+
+    /**
+     * Handle of the keyspace called `name`, created on
+     * first use, or `NULL` for an empty name or when out
+     * of memory.  The same handle is returned for the
+     * same name until the environment is destroyed.
+     */
+
+    Database *
+    Handle(const char *name);
+
+  private:
+
+    /**
+     * Engine.
+     */
+
+    Sophia sp;
+
+    /**
+     * Handles given out, by name.
+     */
+
+    list_t *handles;
+
+    /**
+     * Guards `handles`.
+     */
+
+    pthread_mutex_t mutex;
+
+    // not copyable
+    Environment(const Environment &);
+    Environment &operator=(const Environment &);
+};
+
+/**
+ * Stack space keys and values are encoded into before
+ * falling back to the heap.
+ */
+
+#define SOPHIA_CODEC_STACK_SIZE 64
+
+/**
+ * Codecs turn typed keys and values into bytes and back.
+ * A codec is a struct of static functions over `Type`:
+ *
+ *   size_t Size(const Type &value);
+ *   void Encode(const Type &value, char *out);
+ *   bool Decode(
+ *       const char *data
+ *     , size_t size
+ *     , Type *value
+ *     , size_t *consumed
+ *   );
+ *
+ * `Decode` reads one value from the front of `data` and
+ * puts the bytes it used in `consumed`.  The built-in key
+ * codecs preserve order: encoded values compare bytewise
+ * the way the values compare, so Iterator ranges over
+ * them sort correctly.  Codecs are template arguments, so
+ * nothing is dispatched at run time.
+ */
+
+/**
+ * Big-endian integers with the sign bit flipped.
+ */
+
+template <typename T>
+struct IntegerCodec {
+  static_assert(
+      std::is_integral<T>::value && !std::is_same<T, bool>::value
+    , "IntegerCodec needs an integer type"
+  );
+
+  typedef T Type;
+  typedef typename std::make_unsigned<T>::type Bits;
+
+  static size_t
+  Size(const T &) {
+    return sizeof(T);
+  }
+
+  static void
+  Encode(const T &value, char *out) {
+    Bits bits = (Bits) value;
+    if (std::is_signed<T>::value) bits ^= (Bits) 1 << (sizeof(T) * 8 - 1);
+    for (size_t i = sizeof(T); i--; bits >>= 8) {
+      out[i] = (char) (bits & 0xff);
+    }
+  }
+
+  static bool
+  Decode(const char *data, size_t size, T *value, size_t *consumed) {
+    Bits bits = 0;
+    if (size < sizeof(T)) return false;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      bits = (Bits) (bits << 8) | (unsigned char) data[i];
+    }
+    if (std::is_signed<T>::value) bits ^= (Bits) 1 << (sizeof(T) * 8 - 1);
+    *value = (T) bits;
+    *consumed = sizeof(T);
+    return true;
+  }
+};
+
+/**
+ * IEEE 754 floats: big-endian bits with the sign bit
+ * flipped, and every bit flipped for negatives.  NaNs
+ * sort outside the numbers.
+ */
+
+template <typename T>
+struct FloatCodec {
+  static_assert(
+      std::is_same<T, float>::value || std::is_same<T, double>::value
+    , "FloatCodec needs float or double"
+  );
+
+  typedef T Type;
+  typedef typename std::conditional<
+      sizeof(T) == 4
+    , uint32_t
+    , uint64_t
+  >::type Bits;
+
+  static size_t
+  Size(const T &) {
+    return sizeof(T);
+  }
+
+  static void
+  Encode(const T &value, char *out) {
+    Bits bits;
+    Bits sign = (Bits) 1 << (sizeof(T) * 8 - 1);
+    memcpy(&bits, &value, sizeof(T));
+    bits = bits & sign ? ~bits : bits ^ sign;
+    IntegerCodec<Bits>::Encode(bits, out);
+  }
+
+  static bool
+  Decode(const char *data, size_t size, T *value, size_t *consumed) {
+    Bits bits;
+    Bits sign = (Bits) 1 << (sizeof(T) * 8 - 1);
+    if (!IntegerCodec<Bits>::Decode(data, size, &bits, consumed)) {
+      return false;
+    }
+    bits = bits & sign ? bits ^ sign : ~bits;
+    memcpy(value, &bits, sizeof(T));
+    return true;
+  }
+};
+
+/**
+ * Strings, with NULs escaped as `\0\xff` and terminated
+ * by `\0\1`, so a string sorts before its extensions even
+ * inside a tuple.
+ */
+
+struct StringCodec {
+  typedef std::string Type;
+
+  static size_t
+  Size(const std::string &value) {
+    size_t size = value.size() + 2;
+    for (size_t i = 0; i < value.size(); i++) {
+      if ('\0' == value[i]) size++;
+    }
+    return size;
+  }
+
+  static void
+  Encode(const std::string &value, char *out) {
+    for (size_t i = 0; i < value.size(); i++) {
+      *out++ = value[i];
+      if ('\0' == value[i]) *out++ = '\xff';
+    }
+    *out++ = '\0';
+    *out = '\1';
+  }
+
+  static bool
+  Decode(
+      const char *data
+    , size_t size
+    , std::string *value
+    , size_t *consumed
+  ) {
+    value->clear();
+    for (size_t i = 0; i + 1 < size; i++) {
+      if ('\0' != data[i]) {
+        value->push_back(data[i]);
+      } else if ('\xff' == data[i + 1]) {
+        value->push_back('\0');
+        i++;
+      } else if ('\1' == data[i + 1]) {
+        *consumed = i + 2;
+        return true;
+      } else {
+        return false;
+      }
+    }
+    return false;
+  }
+};
+
+/**
+ * Raw bytes, as the whole of a value.  Not ordered with
+ * respect to longer strings and not usable inside a tuple
+ * except as its last element.
+ */
+
+struct BytesCodec {
+  typedef std::string Type;
+
+  static size_t
+  Size(const std::string &value) {
+    return value.size();
+  }
+
+  static void
+  Encode(const std::string &value, char *out) {
+    memcpy(out, value.data(), value.size());
+  }
+
+  static bool
+  Decode(
+      const char *data
+    , size_t size
+    , std::string *value
+    , size_t *consumed
+  ) {
+    value->assign(data, size);
+    *consumed = size;
+    return true;
+  }
+};
+
+/**
+ * TupleCodec element `I` on, one codec per element.
+ */
+
+template <size_t I, typename... Codecs>
+struct TupleElements;
+
+template <size_t I>
+struct TupleElements<I> {
+  template <typename Tuple>
+  static size_t
+  Size(const Tuple &) {
+    return 0;
+  }
+
+  template <typename Tuple>
+  static void
+  Encode(const Tuple &, char *) {}
+
+  template <typename Tuple>
+  static bool
+  Decode(const char *, size_t, Tuple *, size_t *consumed) {
+    *consumed = 0;
+    return true;
+  }
+};
+
+template <size_t I, typename Codec, typename... Codecs>
+struct TupleElements<I, Codec, Codecs...> {
+  typedef TupleElements<I + 1, Codecs...> Rest;
+
+  template <typename Tuple>
+  static size_t
+  Size(const Tuple &value) {
+    return Codec::Size(std::get<I>(value)) + Rest::Size(value);
+  }
+
+  template <typename Tuple>
+  static void
+  Encode(const Tuple &value, char *out) {
+    Codec::Encode(std::get<I>(value), out);
+    Rest::Encode(value, out + Codec::Size(std::get<I>(value)));
+  }
+
+  template <typename Tuple>
+  static bool
+  Decode(const char *data, size_t size, Tuple *value, size_t *consumed) {
+    size_t used;
+    size_t rest;
+    if (!Codec::Decode(data, size, &std::get<I>(*value), &used)
+     || !Rest::Decode(data + used, size - used, value, &rest)) {
+      return false;
+    }
+    *consumed = used + rest;
+    return true;
+  }
+};
+
+/**
+ * `std::tuple` of elements encoded one after the other,
+ * so tuples sort element by element.
+ */
+
+template <typename... Codecs>
+struct TupleCodec {
+  typedef std::tuple<typename Codecs::Type...> Type;
+  typedef TupleElements<0, Codecs...> Elements;
+
+  static size_t
+  Size(const Type &value) {
+    return Elements::Size(value);
+  }
+
+  static void
+  Encode(const Type &value, char *out) {
+    Elements::Encode(value, out);
+  }
+
+  static bool
+  Decode(const char *data, size_t size, Type *value, size_t *consumed) {
+    return Elements::Decode(data, size, value, consumed);
+  }
+};
+
+/**
+ * Codec picked for `T` when none is given: integers,
+ * floats, `std::string` and tuples of those.
+ */
+
+template <typename T, typename Enable = void>
+struct DefaultCodec;
+
+template <typename T>
+struct DefaultCodec<
+    T
+  , typename std::enable_if<std::is_integral<T>::value>::type
+> : IntegerCodec<T> {};
+
+template <typename T>
+struct DefaultCodec<
+    T
+  , typename std::enable_if<std::is_floating_point<T>::value>::type
+> : FloatCodec<T> {};
+
+template <>
+struct DefaultCodec<std::string> : StringCodec {};
+
+template <typename... Ts>
+struct DefaultCodec<std::tuple<Ts...> >
+  : TupleCodec<DefaultCodec<Ts>...> {};
+
+/**
+ * Value encoded with `Codec`, on the stack when it fits.
+ * `data` is `NULL` when unset or out of memory.
+ */
+
+template <typename Codec>
+class Encoded {
+  public:
+
+    Encoded() : data(NULL), size(0) {}
+
+    explicit Encoded(const typename Codec::Type &value) {
+      size = Codec::Size(value);
+      data = size > sizeof(stack) ? (char *) malloc(size) : stack;
+      if (data) Codec::Encode(value, data);
+    }
+
+    ~Encoded() {
+      if (data != stack) free(data);
+    }
+
+    char *data;
+    size_t size;
+
+  private:
+
+    char stack[SOPHIA_CODEC_STACK_SIZE];
+
+    // not copyable
+    Encoded(const Encoded &);
+    Encoded &operator=(const Encoded &);
+};
+
+/**
+ * Decode all of `data` of `size` into `value`.
+ */
+
+template <typename Codec>
+inline bool
+DecodeAll(const char *data, size_t size, typename Codec::Type *value) {
+  size_t consumed;
+  return Codec::Decode(data, size, value, &consumed) && consumed == size;
+}
+
+/**
+ * Typed view of a Sophia database: keys of type `K` and
+ * values of type `V` encoded by `KeyCodec` and
+ * `ValueCodec`.
+ */
+
+template <
+    typename K
+  , typename V
+  , typename KeyCodec = DefaultCodec<K>
+  , typename ValueCodec = DefaultCodec<V>
+>
+class TypedDB {
+  public:
+
+    TypedDB(Sophia *sp) : sp(sp) {}
+
+    /**
+     * Set `key` = `value`.
+     */
+
+    SophiaReturnCode
+    Set(const K &key, const V &value) {
+      Encoded<KeyCodec> k(key);
+      Encoded<ValueCodec> v(value);
+      if (!k.data || !v.data) return SOPHIA_ALLOC_ERROR;
+      return sp->Set(k.data, k.size, v.data, v.size);
+    }
+
+    /**
+     * Get the value of `key` into `value`, putting whether
+     * it was found in `found`.  A value which doesn't
+     * decode is a `SOPHIA_FORMAT_ERROR`.
+     */
+
+    SophiaReturnCode
+    Get(const K &key, V *value, bool *found) {
+      char buffer[SOPHIA_CODEC_STACK_SIZE];
+      Value v(buffer, sizeof(buffer));
+      Encoded<KeyCodec> k(key);
+
+      *found = false;
+      if (!k.data) return SOPHIA_ALLOC_ERROR;
+      SophiaReturnCode rc = sp->Get(k.data, k.size, v);
+      if (SOPHIA_SUCCESS != rc || !v.Data()) return rc;
+
+      if (!DecodeAll<ValueCodec>(v.Data(), v.Size(), value)) {
+        return SOPHIA_FORMAT_ERROR;
+      }
+      *found = true;
+      return SOPHIA_SUCCESS;
+    }
+
+    /**
+     * Delete `key`.
+     */
+
+    SophiaReturnCode
+    Delete(const K &key) {
+      Encoded<KeyCodec> k(key);
+      if (!k.data) return SOPHIA_ALLOC_ERROR;
+      return sp->Delete(k.data, k.size);
+    }
+
+    /**
+     * Add a pending set of `key` = `value` to
+     * `transaction`.
+     */
+
+    SophiaReturnCode
+    Set(Transaction *transaction, const K &key, const V &value) {
+      Encoded<KeyCodec> k(key);
+      Encoded<ValueCodec> v(value);
+      if (!k.data || !v.data) return SOPHIA_ALLOC_ERROR;
+      return transaction->Set(k.data, k.size, v.data, v.size);
+    }
+
+    /**
+     * Add a pending delete of `key` to `transaction`.
+     */
+
+    SophiaReturnCode
+    Delete(Transaction *transaction, const K &key) {
+      Encoded<KeyCodec> k(key);
+      if (!k.data) return SOPHIA_ALLOC_ERROR;
+      return transaction->Delete(k.data, k.size);
+    }
+
+  private:
+
+    /**
+     * Underlying database.
+     */
+
+    Sophia *sp;
+};
+
+/**
+ * Typed Iterator over keys of type `K` and values of type
+ * `V`.  Every key in the walked range must decode.
+ */
+
+template <
+    typename K
+  , typename V
+  , typename KeyCodec = DefaultCodec<K>
+  , typename ValueCodec = DefaultCodec<V>
+>
+class TypedIterator {
+  public:
+
+    /**
+     * Iterate the whole database in `order`.
+     */
+
+    TypedIterator(Sophia *sp, sporder order = SPGT)
+      : it(sp, order) {
+      rc = SOPHIA_SUCCESS;
+    }
+
+    /**
+     * Iterate from `start` in `order`.
+     */
+
+    TypedIterator(Sophia *sp, sporder order, const K &start)
+      : start(start)
+      , it(sp, order, this->start.data, this->start.size) {
+      rc = this->start.data ? SOPHIA_SUCCESS : SOPHIA_ALLOC_ERROR;
+    }
+
+    /**
+     * Iterate from `start` to `end` (exclusive) in `order`.
+     */
+
+    TypedIterator(
+        Sophia *sp
+      , sporder order
+      , const K &start
+      , const K &end
+    ) : start(start)
+      , end(end)
+      , it(
+          sp
+        , order
+        , this->start.data
+        , this->start.size
+        , this->end.data
+        , this->end.size
+      ) {
+      rc = this->start.data && this->end.data
+        ? SOPHIA_SUCCESS
+        : SOPHIA_ALLOC_ERROR;
+    }
+
+    /**
+     * Begin the iterator.
+     */
+
+    SophiaReturnCode
+    Begin() {
+      if (SOPHIA_SUCCESS != rc) return rc;
+      return it.Begin();
+    }
+
+    /**
+     * Put the next row in `key` and `value`.  Returns
+     * `false` at the end, or when a row doesn't decode,
+     * which End() then reports.
+     */
+
+    bool
+    Next(K *key, V *value) {
+      IteratorResult result;
+      if (SOPHIA_SUCCESS != rc || !it.Next(&result)) return false;
+      if (!DecodeAll<KeyCodec>(result.key, result.keysize, key)
+       || !DecodeAll<ValueCodec>(result.value, result.valuesize, value)) {
+        rc = SOPHIA_FORMAT_ERROR;
+        return false;
+      }
+      return true;
+    }
+
+    /**
+     * End the iterator, returning any decoding error.
+     */
+
+    SophiaReturnCode
+    End() {
+      SophiaReturnCode ended = it.End();
+      return SOPHIA_SUCCESS != rc ? rc : ended;
+    }
+
+  private:
+
+    /**
+     * Encoded bounds, which `it` points into.
+     */
+
+    Encoded<KeyCodec> start;
+    Encoded<KeyCodec> end;
+
+    /**
+     * Untyped iterator.
+     */
+
+    Iterator it;
+
+    /**
+     * First error.
+     */
+
+    SophiaReturnCode rc;
+};
+
+/**
+ * Most keys FixedKeyDB::MultiGet() lays out on the stack.
+ */
+
+#define SOPHIA_FIXED_MULTIGET_STACK 64
+
+/**
+ * Sophia database whose keys are all exactly `N` bytes.
+ *
+ * Key sizes are compile-time constants, so nothing calls
+ * `strlen` or carries a size per key, and the iterator
+ * compares bounds with a fixed-width `memcmp` the compiler
+ * inlines.  The Cache() hashes and compares 8 and 16 byte
+ * keys a word at a time.  Integer ids can be packed into
+ * big-endian keys (which sort numerically) in a register
+ * with Pack().
+ */
+
+template <size_t N>
+class FixedKeyDB {
+  static_assert(N > 0, "FixedKeyDB needs a key width");
+
+  public:
+
+    FixedKeyDB(Sophia *sp) : sp(sp) {}
+
+    /**
+     * Write `id` big-endian into `key`, zero-padded on the
+     * left when `N` is wider than 8 bytes and truncated to
+     * its low bytes when narrower.
+     */
+
+    static void
+    Pack(uint64_t id, char *key) {
+      for (size_t i = N; i--; id >>= 8) key[i] = (char) (id & 0xff);
+    }
+
+    /**
+     * Read back the id of a Pack()ed `key`.
+     */
+
+    static uint64_t
+    Unpack(const char *key) {
+      uint64_t id = 0;
+      size_t first = N > sizeof(uint64_t) ? N - sizeof(uint64_t) : 0;
+      for (size_t i = first; i < N; i++) {
+        id = id << 8 | (unsigned char) key[i];
+      }
+      return id;
+    }
+
+    /**
+     * Set the `N`-byte `key` = `value` of `valuesize`.
+     */
+
+    SophiaReturnCode
+    Set(const char *key, const char *value, size_t valuesize) {
+      return sp->Set(key, N, value, valuesize);
+    }
+
+    /**
+     * Get the value of the `N`-byte `key`, like
+     * Sophia::Get().
+     */
+
+    char *
+    Get(const char *key) {
+      return sp->Get(key, N);
+    }
+
+    /**
+     * Get the value of the `N`-byte `key` into `value`.
+     */
+
+    SophiaReturnCode
+    Get(const char *key, Value &value) {
+      return sp->Get(key, N, value);
+    }
+
+    /**
+     * Delete the `N`-byte `key`.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key) {
+      return sp->Delete(key, N);
+    }
+
+    /**
+     * Look up the `count` keys packed back to back in
+     * `keys` (`count * N` bytes), like Sophia::MultiGet().
+     */
+
+    SophiaReturnCode
+    MultiGet(const char *keys, size_t count, MultiGetResult &result) {
+      const char *stackkeys[SOPHIA_FIXED_MULTIGET_STACK];
+      size_t stacksizes[SOPHIA_FIXED_MULTIGET_STACK];
+      const char **ptrs = stackkeys;
+      size_t *sizes = stacksizes;
+
+      if (count > SOPHIA_FIXED_MULTIGET_STACK) {
+        ptrs = (const char **) malloc(count * sizeof(const char *));
+        sizes = (size_t *) malloc(count * sizeof(size_t));
+        if (!ptrs || !sizes) {
+          free(ptrs);
+          free(sizes);
+          result.Reset();
+          return SOPHIA_ALLOC_ERROR;
+        }
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        ptrs[i] = keys + i * N;
+        sizes[i] = N;
+      }
+      SophiaReturnCode rc = sp->MultiGet(ptrs, sizes, count, result);
+
+      if (ptrs != stackkeys) {
+        free(ptrs);
+        free(sizes);
+      }
+      return rc;
+    }
+
+    /**
+     * Add a pending set of the `N`-byte `key` to
+     * `transaction`.
+     */
+
+    SophiaReturnCode
+    Set(
+        Transaction *transaction
+      , const char *key
+      , const char *value
+      , size_t valuesize
+    ) {
+      return transaction->Set(key, N, value, valuesize);
+    }
+
+    /**
+     * Add a pending delete of the `N`-byte `key` to
+     * `transaction`.
+     */
+
+    SophiaReturnCode
+    Delete(Transaction *transaction, const char *key) {
+      return transaction->Delete(key, N);
+    }
+
+  private:
+
+    /**
+     * Underlying database.
+     */
+
+    Sophia *sp;
+};
+
+/**
+ * Iterator over a FixedKeyDB, optionally up to an `N`-byte
+ * end key (exclusive).  Bounds are copied, so they needn't
+ * outlive the constructor.
+ */
+
+template <size_t N>
+class FixedKeyIterator {
+  public:
+
+    /**
+     * Iterate the whole database in `order`.
+     */
+
+    FixedKeyIterator(Sophia *sp, sporder order = SPGT)
+      : it(sp, order)
+      , order(order)
+      , bounded(false) {}
+
+    /**
+     * Iterate from the `N`-byte `start` in `order`.
+     */
+
+    FixedKeyIterator(Sophia *sp, sporder order, const char *start)
+      : it(sp, order, startkey, N)
+      , order(order)
+      , bounded(false) {
+      memcpy(startkey, start, N);
+    }
+
+    /**
+     * Iterate from `start` to `end` (exclusive) in `order`.
+     */
+
+    FixedKeyIterator(
+        Sophia *sp
+      , sporder order
+      , const char *start
+      , const char *end
+    ) : it(sp, order, startkey, N)
+      , order(order)
+      , bounded(true) {
+      memcpy(startkey, start, N);
+      memcpy(endkey, end, N);
+    }
+
+    /**
+     * Begin the iterator.
+     */
+
+    SophiaReturnCode
+    Begin() {
+      return it.Begin();
+    }
+
+    /**
+     * Put the next result in `result`.  Returns `false` at
+     * the end, releasing the cursor.
+     */
+
+    bool
+    Next(IteratorResult *result) {
+      if (!it.Next(result)) return false;
+      if (bounded && PastEnd(result->key, result->keysize)) {
+        it.End();
+        return false;
+      }
+      return true;
+    }
+
+    /**
+     * End the iterator.
+     */
+
+    SophiaReturnCode
+    End() {
+      return it.End();
+    }
+
+  private:
+
+    /**
+     * Bounds.  `it` points at `startkey`, which is only
+     * read by Begin().
+     */
+
+    char startkey[N];
+    char endkey[N];
+
+    /**
+     * Untyped iterator, without an end bound.
+     */
+
+    Iterator it;
+
+    /**
+     * Iterator order.
+     */
+
+    sporder order;
+
+    /**
+     * Whether `endkey` is set.
+     */
+
+    bool bounded;
+
+    /**
+     * Check if `key` of `keysize` is at or past `endkey`.
+     */
+
+    bool
+    PastEnd(const char *key, size_t keysize) const {
+      int cmp;
+      if (N == keysize) {
+        // the common case, with a constant width
+        cmp = memcmp(key, endkey, N);
+      } else {
+        cmp = memcmp(key, endkey, keysize < N ? keysize : N);
+        if (0 == cmp) cmp = keysize < N ? -1 : 1;
+      }
+      if (SPLT == order || SPLTE == order) cmp = -cmp;
+      return cmp >= 0;
+    }
+};
+
+/**
+ * GroupCommitWriter completion callback, given the result
+ * of the commit the write was part of.  Runs on the writer
+ * thread.
+ */
+
+typedef void (*GroupCommitCallback)(SophiaReturnCode rc, void *data);
+
+// forward def
+typedef struct GroupCommitQueue GroupCommitQueue;
+
+/**
+ * Group-commit writer.
+ *
+ * Queues sets and deletes from any number of threads and
+ * applies them from a dedicated writer thread, many at a
+ * time, in a single transaction.  Writes queue up while the
+ * previous batch commits; a batch is committed once it
+ * holds `batch_size` writes or its first write has waited
+ * `linger_us` microseconds, whichever comes first.  Callers
+ * either wait for their batch to commit or are called back
+ * when it has.
+ *
+ * Use the Sophia instance in ThreadSafe() mode if other
+ * threads use it directly while the writer runs.
+ */
+
+class GroupCommitWriter {
+  public:
+
+    GroupCommitWriter(
+        Sophia *sp
+      , size_t batch_size = 1000
+      , unsigned int linger_us = 0
+    );
+    ~GroupCommitWriter();
+
+    /**
+     * Start the writer thread.
+     */
+
+    SophiaReturnCode
+    Start();
+
+    /**
+     * Commit every queued write and stop the writer
+     * thread.
+     */
+
+    SophiaReturnCode
+    Stop();
+
+    /**
+     * Set `key` of `keysize` to `value` of `valuesize`,
+     * waiting until the write is committed.
+     */
+
+    SophiaReturnCode
+    Set(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    /**
+     * Set `key` = `value` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate
+     * key/value sizes, waiting until the write is
+     * committed.
+     */
+
+    SophiaReturnCode
+    Set(const char *key, const char *value);
+
+    /**
+     * Queue a set of `key` of `keysize` to `value` of
+     * `valuesize` and return straight away.  `callback` is
+     * called with `data` once the write is committed.
+     */
+
+    SophiaReturnCode
+    Set(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+      , GroupCommitCallback callback
+      , void *data = NULL
+    );
+
+    /**
+     * Delete `key` of `keysize`, waiting until the delete
+     * is committed.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key, size_t keysize);
+
+    /**
+     * Delete `key` using the default (`strlen(ptr) + 1`)
+     * algorithm to calculate key size, waiting until the
+     * delete is committed.
+     */
+
+    SophiaReturnCode
+    Delete(const char *key);
+
+    /**
+     * Queue a delete of `key` of `keysize` and return
+     * straight away.  `callback` is called with `data` once
+     * the delete is committed.
+     */
+
+    SophiaReturnCode
+    Delete(
+        const char *key
+      , size_t keysize
+      , GroupCommitCallback callback
+      , void *data = NULL
+    );
+
+    /**
+     * Number of batches committed.
+     */
+
+    size_t
+    Batches();
+
+    /**
+     * Number of writes committed.
+     */
+
+    size_t
+    Writes();
+
+  private:
+
+    /**
+     * Target database.
+     */
+
+    Sophia *sp;
+
+    /**
+     * Most writes per batch.
+     */
+
+    size_t batch_size;
+
+    /**
+     * Longest wait for a batch to fill, in microseconds.
+     */
+
+    unsigned int linger_us;
+
+    /**
+     * Writer thread.
+     */
+
+    pthread_t thread;
+
+    /**
+     * Guards everything below.
+     */
+
+    pthread_mutex_t mutex;
+
+    /**
+     * Signals the writer that writes were queued.
+     */
+
+    pthread_cond_t wake;
+
+    /**
+     * Signals callers that the queue has room.
+     */
+
+    pthread_cond_t space;
+
+    /**
+     * Signals waiting callers that a batch committed.
+     */
+
+    pthread_cond_t committed;
+
+    /**
+     * Whether the writer thread runs.
+     */
+
+    bool running;
+
+    /**
+     * Whether Stop() was called.
+     */
+
+    bool stopping;
+
+    /**
+     * Writes being queued.
+     */
+
+    GroupCommitQueue *pending;
+
+    /**
+     * Writes being committed.
+     */
+
+    GroupCommitQueue *committing;
+
+    /**
+     * Counters.
+     */
+
+    size_t batches;
+    size_t writes;
+
+    /**
+     * Queue a write, `value` being `NULL` for a delete.
+     * Without a `callback`, wait for it to commit.
+     */
+
+    SophiaReturnCode
+    Enqueue(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+      , GroupCommitCallback callback
+      , void *data
+    );
+
+    /**
+     * Writer thread loop.
+     */
+
+    void
+    Run();
+
+    /**
+     * pthread entry point.
+     */
+
+    static void *
+    Main(void *writer);
+
+    // not copyable
+    GroupCommitWriter(const GroupCommitWriter &);
+    GroupCommitWriter &operator=(const GroupCommitWriter &);
+};
+
+/**
+ * AsyncSophia::GetAsync() result.
+ *
+ * Owns `value`, freeing it with the result, so a result
+ * dropped unread doesn't leak.  Move-only.
+ */
+
+struct AsyncGetResult {
+  AsyncGetResult();
+  AsyncGetResult(SophiaReturnCode rc, char *value, size_t valuesize);
+  AsyncGetResult(AsyncGetResult &&other);
+  AsyncGetResult &operator=(AsyncGetResult &&other);
+  ~AsyncGetResult();
+
+  /**
+   * Release ownership of `value`, leaving this result
+   * empty.
+   *
+   * `free` the result when done.
+   */
+
+  char *
+  Release();
+
+  SophiaReturnCode rc;
+
+  /**
+   * Value, or `NULL` if the key was not found.  Freed
+   * with the result unless released.
+   */
+
+  char *value;
+  size_t valuesize;
+
+  private:
+
+    // not copyable
+    AsyncGetResult(const AsyncGetResult &);
+    AsyncGetResult &operator=(const AsyncGetResult &);
+};
+
+/**
+ * AsyncSophia completion callback, given the result of the
+ * operation.  Runs on a worker thread.
+ */
+
+typedef void (*AsyncCallback)(SophiaReturnCode rc, void *data);
+
+/**
+ * AsyncSophia::GetAsync() completion callback.  Runs on a
+ * worker thread, and owns `result`.
+ */
+
+typedef void (*AsyncGetCallback)(AsyncGetResult result, void *data);
+
+// forward def
+typedef struct AsyncTask AsyncTask;
+
+/**
+ * Asynchronous facade over a Sophia instance.
+ *
+ * Operations are queued to a fixed pool of worker threads
+ * and complete through a `std::future` or a callback, so
+ * an event loop never waits on storage.  Keys and values
+ * are copied when queued.  Queueing blocks while
+ * `queue_size` operations are pending, which bounds memory
+ * and pushes back on callers that outrun the database.
+ *
+ * Queueing fails with `SOPHIA_POOL_STOPPED_ERROR` while the
+ * pool isn't running; the future is then ready straight
+ * away, and callbacks are not called.
+ *
+ * More than one worker requires the Sophia instance to be
+ * in ThreadSafe() mode.
+ */
+
+class AsyncSophia {
+  public:
+
+    AsyncSophia(
+        Sophia *sp
+      , size_t threads = 4
+      , size_t queue_size = 1024
+    );
+    ~AsyncSophia();
+
+    /**
+     * Start the workers.
+     */
+
+    SophiaReturnCode
+    Start();
+
+    /**
+     * Run every queued operation and stop the workers.
+     */
+
+    SophiaReturnCode
+    Stop();
+
+    /**
+     * Get the value of `key` of `keysize`.
+     */
+
+    std::future<AsyncGetResult>
+    GetAsync(const char *key, size_t keysize);
+
+    /**
+     * Get the value of `key` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate key size.
+     */
+
+    std::future<AsyncGetResult>
+    GetAsync(const char *key);
+
+    /**
+     * Get the value of `key` of `keysize`, passing it to
+     * `callback` with `data`.
+     */
+
+    SophiaReturnCode
+    GetAsync(
+        const char *key
+      , size_t keysize
+      , AsyncGetCallback callback
+      , void *data = NULL
+    );
+
+    /**
+     * Set `key` of `keysize` to `value` of `valuesize`.
+     */
+
+    std::future<SophiaReturnCode>
+    SetAsync(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    /**
+     * Set `key` = `value` using the default
+     * (`strlen(ptr) + 1`) algorithm to calculate
+     * key/value sizes.
+     */
+
+    std::future<SophiaReturnCode>
+    SetAsync(const char *key, const char *value);
+
+    /**
+     * Set `key` of `keysize` to `value` of `valuesize`,
+     * then call `callback` with `data`.
+     */
+
+    SophiaReturnCode
+    SetAsync(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+      , AsyncCallback callback
+      , void *data = NULL
+    );
+
+    /**
+     * Delete `key` of `keysize`.
+     */
+
+    std::future<SophiaReturnCode>
+    DeleteAsync(const char *key, size_t keysize);
+
+    /**
+     * Delete `key` using the default (`strlen(ptr) + 1`)
+     * algorithm to calculate key size.
+     */
+
+    std::future<SophiaReturnCode>
+    DeleteAsync(const char *key);
+
+    /**
+     * Delete `key` of `keysize`, then call `callback` with
+     * `data`.
+     */
+
+    SophiaReturnCode
+    DeleteAsync(
+        const char *key
+      , size_t keysize
+      , AsyncCallback callback
+      , void *data = NULL
+    );
+
+    /**
+     * Get the values of `count` `keys` of `keysizes` into
+     * `result`, which must outlive the operation.
+     */
+
+    std::future<SophiaReturnCode>
+    MultiGetAsync(
+        const char **keys
+      , const size_t *keysizes
+      , size_t count
+      , MultiGetResult &result
+    );
+
+    /**
+     * Get the values of `count` `keys` of `keysizes` into
+     * `result`, then call `callback` with `data`.
+     */
+
+    SophiaReturnCode
+    MultiGetAsync(
+        const char **keys
+      , const size_t *keysizes
+      , size_t count
+      , MultiGetResult &result
+      , AsyncCallback callback
+      , void *data = NULL
+    );
+
+    /**
+     * Call `callback` with `data` for every key from
+     * `start` (inclusive) to `end` (exclusive), in key
+     * order, on a worker thread.  A `NULL` bound leaves
+     * that side of the range open.
+     */
+
+    std::future<SophiaReturnCode>
+    ScanAsync(
+        const char *start
+      , size_t startsize
+      , const char *end
+      , size_t endsize
+      , ScanCallback callback
+      , void *data = NULL
+    );
+
+  private:
+
+    /**
+     * Target database.
+     */
+
+    Sophia *sp;
+
+    /**
+     * Workers.
+     */
+
+    pthread_t *threads;
+
+    /**
+     * Number of workers.
+     */
+
+    size_t nthreads;
+
+    /**
+     * Guards everything below.
+     */
+
+    pthread_mutex_t mutex;
+
+    /**
+     * Signals workers that operations were queued.
+     */
+
+    pthread_cond_t ready;
+
+    /**
+     * Signals callers that the queue has room.
+     */
+
+    pthread_cond_t space;
+
+    /**
+     * Ring of pending operations.
+     */
+
+    AsyncTask **queue;
+
+    /**
+     * Ring capacity.
+     */
+
+    size_t capacity;
+
+    /**
+     * Index of the oldest pending operation.
+     */
+
+    size_t head;
+
+    /**
+     * Number of pending operations.
+     */
+
+    size_t count;
+
+    /**
+     * Whether the workers run.
+     */
+
+    bool running;
+
+    /**
+     * Whether Stop() was called.
+     */
+
+    bool stopping;
+
+    /**
+     * Queue `task`, which the workers free once run.
+     */
+
+    SophiaReturnCode
+    Enqueue(AsyncTask *task);
+
+    /**
+     * Queue `task`, completing the returned future.
+     */
+
+    std::future<SophiaReturnCode>
+    StatusFuture(AsyncTask *task);
+
+    /**
+     * Queue Get `task`, completing the returned future.
+     */
+
+    std::future<AsyncGetResult>
+    ValueFuture(AsyncTask *task);
+
+    /**
+     * Queue `task`, calling `callback` with `data` when it
+     * completes.
+     */
+
+    SophiaReturnCode
+    Notify(AsyncTask *task, AsyncCallback callback, void *data);
+
+    /**
+     * Worker loop.
+     */
+
+    void
+    Run();
+
+    /**
+     * pthread entry point.
+     */
+
+    static void *
+    Main(void *async);
+
+    // not copyable
+    AsyncSophia(const AsyncSophia &);
+    AsyncSophia &operator=(const AsyncSophia &);
+};
+
+/**
+ * Source of records for BulkLoader, in key order.
+ */
+
+class BulkSource {
+  public:
+
+    virtual ~BulkSource() {}
+
+    /**
+     * Point `key`/`value` at the next record.  Pointers
+     * only need to stay valid until the following call.
+     *
+     * Returns 1 for a record, 0 at the end of the source
+     * and -1 on error.
+     */
+
+    virtual int
+    Next(
+        const char **key
+      , size_t *keysize
+      , const char **value
+      , size_t *valuesize
+    ) = 0;
+};
+
+/**
+ * Memory-mapped file of records for BulkLoader.
+ *
+ * Each record is a `uint32_t` key size and `uint32_t`
+ * value size (host byte order) followed by the key and
+ * value bytes.
+ */
+
+class BulkFile : public BulkSource {
+  public:
+
+    BulkFile(const char *path);
+    ~BulkFile();
+
+    /**
+     * Map the file.
+     */
+
+    SophiaReturnCode
+    Open();
+
+    /**
+     * Get the next record, -1 if it is truncated.
+     */
+
+    int
+    Next(
+        const char **key
+      , size_t *keysize
+      , const char **value
+      , size_t *valuesize
+    );
+
+    /**
+     * Unmap the file.
+     */
+
+    void
+    Close();
+
+    /**
+     * Append a record to `file` in the format read
+     * by BulkFile.
+     */
+
+    static SophiaReturnCode
+    Write(
+        FILE *file
+      , const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+  private:
+
+    /**
+     * Path to the file.
+     */
+
+    const char *path;
+
+    /**
+     * Mapping.
+     */
+
+    char *map;
+
+    /**
+     * Mapping size.
+     */
+
+    size_t mapsize;
+
+    /**
+     * Read offset.
+     */
+
+    size_t offset;
+};
+
+/**
+ * Memory-mapped snapshot file written by
+ * Sophia::ExportSnapshot(), for BulkLoader.
+ *
+ * The file starts with an 8 byte magic, followed by blocks
+ * of records in the BulkFile format, an index giving the
+ * offset, size, record count and CRC-32C of every block,
+ * and a footer locating the index.  Integers are in host
+ * byte order.
+ */
+
+class SnapshotFile : public BulkSource {
+  public:
+
+    SnapshotFile(const char *path);
+    ~SnapshotFile();
+
+    /**
+     * Map the file and check its footer and index.
+     */
+
+    SophiaReturnCode
+    Open();
+
+    /**
+     * Check the checksum and records of every block.
+     */
+
+    SophiaReturnCode
+    Verify();
+
+    /**
+     * Get the next record, -1 if a block is malformed.
+     * Blocks are not checked against their checksums
+     * here; call Verify() first.
+     */
+
+    int
+    Next(
+        const char **key
+      , size_t *keysize
+      , const char **value
+      , size_t *valuesize
+    );
+
+    /**
+     * Unmap the file.
+     */
+
+    void
+    Close();
+
+    /**
+     * Blocks, records and key and value bytes in the file.
+     */
+
+    size_t
+    Blocks() const;
+
+    size_t
+    Records() const;
+
+    size_t
+    Bytes() const;
+
+  private:
+
+    /**
+     * Path to the file.
+     */
+
+    const char *path;
+
+    /**
+     * Mapping.
+     */
+
+    char *map;
+
+    /**
+     * Mapping size.
+     */
+
+    size_t mapsize;
+
+    /**
+     * Block index, in the mapping.
+     */
+
+    const char *index;
+
+    /**
+     * Footer counts.
+     */
+
+    size_t blocks;
+    size_t records;
+    size_t bytes;
+
+    /**
+     * Next block to read.
+     */
+
+    size_t block;
+
+    /**
+     * Read offset and end of the current block.
+     */
+
+    size_t offset;
+    size_t blockend;
+};
+
+/**
+ * Bulk loader.
+ *
+ * Streams a sorted source into the database in large
+ * transactions.  While loading, the database is reopened
+ * with GC disabled and a raised merge watermark; the
+ * previous options and open state are restored
+ * afterwards, even if that reopen fails.  A database
+ * opened read-only fails with `SOPHIA_READ_ONLY_ERROR`.
+ */
+
+class BulkLoader {
+  public:
+
+    BulkLoader(
+        Sophia *sp
+      , size_t batch_size = 10000
+      , int merge_watermark = 1000000
+    );
+
+    /**
+     * Load every record of `source`.
+     */
+
+    SophiaReturnCode
+    Load(BulkSource *source);
+
+    /**
+     * Load every record of the BulkFile at `file`.
+     */
+
+    SophiaReturnCode
+    Load(const char *file);
+
+    /**
+     * Records loaded by the last Load().
+     */
+
+    size_t
+    Records() const;
+
+    /**
+     * Key and value bytes loaded by the last Load().
+     */
+
+    size_t
+    Bytes() const;
+
+    /**
+     * Duration of the last Load(), in seconds.
+     */
+
+    double
+    Seconds() const;
+
+    /**
+     * Records per second of the last Load().
+     */
+
+    double
+    RecordsPerSecond() const;
+
+    /**
+     * Bytes per second of the last Load().
+     */
+
+    double
+    BytesPerSecond() const;
+
+  private:
+
+    /**
+     * Target database.
+     */
+
+    Sophia *sp;
+
+    /**
+     * Records per transaction.
+     */
+
+    size_t batch_size;
+
+    /**
+     * Merge watermark while loading.
+     */
+
+    int merge_watermark;
+
+    /**
+     * Pending records.
+     */
+
+    WriteBatch batch;
+
+    /**
+     * Counters.
+     */
+
+    size_t records;
+    size_t bytes;
+    double seconds;
+};
+
+#ifdef SOPHIA_COROUTINES
+
+/**
+ * C++20 coroutine support.
+ *
+ * Awaitables come in two flavours.  Given a Sophia or
+ * Transaction, the operation runs on the awaiting thread
+ * when awaited and never suspends, so it costs no thread
+ * hop and no allocation.  Given an AsyncSophia, the
+ * coroutine suspends and a worker resumes it once the
+ * operation completes; the awaitable itself holds the
+ * result, so there's no `std::future` state.  A coroutine
+ * resumed by a worker runs on that worker: awaiting an
+ * AsyncSophia from there blocks the worker while the queue
+ * is full, so size the queue for the coroutines in flight.
+ *
+ * Everything here is defined inline, so the library can
+ * be built without C++20.
+ */
+
+namespace co {
+
+/**
+ * Eagerly started, detached coroutine.  Its frame is freed
+ * when it returns.
+ */
+
+class Task {
+  public:
+
+    struct promise_type {
+      Task get_return_object() { return Task(); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/**
+ * Awaitable Get(), resulting in an AsyncGetResult.
+ */
+
+class GetAwaitable {
+  public:
+
+    GetAwaitable(
+        Sophia *sp
+      , AsyncSophia *async
+      , const char *key
+      , size_t keysize
+    );
+
+    bool
+    await_ready();
+
+    bool
+    await_suspend(std::coroutine_handle<> handle);
+
+    AsyncGetResult
+    await_resume();
+
+  private:
+
+    /**
+     * Inline target, or `NULL`.
+     */
+
+    Sophia *sp;
+
+    /**
+     * Async target, or `NULL`.
+     */
+
+    AsyncSophia *async;
+
+    /**
+     * Key.
+     */
+
+    const char *key;
+
+    /**
+     * Key size.
+     */
+
+    size_t keysize;
+
+    /**
+     * Result.
+     */
+
+    AsyncGetResult result;
+
+    /**
+     * Suspended coroutine.
+     */
+
+    std::coroutine_handle<> handle;
+
+    /**
+     * AsyncSophia completion callback.
+     */
+
+    static void
+    Done(AsyncGetResult result, void *awaitable);
+};
+
+/**
+ * Awaitable write, resulting in a SophiaReturnCode.
+ */
+
+class StatusAwaitable {
+  public:
+
+    /**
+     * Operations.
+     */
+
+    typedef enum {
+        SET = 0
+      , DELETE = 1
+      , COMMIT = 2
+    } Operation;
+
+    StatusAwaitable(
+        Operation operation
+      , Sophia *sp
+      , AsyncSophia *async
+      , Transaction *transaction
+      , const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    bool
+    await_ready();
+
+    bool
+    await_suspend(std::coroutine_handle<> handle);
+
+    SophiaReturnCode
+    await_resume();
+
+  private:
+
+    /**
+     * Operation to run.
+     */
+
+    Operation operation;
+
+    /**
+     * Inline target, or `NULL`.
+     */
+
+    Sophia *sp;
+
+    /**
+     * Async target, or `NULL`.
+     */
+
+    AsyncSophia *async;
+
+    /**
+     * Transaction to commit, or `NULL`.
+     */
+
+    Transaction *transaction;
+
+    /**
+     * Key, value and their sizes.
+     */
+
+    const char *key;
+    size_t keysize;
+    const char *value;
+    size_t valuesize;
+
+    /**
+     * Result.
+     */
+
+    SophiaReturnCode rc;
+
+    /**
+     * Suspended coroutine.
+     */
+
+    std::coroutine_handle<> handle;
+
+    /**
+     * Run the operation inline.
+     */
+
+    SophiaReturnCode
+    Run();
+
+    /**
+     * AsyncSophia completion callback.
+     */
+
+    static void
+    Done(SophiaReturnCode rc, void *awaitable);
+};
+
+/**
+ * Generator of the rows of an Iterator.
+ *
+ *   for (const IteratorResult *res : co::Scan(&it)) ...
+ *
+ * Rows are only valid until the generator moves on.
+ */
+
+class Generator {
+  public:
+
+    struct promise_type {
+      const IteratorResult *current = NULL;
+
+      Generator get_return_object() {
+        return Generator(
+          std::coroutine_handle<promise_type>::from_promise(*this)
+        );
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      std::suspend_always final_suspend() noexcept { return {}; }
+      std::suspend_always yield_value(const IteratorResult *row) noexcept {
+        current = row;
+        return {};
+      }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+
+    /**
+     * Input iterator over the generated rows.
+     */
+
+    class Position {
+      public:
+
+        Position(std::coroutine_handle<promise_type> handle);
+
+        const IteratorResult *
+        operator*() const;
+
+        Position &
+        operator++();
+
+        bool
+        operator!=(const Position &other) const;
+
+      private:
+
+        /**
+         * Generator coroutine, `NULL` at the end.
+         */
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    Generator(Generator &&other) noexcept;
+    ~Generator();
+
+    /**
+     * Next row, or `NULL` at the end.
+     */
+
+    const IteratorResult *
+    Next();
+
+    Position
+    begin();
+
+    Position
+    end();
+
+  private:
+
+    Generator(std::coroutine_handle<promise_type> handle);
+
+    /**
+     * Generator coroutine.
+     */
+
+    std::coroutine_handle<promise_type> handle;
+
+    // not copyable
+    Generator(const Generator &);
+    Generator &operator=(const Generator &);
+};
+
+/**
+ * Get `key` of `keysize` from `sp` when awaited.
+ */
+
+inline GetAwaitable
+Get(Sophia *sp, const char *key, size_t keysize) {
+  return GetAwaitable(sp, NULL, key, keysize);
+}
+
+/**
+ * Get `key` of `keysize` through `async`.
+ */
+
+inline GetAwaitable
+Get(AsyncSophia *async, const char *key, size_t keysize) {
+  return GetAwaitable(NULL, async, key, keysize);
+}
+
+/**
+ * Set `key` of `keysize` to `value` of `valuesize` in `sp`
+ * when awaited.
+ */
+
+inline StatusAwaitable
+Set(
+    Sophia *sp
+  , const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  return StatusAwaitable(
+      StatusAwaitable::SET
+    , sp
+    , NULL
+    , NULL
+    , key
+    , keysize
+    , value
+    , valuesize
+  );
+}
+
+/**
+ * Set `key` of `keysize` to `value` of `valuesize`
+ * through `async`.
+ */
+
+inline StatusAwaitable
+Set(
+    AsyncSophia *async
+  , const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  return StatusAwaitable(
+      StatusAwaitable::SET
+    , NULL
+    , async
+    , NULL
+    , key
+    , keysize
+    , value
+    , valuesize
+  );
+}
+
+/**
+ * Delete `key` of `keysize` from `sp` when awaited.
+ */
+
+inline StatusAwaitable
+Delete(Sophia *sp, const char *key, size_t keysize) {
+  return StatusAwaitable(
+      StatusAwaitable::DELETE
+    , sp
+    , NULL
+    , NULL
+    , key
+    , keysize
+    , NULL
+    , 0
+  );
+}
+
+/**
+ * Delete `key` of `keysize` through `async`.
+ */
+
+inline StatusAwaitable
+Delete(AsyncSophia *async, const char *key, size_t keysize) {
+  return StatusAwaitable(
+      StatusAwaitable::DELETE
+    , NULL
+    , async
+    , NULL
+    , key
+    , keysize
+    , NULL
+    , 0
+  );
+}
+
+/**
+ * Commit `transaction` when awaited.
+ */
+
+inline StatusAwaitable
+Commit(Transaction *transaction) {
+  return StatusAwaitable(
+      StatusAwaitable::COMMIT
+    , NULL
+    , NULL
+    , transaction
+    , NULL
+    , 0
+    , NULL
+    , 0
+  );
+}
+
+/**
+ * Generate the rows of `it`, beginning and ending it.
+ */
+
+inline Generator
+Scan(Iterator *it) {
+  IteratorResult *row;
+  if (SOPHIA_SUCCESS != it->Begin()) co_return;
+  while ((row = it->Next())) co_yield row;
+  it->End();
+}
+
+/**
+ * Get awaitable.
+ */
+
+inline
+GetAwaitable::GetAwaitable(
+    Sophia *sp
+  , AsyncSophia *async
+  , const char *key
+  , size_t keysize
+) : sp(sp), async(async), key(key), keysize(keysize) {}
+
+inline bool
+GetAwaitable::await_ready() {
+  if (async) return false;
+
+  Value value;
+  result.rc = sp->Get(key, keysize, value);
+  result.valuesize = value.Size();
+  result.value = value.Release();
+  return true;
+}
+
+inline bool
+GetAwaitable::await_suspend(std::coroutine_handle<> handle) {
+  this->handle = handle;
+  SophiaReturnCode rc = async->GetAsync(key, keysize, Done, this);
+  if (SOPHIA_SUCCESS == rc) return true;
+
+  // never queued, so resume straight away
+  result.rc = rc;
+  return false;
+}
+
+inline AsyncGetResult
+GetAwaitable::await_resume() {
+  return std::move(result);
+}
+
+inline void
+GetAwaitable::Done(AsyncGetResult result, void *awaitable) {
+  GetAwaitable *self = (GetAwaitable *) awaitable;
+  self->result = std::move(result);
+  self->handle.resume();
+}
+
+/**
+ * Status awaitable.
+ */
+
+inline
+StatusAwaitable::StatusAwaitable(
+    Operation operation
+  , Sophia *sp
+  , AsyncSophia *async
+  , Transaction *transaction
+  , const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) : operation(operation)
+  , sp(sp)
+  , async(async)
+  , transaction(transaction)
+  , key(key)
+  , keysize(keysize)
+  , value(value)
+  , valuesize(valuesize) {
+  rc = SOPHIA_SUCCESS;
+}
+
+inline bool
+StatusAwaitable::await_ready() {
+  if (async) return false;
+  rc = Run();
+  return true;
+}
+
+inline bool
+StatusAwaitable::await_suspend(std::coroutine_handle<> handle) {
+  SophiaReturnCode queued;
+
+  this->handle = handle;
+  if (SET == operation) {
+    queued = async->SetAsync(key, keysize, value, valuesize, Done, this);
+  } else {
+    queued = async->DeleteAsync(key, keysize, Done, this);
+  }
+  if (SOPHIA_SUCCESS == queued) return true;
+
+  // never queued, so resume straight away
+  rc = queued;
+  return false;
+}
+
+inline SophiaReturnCode
+StatusAwaitable::await_resume() {
+  return rc;
+}
+
+inline SophiaReturnCode
+StatusAwaitable::Run() {
+  switch (operation) {
+    case SET:
+      return sp->Set(key, keysize, value, valuesize);
+    case DELETE:
+      return sp->Delete(key, keysize);
+    case COMMIT:
+      return transaction->Commit();
+  }
+  return SOPHIA_SUCCESS;
+}
+
+inline void
+StatusAwaitable::Done(SophiaReturnCode rc, void *awaitable) {
+  StatusAwaitable *self = (StatusAwaitable *) awaitable;
+  self->rc = rc;
+  self->handle.resume();
+}
+
+/**
+ * Generator.
+ */
+
+inline
+Generator::Generator(
+    std::coroutine_handle<promise_type> handle
+) : handle(handle) {}
+
+inline
+Generator::Generator(Generator &&other) noexcept : handle(other.handle) {
+  other.handle = NULL;
+}
+
+inline
+Generator::~Generator() {
+  if (handle) handle.destroy();
+}
+
+inline const IteratorResult *
+Generator::Next() {
+  if (!handle || handle.done()) return NULL;
+  handle.resume();
+  return handle.done() ? NULL : handle.promise().current;
+}
+
+inline Generator::Position
+Generator::begin() {
+  if (!Next()) return end();
+  return Position(handle);
+}
+
+inline Generator::Position
+Generator::end() {
+  return Position(NULL);
+}
+
+inline
+Generator::Position::Position(
+    std::coroutine_handle<promise_type> handle
+) : handle(handle) {}
+
+inline const IteratorResult *
+Generator::Position::operator*() const {
+  return handle.promise().current;
+}
+
+inline Generator::Position &
+Generator::Position::operator++() {
+  handle.resume();
+  if (handle.done()) handle = NULL;
+  return *this;
+}
+
+inline bool
+Generator::Position::operator!=(const Position &other) const {
+  return handle != other.handle;
+}
+
+} // namespace co
+
+#endif // SOPHIA_COROUTINES
 
 } // namespace sophia
 
@@ -2,6 +2,24 @@
 #include <sophia.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <new>
 #include "sophia-cc.h"
 
 namespace sophia {
@@ -11,578 +29,8252 @@ namespace sophia {
  */
 
 typedef enum {
-    TRANSACTION_OPERATION_SET = 0
-  , TRANSACTION_OPERATION_DELETE = 1
-} TransactionOperationType;
+    WRITE_BATCH_SET = 0
+  , WRITE_BATCH_DELETE = 1
+} WriteBatchOperationType;
 
 /**
- * Operation.
+ * WriteBatch record header, followed in the arena by
+ * `keysize` bytes of key and `valuesize` bytes of value.
  */
 
-struct TransactionOperation {
-  char *key;
+typedef struct {
+  int type;
+  size_t keysize;
+  size_t valuesize;
+} WriteBatchRecord;
+
+/**
+ * MultiGet() result entry.
+ */
+
+struct MultiGetEntry {
+  size_t offset;
+  size_t size;
+  bool found;
+};
+
+/**
+ * Number of rows a MultiGet() cursor may step over
+ * before it is re-seeked to the next key.  The budget is
+ * halved on every re-seek (down to a single row) and
+ * restored on every hit, so sparse batches stop paying
+ * for walks which won't reach their key.
+ */
+
+#define MULTIGET_MAX_SKIP 16
+
+/**
+ * Stack space MultiGet() copies cached values through.
+ */
+
+#define MULTIGET_SCRATCH_SIZE 256
+
+/**
+ * Compare keys the way sophia's default comparator does:
+ * bytewise, then shorter first.
+ */
+
+static int
+CompareKeys(
+    const char *a
+  , size_t asize
+  , const char *b
+  , size_t bsize
+) {
+  int rc = memcmp(a, b, asize < bsize ? asize : bsize);
+  if (0 != rc) return rc;
+  if (asize == bsize) return 0;
+  return asize < bsize ? -1 : 1;
+}
+
+/**
+ * Prefix of the keys reserved for wrapper metadata.
+ */
+
+#define RESERVED_PREFIX "\0\0sophia-cc:"
+#define RESERVED_PREFIX_SIZE 12
+
+/**
+ * Reserved key holding the tracked key count.
+ */
+
+static const char COUNT_KEY[] = RESERVED_PREFIX "count";
+
+/**
+ * Reserved key holding the stamp of the Bloom filter
+ * sidecar saved by the last clean Close().
+ */
+
+static const char FILTER_KEY[] = RESERVED_PREFIX "filter";
+
+/**
+ * Reserved key flagging that values carry a codec header.
+ */
+
+static const char FRAMING_KEY[] = RESERVED_PREFIX "framed";
+
+/**
+ * Reserved key holding the compression dictionary.
+ */
+
+static const char DICTIONARY_KEY[] = RESERVED_PREFIX "dictionary";
+
+/**
+ * Prefix of the reserved keys holding SecondaryIndex
+ * entries, which the index name and a NUL follow.
+ */
+
+#define INDEX_PREFIX RESERVED_PREFIX "index:"
+
+/**
+ * An index entry key is the escaped index key followed by
+ * the key of its record, and its value is the record key
+ * size as a `uint32_t`.  NULs in index keys become NUL
+ * 0xff and a NUL 0x01 ends them, so entries sort by index
+ * key and then by key.
+ */
+
+#define INDEX_KEY_END_SIZE 2
+
+/**
+ * Size of `key` of `keysize` escaped for an index entry.
+ */
+
+static size_t
+EscapedIndexKeySize(const char *key, size_t keysize) {
+  size_t size = keysize;
+  for (size_t i = 0; i < keysize; i++) {
+    if ('\0' == key[i]) size++;
+  }
+  return size;
+}
+
+/**
+ * Escape `key` of `keysize` to `out`, returning the end of
+ * the output.
+ */
+
+static char *
+EscapeIndexKey(const char *key, size_t keysize, char *out) {
+  for (size_t i = 0; i < keysize; i++) {
+    *out++ = key[i];
+    if ('\0' == key[i]) *out++ = (char) 0xff;
+  }
+  return out;
+}
+
+/**
+ * Put the entry key mapping `indexkey` to `key` behind
+ * the index's entry `prefix` in `*entry`, grown as
+ * needed, and its size in `*size`.
+ */
+
+static SophiaReturnCode
+IndexEntryKey(
+    const char *prefix
+  , size_t prefixsize
+  , const char *indexkey
+  , size_t indexkeysize
+  , const char *key
+  , size_t keysize
+  , char **entry
+  , size_t *capacity
+  , size_t *size
+) {
+  *size = prefixsize
+        + EscapedIndexKeySize(indexkey, indexkeysize)
+        + INDEX_KEY_END_SIZE
+        + keysize;
+  if (*size > *capacity) {
+    char *ptr = (char *) realloc(*entry, *size);
+    if (!ptr) return SOPHIA_ALLOC_ERROR;
+    *entry = ptr;
+    *capacity = *size;
+  }
+
+  char *out = *entry;
+  memcpy(out, prefix, prefixsize);
+  out = EscapeIndexKey(indexkey, indexkeysize, out + prefixsize);
+  *out++ = '\0';
+  *out++ = 0x01;
+  memcpy(out, key, keysize);
+  return SOPHIA_SUCCESS;
+}
+
+/**
+ * Tracked count value: a `uint64_t` count followed by
+ * a clean-shutdown flag.
+ */
+
+#define COUNT_VALUE_SIZE 9
+
+/**
+ * Writes between saves of the tracked key count, which
+ * bounds how stale it can be after an unclean shutdown.
+ */
+
+#define COUNT_SAVE_INTERVAL 1024
+
+/**
+ * Check if `key` is reserved for wrapper metadata.
+ */
+
+static inline bool
+IsReservedKey(const char *key, size_t keysize) {
+  return keysize >= RESERVED_PREFIX_SIZE
+      && '\0' == key[0]
+      && 0 == memcmp(key, RESERVED_PREFIX, RESERVED_PREFIX_SIZE);
+}
+
+/**
+ * Check if `key` exists: 1 if it does, 0 if it doesn't
+ * and -1 on error.
+ */
+
+static int
+KeyExists(void *db, const char *key, size_t keysize) {
+  void *ref = NULL;
+  size_t valuesize;
+  if (-1 == sp_get(db, key, keysize, &ref, &valuesize)) return -1;
+  if (NULL == ref) return 0;
+  free(ref);
+  return 1;
+}
+
+/**
+ * Check if any key besides the reserved ones exists: 1 if
+ * one does, 0 if none does and -1 on error.
+ */
+
+static int
+HasValues(void *db) {
+  void *cursor = sp_cursor(db, SPGT, NULL, 0);
+  int found = 0;
+  if (NULL == cursor) return -1;
+  while (!found && sp_fetch(cursor)) {
+    const char *key = sp_key(cursor);
+    found = key && !IsReservedKey(key, sp_keysize(cursor));
+  }
+  sp_destroy(cursor);
+  return found;
+}
+
+/**
+ * A WriteBatch record, as seen by CountDelta() and
+ * IndexEntries().
+ */
+
+typedef struct {
+  const char *key;
+  size_t keysize;
+  const char *value;
+  size_t valuesize;
+  int type;
+  size_t seq;
+} CountRecord;
+
+/**
+ * Orders CountRecords by key, then by batch order.
+ */
+
+struct CountOrder {
+  bool
+  operator()(const CountRecord &a, const CountRecord &b) const {
+    int rc = CompareKeys(a.key, a.keysize, b.key, b.keysize);
+    return 0 == rc ? a.seq < b.seq : rc < 0;
+  }
+};
+
+/**
+ * Buffers of indexed writes.
+ */
+
+class IndexScratch {
+  public:
+
+    IndexScratch() {
+      records = NULL;
+      recordscapacity = 0;
+      entry = NULL;
+      entrycapacity = 0;
+    }
+
+    ~IndexScratch() {
+      free(records);
+      free(entry);
+    }
+
+    /**
+     * Single write of Set() and Delete().
+     */
+
+    WriteBatch write;
+
+    /**
+     * Index entry writes of a commit.
+     */
+
+    WriteBatch entries;
+
+    /**
+     * Index keys of the replaced and the written record.
+     */
+
+    IndexKeys before;
+    IndexKeys after;
+
+    /**
+     * Sorted records of a commit.
+     */
+
+    CountRecord *records;
+    size_t recordscapacity;
+
+    /**
+     * Entry key being written.
+     */
+
+    char *entry;
+    size_t entrycapacity;
+};
+
+/**
+ * Orders MultiGet() key indexes by key.
+ */
+
+struct MultiGetOrder {
+  const char **keys;
+  const size_t *keysizes;
+
+  bool
+  operator()(size_t a, size_t b) const {
+    return CompareKeys(keys[a], keysizes[a], keys[b], keysizes[b]) < 0;
+  }
+};
+
+/**
+ * Cursor list `free` callback.
+ */
+
+static void
+DestroyCursor(void *node) {
+  if (node) sp_destroy(node);
+}
+
+/**
+ * Holds a reader/writer lock for its scope.  A `NULL`
+ * lock is a no-op.
+ */
+
+class ScopedLock {
+  public:
+
+    ScopedLock(pthread_rwlock_t *lock, bool write) : lock(lock) {
+      if (!lock) return;
+      if (write) {
+        pthread_rwlock_wrlock(lock);
+      } else {
+        pthread_rwlock_rdlock(lock);
+      }
+    }
+
+    ~ScopedLock() {
+      Unlock();
+    }
+
+    void
+    Unlock() {
+      if (lock) pthread_rwlock_unlock(lock);
+      lock = NULL;
+    }
+
+  private:
+
+    pthread_rwlock_t *lock;
+};
+
+/**
+ * Cursor registry.
+ */
+
+CursorRegistry::CursorRegistry() {
+  for (size_t i = 0; i < SOPHIA_CURSOR_SHARDS; i++) {
+    lists[i] = list_new();
+    if (lists[i]) lists[i]->free = DestroyCursor;
+    pthread_mutex_init(&locks[i], NULL);
+  }
+}
+
+CursorRegistry::~CursorRegistry() {
+  for (size_t i = 0; i < SOPHIA_CURSOR_SHARDS; i++) {
+    if (lists[i]) list_destroy(lists[i]);
+    pthread_mutex_destroy(&locks[i]);
+  }
+}
+
+size_t
+CursorRegistry::Shard(void *cursor) const {
+  uintptr_t p = (uintptr_t) cursor;
+  return (p >> 4 ^ p >> 12) % SOPHIA_CURSOR_SHARDS;
+}
+
+SophiaReturnCode
+CursorRegistry::Add(void *cursor, list_node_t **node) {
+  size_t shard = Shard(cursor);
+
+  if (!lists[shard] || !(*node = list_node_new(cursor))) {
+    sp_destroy(cursor);
+    *node = NULL;
+    return SOPHIA_ALLOC_ERROR;
+  }
+
+  pthread_mutex_lock(&locks[shard]);
+  list_rpush(lists[shard], *node);
+  pthread_mutex_unlock(&locks[shard]);
+  return SOPHIA_SUCCESS;
+}
+
+void
+CursorRegistry::Remove(list_node_t *node) {
+  size_t shard = Shard(node->val);
+
+  pthread_mutex_lock(&locks[shard]);
+  list_remove(lists[shard], node);
+  pthread_mutex_unlock(&locks[shard]);
+}
+
+void
+CursorRegistry::Clear() {
+  for (size_t i = 0; i < SOPHIA_CURSOR_SHARDS; i++) {
+    if (!lists[i]) continue;
+    pthread_mutex_lock(&locks[i]);
+    list_node_t *node;
+    while ((node = list_lpop(lists[i]))) {
+      DestroyCursor(node->val);
+      free(node);
+    }
+    pthread_mutex_unlock(&locks[i]);
+  }
+}
+
+size_t
+CursorRegistry::Count() {
+  size_t n = 0;
+  for (size_t i = 0; i < SOPHIA_CURSOR_SHARDS; i++) {
+    if (!lists[i]) continue;
+    pthread_mutex_lock(&locks[i]);
+    n += lists[i]->len;
+    pthread_mutex_unlock(&locks[i]);
+  }
+  return n;
+}
+
+/**
+ * Cached value.  The key and value follow the entry in
+ * the same allocation.
+ */
+
+typedef struct CacheEntry {
+  struct CacheEntry *next;
+  uint64_t hash;
   size_t keysize;
-  char *value;
   size_t valuesize;
-  TransactionOperationType type;
+  size_t slot;
+  bool referenced;
+} CacheEntry;
+
+/**
+ * Independently locked part of a ValueCache: a chained
+ * hash table of entries plus the CLOCK ring they are
+ * evicted from.
+ */
+
+typedef struct {
+  pthread_mutex_t mutex;
+  CacheEntry **buckets;
+  size_t nbuckets;
+  CacheEntry **ring;
+  size_t count;
+  size_t ringcapacity;
+  size_t hand;
+  size_t bytes;
+  size_t budget;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+} CacheShard;
+
+/**
+ * Read-through value cache.
+ */
+
+class ValueCache {
+  public:
+
+    /**
+     * Create a cache of `budget` bytes over `nshards`
+     * shards, or `NULL`.
+     */
+
+    static ValueCache *
+    New(size_t budget, size_t nshards);
+
+    ~ValueCache();
+
+    /**
+     * Look up `key` of `keysize`.  On a hit the value is
+     * copied to `buffer` when it fits in `capacity`,
+     * otherwise to a new allocation, and put in `value`.
+     *
+     * Returns 1 for a hit, 0 for a miss and -1 when the
+     * copy can't be allocated.
+     */
+
+    int
+    Lookup(
+        const char *key
+      , size_t keysize
+      , char *buffer
+      , size_t capacity
+      , char **value
+      , size_t *valuesize
+    );
+
+    /**
+     * Cache a copy of `value` of `valuesize` for `key` of
+     * `keysize`, evicting as needed.
+     */
+
+    void
+    Insert(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    /**
+     * Drop `key` of `keysize`.
+     */
+
+    void
+    Erase(const char *key, size_t keysize);
+
+    /**
+     * Drop every entry.
+     */
+
+    void
+    Clear();
+
+    /**
+     * Sum the counters of every shard into `stats`.
+     */
+
+    void
+    Stats(ValueCacheStats *stats);
+
+  private:
+
+    ValueCache() {}
+
+    /**
+     * Shards.
+     */
+
+    CacheShard *shards;
+
+    /**
+     * Number of shards.
+     */
+
+    size_t nshards;
+
+    /**
+     * Find `key` of `hash` in `shard`, putting the link
+     * pointing at it in `link`.
+     */
+
+    CacheEntry *
+    Find(
+        CacheShard *shard
+      , uint64_t hash
+      , const char *key
+      , size_t keysize
+      , CacheEntry ***link
+    );
+
+    /**
+     * Unlink and free `entry`.
+     */
+
+    void
+    Remove(CacheShard *shard, CacheEntry *entry, CacheEntry **link);
+
+    /**
+     * Evict one entry with the CLOCK hand.
+     */
+
+    void
+    Evict(CacheShard *shard);
 };
 
-/**
- * Cursor list `free` callback.
- */
+/**
+ * Bytes an entry costs against the budget.
+ */
+
+#define CACHE_ENTRY_COST(keysize, valuesize) \
+  (sizeof(CacheEntry) + (keysize) + (valuesize))
+
+/**
+ * FNV-1a hash of `key` of `keysize`.
+ */
+
+static inline uint64_t
+HashKey(const char *key, size_t keysize) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < keysize; i++) {
+    hash ^= (unsigned char) key[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * splitmix64 finalizer of `x`.
+ */
+
+static inline uint64_t
+MixKeyWord(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * ValueCache hash of `key` of `keysize`.  The 8 and 16
+ * byte keys of FixedKeyDB are mixed a word at a time.
+ * Nothing persists it, unlike HashKey().
+ */
+
+static inline uint64_t
+HashCacheKey(const char *key, size_t keysize) {
+  uint64_t a;
+  uint64_t b;
+
+  switch (keysize) {
+    case 8:
+      memcpy(&a, key, 8);
+      return MixKeyWord(a);
+    case 16:
+      memcpy(&a, key, 8);
+      memcpy(&b, key + 8, 8);
+      return MixKeyWord(a ^ MixKeyWord(b));
+  }
+  return HashKey(key, keysize);
+}
+
+/**
+ * Whether `a` and `b`, both of `size`, are equal, with
+ * fixed-width compares for the 8 and 16 byte keys of
+ * FixedKeyDB.
+ */
+
+static inline bool
+SameKey(const char *a, const char *b, size_t size) {
+  switch (size) {
+    case 8: return 0 == memcmp(a, b, 8);
+    case 16: return 0 == memcmp(a, b, 16);
+  }
+  return 0 == memcmp(a, b, size);
+}
+
+ValueCache *
+ValueCache::New(size_t budget, size_t nshards) {
+  ValueCache *cache = new (std::nothrow) ValueCache();
+  if (!cache) return NULL;
+
+  if (0 == nshards) nshards = 1;
+  cache->nshards = nshards;
+  cache->shards = (CacheShard *) calloc(nshards, sizeof(CacheShard));
+  if (!cache->shards) {
+    delete cache;
+    return NULL;
+  }
+
+  for (size_t i = 0; i < nshards; i++) {
+    pthread_mutex_init(&cache->shards[i].mutex, NULL);
+    cache->shards[i].budget = budget / nshards;
+  }
+  return cache;
+}
+
+ValueCache::~ValueCache() {
+  Clear();
+  for (size_t i = 0; i < nshards; i++) {
+    free(shards[i].buckets);
+    free(shards[i].ring);
+    pthread_mutex_destroy(&shards[i].mutex);
+  }
+  free(shards);
+}
+
+CacheEntry *
+ValueCache::Find(
+    CacheShard *shard
+  , uint64_t hash
+  , const char *key
+  , size_t keysize
+  , CacheEntry ***link
+) {
+  if (0 == shard->nbuckets) return NULL;
+
+  CacheEntry **ptr = &shard->buckets[(hash >> 16) & (shard->nbuckets - 1)];
+  for (; *ptr; ptr = &(*ptr)->next) {
+    CacheEntry *entry = *ptr;
+    if (entry->hash == hash
+     && entry->keysize == keysize
+     && SameKey((char *) (entry + 1), key, keysize)) {
+      if (link) *link = ptr;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+int
+ValueCache::Lookup(
+    const char *key
+  , size_t keysize
+  , char *buffer
+  , size_t capacity
+  , char **value
+  , size_t *valuesize
+) {
+  uint64_t hash = HashCacheKey(key, keysize);
+  CacheShard *shard = &shards[hash % nshards];
+  int rc = 1;
+
+  pthread_mutex_lock(&shard->mutex);
+  CacheEntry *entry = Find(shard, hash, key, keysize, NULL);
+  if (!entry) {
+    shard->misses++;
+    pthread_mutex_unlock(&shard->mutex);
+    return 0;
+  }
+
+  entry->referenced = true;
+  shard->hits++;
+  *valuesize = entry->valuesize;
+  *value = buffer && entry->valuesize <= capacity
+    ? buffer
+    : (char *) malloc(entry->valuesize ? entry->valuesize : 1);
+  if (*value) {
+    memcpy(*value, (char *) (entry + 1) + keysize, entry->valuesize);
+  } else {
+    rc = -1;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return rc;
+}
+
+void
+ValueCache::Insert(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  uint64_t hash = HashCacheKey(key, keysize);
+  CacheShard *shard = &shards[hash % nshards];
+  size_t cost = CACHE_ENTRY_COST(keysize, valuesize);
+  CacheEntry **link;
+
+  // don't let one value flush a shard
+  if (cost > shard->budget / 4) return;
+
+  CacheEntry *entry = (CacheEntry *) malloc(cost);
+  if (!entry) return;
+  entry->hash = hash;
+  entry->keysize = keysize;
+  entry->valuesize = valuesize;
+  entry->referenced = false;
+  memcpy(entry + 1, key, keysize);
+  memcpy((char *) (entry + 1) + keysize, value, valuesize);
+
+  pthread_mutex_lock(&shard->mutex);
+
+  CacheEntry *existing = Find(shard, hash, key, keysize, &link);
+  if (existing) Remove(shard, existing, link);
+  while (shard->count && shard->bytes + cost > shard->budget) Evict(shard);
+
+  // grow the table and the ring together
+  if (shard->count == shard->ringcapacity) {
+    size_t grown = shard->ringcapacity ? shard->ringcapacity * 2 : 64;
+    CacheEntry **ring = (CacheEntry **) realloc(
+        shard->ring
+      , grown * sizeof(CacheEntry *)
+    );
+    CacheEntry **buckets = (CacheEntry **) calloc(
+        grown
+      , sizeof(CacheEntry *)
+    );
+    if (ring) shard->ring = ring;
+    if (!ring || !buckets) {
+      free(buckets);
+      pthread_mutex_unlock(&shard->mutex);
+      free(entry);
+      return;
+    }
+    for (size_t i = 0; i < shard->count; i++) {
+      CacheEntry *e = shard->ring[i];
+      CacheEntry **bucket = &buckets[(e->hash >> 16) & (grown - 1)];
+      e->next = *bucket;
+      *bucket = e;
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = grown;
+    shard->ringcapacity = grown;
+  }
+
+  CacheEntry **bucket = &shard->buckets[(hash >> 16) & (shard->nbuckets - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+  entry->slot = shard->count;
+  shard->ring[shard->count++] = entry;
+  shard->bytes += cost;
+
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void
+ValueCache::Erase(const char *key, size_t keysize) {
+  uint64_t hash = HashCacheKey(key, keysize);
+  CacheShard *shard = &shards[hash % nshards];
+  CacheEntry **link;
+
+  pthread_mutex_lock(&shard->mutex);
+  CacheEntry *entry = Find(shard, hash, key, keysize, &link);
+  if (entry) Remove(shard, entry, link);
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void
+ValueCache::Remove(CacheShard *shard, CacheEntry *entry, CacheEntry **link) {
+  *link = entry->next;
+
+  // fill the hole in the ring with its last entry
+  CacheEntry *last = shard->ring[--shard->count];
+  shard->ring[entry->slot] = last;
+  last->slot = entry->slot;
+  if (shard->hand >= shard->count) shard->hand = 0;
+
+  shard->bytes -= CACHE_ENTRY_COST(entry->keysize, entry->valuesize);
+  free(entry);
+}
+
+void
+ValueCache::Evict(CacheShard *shard) {
+  CacheEntry **link;
+
+  // give referenced entries a second chance
+  CacheEntry *entry = shard->ring[shard->hand];
+  while (entry->referenced) {
+    entry->referenced = false;
+    shard->hand = (shard->hand + 1) % shard->count;
+    entry = shard->ring[shard->hand];
+  }
+
+  Find(shard, entry->hash, (char *) (entry + 1), entry->keysize, &link);
+  Remove(shard, entry, link);
+  shard->evictions++;
+}
+
+void
+ValueCache::Clear() {
+  for (size_t i = 0; i < nshards; i++) {
+    CacheShard *shard = &shards[i];
+    pthread_mutex_lock(&shard->mutex);
+    for (size_t j = 0; j < shard->count; j++) free(shard->ring[j]);
+    if (shard->buckets) {
+      memset(shard->buckets, 0, shard->nbuckets * sizeof(CacheEntry *));
+    }
+    shard->count = 0;
+    shard->hand = 0;
+    shard->bytes = 0;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+void
+ValueCache::Stats(ValueCacheStats *stats) {
+  memset(stats, 0, sizeof(ValueCacheStats));
+  for (size_t i = 0; i < nshards; i++) {
+    CacheShard *shard = &shards[i];
+    pthread_mutex_lock(&shard->mutex);
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    stats->entries += shard->count;
+    stats->bytes += shard->bytes;
+    stats->capacity += shard->budget;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+/**
+ * Bloom filter sidecar file header, followed by the
+ * filter words.
+ */
+
+typedef struct {
+  char magic[8];
+  uint64_t stamp;
+  uint64_t nbits;
+  uint64_t hashes;
+  uint64_t setbits;
+} BloomFilterHeader;
+
+/**
+ * Bloom filter sidecar magic.
+ */
+
+#define BLOOM_FILTER_MAGIC "SPCCBLM1"
+
+/**
+ * Suffix appended to the database path to name the
+ * filter sidecar.
+ */
+
+#define BLOOM_FILTER_SUFFIX ".filter"
+
+/**
+ * Bloom filter over the keys of a database.  Keys are
+ * only ever added; deletes leave their bits set.
+ */
+
+class BloomFilter {
+  public:
+
+    /**
+     * Create a filter sized for `keys` keys at
+     * `fp_rate`, or `NULL`.
+     */
+
+    static BloomFilter *
+    New(size_t keys, double fp_rate);
+
+    ~BloomFilter();
+
+    /**
+     * Add `key` of `keysize`.
+     */
+
+    void
+    Add(const char *key, size_t keysize);
+
+    /**
+     * Check whether `key` of `keysize` may have been
+     * added.  Counts the lookup, and a negative.
+     */
+
+    bool
+    Check(const char *key, size_t keysize);
+
+    /**
+     * Count a key which passed Check() but didn't exist.
+     */
+
+    void
+    FalsePositive();
+
+    /**
+     * Clear every bit.
+     */
+
+    void
+    Reset();
+
+    /**
+     * Load the sidecar of the database at `path` if it
+     * was saved with `stamp` and matches our geometry.
+     */
+
+    bool
+    Load(const char *path, uint64_t stamp);
+
+    /**
+     * Save the sidecar of the database at `path` with
+     * `stamp`.
+     */
+
+    bool
+    Save(const char *path, uint64_t stamp);
+
+    /**
+     * Put the counters in `stats`.
+     */
+
+    void
+    Stats(BloomFilterStats *stats);
+
+  private:
+
+    BloomFilter() {}
+
+    /**
+     * Filter words.
+     */
+
+    uint64_t *bits;
+
+    /**
+     * Number of bits, a multiple of 64.
+     */
+
+    size_t nbits;
+
+    /**
+     * Number of probes per key.
+     */
+
+    size_t hashes;
+
+    /**
+     * Number of bits set.
+     */
+
+    size_t setbits;
+
+    /**
+     * Lookup counters, bumped by concurrent readers.
+     */
+
+    std::atomic<size_t> lookups;
+    std::atomic<size_t> negatives;
+    std::atomic<size_t> false_positives;
+
+    /**
+     * Probe positions of `key` of `keysize`: the first in
+     * `h1`, then every `h2` on.
+     */
+
+    void
+    Hash(const char *key, size_t keysize, uint64_t *h1, uint64_t *h2);
+
+    /**
+     * Sidecar path of the database at `path`, to free.
+     */
+
+    static char *
+    Sidecar(const char *path, const char *suffix);
+};
+
+BloomFilter *
+BloomFilter::New(size_t keys, double fp_rate) {
+  if (fp_rate <= 0 || fp_rate >= 1) fp_rate = 0.01;
+
+  // m = -n ln(p) / ln(2)^2, k = m / n ln(2)
+  double bits = -(double) keys * log(fp_rate) / (M_LN2 * M_LN2);
+  size_t words = (size_t) (bits / 64) + 1;
+
+  BloomFilter *filter = new (std::nothrow) BloomFilter();
+  if (!filter) return NULL;
+  filter->bits = (uint64_t *) calloc(words, sizeof(uint64_t));
+  if (!filter->bits) {
+    delete filter;
+    return NULL;
+  }
+  filter->nbits = words * 64;
+  filter->hashes = (size_t) (filter->nbits * M_LN2 / keys + 0.5);
+  if (filter->hashes < 1) filter->hashes = 1;
+  if (filter->hashes > 16) filter->hashes = 16;
+  filter->setbits = 0;
+  filter->lookups = 0;
+  filter->negatives = 0;
+  filter->false_positives = 0;
+  return filter;
+}
+
+BloomFilter::~BloomFilter() {
+  free(bits);
+}
+
+void
+BloomFilter::Hash(
+    const char *key
+  , size_t keysize
+  , uint64_t *h1
+  , uint64_t *h2
+) {
+  // finalize FNV so both halves are well mixed
+  uint64_t hash = HashKey(key, keysize);
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  *h1 = hash;
+  *h2 = (hash >> 32 | hash << 32) | 1;
+}
+
+void
+BloomFilter::Add(const char *key, size_t keysize) {
+  uint64_t h1;
+  uint64_t h2;
+
+  Hash(key, keysize, &h1, &h2);
+  for (size_t i = 0; i < hashes; i++) {
+    uint64_t bit = (h1 + i * h2) % nbits;
+    uint64_t mask = 1ULL << (bit & 63);
+    if (!(bits[bit >> 6] & mask)) {
+      bits[bit >> 6] |= mask;
+      setbits++;
+    }
+  }
+}
+
+bool
+BloomFilter::Check(const char *key, size_t keysize) {
+  uint64_t h1;
+  uint64_t h2;
+
+  lookups.fetch_add(1, std::memory_order_relaxed);
+  Hash(key, keysize, &h1, &h2);
+  for (size_t i = 0; i < hashes; i++) {
+    uint64_t bit = (h1 + i * h2) % nbits;
+    if (!(bits[bit >> 6] & (1ULL << (bit & 63)))) {
+      negatives.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+BloomFilter::FalsePositive() {
+  false_positives.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+BloomFilter::Reset() {
+  memset(bits, 0, nbits / 8);
+  setbits = 0;
+}
+
+char *
+BloomFilter::Sidecar(const char *path, const char *suffix) {
+  size_t size = strlen(path);
+  size_t suffixsize = strlen(suffix);
+  char *sidecar = (char *) malloc(size + suffixsize + 1);
+  if (!sidecar) return NULL;
+  memcpy(sidecar, path, size);
+  memcpy(sidecar + size, suffix, suffixsize + 1);
+  return sidecar;
+}
+
+bool
+BloomFilter::Load(const char *path, uint64_t stamp) {
+  BloomFilterHeader header;
+  bool loaded = false;
+
+  char *sidecar = Sidecar(path, BLOOM_FILTER_SUFFIX);
+  if (!sidecar) return false;
+  FILE *file = fopen(sidecar, "rb");
+  free(sidecar);
+  if (!file) return false;
+
+  if (1 == fread(&header, sizeof(header), 1, file)
+   && 0 == memcmp(header.magic, BLOOM_FILTER_MAGIC, sizeof(header.magic))
+   && stamp == header.stamp
+   && nbits == header.nbits
+   && hashes == header.hashes
+   && nbits / 64 == fread(bits, sizeof(uint64_t), nbits / 64, file)) {
+    setbits = header.setbits;
+    loaded = true;
+  }
+  fclose(file);
+
+  if (!loaded) Reset();
+  return loaded;
+}
+
+bool
+BloomFilter::Save(const char *path, uint64_t stamp) {
+  BloomFilterHeader header;
+  bool saved;
+
+  memcpy(header.magic, BLOOM_FILTER_MAGIC, sizeof(header.magic));
+  header.stamp = stamp;
+  header.nbits = nbits;
+  header.hashes = hashes;
+  header.setbits = setbits;
+
+  char *sidecar = Sidecar(path, BLOOM_FILTER_SUFFIX);
+  char *tmp = Sidecar(path, BLOOM_FILTER_SUFFIX ".tmp");
+  FILE *file = sidecar && tmp ? fopen(tmp, "wb") : NULL;
+  if (!file) {
+    free(sidecar);
+    free(tmp);
+    return false;
+  }
+
+  // write aside and rename so a torn file is never loaded
+  saved = 1 == fwrite(&header, sizeof(header), 1, file)
+       && nbits / 64 == fwrite(bits, sizeof(uint64_t), nbits / 64, file);
+  saved = 0 == fclose(file) && saved;
+  saved = saved && 0 == rename(tmp, sidecar);
+  if (!saved) unlink(tmp);
+
+  free(sidecar);
+  free(tmp);
+  return saved;
+}
+
+void
+BloomFilter::Stats(BloomFilterStats *stats) {
+  size_t checked = lookups.load(std::memory_order_relaxed);
+  size_t negative = negatives.load(std::memory_order_relaxed);
+  size_t positive = false_positives.load(std::memory_order_relaxed);
+
+  stats->lookups = checked;
+  stats->negatives = negative;
+  stats->false_positives = positive;
+  stats->false_positive_rate = negative + positive
+    ? (double) positive / (negative + positive)
+    : 0;
+  stats->expected_false_positive_rate =
+    pow((double) setbits / nbits, (double) hashes);
+  stats->bits = nbits;
+  stats->hashes = hashes;
+  stats->bytes = nbits / 8;
+}
+
+/**
+ * Codec ids stored in the first byte of a framed value.
+ * Compressed values follow it with their decoded size as
+ * a varint.
+ */
+
+typedef enum {
+    VALUE_RAW = 0
+  , VALUE_LZ = 1
+  , VALUE_LZ_DICTIONARY = 2
+} ValueCodecId;
+
+/**
+ * Longest varint of a size.
+ */
+
+#define VARINT_MAX_SIZE 10
+
+/**
+ * Number of bits hashing built-in codec positions.
+ */
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/**
+ * Shortest match worth a sequence.
+ */
+
+#define LZ_MIN_MATCH 4
+
+/**
+ * Furthest a match may reach back, also bounding the
+ * dictionary size.
+ */
+
+#define LZ_MAX_OFFSET 65535
+
+/**
+ * Put `value` as a varint in `dst`, returning its size.
+ */
+
+static size_t
+PutVarint(char *dst, uint64_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    dst[n++] = (char) (value | 0x80);
+    value >>= 7;
+  }
+  dst[n++] = (char) value;
+  return n;
+}
+
+/**
+ * Read a varint of at most `size` bytes from `src` into
+ * `value`, returning its size or `0` if malformed.
+ */
+
+static size_t
+GetVarint(const char *src, size_t size, uint64_t *value) {
+  *value = 0;
+  for (size_t n = 0; n < size && n < VARINT_MAX_SIZE; n++) {
+    unsigned char byte = (unsigned char) src[n];
+    *value |= (uint64_t) (byte & 0x7f) << (7 * n);
+    if (!(byte & 0x80)) return n + 1;
+  }
+  return 0;
+}
+
+/**
+ * Split `framed` of `framedsize` into its codec `id`,
+ * header size and decoded size.  Returns `false` if
+ * malformed.
+ */
+
+static bool
+ParseFrame(
+    const char *framed
+  , size_t framedsize
+  , unsigned char *id
+  , size_t *header
+  , size_t *rawsize
+) {
+  uint64_t size;
+
+  if (0 == framedsize) return false;
+  *id = (unsigned char) framed[0];
+  if (VALUE_RAW == *id) {
+    *header = 1;
+    *rawsize = framedsize - 1;
+    return true;
+  }
+
+  size_t n = GetVarint(framed + 1, framedsize - 1, &size);
+  if (0 == n || size > SIZE_MAX / 2) return false;
+  *header = 1 + n;
+  *rawsize = (size_t) size;
+  return true;
+}
+
+/**
+ * Hash of the 4 bytes at `ptr`.
+ */
+
+static inline uint32_t
+LzHash(const unsigned char *ptr) {
+  uint32_t bytes;
+  memcpy(&bytes, ptr, sizeof(bytes));
+  return (bytes * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Largest built-in encoding of `size` bytes.
+ */
+
+static size_t
+LzBound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+/**
+ * Append a sequence of `literals` bytes of `literal`
+ * followed, unless `length` is `0`, by a match of
+ * `length` bytes `offset` back.  Returns `false` when it
+ * doesn't fit before `end`.
+ */
+
+static bool
+LzEmit(
+    unsigned char **out
+  , unsigned char *end
+  , const unsigned char *literal
+  , size_t literals
+  , size_t offset
+  , size_t length
+) {
+  unsigned char *ptr = *out;
+  size_t extra = length ? length - LZ_MIN_MATCH : 0;
+  size_t need = 1 + literals + literals / 255 + 1
+    + (length ? 2 + extra / 255 + 1 : 0);
+
+  if ((size_t) (end - ptr) < need) return false;
+
+  // token: literal count, then match length, 15 meaning
+  // more follows in 255-capped bytes
+  unsigned char *token = ptr++;
+  *token = (unsigned char) (
+      (literals < 15 ? literals : 15) << 4
+    | (extra < 15 ? extra : 15)
+  );
+  if (literals >= 15) {
+    size_t rest = literals - 15;
+    for (; rest >= 255; rest -= 255) *ptr++ = 255;
+    *ptr++ = (unsigned char) rest;
+  }
+  memcpy(ptr, literal, literals);
+  ptr += literals;
+
+  if (length) {
+    *ptr++ = (unsigned char) (offset & 0xff);
+    *ptr++ = (unsigned char) (offset >> 8);
+    if (extra >= 15) {
+      size_t rest = extra - 15;
+      for (; rest >= 255; rest -= 255) *ptr++ = 255;
+      *ptr++ = (unsigned char) rest;
+    }
+  }
+
+  *out = ptr;
+  return true;
+}
+
+/**
+ * Compress `src` of `size` into at most `capacity` bytes
+ * of `dst`, matching against `dictionary` of
+ * `dictionarysize` hashed into `dictionarytable` when
+ * given.  Returns the compressed size, or `0` when it
+ * doesn't fit.
+ */
+
+static size_t
+LzCompress(
+    const char *src
+  , size_t size
+  , char *dst
+  , size_t capacity
+  , const char *dictionary
+  , size_t dictionarysize
+  , const uint32_t *dictionarytable
+) {
+  uint32_t table[LZ_HASH_SIZE];
+  const unsigned char *in = (const unsigned char *) src;
+  const unsigned char *dict = (const unsigned char *) dictionary;
+  unsigned char *out = (unsigned char *) dst;
+  unsigned char *end = out + capacity;
+  size_t anchor = 0;
+  size_t i = 0;
+
+  if (dictionarytable) {
+    memcpy(table, dictionarytable, sizeof(table));
+  } else {
+    memset(table, 0, sizeof(table));
+  }
+
+  // positions count from the start of the dictionary,
+  // which sits right before the value; the table holds
+  // them plus one so zero is empty
+  while (i + LZ_MIN_MATCH <= size) {
+    size_t position = dictionarysize + i;
+    uint32_t hash = LzHash(in + i);
+    size_t candidate = table[hash];
+    size_t length = 0;
+
+    table[hash] = (uint32_t) (position + 1);
+    if (0 == candidate || position - (candidate - 1) > LZ_MAX_OFFSET) {
+      i++;
+      continue;
+    }
+    candidate--;
+
+    if (candidate >= dictionarysize) {
+      const unsigned char *match = in + (candidate - dictionarysize);
+      while (i + length < size && match[length] == in[i + length]) {
+        length++;
+      }
+    } else {
+      while (i + length < size) {
+        size_t at = candidate + length;
+        unsigned char byte = at < dictionarysize
+          ? dict[at]
+          : in[at - dictionarysize];
+        if (byte != in[i + length]) break;
+        length++;
+      }
+    }
+
+    if (length < LZ_MIN_MATCH) {
+      i++;
+      continue;
+    }
+    if (!LzEmit(
+        &out
+      , end
+      , in + anchor
+      , i - anchor
+      , position - candidate
+      , length
+    )) {
+      return 0;
+    }
+    i += length;
+    anchor = i;
+  }
+
+  if (!LzEmit(&out, end, in + anchor, size - anchor, 0, 0)) return 0;
+  return out - (unsigned char *) dst;
+}
+
+/**
+ * Add a 255-capped length continuation at `*in` to
+ * `*length`.  Returns `false` past `end`.
+ */
+
+static bool
+LzLength(const unsigned char **in, const unsigned char *end, size_t *length) {
+  unsigned char byte;
+  do {
+    if (*in == end) return false;
+    byte = *(*in)++;
+    *length += byte;
+  } while (255 == byte);
+  return true;
+}
+
+/**
+ * Decompress `src` of `size` into exactly `rawsize`
+ * bytes of `dst`, with the `dictionary` of
+ * `dictionarysize` it was compressed against.  Returns
+ * `false` if malformed.
+ */
+
+static bool
+LzDecompress(
+    const char *src
+  , size_t size
+  , char *dst
+  , size_t rawsize
+  , const char *dictionary
+  , size_t dictionarysize
+) {
+  const unsigned char *in = (const unsigned char *) src;
+  const unsigned char *end = in + size;
+  size_t n = 0;
+
+  while (in < end) {
+    unsigned char token = *in++;
+    size_t literals = token >> 4;
+    if (15 == literals && !LzLength(&in, end, &literals)) return false;
+    if (literals > (size_t) (end - in) || literals > rawsize - n) {
+      return false;
+    }
+    memcpy(dst + n, in, literals);
+    in += literals;
+    n += literals;
+
+    // only the last sequence has no match
+    if (in == end) break;
+    if (end - in < 2) return false;
+    size_t offset = in[0] | (size_t) in[1] << 8;
+    size_t length = token & 15;
+    in += 2;
+    if (15 == length && !LzLength(&in, end, &length)) return false;
+    length += LZ_MIN_MATCH;
+    if (0 == offset || offset > n + dictionarysize || length > rawsize - n) {
+      return false;
+    }
+
+    if (offset <= n && offset >= length) {
+      memcpy(dst + n, dst + n - offset, length);
+    } else {
+      // overlapping, or reaching into the dictionary
+      for (size_t j = n; j < n + length; j++) {
+        dst[j] = offset <= j
+          ? dst[j - offset]
+          : dictionary[dictionarysize - (offset - j)];
+      }
+    }
+    n += length;
+  }
+
+  return n == rawsize;
+}
+
+/**
+ * Frames values for storage: prepends the codec header
+ * and compresses them with the chosen codec.
+ */
+
+class ValueCompressor {
+  public:
+
+    /**
+     * Create a disabled compressor, or `NULL`.
+     */
+
+    static ValueCompressor *
+    New();
+
+    ~ValueCompressor();
+
+    /**
+     * Whether Pack() compresses.
+     */
+
+    bool enabled;
+
+    /**
+     * Smallest value Pack() compresses.
+     */
+
+    size_t min_size;
+
+    /**
+     * Codec Pack() uses, or `NULL` for the built-in one.
+     */
+
+    const CompressionCodec *codec;
+
+    /**
+     * Let Unpack() decode values of `codec`.
+     */
+
+    SophiaReturnCode
+    Register(const CompressionCodec *codec);
+
+    /**
+     * Use `dictionary` of `size`, taking it.  `NULL`
+     * drops the dictionary.
+     */
+
+    SophiaReturnCode
+    Dictionary(char *dictionary, size_t size);
+
+    /**
+     * Check whether the dictionary is set to `dictionary`
+     * of `size`, or to anything when `NULL`.
+     */
+
+    bool
+    HasDictionary(const char *dictionary, size_t size) const;
+
+    /**
+     * Frame `value` of `valuesize` into `*framed` of
+     * `*framedsize`, valid until the next call.  Counts
+     * the write, so calls must not race.
+     */
+
+    SophiaReturnCode
+    Pack(
+        const char *value
+      , size_t valuesize
+      , const char **framed
+      , size_t *framedsize
+    );
+
+    /**
+     * Decode `framed` of `framedsize` into `value` of
+     * `rawsize`, as found by ParseFrame().  Returns
+     * `false` on malformed values and unknown codecs.
+     */
+
+    bool
+    Unpack(
+        const char *framed
+      , size_t framedsize
+      , char *value
+      , size_t rawsize
+    ) const;
+
+    /**
+     * Point `*value` of `*valuesize` at the decoded
+     * `framed` of `framedsize`: into `framed` when it is
+     * stored raw, otherwise into `*buffer` of `*capacity`,
+     * grown as needed.
+     */
+
+    bool
+    Decode(
+        const char *framed
+      , size_t framedsize
+      , char **buffer
+      , size_t *capacity
+      , const char **value
+      , size_t *valuesize
+    ) const;
+
+    /**
+     * Put the counters in `stats`.
+     */
+
+    void
+    Stats(ValueCompressionStats *stats) const;
+
+  private:
+
+    ValueCompressor() {}
+
+    /**
+     * Codecs by id, user codecs only.
+     */
+
+    const CompressionCodec *codecs[256];
+
+    /**
+     * Dictionary, or `NULL`.
+     */
+
+    char *dictionary;
+
+    /**
+     * Dictionary size.
+     */
+
+    size_t dictionarysize;
+
+    /**
+     * Built-in codec hash table over the dictionary.
+     */
+
+    uint32_t *dictionarytable;
+
+    /**
+     * Pack() output.
+     */
+
+    char *buffer;
+
+    /**
+     * Allocated `buffer` bytes.
+     */
+
+    size_t buffercapacity;
+
+    /**
+     * Write counters.
+     */
+
+    size_t values;
+    size_t compressed;
+    size_t raw_bytes;
+    size_t stored_bytes;
+};
+
+ValueCompressor *
+ValueCompressor::New() {
+  ValueCompressor *compressor = new (std::nothrow) ValueCompressor();
+  if (!compressor) return NULL;
+  compressor->enabled = false;
+  compressor->min_size = 0;
+  compressor->codec = NULL;
+  memset(compressor->codecs, 0, sizeof(compressor->codecs));
+  compressor->dictionary = NULL;
+  compressor->dictionarysize = 0;
+  compressor->dictionarytable = NULL;
+  compressor->buffer = NULL;
+  compressor->buffercapacity = 0;
+  compressor->values = 0;
+  compressor->compressed = 0;
+  compressor->raw_bytes = 0;
+  compressor->stored_bytes = 0;
+  return compressor;
+}
+
+ValueCompressor::~ValueCompressor() {
+  free(dictionary);
+  free(dictionarytable);
+  free(buffer);
+}
+
+SophiaReturnCode
+ValueCompressor::Register(const CompressionCodec *codec) {
+  if (codec->id <= VALUE_LZ_DICTIONARY) return SOPHIA_COMPRESSION_ERROR;
+  if (!codec->bound || !codec->compress || !codec->decompress) {
+    return SOPHIA_COMPRESSION_ERROR;
+  }
+  codecs[codec->id] = codec;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+ValueCompressor::Dictionary(char *dictionary, size_t size) {
+  uint32_t *table = NULL;
+
+  if (dictionary) {
+    if (!(table = (uint32_t *) calloc(LZ_HASH_SIZE, sizeof(uint32_t)))) {
+      free(dictionary);
+      return SOPHIA_ALLOC_ERROR;
+    }
+    // later positions win, being closer to the value
+    const unsigned char *ptr = (const unsigned char *) dictionary;
+    for (size_t i = 0; i + LZ_MIN_MATCH <= size; i++) {
+      table[LzHash(ptr + i)] = (uint32_t) (i + 1);
+    }
+  }
+
+  free(this->dictionary);
+  free(dictionarytable);
+  this->dictionary = dictionary;
+  dictionarysize = dictionary ? size : 0;
+  dictionarytable = table;
+  return SOPHIA_SUCCESS;
+}
+
+bool
+ValueCompressor::HasDictionary(const char *dictionary, size_t size) const {
+  if (!this->dictionary) return false;
+  if (!dictionary) return true;
+  return size == dictionarysize
+      && 0 == memcmp(dictionary, this->dictionary, size);
+}
+
+SophiaReturnCode
+ValueCompressor::Pack(
+    const char *value
+  , size_t valuesize
+  , const char **framed
+  , size_t *framedsize
+) {
+  bool compress = enabled && valuesize >= min_size && valuesize > 0;
+  size_t bound = valuesize;
+
+  if (compress) {
+    bound = codec ? codec->bound(valuesize, codec->data) : LzBound(valuesize);
+    if (bound < valuesize) bound = valuesize;
+  }
+
+  size_t need = 1 + VARINT_MAX_SIZE + bound;
+  if (need > buffercapacity) {
+    char *grown = (char *) realloc(buffer, need);
+    if (!grown) return SOPHIA_ALLOC_ERROR;
+    buffer = grown;
+    buffercapacity = need;
+  }
+
+  *framedsize = 0;
+  if (compress) {
+    size_t header = 1 + PutVarint(buffer + 1, valuesize);
+    size_t size;
+
+    if (codec) {
+      buffer[0] = (char) codec->id;
+      size = codec->compress(
+          value
+        , valuesize
+        , buffer + header
+        , buffercapacity - header
+        , dictionary
+        , dictionarysize
+        , codec->data
+      );
+    } else {
+      // give up as soon as it stops paying
+      size_t limit = valuesize + 1 > header ? valuesize + 1 - header : 0;
+      buffer[0] = dictionary ? VALUE_LZ_DICTIONARY : VALUE_LZ;
+      size = limit ? LzCompress(
+          value
+        , valuesize
+        , buffer + header
+        , limit
+        , dictionary
+        , dictionarysize
+        , dictionarytable
+      ) : 0;
+    }
+
+    if (size && header + size < valuesize + 1) {
+      *framedsize = header + size;
+      compressed++;
+    }
+  }
+
+  if (0 == *framedsize) {
+    buffer[0] = VALUE_RAW;
+    memcpy(buffer + 1, value, valuesize);
+    *framedsize = 1 + valuesize;
+  }
+
+  *framed = buffer;
+  values++;
+  raw_bytes += valuesize;
+  stored_bytes += *framedsize;
+  return SOPHIA_SUCCESS;
+}
+
+bool
+ValueCompressor::Unpack(
+    const char *framed
+  , size_t framedsize
+  , char *value
+  , size_t rawsize
+) const {
+  unsigned char id;
+  size_t header;
+  size_t size;
+
+  if (!ParseFrame(framed, framedsize, &id, &header, &size)) return false;
+  if (size != rawsize) return false;
+  const char *payload = framed + header;
+  size_t payloadsize = framedsize - header;
+
+  switch (id) {
+    case VALUE_RAW:
+      memcpy(value, payload, rawsize);
+      return true;
+    case VALUE_LZ:
+      return LzDecompress(payload, payloadsize, value, rawsize, NULL, 0);
+    case VALUE_LZ_DICTIONARY:
+      if (!dictionary) return false;
+      return LzDecompress(
+          payload
+        , payloadsize
+        , value
+        , rawsize
+        , dictionary
+        , dictionarysize
+      );
+  }
+
+  const CompressionCodec *with = codecs[id];
+  if (!with) return false;
+  return with->decompress(
+      payload
+    , payloadsize
+    , value
+    , rawsize
+    , dictionary
+    , dictionarysize
+    , with->data
+  );
+}
+
+bool
+ValueCompressor::Decode(
+    const char *framed
+  , size_t framedsize
+  , char **buffer
+  , size_t *capacity
+  , const char **value
+  , size_t *valuesize
+) const {
+  unsigned char id;
+  size_t header;
+  size_t rawsize;
+
+  if (!ParseFrame(framed, framedsize, &id, &header, &rawsize)) return false;
+  if (VALUE_RAW == id) {
+    *value = framed + header;
+    *valuesize = rawsize;
+    return true;
+  }
+
+  if (rawsize > *capacity || !*buffer) {
+    size_t grown = rawsize ? rawsize : 1;
+    char *ptr = (char *) realloc(*buffer, grown);
+    if (!ptr) return false;
+    *buffer = ptr;
+    *capacity = grown;
+  }
+  if (!Unpack(framed, framedsize, *buffer, rawsize)) return false;
+  *value = *buffer;
+  *valuesize = rawsize;
+  return true;
+}
+
+void
+ValueCompressor::Stats(ValueCompressionStats *stats) const {
+  stats->values = values;
+  stats->compressed = compressed;
+  stats->raw_bytes = raw_bytes;
+  stats->stored_bytes = stored_bytes;
+  stats->ratio = stored_bytes ? (double) raw_bytes / stored_bytes : 0;
+  stats->dictionary_bytes = dictionarysize;
+}
+
+/**
+ * Operation stats.
+ */
+
+static const char *OPERATION_NAMES[SOPHIA_OPERATIONS] = {
+    "get"
+  , "multiget"
+  , "set"
+  , "delete"
+  , "write"
+  , "count"
+  , "iterator_next"
+};
+
+const char *
+OperationName(SophiaOperation op) {
+  if ((size_t) op >= SOPHIA_OPERATIONS) return NULL;
+  return OPERATION_NAMES[op];
+}
+
+size_t
+ErrorSlot(SophiaReturnCode rc) {
+  if (SOPHIA_ENV_ERROR == rc) return 30;
+  if (SOPHIA_DB_ERROR == rc) return 31;
+  if (rc < 0 && rc > -30) return (size_t) -rc;
+  return 0;
+}
+
+uint64_t
+LatencyBucketFloor(size_t i) {
+  if (i < 8) return i;
+  return (uint64_t) (8 + i % 8) << (i / 8 - 1);
+}
+
+/**
+ * Growable `snprintf` target of the stats dumpers.
+ */
+
+typedef struct {
+  char *buffer;
+  size_t size;
+  size_t length;
+} StatsText;
+
+/**
+ * Append `format` to `text`, counting what doesn't fit.
+ */
+
+static void
+StatsAppend(StatsText *text, const char *format, ...) {
+  va_list args;
+  bool fits = text->length < text->size;
+
+  va_start(args, format);
+  int n = vsnprintf(
+      fits ? text->buffer + text->length : NULL
+    , fits ? text->size - text->length : 0
+    , format
+    , args
+  );
+  va_end(args);
+  if (n > 0) text->length += n;
+}
+
+/**
+ * Return code counted in OperationStats::error_codes slot
+ * `i`, as text.
+ */
+
+static void
+ErrorSlotCode(size_t i, char *code) {
+  if (0 == i) {
+    strcpy(code, "other");
+  } else if (30 == i) {
+    sprintf(code, "%d", SOPHIA_ENV_ERROR);
+  } else if (31 == i) {
+    sprintf(code, "%d", SOPHIA_DB_ERROR);
+  } else {
+    sprintf(code, "-%zu", i);
+  }
+}
+
+/**
+ * Prometheus histogram bounds, in seconds.
+ */
+
+static const double PROMETHEUS_BOUNDS[] = {
+    1e-6, 2.5e-6, 5e-6
+  , 1e-5, 2.5e-5, 5e-5
+  , 1e-4, 2.5e-4, 5e-4
+  , 1e-3, 2.5e-3, 5e-3
+  , 1e-2, 2.5e-2, 5e-2
+  , 1e-1, 2.5e-1, 5e-1
+  , 1
+};
+
+size_t
+StatsPrometheus(
+    const SophiaStats *stats
+  , char *buffer
+  , size_t size
+  , const char *prefix
+) {
+  StatsText text = { buffer, size, 0 };
+  char code[16];
+
+  if (size) buffer[0] = '\0';
+
+  StatsAppend(&text, "# HELP %s_operations_total Calls by operation.\n"
+    "# TYPE %s_operations_total counter\n", prefix, prefix);
+  for (size_t op = 0; op < SOPHIA_OPERATIONS; op++) {
+    StatsAppend(&text, "%s_operations_total{op=\"%s\"} %llu\n"
+      , prefix
+      , OPERATION_NAMES[op]
+      , (unsigned long long) stats->operations[op].count
+    );
+  }
+
+  StatsAppend(&text, "# HELP %s_operation_bytes_total Key and value "
+    "bytes by operation.\n"
+    "# TYPE %s_operation_bytes_total counter\n", prefix, prefix);
+  for (size_t op = 0; op < SOPHIA_OPERATIONS; op++) {
+    StatsAppend(&text, "%s_operation_bytes_total{op=\"%s\"} %llu\n"
+      , prefix
+      , OPERATION_NAMES[op]
+      , (unsigned long long) stats->operations[op].bytes
+    );
+  }
+
+  StatsAppend(&text, "# HELP %s_operation_errors_total Failed calls by "
+    "operation and return code.\n"
+    "# TYPE %s_operation_errors_total counter\n", prefix, prefix);
+  for (size_t op = 0; op < SOPHIA_OPERATIONS; op++) {
+    for (size_t i = 0; i < SOPHIA_ERROR_SLOTS; i++) {
+      uint64_t errors = stats->operations[op].error_codes[i];
+      if (0 == errors) continue;
+      ErrorSlotCode(i, code);
+      StatsAppend(&text, "%s_operation_errors_total{op=\"%s\",code=\"%s\"}"
+        " %llu\n"
+        , prefix
+        , OPERATION_NAMES[op]
+        , code
+        , (unsigned long long) errors
+      );
+    }
+  }
+
+  StatsAppend(&text, "# HELP %s_operation_duration_seconds Call "
+    "latency by operation.\n"
+    "# TYPE %s_operation_duration_seconds histogram\n", prefix, prefix);
+  for (size_t op = 0; op < SOPHIA_OPERATIONS; op++) {
+    const OperationStats *operation = &stats->operations[op];
+    const size_t bounds = sizeof(PROMETHEUS_BOUNDS) / sizeof(double);
+    uint64_t below = 0;
+    size_t i = 0;
+
+    // a bucket counts towards a bound once all of it is
+    // below the bound
+    for (size_t b = 0; b < bounds; b++) {
+      double limit = PROMETHEUS_BOUNDS[b] * 1e9;
+      while (i + 1 < SOPHIA_LATENCY_BUCKETS
+          && LatencyBucketFloor(i + 1) <= limit) {
+        below += operation->buckets[i++];
+      }
+      StatsAppend(&text, "%s_operation_duration_seconds_bucket"
+        "{op=\"%s\",le=\"%g\"} %llu\n"
+        , prefix
+        , OPERATION_NAMES[op]
+        , PROMETHEUS_BOUNDS[b]
+        , (unsigned long long) below
+      );
+    }
+    StatsAppend(&text, "%s_operation_duration_seconds_bucket"
+      "{op=\"%s\",le=\"+Inf\"} %llu\n"
+      , prefix
+      , OPERATION_NAMES[op]
+      , (unsigned long long) operation->count
+    );
+    StatsAppend(&text, "%s_operation_duration_seconds_sum{op=\"%s\"} %.9f\n"
+      , prefix
+      , OPERATION_NAMES[op]
+      , operation->sum / 1e9
+    );
+    StatsAppend(&text, "%s_operation_duration_seconds_count{op=\"%s\"}"
+      " %llu\n"
+      , prefix
+      , OPERATION_NAMES[op]
+      , (unsigned long long) operation->count
+    );
+  }
+
+  return text.length;
+}
+
+size_t
+StatsJSON(const SophiaStats *stats, char *buffer, size_t size) {
+  StatsText text = { buffer, size, 0 };
+  char code[16];
+
+  if (size) buffer[0] = '\0';
+
+  StatsAppend(&text, "{\"enabled\":%s,\"operations\":{"
+    , stats->enabled ? "true" : "false");
+  for (size_t op = 0; op < SOPHIA_OPERATIONS; op++) {
+    const OperationStats *operation = &stats->operations[op];
+    bool first = true;
+
+    StatsAppend(&text, "%s\"%s\":{\"count\":%llu,\"bytes\":%llu"
+      ",\"errors\":%llu,\"error_codes\":{"
+      , op ? "," : ""
+      , OPERATION_NAMES[op]
+      , (unsigned long long) operation->count
+      , (unsigned long long) operation->bytes
+      , (unsigned long long) operation->errors
+    );
+    for (size_t i = 0; i < SOPHIA_ERROR_SLOTS; i++) {
+      if (0 == operation->error_codes[i]) continue;
+      ErrorSlotCode(i, code);
+      StatsAppend(&text, "%s\"%s\":%llu"
+        , first ? "" : ","
+        , code
+        , (unsigned long long) operation->error_codes[i]
+      );
+      first = false;
+    }
+    StatsAppend(&text, "},\"latency_ns\":{\"min\":%llu,\"mean\":%llu"
+      ",\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu"
+      ",\"max\":%llu}}"
+      , (unsigned long long) operation->min
+      , (unsigned long long) (operation->count
+          ? operation->sum / operation->count
+          : 0)
+      , (unsigned long long) operation->p50
+      , (unsigned long long) operation->p90
+      , (unsigned long long) operation->p99
+      , (unsigned long long) operation->p999
+      , (unsigned long long) operation->max
+    );
+  }
+  StatsAppend(&text, "}}");
+
+  return text.length;
+}
+
+size_t
+SlowOperationText(const SlowOperation *operation, char *buffer, size_t size) {
+  StatsText text = { buffer, size, 0 };
+  size_t prefix = operation->keysize < SOPHIA_TRACE_KEY_PREFIX
+    ? operation->keysize
+    : SOPHIA_TRACE_KEY_PREFIX;
+
+  if (size) buffer[0] = '\0';
+
+  StatsAppend(&text, "seq=%llu time=%llu.%09llu op=%s duration_ns=%llu"
+    " rc=%d keysize=%zu valuesize=%zu cursors=%zu key=\""
+    , (unsigned long long) operation->sequence
+    , (unsigned long long) (operation->time / 1000000000)
+    , (unsigned long long) (operation->time % 1000000000)
+    , OperationName(operation->op)
+    , (unsigned long long) operation->duration
+    , (int) operation->rc
+    , operation->keysize
+    , operation->valuesize
+    , operation->cursors
+  );
+  // keys are binary, so escape all but printable ascii
+  for (size_t i = 0; i < prefix; i++) {
+    unsigned char c = (unsigned char) operation->key[i];
+    if (c < 0x20 || c >= 0x7f || '"' == c || '\\' == c) {
+      StatsAppend(&text, "\\x%02x", c);
+    } else {
+      StatsAppend(&text, "%c", c);
+    }
+  }
+  StatsAppend(&text, prefix < operation->keysize ? "...\"" : "\"");
+
+  return text.length;
+}
+
+#ifdef SOPHIA_STATS
+
+/**
+ * Number of bits picking a counter stripe.
+ */
+
+#define STATS_STRIPE_BITS 4
+#define STATS_STRIPES (1 << STATS_STRIPE_BITS)
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+
+static inline uint64_t
+Nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Histogram bucket of a latency of `ns` nanoseconds:
+ * exact below 8, then 8 per power of two.
+ */
+
+static inline size_t
+LatencyBucket(uint64_t ns) {
+  if (ns < 8) return (size_t) ns;
+  size_t msb = 63 - __builtin_clzll(ns);
+  size_t bucket = (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+  return bucket < SOPHIA_LATENCY_BUCKETS
+    ? bucket
+    : SOPHIA_LATENCY_BUCKETS - 1;
+}
+
+/**
+ * Upper bound of the bucket holding the `q` quantile of
+ * `stats`, capped at its max.
+ */
+
+static uint64_t
+LatencyQuantile(const OperationStats *stats, double q) {
+  uint64_t rank = (uint64_t) ceil(q * stats->count);
+  uint64_t seen = 0;
+
+  if (0 == rank) rank = 1;
+  for (size_t i = 0; i + 1 < SOPHIA_LATENCY_BUCKETS; i++) {
+    seen += stats->buckets[i];
+    if (seen >= rank) {
+      uint64_t bound = LatencyBucketFloor(i + 1) - 1;
+      return bound < stats->max ? bound : stats->max;
+    }
+  }
+  return stats->max;
+}
+
+/**
+ * Live counters of one operation.
+ */
+
+typedef struct {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> errors;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> min;
+  std::atomic<uint64_t> max;
+  std::atomic<uint64_t> error_codes[SOPHIA_ERROR_SLOTS];
+  std::atomic<uint64_t> buckets[SOPHIA_LATENCY_BUCKETS];
+} OperationCounters;
+
+/**
+ * Counters updated by the threads hashing to a stripe,
+ * cache line aligned so stripes never share a line.
+ */
+
+struct alignas(64) StatsStripe {
+  OperationCounters operations[SOPHIA_OPERATIONS];
+};
+
+/**
+ * Operation counters of a Sophia instance.
+ */
+
+class Instrumentation {
+  public:
+
+    /**
+     * Create zeroed counters, or `NULL`.
+     */
+
+    static Instrumentation *
+    New();
+
+    ~Instrumentation();
+
+    /**
+     * Count `op` of `bytes` which took `ns` and returned
+     * `rc`.
+     */
+
+    void
+    Record(SophiaOperation op, uint64_t ns, size_t bytes, SophiaReturnCode rc);
+
+    /**
+     * Sum the stripes into `stats`.
+     */
+
+    void
+    Stats(SophiaStats *stats) const;
+
+  private:
+
+    Instrumentation() {}
+
+    /**
+     * Counter stripes.
+     */
+
+    StatsStripe *stripes;
+
+    /**
+     * Stripe of the calling thread.
+     */
+
+    static size_t
+    Stripe();
+};
+
+Instrumentation *
+Instrumentation::New() {
+  Instrumentation *instruments = new (std::nothrow) Instrumentation();
+  if (!instruments) return NULL;
+  instruments->stripes = new (std::nothrow) StatsStripe[STATS_STRIPES];
+  if (!instruments->stripes) {
+    delete instruments;
+    return NULL;
+  }
+
+  for (size_t s = 0; s < STATS_STRIPES; s++) {
+    for (size_t op = 0; op < SOPHIA_OPERATIONS; op++) {
+      OperationCounters *counters = &instruments->stripes[s].operations[op];
+      counters->count = 0;
+      counters->bytes = 0;
+      counters->errors = 0;
+      counters->sum = 0;
+      counters->min = UINT64_MAX;
+      counters->max = 0;
+      for (size_t i = 0; i < SOPHIA_ERROR_SLOTS; i++) {
+        counters->error_codes[i] = 0;
+      }
+      for (size_t i = 0; i < SOPHIA_LATENCY_BUCKETS; i++) {
+        counters->buckets[i] = 0;
+      }
+    }
+  }
+  return instruments;
+}
+
+Instrumentation::~Instrumentation() {
+  delete[] stripes;
+}
+
+size_t
+Instrumentation::Stripe() {
+  // thread ids are stack addresses, so mix their bits
+  uint64_t id = (uint64_t) (uintptr_t) pthread_self();
+  return (size_t) (id * 0x9e3779b97f4a7c15ULL >> (64 - STATS_STRIPE_BITS));
+}
+
+void
+Instrumentation::Record(
+    SophiaOperation op
+  , uint64_t ns
+  , size_t bytes
+  , SophiaReturnCode rc
+) {
+  OperationCounters *counters = &stripes[Stripe()].operations[op];
+  const std::memory_order relaxed = std::memory_order_relaxed;
+
+  counters->count.fetch_add(1, relaxed);
+  counters->bytes.fetch_add(bytes, relaxed);
+  counters->sum.fetch_add(ns, relaxed);
+  counters->buckets[LatencyBucket(ns)].fetch_add(1, relaxed);
+  if (SOPHIA_SUCCESS != rc) {
+    counters->errors.fetch_add(1, relaxed);
+    counters->error_codes[ErrorSlot(rc)].fetch_add(1, relaxed);
+  }
+
+  uint64_t seen = counters->max.load(relaxed);
+  while (ns > seen && !counters->max.compare_exchange_weak(seen, ns, relaxed)) {
+  }
+  seen = counters->min.load(relaxed);
+  while (ns < seen && !counters->min.compare_exchange_weak(seen, ns, relaxed)) {
+  }
+}
+
+void
+Instrumentation::Stats(SophiaStats *stats) const {
+  const std::memory_order relaxed = std::memory_order_relaxed;
+
+  memset(stats, 0, sizeof(SophiaStats));
+  stats->enabled = true;
+  for (size_t op = 0; op < SOPHIA_OPERATIONS; op++) {
+    OperationStats *operation = &stats->operations[op];
+    uint64_t min = UINT64_MAX;
+
+    for (size_t s = 0; s < STATS_STRIPES; s++) {
+      const OperationCounters *counters = &stripes[s].operations[op];
+      operation->count += counters->count.load(relaxed);
+      operation->bytes += counters->bytes.load(relaxed);
+      operation->errors += counters->errors.load(relaxed);
+      operation->sum += counters->sum.load(relaxed);
+      min = std::min(min, counters->min.load(relaxed));
+      operation->max = std::max(operation->max, counters->max.load(relaxed));
+      for (size_t i = 0; i < SOPHIA_ERROR_SLOTS; i++) {
+        operation->error_codes[i] += counters->error_codes[i].load(relaxed);
+      }
+      for (size_t i = 0; i < SOPHIA_LATENCY_BUCKETS; i++) {
+        operation->buckets[i] += counters->buckets[i].load(relaxed);
+      }
+    }
+
+    if (0 == operation->count) continue;
+    operation->min = min;
+    operation->p50 = LatencyQuantile(operation, 0.5);
+    operation->p90 = LatencyQuantile(operation, 0.9);
+    operation->p99 = LatencyQuantile(operation, 0.99);
+    operation->p999 = LatencyQuantile(operation, 0.999);
+  }
+}
+
+/**
+ * Ring buffer slot.  `sequence` is odd while a writer
+ * fills the slot and `2 * (n + 1)` once it holds the
+ * `n`th slow operation, so readers can tell a torn or
+ * overwritten copy.
+ */
+
+typedef struct {
+  std::atomic<uint64_t> sequence;
+  SlowOperation operation;
+} SlowOperationSlot;
+
+/**
+ * Slow operations of a Sophia instance.
+ */
+
+class SlowOperationTracer {
+  public:
+
+    /**
+     * Create an empty ring of `capacity` rounded up to a
+     * power of two, or `NULL`.
+     */
+
+    static SlowOperationTracer *
+    New(uint64_t threshold, size_t capacity, CursorRegistry *cursors);
+
+    ~SlowOperationTracer();
+
+    /**
+     * Slowest operation not to record, plus one.
+     */
+
+    uint64_t
+    Threshold() const {
+      return threshold;
+    }
+
+    /**
+     * Record `op` of `key` which took `ns` and returned
+     * `rc`.  Dropped if a writer still holds its slot.
+     */
+
+    void
+    Record(
+        SophiaOperation op
+      , uint64_t ns
+      , SophiaReturnCode rc
+      , const char *key
+      , size_t keysize
+      , size_t valuesize
+    );
+
+    /**
+     * Copy the latest `max` operations to `operations`.
+     */
+
+    size_t
+    Dump(SlowOperation *operations, size_t max) const;
+
+    /**
+     * Start or restart appending to the file at `path`.
+     */
+
+    SophiaReturnCode
+    StartLog(const char *path, unsigned int interval_ms);
+
+    /**
+     * Stop appending, flushing what is left.
+     */
+
+    void
+    StopLog();
+
+  private:
+
+    SlowOperationTracer() {}
+
+    uint64_t threshold;
+
+    /**
+     * Ring size minus one.
+     */
+
+    uint64_t mask;
+
+    SlowOperationSlot *slots;
+
+    /**
+     * Number of operations ever recorded.
+     */
+
+    std::atomic<uint64_t> head;
+
+    /**
+     * Registry counted for SlowOperation::cursors.
+     */
+
+    CursorRegistry *cursors;
+
+    /**
+     * Log file, or `NULL` when not logging.
+     */
+
+    FILE *log;
+
+    /**
+     * First operation not yet logged.
+     */
+
+    uint64_t logged;
+
+    unsigned int interval_ms;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    bool stopping;
+
+    /**
+     * Copy operation `n` to `operation`.  Returns 1 if
+     * copied, 0 if it was dropped or overwritten and -1
+     * if it is still being written.
+     */
+
+    int
+    Read(uint64_t n, SlowOperation *operation) const;
+
+    /**
+     * Append the operations not yet logged.
+     */
+
+    void
+    Flush();
+
+    /**
+     * Logging thread.
+     */
+
+    static void *
+    Main(void *data);
+};
+
+SlowOperationTracer *
+SlowOperationTracer::New(
+    uint64_t threshold
+  , size_t capacity
+  , CursorRegistry *cursors
+) {
+  size_t size = 1;
+  while (size < capacity) size <<= 1;
+
+  SlowOperationTracer *tracer = new (std::nothrow) SlowOperationTracer();
+  if (!tracer) return NULL;
+  tracer->slots = new (std::nothrow) SlowOperationSlot[size];
+  if (!tracer->slots) {
+    delete tracer;
+    return NULL;
+  }
+
+  for (size_t i = 0; i < size; i++) tracer->slots[i].sequence = 0;
+  tracer->threshold = threshold;
+  tracer->mask = size - 1;
+  tracer->head = 0;
+  tracer->cursors = cursors;
+  tracer->log = NULL;
+  tracer->logged = 0;
+  tracer->interval_ms = 0;
+  tracer->stopping = false;
+  pthread_mutex_init(&tracer->mutex, NULL);
+  pthread_cond_init(&tracer->wake, NULL);
+  return tracer;
+}
+
+SlowOperationTracer::~SlowOperationTracer() {
+  StopLog();
+  pthread_cond_destroy(&wake);
+  pthread_mutex_destroy(&mutex);
+  delete[] slots;
+}
+
+void
+SlowOperationTracer::Record(
+    SophiaOperation op
+  , uint64_t ns
+  , SophiaReturnCode rc
+  , const char *key
+  , size_t keysize
+  , size_t valuesize
+) {
+  uint64_t n = head.fetch_add(1, std::memory_order_relaxed);
+  SlowOperationSlot *slot = &slots[n & mask];
+  uint64_t seen = slot->sequence.load(std::memory_order_relaxed);
+  struct timespec ts;
+
+  // a slow writer lapped by the ring gives up its entry
+  // rather than wait or clobber a newer one
+  if ((seen & 1) || seen > 2 * n) return;
+  if (!slot->sequence.compare_exchange_strong(
+      seen
+    , 2 * n + 1
+    , std::memory_order_relaxed)) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  SlowOperation *operation = &slot->operation;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  operation->sequence = n;
+  operation->op = op;
+  operation->rc = rc;
+  operation->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  operation->duration = ns;
+  operation->keysize = keysize;
+  operation->valuesize = valuesize;
+  operation->cursors = cursors->Count();
+  if (key) {
+    memcpy(
+        operation->key
+      , key
+      , keysize < SOPHIA_TRACE_KEY_PREFIX ? keysize : SOPHIA_TRACE_KEY_PREFIX
+    );
+  }
+
+  slot->sequence.store(2 * n + 2, std::memory_order_release);
+}
+
+int
+SlowOperationTracer::Read(uint64_t n, SlowOperation *operation) const {
+  const SlowOperationSlot *slot = &slots[n & mask];
+  uint64_t seen = slot->sequence.load(std::memory_order_acquire);
+
+  if (2 * n + 1 == seen) return -1;
+  if (2 * n + 2 != seen) return 0;
+  memcpy(operation, &slot->operation, sizeof(SlowOperation));
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return seen == slot->sequence.load(std::memory_order_relaxed) ? 1 : 0;
+}
+
+size_t
+SlowOperationTracer::Dump(SlowOperation *operations, size_t max) const {
+  uint64_t end = head.load(std::memory_order_acquire);
+  uint64_t size = mask + 1 < max ? mask + 1 : max;
+  size_t copied = 0;
+
+  for (uint64_t n = end > size ? end - size : 0; n < end; n++) {
+    if (1 == Read(n, &operations[copied])) copied++;
+  }
+  return copied;
+}
+
+void
+SlowOperationTracer::Flush() {
+  uint64_t end = head.load(std::memory_order_acquire);
+  SlowOperation operation;
+  uint64_t dropped = 0;
+  char line[256];
+
+  if (end - logged > mask + 1) {
+    dropped = end - logged - (mask + 1);
+    logged = end - (mask + 1);
+  }
+  for (; logged < end; logged++) {
+    int rc = Read(logged, &operation);
+    if (-1 == rc) break;
+    if (0 == rc) {
+      dropped++;
+      continue;
+    }
+    if (dropped) fprintf(log, "dropped=%llu\n", (unsigned long long) dropped);
+    dropped = 0;
+    SlowOperationText(&operation, line, sizeof(line));
+    fprintf(log, "%s\n", line);
+  }
+  if (dropped) fprintf(log, "dropped=%llu\n", (unsigned long long) dropped);
+  fflush(log);
+}
+
+void *
+SlowOperationTracer::Main(void *data) {
+  SlowOperationTracer *tracer = (SlowOperationTracer *) data;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&tracer->mutex);
+  while (!tracer->stopping) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += tracer->interval_ms / 1000;
+    deadline.tv_nsec += (long) (tracer->interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&tracer->wake, &tracer->mutex, &deadline);
+    tracer->Flush();
+  }
+  pthread_mutex_unlock(&tracer->mutex);
+  return NULL;
+}
+
+SophiaReturnCode
+SlowOperationTracer::StartLog(const char *path, unsigned int interval_ms) {
+  StopLog();
+
+  if (!(log = fopen(path, "a"))) return SOPHIA_FILE_ERROR;
+  this->interval_ms = interval_ms ? interval_ms : 1;
+  logged = head.load(std::memory_order_acquire);
+  stopping = false;
+  if (0 != pthread_create(&thread, NULL, Main, this)) {
+    fclose(log);
+    log = NULL;
+    return SOPHIA_THREAD_ERROR;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+void
+SlowOperationTracer::StopLog() {
+  if (!log) return;
+
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, NULL);
+
+  // the thread may stop before its first flush
+  Flush();
+  fclose(log);
+  log = NULL;
+}
+
+/**
+ * Times one public operation for `instruments` and
+ * `tracer`, if any.
+ */
+
+class OperationTimer {
+  public:
+
+    OperationTimer(Instrumentation *instruments, SlowOperationTracer *tracer)
+      : instruments(instruments)
+      , tracer(tracer)
+      , start(instruments || tracer ? Nanos() : 0) {}
+
+    /**
+     * Count `op` of `bytes` returning `rc`, and trace it
+     * with `key` and the sizes if it was slow.
+     */
+
+    void
+    Record(
+        SophiaOperation op
+      , size_t bytes
+      , SophiaReturnCode rc = SOPHIA_SUCCESS
+      , const char *key = NULL
+      , size_t keysize = 0
+      , size_t valuesize = 0
+    ) {
+      if (!instruments && !tracer) return;
+      uint64_t ns = Nanos() - start;
+      if (instruments) instruments->Record(op, ns, bytes, rc);
+      if (tracer && ns >= tracer->Threshold()) {
+        tracer->Record(op, ns, rc, key, keysize, valuesize);
+      }
+    }
+
+  private:
+
+    Instrumentation *instruments;
+    SlowOperationTracer *tracer;
+    uint64_t start;
+};
+
+#else
+
+/**
+ * Compiled out: Sophia::instruments and Sophia::tracer
+ * are always `NULL`.
+ */
+
+class Instrumentation {
+  public:
+
+    void
+    Stats(SophiaStats *stats) const {
+      memset(stats, 0, sizeof(SophiaStats));
+    }
+};
+
+class SlowOperationTracer {
+  public:
+
+    size_t
+    Dump(SlowOperation *, size_t) const {
+      return 0;
+    }
+
+    SophiaReturnCode
+    StartLog(const char *, unsigned int) {
+      return SOPHIA_NOT_TRACING_ERROR;
+    }
+
+    void
+    StopLog() {}
+};
+
+class OperationTimer {
+  public:
+
+    OperationTimer(Instrumentation *, SlowOperationTracer *) {}
+
+    void
+    Record(
+        SophiaOperation
+      , size_t
+      , SophiaReturnCode = SOPHIA_SUCCESS
+      , const char * = NULL
+      , size_t = 0
+      , size_t = 0
+    ) {}
+};
+
+#endif // SOPHIA_STATS
+
+/**
+ * Snapshot file magic.
+ */
+
+#define SNAPSHOT_MAGIC "SPCCSNP1"
+
+/**
+ * Snapshot block index entry.
+ */
+
+typedef struct {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t records;
+  uint32_t checksum;
+  uint32_t reserved;
+} SnapshotBlock;
+
+/**
+ * Snapshot footer, closing the file.  `checksum` covers
+ * the fields before it.
+ */
+
+typedef struct {
+  uint64_t index;
+  uint64_t blocks;
+  uint64_t records;
+  uint64_t bytes;
+  uint32_t index_checksum;
+  uint32_t checksum;
+  char magic[8];
+} SnapshotFooter;
+
+#ifndef __SSE4_2__
+
+/**
+ * CRC-32C tables for slicing by 8 bytes.
+ */
+
+struct Crc32cTables {
+  uint32_t table[8][256];
+
+  Crc32cTables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+      }
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+      for (int t = 1; t < 8; t++) {
+        uint32_t crc = table[t - 1][i];
+        table[t][i] = (crc >> 8) ^ table[0][crc & 0xff];
+      }
+    }
+  }
+};
+
+/**
+ * Little-endian 32 bits at `p`.
+ */
+
+static inline uint32_t
+LoadLE32(const unsigned char *p) {
+  return (uint32_t) p[0]
+       | (uint32_t) p[1] << 8
+       | (uint32_t) p[2] << 16
+       | (uint32_t) p[3] << 24;
+}
+
+#endif
+
+/**
+ * Extend CRC-32C (Castagnoli) `crc` with `size` bytes of
+ * `data`.  Uses the SSE4.2 instruction when built for it.
+ */
+
+static uint32_t
+Crc32c(uint32_t crc, const char *data, size_t size) {
+  const unsigned char *p = (const unsigned char *) data;
+
+  crc = ~crc;
+#ifdef __SSE4_2__
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc = (uint32_t) _mm_crc32_u64(crc, word);
+  }
+  for (; size; p++, size--) crc = _mm_crc32_u8(crc, *p);
+#else
+  static const Crc32cTables tables;
+  const uint32_t (*t)[256] = tables.table;
+
+  for (; size >= 8; p += 8, size -= 8) {
+    uint32_t lo = LoadLE32(p) ^ crc;
+    uint32_t hi = LoadLE32(p + 4);
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff]
+        ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+        ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+        ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  for (; size; p++, size--) crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+#endif
+  return ~crc;
+}
+
+/**
+ * Streams records into a snapshot file, a block at a
+ * time.
+ */
+
+class SnapshotWriter {
+  public:
+
+    SnapshotWriter(size_t block_size);
+    ~SnapshotWriter();
+
+    /**
+     * Create the file, written aside until Finish().
+     */
+
+    SophiaReturnCode
+    Open(const char *path);
+
+    /**
+     * Append a record, writing out the current block first
+     * if the record would overflow it.
+     */
+
+    SophiaReturnCode
+    Add(
+        const char *key
+      , size_t keysize
+      , const char *value
+      , size_t valuesize
+    );
+
+    /**
+     * Write the last block, the index and the footer, and
+     * rename the file into place.
+     */
+
+    SophiaReturnCode
+    Finish();
+
+  private:
+
+    /**
+     * Target block size.
+     */
+
+    size_t block_size;
+
+    /**
+     * Final and temporary paths.
+     */
+
+    char *path;
+    char *tmp;
+
+    /**
+     * Temporary file, or `NULL`.
+     */
+
+    FILE *file;
+
+    /**
+     * Current block and its records.
+     */
+
+    char *block;
+    size_t blocksize;
+    size_t blockcapacity;
+    uint32_t blockrecords;
+
+    /**
+     * Index of the written blocks.
+     */
+
+    SnapshotBlock *index;
+    size_t blocks;
+    size_t indexcapacity;
+
+    /**
+     * End of the file so far.
+     */
+
+    uint64_t offset;
+
+    /**
+     * Records and key and value bytes added.
+     */
+
+    uint64_t records;
+    uint64_t bytes;
+
+    /**
+     * Write out the current block.
+     */
+
+    SophiaReturnCode
+    Flush();
+};
+
+SnapshotWriter::SnapshotWriter(size_t block_size)
+  : block_size(block_size ? block_size : 1) {
+  path = NULL;
+  tmp = NULL;
+  file = NULL;
+  block = NULL;
+  blocksize = 0;
+  blockcapacity = 0;
+  blockrecords = 0;
+  index = NULL;
+  blocks = 0;
+  indexcapacity = 0;
+  offset = 0;
+  records = 0;
+  bytes = 0;
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  // never finished: drop the partial file
+  if (file) {
+    fclose(file);
+    unlink(tmp);
+  }
+  free(path);
+  free(tmp);
+  free(block);
+  free(index);
+}
+
+SophiaReturnCode
+SnapshotWriter::Open(const char *path) {
+  size_t size = strlen(path);
+
+  this->path = (char *) malloc(size + 1);
+  tmp = (char *) malloc(size + sizeof(".tmp"));
+  if (!this->path || !tmp) return SOPHIA_ALLOC_ERROR;
+  memcpy(this->path, path, size + 1);
+  memcpy(tmp, path, size);
+  memcpy(tmp + size, ".tmp", sizeof(".tmp"));
+
+  if (!(file = fopen(tmp, "wb"))) return SOPHIA_FILE_ERROR;
+  if (1 != fwrite(SNAPSHOT_MAGIC, 8, 1, file)) return SOPHIA_FILE_ERROR;
+  offset = 8;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+SnapshotWriter::Add(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  uint32_t sizes[2] = { (uint32_t) keysize, (uint32_t) valuesize };
+  size_t size = sizeof(sizes) + keysize + valuesize;
+  SophiaReturnCode rc;
+
+  if (blocksize && blocksize + size > block_size) {
+    if (SOPHIA_SUCCESS != (rc = Flush())) return rc;
+  }
+  if (blocksize + size > UINT32_MAX) return SOPHIA_FORMAT_ERROR;
+
+  if (blocksize + size > blockcapacity) {
+    size_t capacity = blockcapacity ? blockcapacity : block_size;
+    while (capacity < blocksize + size) capacity *= 2;
+    char *grown = (char *) realloc(block, capacity);
+    if (!grown) return SOPHIA_ALLOC_ERROR;
+    block = grown;
+    blockcapacity = capacity;
+  }
+
+  memcpy(block + blocksize, sizes, sizeof(sizes));
+  memcpy(block + blocksize + sizeof(sizes), key, keysize);
+  memcpy(block + blocksize + sizeof(sizes) + keysize, value, valuesize);
+  blocksize += size;
+  blockrecords++;
+  records++;
+  bytes += keysize + valuesize;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+SnapshotWriter::Flush() {
+  if (0 == blocksize) return SOPHIA_SUCCESS;
+
+  if (blocks == indexcapacity) {
+    size_t capacity = indexcapacity ? indexcapacity * 2 : 64;
+    void *grown = realloc(index, capacity * sizeof(SnapshotBlock));
+    if (!grown) return SOPHIA_ALLOC_ERROR;
+    index = (SnapshotBlock *) grown;
+    indexcapacity = capacity;
+  }
+
+  SnapshotBlock *entry = &index[blocks];
+  entry->offset = offset;
+  entry->size = (uint32_t) blocksize;
+  entry->records = blockrecords;
+  entry->checksum = Crc32c(0, block, blocksize);
+  entry->reserved = 0;
+  if (1 != fwrite(block, blocksize, 1, file)) return SOPHIA_FILE_ERROR;
+
+  blocks++;
+  offset += blocksize;
+  blocksize = 0;
+  blockrecords = 0;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+SnapshotWriter::Finish() {
+  SnapshotFooter footer;
+  SophiaReturnCode rc;
+
+  if (SOPHIA_SUCCESS != (rc = Flush())) return rc;
+  size_t indexsize = blocks * sizeof(SnapshotBlock);
+
+  memset(&footer, 0, sizeof(footer));
+  footer.index = offset;
+  footer.blocks = blocks;
+  footer.records = records;
+  footer.bytes = bytes;
+  footer.index_checksum = Crc32c(0, (const char *) index, indexsize);
+  footer.checksum = Crc32c(
+      0
+    , (const char *) &footer
+    , offsetof(SnapshotFooter, checksum)
+  );
+  memcpy(footer.magic, SNAPSHOT_MAGIC, sizeof(footer.magic));
+
+  if ((indexsize && 1 != fwrite(index, indexsize, 1, file))
+   || 1 != fwrite(&footer, sizeof(footer), 1, file)) {
+    return SOPHIA_FILE_ERROR;
+  }
+
+  // rename only once complete so a torn file is never read
+  bool written = 0 == fclose(file);
+  file = NULL;
+  if (!written || 0 != rename(tmp, path)) {
+    unlink(tmp);
+    return SOPHIA_FILE_ERROR;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+/**
+ * ParallelScan() shards per thread when it picks the
+ * split points itself.
+ */
+
+#define PARALLEL_SCAN_SHARDS_PER_THREAD 8
+
+/**
+ * Size of the chunks of rows buffered by an ordered
+ * ParallelScan(), and how many a shard may hold before its
+ * thread waits for the caller to catch up.
+ */
+
+#define PARALLEL_SCAN_CHUNK_SIZE 65536
+#define PARALLEL_SCAN_CHUNKS 4
+
+/**
+ * Buffered rows of a shard, in the BulkFile record format.
+ * The rows follow the chunk in the same allocation.
+ */
+
+typedef struct ScanChunk {
+  struct ScanChunk *next;
+  size_t size;
+  size_t capacity;
+} ScanChunk;
+
+/**
+ * A ParallelScan() shard.
+ */
+
+typedef struct {
+  /**
+   * Bounds, `NULL` when open.
+   */
+
+  const char *start;
+  size_t startsize;
+  const char *end;
+  size_t endsize;
+
+  /**
+   * Buffered chunks, when ordered.
+   */
+
+  ScanChunk *head;
+  ScanChunk *tail;
+  size_t chunks;
+
+  /**
+   * Whether every row has been buffered.
+   */
+
+  bool done;
+} ScanShard;
+
+/**
+ * Runs one Sophia::ParallelScan().
+ */
+
+class ParallelScanner {
+  public:
+
+    ParallelScanner(
+        Sophia *sp
+      , ParallelScanCallback callback
+      , void *data
+      , bool ordered
+    );
+    ~ParallelScanner();
+
+    /**
+     * Split from `start` to `end` at the `nsplits`
+     * `splits`, skipping those out of order or range.
+     */
+
+    SophiaReturnCode
+    Split(
+        const char *start
+      , size_t startsize
+      , const char *end
+      , size_t endsize
+      , const char *const *splits
+      , const size_t *splitsizes
+      , size_t nsplits
+    );
+
+    /**
+     * Split from `start` to `end` into up to `n` shards at
+     * keys interpolated between the first and last key.
+     */
+
+    SophiaReturnCode
+    Split(
+        const char *start
+      , size_t startsize
+      , const char *end
+      , size_t endsize
+      , size_t n
+    );
+
+    /**
+     * Scan every shard with `nthreads` threads.
+     */
+
+    SophiaReturnCode
+    Run(size_t nthreads);
+
+  private:
+
+    Sophia *sp;
+    ParallelScanCallback callback;
+    void *data;
+    bool ordered;
+
+    /**
+     * Shards, and interpolated split keys they point into.
+     */
+
+    ScanShard *shards;
+    size_t nshards;
+    char *keys;
+
+    /**
+     * Next shard never taken, and shards handed back by a
+     * thread whose cursor was refused.
+     */
+
+    size_t next;
+    size_t *requeued;
+    size_t nrequeued;
+
+    /**
+     * Cursors open and threads running.
+     */
+
+    size_t active;
+    size_t running;
+
+    /**
+     * First error, and whether to stop early.
+     */
+
+    SophiaReturnCode rc;
+    std::atomic<bool> stopped;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t produced;
+    pthread_cond_t consumed;
+
+    /**
+     * Allocate `n` shards.
+     */
+
+    SophiaReturnCode
+    Allocate(size_t n);
+
+    /**
+     * Take a shard, or return `false` if none is left.
+     * Called with `mutex` held.
+     */
+
+    bool
+    Take(size_t *shard);
+
+    /**
+     * Scan `shard`.  Sets `refused` if its cursor could
+     * not be opened.
+     */
+
+    SophiaReturnCode
+    Scan(size_t shard, bool *refused);
+
+    /**
+     * Queue the rows of `*chunk` for the caller.
+     */
+
+    SophiaReturnCode
+    Publish(size_t shard, ScanChunk **chunk);
+
+    /**
+     * Stop every thread, keeping the first error.  Called
+     * with `mutex` held.
+     */
+
+    void
+    Stop(SophiaReturnCode rc);
+
+    /**
+     * Thread loop.
+     */
+
+    void
+    Work();
+
+    /**
+     * Pass the buffered rows to the callback in order.
+     */
+
+    void
+    Consume();
+
+    /**
+     * pthread entry point.
+     */
+
+    static void *
+    Main(void *scanner);
+};
+
+ParallelScanner::ParallelScanner(
+    Sophia *sp
+  , ParallelScanCallback callback
+  , void *data
+  , bool ordered
+) : sp(sp), callback(callback), data(data), ordered(ordered) {
+  shards = NULL;
+  nshards = 0;
+  keys = NULL;
+  next = 0;
+  requeued = NULL;
+  nrequeued = 0;
+  active = 0;
+  running = 0;
+  rc = SOPHIA_SUCCESS;
+  stopped = false;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&produced, NULL);
+  pthread_cond_init(&consumed, NULL);
+}
+
+ParallelScanner::~ParallelScanner() {
+  for (size_t i = 0; i < nshards; i++) {
+    while (ScanChunk *chunk = shards[i].head) {
+      shards[i].head = chunk->next;
+      free(chunk);
+    }
+  }
+  free(shards);
+  free(keys);
+  free(requeued);
+  pthread_cond_destroy(&consumed);
+  pthread_cond_destroy(&produced);
+  pthread_mutex_destroy(&mutex);
+}
+
+SophiaReturnCode
+ParallelScanner::Allocate(size_t n) {
+  shards = (ScanShard *) calloc(n, sizeof(ScanShard));
+  requeued = (size_t *) malloc(n * sizeof(size_t));
+  if (!shards || !requeued) return SOPHIA_ALLOC_ERROR;
+  nshards = n;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+ParallelScanner::Split(
+    const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+  , const char *const *splits
+  , const size_t *splitsizes
+  , size_t nsplits
+) {
+  SophiaReturnCode rc = Allocate(nsplits + 1);
+  if (SOPHIA_SUCCESS != rc) return rc;
+
+  size_t n = 0;
+  shards[0].start = start;
+  shards[0].startsize = startsize;
+  for (size_t i = 0; i < nsplits; i++) {
+    const char *key = splits[i];
+    size_t keysize = splitsizes[i];
+    const char *low = shards[n].start;
+    if (low && CompareKeys(key, keysize, low, shards[n].startsize) <= 0) {
+      continue;
+    }
+    if (end && CompareKeys(key, keysize, end, endsize) >= 0) continue;
+    shards[n].end = key;
+    shards[n].endsize = keysize;
+    n++;
+    shards[n].start = key;
+    shards[n].startsize = keysize;
+  }
+  shards[n].end = end;
+  shards[n].endsize = endsize;
+  nshards = n + 1;
+  return SOPHIA_SUCCESS;
+}
+
+/**
+ * Key digits past the common prefix of two keys, in a
+ * radix spanning the bytes they use.  Keys mostly draw on
+ * a small alphabet (digits, hex, names), so interpolating
+ * in that radix rather than in bytes keeps split points
+ * among real keys.
+ */
+
+typedef struct {
+
+  /**
+   * Length of the common prefix.
+   */
+
+  size_t prefix;
+
+  /**
+   * Byte of digit 0.
+   */
+
+  unsigned char zero;
+
+  /**
+   * Bytes in the alphabet.
+   */
+
+  uint64_t radix;
+
+  /**
+   * Digits interpolated, as many as fit 64 bits.
+   */
+
+  size_t width;
+} KeyDigits;
+
+/**
+ * Digits spanning keys `a` and `b`, trailing NULs aside.
+ */
+
+static void
+KeyDigitsInit(
+    KeyDigits *digits
+  , const char *a
+  , size_t asize
+  , const char *b
+  , size_t bsize
+) {
+  const char *keys[] = { a, b };
+  size_t sizes[] = { asize, bsize };
+  size_t size = std::min(asize, bsize);
+  unsigned char low = 255;
+  unsigned char high = 0;
+  size_t prefix = 0;
+
+  while (prefix < size && a[prefix] == b[prefix]) prefix++;
+  for (int k = 0; k < 2; k++) {
+    size_t end = sizes[k];
+    while (end > prefix && '\0' == keys[k][end - 1]) end--;
+    for (size_t i = prefix; i < end; i++) {
+      low = std::min(low, (unsigned char) keys[k][i]);
+      high = std::max(high, (unsigned char) keys[k][i]);
+    }
+  }
+
+  digits->prefix = prefix;
+  digits->zero = low;
+  digits->radix = low <= high ? (uint64_t) (high - low) + 1 : 1;
+  digits->width = 0;
+  uint64_t span = 1;
+  while (digits->width < 16 && span <= UINT64_MAX / digits->radix) {
+    span *= digits->radix;
+    digits->width++;
+  }
+}
+
+/**
+ * Value of the digits of `key`, clamping bytes outside
+ * the alphabet.
+ */
+
+static uint64_t
+KeyDigitsValue(const KeyDigits *digits, const char *key, size_t keysize) {
+  uint64_t value = 0;
+
+  for (size_t i = 0; i < digits->width; i++) {
+    size_t at = digits->prefix + i;
+    unsigned char c = at < keysize ? (unsigned char) key[at] : digits->zero;
+    uint64_t digit = c < digits->zero ? 0 : c - digits->zero;
+    value = value * digits->radix + std::min(digit, digits->radix - 1);
+  }
+  return value;
+}
+
+SophiaReturnCode
+ParallelScanner::Split(
+    const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+  , size_t n
+) {
+  IteratorResult result;
+  KeyDigits digits;
+  char *first = NULL;
+  size_t firstsize = 0;
+  uint64_t low = 0;
+  uint64_t high = 0;
+  SophiaReturnCode rc;
+
+  // the first and last key in range bound the splits
+  if (n > 1) {
+    Iterator it(sp, SPGTE, start, startsize, end, endsize);
+    if (SOPHIA_SUCCESS != (rc = it.Begin())) return rc;
+    if (it.Next(&result)) {
+      firstsize = result.keysize;
+      if (!(first = (char *) malloc(firstsize ? firstsize : 1))) {
+        it.End();
+        return SOPHIA_ALLOC_ERROR;
+      }
+      memcpy(first, result.key, firstsize);
+    }
+    if (SOPHIA_SUCCESS != (rc = it.End())) {
+      free(first);
+      return rc;
+    }
+  }
+
+  memset(&digits, 0, sizeof(digits));
+  if (first) {
+    Iterator it(sp, end ? SPLT : SPLTE, end, endsize);
+    if (SOPHIA_SUCCESS != (rc = it.Begin())) {
+      free(first);
+      return rc;
+    }
+    if (it.Next(&result)) {
+      KeyDigitsInit(&digits, first, firstsize, result.key, result.keysize);
+      low = KeyDigitsValue(&digits, first, firstsize);
+      high = KeyDigitsValue(&digits, result.key, result.keysize);
+    }
+    if (SOPHIA_SUCCESS != (rc = it.End())) {
+      free(first);
+      return rc;
+    }
+  }
+
+  // keys only differing past the digits can't be split
+  if (high <= low) n = 1;
+  if (n > 1 && high - low < n) n = (size_t) (high - low);
+
+  if (SOPHIA_SUCCESS != (rc = Allocate(n))) {
+    free(first);
+    return rc;
+  }
+  size_t keysize = digits.prefix + digits.width;
+  if (n > 1 && !(keys = (char *) malloc((n - 1) * keysize))) {
+    free(first);
+    return SOPHIA_ALLOC_ERROR;
+  }
+
+  uint64_t step = n > 1 ? (high - low) / n : 0;
+  shards[0].start = start;
+  shards[0].startsize = startsize;
+  for (size_t i = 1; i < n; i++) {
+    char *key = keys + (i - 1) * keysize;
+    uint64_t value = low + step * i;
+    memcpy(key, first, digits.prefix);
+    for (size_t d = digits.width; d > 0; d--) {
+      key[digits.prefix + d - 1] = (char) (digits.zero + value % digits.radix);
+      value /= digits.radix;
+    }
+    shards[i - 1].end = key;
+    shards[i - 1].endsize = keysize;
+    shards[i].start = key;
+    shards[i].startsize = keysize;
+  }
+  shards[n - 1].end = end;
+  shards[n - 1].endsize = endsize;
+
+  free(first);
+  return SOPHIA_SUCCESS;
+}
+
+bool
+ParallelScanner::Take(size_t *shard) {
+  if (stopped) return false;
+  if (nrequeued) {
+    *shard = requeued[--nrequeued];
+    return true;
+  }
+  if (next == nshards) return false;
+  *shard = next++;
+  return true;
+}
+
+void
+ParallelScanner::Stop(SophiaReturnCode rc) {
+  if (SOPHIA_SUCCESS == this->rc) this->rc = rc;
+  stopped = true;
+  pthread_cond_broadcast(&produced);
+  pthread_cond_broadcast(&consumed);
+}
+
+SophiaReturnCode
+ParallelScanner::Publish(size_t shard, ScanChunk **chunk) {
+  ScanShard *s = &shards[shard];
+
+  pthread_mutex_lock(&mutex);
+  for (;;) {
+    // never wait on a shard the caller can't reach while
+    // an earlier one still waits for a thread
+    size_t pending = nrequeued ? requeued[0] : next;
+    for (size_t i = 1; i < nrequeued; i++) {
+      pending = std::min(pending, requeued[i]);
+    }
+    if (stopped || s->chunks < PARALLEL_SCAN_CHUNKS || pending < shard) {
+      break;
+    }
+    pthread_cond_wait(&consumed, &mutex);
+  }
+  if (stopped) {
+    pthread_mutex_unlock(&mutex);
+    return SOPHIA_SUCCESS;
+  }
+
+  (*chunk)->next = NULL;
+  if (s->tail) {
+    s->tail->next = *chunk;
+  } else {
+    s->head = *chunk;
+  }
+  s->tail = *chunk;
+  s->chunks++;
+  *chunk = NULL;
+  pthread_cond_broadcast(&produced);
+  pthread_mutex_unlock(&mutex);
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+ParallelScanner::Scan(size_t shard, bool *refused) {
+  ScanShard *s = &shards[shard];
+  ScanChunk *chunk = NULL;
+  IteratorResult result;
+  SophiaReturnCode rc;
+
+  Iterator it(sp, SPGTE, s->start, s->startsize, s->end, s->endsize);
+  if (SOPHIA_SUCCESS != (rc = it.Begin())) {
+    *refused = SOPHIA_DB_ERROR == rc;
+    return rc;
+  }
+
+  while (!stopped && it.Next(&result)) {
+    if (!ordered) {
+      if (!callback(&result, shard, data)) {
+        pthread_mutex_lock(&mutex);
+        Stop(SOPHIA_SUCCESS);
+        pthread_mutex_unlock(&mutex);
+      }
+      continue;
+    }
+
+    uint32_t sizes[2] = {
+        (uint32_t) result.keysize
+      , (uint32_t) result.valuesize
+    };
+    size_t size = sizeof(sizes) + result.keysize + result.valuesize;
+    if (chunk && chunk->size + size > chunk->capacity) {
+      if (SOPHIA_SUCCESS != (rc = Publish(shard, &chunk))) break;
+      free(chunk);
+      chunk = NULL;
+    }
+    if (!chunk) {
+      size_t capacity = std::max(size, (size_t) PARALLEL_SCAN_CHUNK_SIZE);
+      chunk = (ScanChunk *) malloc(sizeof(ScanChunk) + capacity);
+      if (!chunk) {
+        rc = SOPHIA_ALLOC_ERROR;
+        break;
+      }
+      chunk->size = 0;
+      chunk->capacity = capacity;
+    }
+    char *row = (char *) (chunk + 1) + chunk->size;
+    memcpy(row, sizes, sizeof(sizes));
+    memcpy(row + sizeof(sizes), result.key, result.keysize);
+    memcpy(row + sizeof(sizes) + result.keysize, result.value, sizes[1]);
+    chunk->size += size;
+  }
+
+  SophiaReturnCode endrc = it.End();
+  if (SOPHIA_SUCCESS == rc && chunk) rc = Publish(shard, &chunk);
+  free(chunk);
+  return SOPHIA_SUCCESS == rc ? endrc : rc;
+}
+
+void
+ParallelScanner::Work() {
+  size_t shard;
+
+  pthread_mutex_lock(&mutex);
+  while (Take(&shard)) {
+    bool refused = false;
+    active++;
+    pthread_mutex_unlock(&mutex);
+    SophiaReturnCode rc = Scan(shard, &refused);
+    pthread_mutex_lock(&mutex);
+    active--;
+
+    // the engine won't open another cursor: hand the shard
+    // to the threads still scanning and bow out
+    if (refused && active) {
+      requeued[nrequeued++] = shard;
+      break;
+    }
+    if (SOPHIA_SUCCESS != rc) Stop(rc);
+    shards[shard].done = true;
+    pthread_cond_broadcast(&produced);
+  }
+  running--;
+  pthread_cond_broadcast(&produced);
+  pthread_cond_broadcast(&consumed);
+  pthread_mutex_unlock(&mutex);
+}
+
+void *
+ParallelScanner::Main(void *scanner) {
+  ((ParallelScanner *) scanner)->Work();
+  return NULL;
+}
+
+void
+ParallelScanner::Consume() {
+  IteratorResult result;
+  uint32_t sizes[2];
+
+  pthread_mutex_lock(&mutex);
+  for (size_t shard = 0; shard < nshards && !stopped; ) {
+    ScanShard *s = &shards[shard];
+    ScanChunk *chunk = s->head;
+
+    if (!chunk) {
+      if (s->done) {
+        shard++;
+      } else if (0 == running) {
+        // every thread bowed out; can't happen, but don't hang
+        Stop(SOPHIA_DB_ERROR);
+      } else {
+        pthread_cond_wait(&produced, &mutex);
+      }
+      continue;
+    }
+
+    if (!(s->head = chunk->next)) s->tail = NULL;
+    s->chunks--;
+    pthread_cond_broadcast(&consumed);
+    pthread_mutex_unlock(&mutex);
+
+    bool more = true;
+    const char *row = (const char *) (chunk + 1);
+    const char *rowsend = row + chunk->size;
+    while (more && row < rowsend) {
+      memcpy(sizes, row, sizeof(sizes));
+      result.key = row + sizeof(sizes);
+      result.keysize = sizes[0];
+      result.value = result.key + sizes[0];
+      result.valuesize = sizes[1];
+      row = result.value + sizes[1];
+      more = callback(&result, shard, data);
+    }
+    free(chunk);
+
+    pthread_mutex_lock(&mutex);
+    if (!more) Stop(SOPHIA_SUCCESS);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+SophiaReturnCode
+ParallelScanner::Run(size_t nthreads) {
+  pthread_t *threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+  size_t started = 0;
+
+  if (!threads) return SOPHIA_ALLOC_ERROR;
+
+  pthread_mutex_lock(&mutex);
+  for (; started < nthreads && started < nshards; started++) {
+    if (0 != pthread_create(&threads[started], NULL, Main, this)) break;
+    running++;
+  }
+  if (0 == started) Stop(SOPHIA_THREAD_ERROR);
+  pthread_mutex_unlock(&mutex);
+
+  if (ordered) Consume();
+  for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  free(threads);
+  return rc;
+}
+
+/**
+ * Sophia.
+ */
+
+Sophia::Sophia(const char *path) : path(path) {
+  env = NULL;
+  db = NULL;
+  open = false;
+  create_if_missing = true;
+  read_only = false;
+  page_size = 2048;
+  merge_watermark = 100000;
+  gc = true;
+  counting = false;
+  counted = false;
+  count = 0;
+  count_writes = 0;
+  threadsafe = false;
+  cache = NULL;
+  filter = NULL;
+  filtered = false;
+  compressor = NULL;
+  framed = false;
+  instruments = NULL;
+  tracer = NULL;
+  indexes = NULL;
+  nindexes = 0;
+  scratch = NULL;
+  pthread_rwlock_init(&lock, NULL);
+}
+
+Sophia::~Sophia() {
+  if (open) Close();
+  pthread_rwlock_destroy(&lock);
+  delete cache;
+  delete filter;
+  delete compressor;
+  delete instruments;
+  delete tracer;
+  free(indexes);
+  delete scratch;
+  if (db) sp_destroy(db);
+  if (env) sp_destroy(env);
+}
+
+bool
+Sophia::IsOpen() {
+  return open;
+}
+
+bool
+Sophia::IsThreadSafe() {
+  return threadsafe;
+}
+
+SophiaReturnCode
+Sophia::Open(
+    bool create_if_missing
+  , bool read_only
+  , int page_size
+  , int merge_watermark
+  , bool gc
+) {
+  uint32_t flags = 0;
+
+  this->create_if_missing = create_if_missing;
+  this->read_only = read_only;
+  this->page_size = page_size;
+  this->merge_watermark = merge_watermark;
+  this->gc = gc;
+
+  if (!(env = sp_env())) {
+    return SOPHIA_ENV_ALLOC_ERROR;
+  }
+
+  if (create_if_missing) flags |= SPO_CREAT;
+
+  if (read_only) {
+    flags |= SPO_RDONLY;
+  } else {
+    flags |= SPO_RDWR;
+  }
+
+  if (-1 == sp_ctl(env, SPDIR, flags, path)) {
+    free(env);
+    return SOPHIA_OPEN_ERROR;
+  }
+
+  if (gc && -1 == sp_ctl(env, SPGC, 1)) {
+    free(env);
+    return SOPHIA_GC_ERROR;
+  }
+
+  if (-1 == sp_ctl(env, SPMERGEWM, merge_watermark)) {
+    free(env);
+    return SOPHIA_MW_ERROR;
+  }
+
+  if (-1 == sp_ctl(env, SPPAGE, page_size)) {
+    free(env);
+    return SOPHIA_PAGE_ERROR;
+  }
+
+  if (!(db = sp_open(env))) {
+    free(env);
+    return SOPHIA_ENV_ERROR;
+  }
+
+  open = true;
+  counted = false;
+  count = 0;
+  count_writes = 0;
+  if (cache) cache->Clear();
+
+  SophiaReturnCode rc = OpenFilter();
+  if (SOPHIA_SUCCESS == rc) rc = OpenCompression();
+  if (SOPHIA_SUCCESS != rc) {
+    Close();
+    return rc;
+  }
+
+  void *ref = NULL;
+  size_t size = 0;
+  bool clean = false;
+
+  if (-1 != sp_get(db, COUNT_KEY, sizeof(COUNT_KEY), &ref, &size) && ref) {
+    if (COUNT_VALUE_SIZE == size) {
+      uint64_t saved;
+      memcpy(&saved, ref, sizeof(saved));
+      count = saved;
+      clean = 1 == ((char *) ref)[sizeof(saved)];
+    }
+    free(ref);
+  }
+  counted = counting && clean;
+
+  // flag the count as in use until Close(); any write from
+  // here on makes a clean count stale, whether or not this
+  // instance tracks it
+  if (!read_only && (counting || clean)) {
+    if (SOPHIA_SUCCESS != (rc = SaveCount(false))) {
+      Close();
+      return rc;
+    }
+  }
+
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::Close() {
+  // noop if we're already closed
+  if (!open) return SOPHIA_SUCCESS;
+
+  cursors.Clear();
+
+  if (counting && !read_only) SaveCount(counted);
+  SophiaReturnCode saverc = SOPHIA_SUCCESS;
+  if (filter && filtered && !read_only) saverc = SaveFilter();
+
+  if (db && -1 == sp_destroy(db)) {
+    return SOPHIA_DESTROY_ERROR;
+  }
+  db = NULL;
+
+  if (env && -1 == sp_destroy(env)) {
+    return SOPHIA_DESTROY_ERROR;
+  }
+  env = NULL;
+
+  open = false;
+
+  // the close went through, but the next Open() rebuilds the filter
+  return saverc;
+}
+
+SophiaReturnCode
+Sophia::Set(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  OperationTimer timer(instruments, tracer);
+  SophiaReturnCode rc = DoSet(key, keysize, value, valuesize);
+  timer.Record(SOPHIA_OP_SET, keysize + valuesize, rc, key, keysize, valuesize);
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::DoSet(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  long delta = 0;
+
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  ScopedLock guard(RWLock(), true);
+
+  // indexed records are replaced along with their entries
+  if (nindexes) {
+    WriteBatch *batch = &scratch->write;
+    batch->Clear();
+    SophiaReturnCode rc = batch->Set(key, keysize, value, valuesize);
+    return SOPHIA_SUCCESS == rc ? Commit(*batch, false) : rc;
+  }
+
+  if (counting) {
+    int exists = KeyExists(db, key, keysize);
+    if (-1 == exists) return SOPHIA_DB_ERROR;
+    delta = exists ? 0 : 1;
+  }
+
+  if (framed) {
+    SophiaReturnCode rc;
+    rc = compressor->Pack(value, valuesize, &value, &valuesize);
+    if (SOPHIA_SUCCESS != rc) return rc;
+  }
+
+  if (-1 == sp_set(db, key, keysize, value, valuesize)) {
+    return SOPHIA_DB_ERROR;
+  }
+
+  if (cache) cache->Erase(key, keysize);
+  if (filter) filter->Add(key, keysize);
+  if (counting) AddCount(delta, 1);
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::Set(const char *key, const char *value) {
+  size_t keysize = strlen(key) + 1;
+  size_t valuesize = strlen(value) + 1;
+  return Set(key, keysize, value, valuesize);
+}
+
+char *
+Sophia::Get(const char *key, size_t keysize) {
+  OperationTimer timer(instruments, tracer);
+  size_t valuesize = 0;
+  char *value = DoGet(key, keysize, &valuesize);
+  timer.Record(
+      SOPHIA_OP_GET
+    , keysize + valuesize
+    , SOPHIA_SUCCESS
+    , key
+    , keysize
+    , valuesize
+  );
+  return value;
+}
+
+char *
+Sophia::DoGet(const char *key, size_t keysize, size_t *size) {
+  void *ref = NULL;
+  char *value = NULL;
+  size_t valuesize;
+
+  if (!IsOpen()) return NULL;
+  ScopedLock guard(RWLock(), false);
+
+  if (filter && !filter->Check(key, keysize)) return NULL;
+
+  if (cache) {
+    int hit = cache->Lookup(key, keysize, NULL, 0, &value, &valuesize);
+    if (hit) {
+      *size = valuesize;
+      return value;
+    }
+  }
+
+  if (-1 == sp_get(db, key, keysize, &ref, &valuesize)) {
+    return NULL;
+  }
+
+  if (NULL == ref) {
+    if (filter) filter->FalsePositive();
+    return NULL;
+  }
+
+  value = (char *) ref;
+  if (framed && !(value = Unframe(value, &valuesize))) return NULL;
+  if (cache) cache->Insert(key, keysize, value, valuesize);
+  *size = valuesize;
+  return value;
+}
+
+char *
+Sophia::Get(const char *key) {
+  size_t keysize = strlen(key) + 1;
+  return Get(key, keysize);
+}
+
+SophiaReturnCode
+Sophia::Get(const char *key, size_t keysize, Value &value) {
+  OperationTimer timer(instruments, tracer);
+  SophiaReturnCode rc = DoGet(key, keysize, value);
+  timer.Record(
+      SOPHIA_OP_GET
+    , keysize + value.Size()
+    , rc
+    , key
+    , keysize
+    , value.Size()
+  );
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::DoGet(const char *key, size_t keysize, Value &value) {
+  void *ref = NULL;
+  size_t valuesize = 0;
+  int rc;
+
+  value.Reset();
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  ScopedLock guard(RWLock(), false);
+
+  if (filter && !filter->Check(key, keysize)) return SOPHIA_SUCCESS;
+
+  if (cache) {
+    char *data = NULL;
+    rc = cache->Lookup(
+        key
+      , keysize
+      , value.buffer
+      , value.capacity
+      , &data
+      , &valuesize
+    );
+    if (-1 == rc) return SOPHIA_ALLOC_ERROR;
+    if (1 == rc) {
+      value.data = data;
+      value.size = valuesize;
+      value.owned = data != value.buffer;
+      return SOPHIA_SUCCESS;
+    }
+  }
+
+  rc = sp_get(db, key, keysize, &ref, &valuesize);
+  if (-1 == rc) return SOPHIA_DB_ERROR;
+
+  if (ref && framed) {
+    ref = Unframe((char *) ref, &valuesize);
+    if (!ref) return SOPHIA_COMPRESSION_ERROR;
+  }
+
+  if (ref) {
+    if (cache) cache->Insert(key, keysize, (char *) ref, valuesize);
+    value.Assign((char *) ref, valuesize);
+  } else if (filter) {
+    filter->FalsePositive();
+  }
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::Get(const char *key, Value &value) {
+  size_t keysize = strlen(key) + 1;
+  return Get(key, keysize, value);
+}
+
+SophiaReturnCode
+Sophia::Apply(const WriteBatch &batch, bool metadata) {
+  WriteBatchRecord record;
+  const char *ptr = batch.arena;
+  const char *end = batch.arena + batch.size;
+
+  while (ptr < end) {
+    memcpy(&record, ptr, sizeof(WriteBatchRecord));
+    const char *key = ptr + sizeof(WriteBatchRecord);
+    const char *value = key + record.keysize;
+    int rc;
+
+    if (WRITE_BATCH_SET == record.type) {
+      const char *stored = value;
+      size_t storedsize = record.valuesize;
+      if (framed && !metadata) {
+        SophiaReturnCode packed;
+        packed = compressor->Pack(value, storedsize, &stored, &storedsize);
+        if (SOPHIA_SUCCESS != packed) return packed;
+      }
+      rc = sp_set(db, key, record.keysize, stored, storedsize);
+    } else {
+      rc = sp_delete(db, key, record.keysize);
+    }
+    if (-1 == rc) return SOPHIA_DB_ERROR;
+
+    ptr = value + record.valuesize;
+  }
+
+  return SOPHIA_SUCCESS;
+}
+
+void
+Sophia::Committed(const WriteBatch &batch) {
+  WriteBatchRecord record;
+  const char *ptr = batch.arena;
+  const char *end = batch.arena + batch.size;
+
+  while (ptr < end) {
+    memcpy(&record, ptr, sizeof(WriteBatchRecord));
+    const char *key = ptr + sizeof(WriteBatchRecord);
+    if (cache) cache->Erase(key, record.keysize);
+    if (filter && WRITE_BATCH_SET == record.type) {
+      filter->Add(key, record.keysize);
+    }
+    ptr = key + record.keysize + record.valuesize;
+  }
+}
+
+SophiaReturnCode
+Sophia::Write(const WriteBatch &batch) {
+  OperationTimer timer(instruments, tracer);
+  SophiaReturnCode rc;
+  {
+    ScopedLock guard(RWLock(), true);
+    rc = Commit(batch, false);
+  }
+  timer.Record(SOPHIA_OP_WRITE, batch.Size(), rc, NULL, 0, batch.Size());
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::Commit(const WriteBatch &batch, bool existing) {
+  SophiaReturnCode rc;
+  long delta = 0;
+
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+
+  if (counting) {
+    if (existing) {
+      delta = -(long) batch.Count();
+    } else if (SOPHIA_SUCCESS != (rc = CountDelta(batch, &delta))) {
+      return rc;
+    }
+  }
+
+  if (nindexes) {
+    scratch->entries.Clear();
+    rc = IndexEntries(batch, &scratch->entries);
+    if (SOPHIA_SUCCESS != rc) return rc;
+  }
+
+  if (-1 == sp_begin(db)) return SOPHIA_DB_ERROR;
+
+  rc = Apply(batch);
+  if (SOPHIA_SUCCESS == rc && nindexes) rc = Apply(scratch->entries, true);
+  if (SOPHIA_SUCCESS != rc) {
+    sp_rollback(db);
+    return rc;
+  }
+
+  if (-1 == sp_commit(db)) return SOPHIA_DB_ERROR;
+
+  if (cache || filter) Committed(batch);
+  if (counting) AddCount(delta, batch.Count());
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::CountDelta(const WriteBatch &batch, long *delta) {
+  WriteBatchRecord record;
+  CountRecord *records;
+  const char *ptr = batch.arena;
+  size_t n = 0;
+
+  *delta = 0;
+  if (0 == batch.count) return SOPHIA_SUCCESS;
+
+  records = (CountRecord *) malloc(batch.count * sizeof(CountRecord));
+  if (!records) return SOPHIA_ALLOC_ERROR;
+
+  for (; n < batch.count; n++) {
+    memcpy(&record, ptr, sizeof(WriteBatchRecord));
+    records[n].key = ptr + sizeof(WriteBatchRecord);
+    records[n].keysize = record.keysize;
+    records[n].value = records[n].key + record.keysize;
+    records[n].valuesize = record.valuesize;
+    records[n].type = record.type;
+    records[n].seq = n;
+    ptr = records[n].key + record.keysize + record.valuesize;
+  }
+
+  // each key needs one lookup, and only its last write counts
+  std::sort(records, records + n, CountOrder());
+  for (size_t i = 0; i < n;) {
+    size_t last = i;
+    while (last + 1 < n && 0 == CompareKeys(
+        records[last + 1].key
+      , records[last + 1].keysize
+      , records[i].key
+      , records[i].keysize
+    )) {
+      last++;
+    }
+
+    int exists = KeyExists(db, records[i].key, records[i].keysize);
+    if (-1 == exists) {
+      free(records);
+      return SOPHIA_DB_ERROR;
+    }
+    *delta += (WRITE_BATCH_SET == records[last].type ? 1 : 0) - exists;
+    i = last + 1;
+  }
+
+  free(records);
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::IndexEntries(const WriteBatch &batch, WriteBatch *entries) {
+  WriteBatchRecord record;
+  IndexKeys *before = &scratch->before;
+  IndexKeys *after = &scratch->after;
+  SophiaReturnCode rc = SOPHIA_SUCCESS;
+  const char *ptr = batch.arena;
+  size_t n = 0;
+
+  if (0 == batch.count) return SOPHIA_SUCCESS;
+
+  if (batch.count > scratch->recordscapacity) {
+    CountRecord *grown = (CountRecord *) realloc(
+        scratch->records
+      , batch.count * sizeof(CountRecord)
+    );
+    if (!grown) return SOPHIA_ALLOC_ERROR;
+    scratch->records = grown;
+    scratch->recordscapacity = batch.count;
+  }
+  CountRecord *records = scratch->records;
+
+  for (; n < batch.count; n++) {
+    memcpy(&record, ptr, sizeof(WriteBatchRecord));
+    records[n].key = ptr + sizeof(WriteBatchRecord);
+    records[n].keysize = record.keysize;
+    records[n].value = records[n].key + record.keysize;
+    records[n].valuesize = record.valuesize;
+    records[n].type = record.type;
+    records[n].seq = n;
+    ptr = records[n].value + record.valuesize;
+  }
+
+  // the batch applies atomically, so only the record it
+  // replaces and the last write of each key matter
+  std::sort(records, records + n, CountOrder());
+  for (size_t i = 0; i < n && SOPHIA_SUCCESS == rc;) {
+    const char *key = records[i].key;
+    size_t keysize = records[i].keysize;
+    uint32_t stored = (uint32_t) keysize;
+    const char *value = (const char *) &stored;
+    size_t last = i;
+    while (last + 1 < n && 0 == CompareKeys(
+        records[last + 1].key
+      , records[last + 1].keysize
+      , key
+      , keysize
+    )) {
+      last++;
+    }
+    const CountRecord *written = &records[last];
+    i = last + 1;
+
+    void *ref = NULL;
+    size_t oldsize = 0;
+    if (-1 == sp_get(db, key, keysize, &ref, &oldsize)) {
+      rc = SOPHIA_DB_ERROR;
+      break;
+    }
+    char *old = (char *) ref;
+    if (old && framed && !(old = Unframe(old, &oldsize))) {
+      rc = SOPHIA_COMPRESSION_ERROR;
+      break;
+    }
+
+    for (size_t x = 0; x < nindexes && SOPHIA_SUCCESS == rc; x++) {
+      SecondaryIndex *index = indexes[x];
+
+      before->Clear();
+      after->Clear();
+      if ((old && !index->extractor(
+          key
+        , keysize
+        , old
+        , oldsize
+        , before
+        , index->data
+      )) || (WRITE_BATCH_SET == written->type && !index->extractor(
+          key
+        , keysize
+        , written->value
+        , written->valuesize
+        , after
+        , index->data
+      ))) {
+        rc = SOPHIA_INDEX_ERROR;
+        break;
+      }
+      if (before->failed || after->failed) {
+        rc = SOPHIA_ALLOC_ERROR;
+        break;
+      }
+
+      // entries only in `before` go, entries only in `after` come
+      for (int side = 0; side < 2 && SOPHIA_SUCCESS == rc; side++) {
+        const IndexKeys *keys = side ? after : before;
+        const IndexKeys *other = side ? before : after;
+        const char *at = keys->arena;
+
+        for (size_t k = 0; k < keys->count && SOPHIA_SUCCESS == rc; k++) {
+          size_t size;
+          size_t entrysize;
+          memcpy(&size, at, sizeof(size));
+          at += sizeof(size);
+          if (!other->Contains(at, size)) {
+            rc = IndexEntryKey(
+                index->prefix
+              , index->prefixsize
+              , at
+              , size
+              , key
+              , keysize
+              , &scratch->entry
+              , &scratch->entrycapacity
+              , &entrysize
+            );
+            if (SOPHIA_SUCCESS != rc) break;
+            rc = side
+              ? entries->Set(scratch->entry, entrysize, value, sizeof(stored))
+              : entries->Delete(scratch->entry, entrysize);
+          }
+          at += size;
+        }
+      }
+    }
+
+    free(old);
+  }
+
+  return rc;
+}
+
+void
+Sophia::AddCount(long delta, size_t writes) {
+  if (delta < 0 && (size_t) -delta > count) {
+    count = 0;
+  } else {
+    count += delta;
+  }
+
+  count_writes += writes;
+  if (count_writes >= COUNT_SAVE_INTERVAL) SaveCount(false);
+}
+
+SophiaReturnCode
+Sophia::SaveCount(bool clean) {
+  char value[COUNT_VALUE_SIZE];
+  uint64_t saved = count;
+
+  memcpy(value, &saved, sizeof(saved));
+  value[sizeof(saved)] = clean ? 1 : 0;
+  count_writes = 0;
+
+  if (-1 == sp_set(db, COUNT_KEY, sizeof(COUNT_KEY), value, sizeof(value))) {
+    return SOPHIA_DB_ERROR;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+void
+Sophia::TrackCount(bool track) {
+  counting = track;
+  counted = false;
+  count = 0;
+  count_writes = 0;
+}
+
+void
+Sophia::ThreadSafe(bool threadsafe) {
+  if (!open) this->threadsafe = threadsafe;
+}
+
+pthread_rwlock_t *
+Sophia::RWLock() {
+  return threadsafe ? &lock : NULL;
+}
+
+SophiaReturnCode
+Sophia::Cache(size_t bytes, size_t shards) {
+  ValueCache *created = NULL;
+
+  if (bytes && !(created = ValueCache::New(bytes, shards))) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+
+  // swap under the write lock so no reader holds the old one
+  ScopedLock guard(RWLock(), true);
+  delete cache;
+  cache = created;
+  return SOPHIA_SUCCESS;
+}
+
+void
+Sophia::CacheStats(ValueCacheStats *stats) {
+  ScopedLock guard(RWLock(), false);
+  if (cache) {
+    cache->Stats(stats);
+  } else {
+    memset(stats, 0, sizeof(ValueCacheStats));
+  }
+}
+
+SophiaReturnCode
+Sophia::Filter(size_t keys, double fp_rate) {
+  BloomFilter *created = NULL;
+
+  if (keys && !(created = BloomFilter::New(keys, fp_rate))) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+
+  ScopedLock guard(RWLock(), true);
+  if (open && created) {
+    SophiaReturnCode rc = RebuildFilter(created);
+    if (SOPHIA_SUCCESS != rc) {
+      delete created;
+      return rc;
+    }
+  }
+  delete filter;
+  filter = created;
+  filtered = open && created;
+  return SOPHIA_SUCCESS;
+}
+
+void
+Sophia::FilterStats(BloomFilterStats *stats) {
+  ScopedLock guard(RWLock(), false);
+  if (filter) {
+    filter->Stats(stats);
+  } else {
+    memset(stats, 0, sizeof(BloomFilterStats));
+  }
+}
+
+SophiaReturnCode
+Sophia::OpenFilter() {
+  uint64_t stamp = 0;
+  void *ref = NULL;
+  size_t size = 0;
+
+  if (-1 == sp_get(db, FILTER_KEY, sizeof(FILTER_KEY), &ref, &size)) {
+    return SOPHIA_DB_ERROR;
+  }
+  bool saved = NULL != ref;
+  if (ref && sizeof(stamp) == size) memcpy(&stamp, ref, sizeof(stamp));
+  free(ref);
+
+  // any write from here on makes a saved filter stale,
+  // whether or not this instance keeps one
+  if (saved && !read_only) {
+    if (-1 == sp_delete(db, FILTER_KEY, sizeof(FILTER_KEY))) {
+      return SOPHIA_DB_ERROR;
+    }
+  }
+
+  // a filter left partial by a failed Open() isn't saved
+  filtered = false;
+  if (!filter) return SOPHIA_SUCCESS;
+  if (!(stamp && filter->Load(path, stamp))) {
+    SophiaReturnCode rc = RebuildFilter(filter);
+    if (SOPHIA_SUCCESS != rc) return rc;
+  }
+  filtered = true;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::SaveFilter() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  uint64_t stamp = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+
+  if (!filter->Save(path, stamp)) return SOPHIA_FILE_ERROR;
+  if (-1 == sp_set(db, FILTER_KEY, sizeof(FILTER_KEY), &stamp, sizeof(stamp))) {
+    return SOPHIA_DB_ERROR;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::RebuildFilter(BloomFilter *filter) {
+  list_node_t *cursor_node = NULL;
+
+  filter->Reset();
+
+  void *cursor = sp_cursor(db, SPGT, NULL, 0);
+  if (NULL == cursor) return SOPHIA_DB_ERROR;
+
+  // Add() destroys the cursor if it fails
+  SophiaReturnCode rc = cursors.Add(cursor, &cursor_node);
+  if (SOPHIA_SUCCESS != rc) return rc;
+  while (sp_fetch(cursor)) {
+    const char *key = sp_key(cursor);
+    size_t keysize = sp_keysize(cursor);
+    if (key && !IsReservedKey(key, keysize)) filter->Add(key, keysize);
+  }
+
+  // remove and destroy the cursor
+  cursors.Remove(cursor_node);
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::Compression(
+    bool enable
+  , size_t min_size
+  , const CompressionCodec *codec
+) {
+  ScopedLock guard(RWLock(), true);
+
+  // values written so far have no header to tell them apart
+  if (enable && open && !framed) return SOPHIA_COMPRESSION_ERROR;
+
+  if (!compressor && !(compressor = ValueCompressor::New())) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+  if (codec) {
+    SophiaReturnCode rc = compressor->Register(codec);
+    if (SOPHIA_SUCCESS != rc) return rc;
+  }
+  compressor->enabled = enable;
+  compressor->min_size = min_size;
+  compressor->codec = codec;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::RegisterCodec(const CompressionCodec *codec) {
+  ScopedLock guard(RWLock(), true);
+  if (!compressor && !(compressor = ValueCompressor::New())) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+  return compressor->Register(codec);
+}
+
+SophiaReturnCode
+Sophia::CompressionDictionary(const char *dictionary, size_t size) {
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (!dictionary || 0 == size || size > LZ_MAX_OFFSET) {
+    return SOPHIA_COMPRESSION_ERROR;
+  }
+
+  ScopedLock guard(RWLock(), true);
+  if (!framed) return SOPHIA_COMPRESSION_ERROR;
+
+  // values compressed against the stored dictionary need it
+  if (compressor->HasDictionary(NULL, 0)) {
+    return compressor->HasDictionary(dictionary, size)
+      ? SOPHIA_SUCCESS
+      : SOPHIA_COMPRESSION_ERROR;
+  }
+
+  char *copy = (char *) malloc(size);
+  if (!copy) return SOPHIA_ALLOC_ERROR;
+  memcpy(copy, dictionary, size);
+  if (-1 == sp_set(db, DICTIONARY_KEY, sizeof(DICTIONARY_KEY), copy, size)) {
+    free(copy);
+    return SOPHIA_DB_ERROR;
+  }
+  return compressor->Dictionary(copy, size);
+}
+
+void
+Sophia::CompressionStats(ValueCompressionStats *stats) {
+  ScopedLock guard(RWLock(), false);
+  if (compressor) {
+    compressor->Stats(stats);
+  } else {
+    memset(stats, 0, sizeof(ValueCompressionStats));
+  }
+}
+
+SophiaReturnCode
+Sophia::Instrument(bool enable) {
+#ifdef SOPHIA_STATS
+  Instrumentation *created = NULL;
+
+  if (enable && instruments) return SOPHIA_SUCCESS;
+  if (enable && !(created = Instrumentation::New())) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+
+  ScopedLock guard(RWLock(), true);
+  delete instruments;
+  instruments = created;
+#else
+  (void) enable;
+#endif
+  return SOPHIA_SUCCESS;
+}
+
+void
+Sophia::Stats(SophiaStats *stats) {
+  if (instruments) {
+    instruments->Stats(stats);
+  } else {
+    memset(stats, 0, sizeof(SophiaStats));
+  }
+}
+
+SophiaReturnCode
+Sophia::Trace(bool enable, uint64_t threshold_ns, size_t capacity) {
+#ifdef SOPHIA_STATS
+  SlowOperationTracer *created = NULL;
+
+  if (enable) {
+    created = SlowOperationTracer::New(threshold_ns, capacity, &cursors);
+    if (!created) return SOPHIA_ALLOC_ERROR;
+  }
+
+  ScopedLock guard(RWLock(), true);
+  delete tracer;
+  tracer = created;
+#else
+  (void) enable;
+  (void) threshold_ns;
+  (void) capacity;
+#endif
+  return SOPHIA_SUCCESS;
+}
+
+size_t
+Sophia::SlowOperations(SlowOperation *operations, size_t max) {
+  return tracer ? tracer->Dump(operations, max) : 0;
+}
+
+SophiaReturnCode
+Sophia::TraceLog(const char *path, unsigned int interval_ms) {
+  if (!tracer) return path ? SOPHIA_NOT_TRACING_ERROR : SOPHIA_SUCCESS;
+  if (!path) {
+    tracer->StopLog();
+    return SOPHIA_SUCCESS;
+  }
+  return tracer->StartLog(path, interval_ms);
+}
+
+SophiaReturnCode
+Sophia::OpenCompression() {
+  void *ref = NULL;
+  size_t size = 0;
+
+  if (-1 == sp_get(db, FRAMING_KEY, sizeof(FRAMING_KEY), &ref, &size)) {
+    return SOPHIA_DB_ERROR;
+  }
+  framed = NULL != ref;
+  free(ref);
+
+  // headers can only be introduced before the first value
+  if (!framed && compressor && compressor->enabled && !read_only) {
+    int used = HasValues(db);
+    if (-1 == used) return SOPHIA_DB_ERROR;
+    if (used) return SOPHIA_COMPRESSION_ERROR;
+
+    char flag = 1;
+    if (-1 == sp_set(db, FRAMING_KEY, sizeof(FRAMING_KEY), &flag, 1)) {
+      return SOPHIA_DB_ERROR;
+    }
+    framed = true;
+  }
+
+  if (!framed) return SOPHIA_SUCCESS;
+  if (!compressor && !(compressor = ValueCompressor::New())) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+
+  ref = NULL;
+  if (-1 == sp_get(db, DICTIONARY_KEY, sizeof(DICTIONARY_KEY), &ref, &size)) {
+    return SOPHIA_DB_ERROR;
+  }
+  return compressor->Dictionary((char *) ref, size);
+}
+
+char *
+Sophia::Unframe(char *ref, size_t *size) {
+  unsigned char id;
+  size_t header;
+  size_t rawsize;
+
+  if (!ParseFrame(ref, *size, &id, &header, &rawsize)) {
+    free(ref);
+    return NULL;
+  }
+
+  // raw values just shed their header
+  if (VALUE_RAW == id) {
+    memmove(ref, ref + header, rawsize);
+    *size = rawsize;
+    return ref;
+  }
+
+  char *value = (char *) malloc(rawsize ? rawsize : 1);
+  if (!value || !compressor->Unpack(ref, *size, value, rawsize)) {
+    free(value);
+    free(ref);
+    return NULL;
+  }
+  free(ref);
+  *size = rawsize;
+  return value;
+}
+
+SophiaReturnCode
+Sophia::MultiGet(
+    const char **keys
+  , const size_t *keysizes
+  , size_t count
+  , MultiGetResult &result
+) {
+  OperationTimer timer(instruments, tracer);
+  SophiaReturnCode rc = DoMultiGet(keys, keysizes, count, result);
+  size_t bytes = result.arenasize;
+  for (size_t i = 0; i < count; i++) bytes += keysizes[i];
+  timer.Record(
+      SOPHIA_OP_MULTIGET
+    , bytes
+    , rc
+    , count ? keys[0] : NULL
+    , count ? keysizes[0] : 0
+    , result.arenasize
+  );
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::DoMultiGet(
+    const char **keys
+  , const size_t *keysizes
+  , size_t count
+  , MultiGetResult &result
+) {
+  SophiaReturnCode rc;
+  size_t *order = NULL;
+  size_t pending = 0;
+  size_t previous = count;
+  void *cursor = NULL;
+  list_node_t *cursor_node = NULL;
+  bool exhausted = false;
+  size_t budget = MULTIGET_MAX_SKIP;
+
+  result.Reset();
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+
+  rc = result.Prepare(count);
+  if (SOPHIA_SUCCESS != rc || 0 == count) return rc;
+  ScopedLock guard(RWLock(), false);
+
+  if (!(order = (size_t *) malloc(count * sizeof(size_t)))) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+  // keys the filter rules out or the cache answers never
+  // reach a cursor
+  for (size_t i = 0; i < count; i++) {
+    if (filter && !filter->Check(keys[i], keysizes[i])) continue;
+    if (cache) {
+      char scratch[MULTIGET_SCRATCH_SIZE];
+      char *value = NULL;
+      size_t valuesize = 0;
+      int hit = cache->Lookup(
+          keys[i]
+        , keysizes[i]
+        , scratch
+        , sizeof(scratch)
+        , &value
+        , &valuesize
+      );
+      if (1 == hit) rc = result.Store(i, value, valuesize);
+      if (value && value != scratch) free(value);
+      if (-1 == hit) rc = SOPHIA_ALLOC_ERROR;
+      if (SOPHIA_SUCCESS != rc) {
+        free(order);
+        return rc;
+      }
+      if (1 == hit) continue;
+    }
+    order[pending++] = i;
+  }
+
+  MultiGetOrder compare = { keys, keysizes };
+  std::sort(order, order + pending, compare);
+
+  for (size_t n = 0; n < pending && !exhausted; n++) {
+    size_t i = order[n];
+    const char *key = keys[i];
+    size_t keysize = keysizes[i];
+    int cmp = -1;
+
+    // duplicates share the first lookup
+    if (count != previous && 0 == CompareKeys(
+        keys[previous]
+      , keysizes[previous]
+      , key
+      , keysize
+    )) {
+      result.entries[i] = result.entries[previous];
+      continue;
+    }
+    previous = i;
+
+    // walk the open cursor up to `key`, giving up on wide gaps
+    if (cursor) {
+      size_t skipped = 0;
+      while ((cmp = CompareKeys(
+          sp_key(cursor)
+        , sp_keysize(cursor)
+        , key
+        , keysize
+      )) < 0) {
+        if (budget == skipped++) break;
+        if (!sp_fetch(cursor)) {
+          exhausted = true;
+          break;
+        }
+      }
+      if (exhausted) break;
+      if (cmp < 0) {
+        cursors.Remove(cursor_node);
+        cursor = NULL;
+        if (budget > 1) budget /= 2;
+      } else {
+        budget = MULTIGET_MAX_SKIP;
+      }
+    }
+
+    if (!cursor) {
+      if (!(cursor = sp_cursor(db, SPGTE, key, keysize))) {
+        rc = SOPHIA_DB_ERROR;
+        break;
+      }
+      if (SOPHIA_SUCCESS != (rc = cursors.Add(cursor, &cursor_node))) {
+        cursor = NULL;
+        break;
+      }
+      if (!sp_fetch(cursor)) break;
+      cmp = CompareKeys(sp_key(cursor), sp_keysize(cursor), key, keysize);
+    }
+
+    if (0 == cmp) {
+      const char *value = (const char *) sp_value(cursor);
+      size_t valuesize = sp_valuesize(cursor);
+      if (framed) {
+        // decode straight into the arena
+        const char *stored = value;
+        size_t storedsize = valuesize;
+        unsigned char id;
+        size_t header;
+        char *ptr;
+        if (!ParseFrame(stored, storedsize, &id, &header, &valuesize)) {
+          rc = SOPHIA_COMPRESSION_ERROR;
+          break;
+        }
+        if (!(ptr = result.Reserve(i, valuesize))) {
+          rc = SOPHIA_ALLOC_ERROR;
+          break;
+        }
+        if (!compressor->Unpack(stored, storedsize, ptr, valuesize)) {
+          rc = SOPHIA_COMPRESSION_ERROR;
+          break;
+        }
+        value = ptr;
+      } else {
+        rc = result.Store(i, value, valuesize);
+        if (SOPHIA_SUCCESS != rc) break;
+      }
+      if (cache) cache->Insert(key, keysize, value, valuesize);
+    }
+  }
+
+  // remove and destroy the cursor
+  if (cursor) cursors.Remove(cursor_node);
+
+  if (filter && SOPHIA_SUCCESS == rc) {
+    for (size_t n = 0; n < pending; n++) {
+      if (!result.entries[order[n]].found) filter->FalsePositive();
+    }
+  }
+  free(order);
+
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::MultiGet(const char **keys, size_t count, MultiGetResult &result) {
+  SophiaReturnCode rc;
+  size_t *keysizes = (size_t *) malloc((count ? count : 1) * sizeof(size_t));
+  if (!keysizes) return SOPHIA_ALLOC_ERROR;
+  for (size_t i = 0; i < count; i++) keysizes[i] = strlen(keys[i]) + 1;
+  rc = MultiGet(keys, keysizes, count, result);
+  free(keysizes);
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::Delete(const char *key, size_t keysize) {
+  OperationTimer timer(instruments, tracer);
+  SophiaReturnCode rc = DoDelete(key, keysize);
+  timer.Record(SOPHIA_OP_DELETE, keysize, rc, key, keysize);
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::DoDelete(const char *key, size_t keysize) {
+  long delta = 0;
+
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  ScopedLock guard(RWLock(), true);
+
+  if (nindexes) {
+    WriteBatch *batch = &scratch->write;
+    batch->Clear();
+    SophiaReturnCode rc = batch->Delete(key, keysize);
+    return SOPHIA_SUCCESS == rc ? Commit(*batch, false) : rc;
+  }
+
+  if (counting) {
+    int exists = KeyExists(db, key, keysize);
+    if (-1 == exists) return SOPHIA_DB_ERROR;
+    delta = exists ? -1 : 0;
+  }
+
+  if (-1 == sp_delete(db, key, keysize)) {
+    return SOPHIA_DB_ERROR;
+  }
+
+  if (cache) cache->Erase(key, keysize);
+  if (counting) AddCount(delta, 1);
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::Delete(const char *key) {
+  size_t keysize = strlen(key) + 1;
+  return Delete(key, keysize);
+}
+
+SophiaReturnCode
+Sophia::ScanPrefix(
+    const char *prefix
+  , size_t prefixsize
+  , ScanCallback callback
+  , void *data
+) {
+  IteratorResult result;
+  PrefixIterator it(this, prefix, prefixsize);
+  SophiaReturnCode rc = it.Begin();
+  if (SOPHIA_SUCCESS != rc) return rc;
+
+  while (it.Next(&result)) {
+    if (!callback(&result, data)) break;
+  }
+
+  return it.End();
+}
+
+SophiaReturnCode
+Sophia::ParallelScan(
+    const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+  , size_t nthreads
+  , ParallelScanCallback callback
+  , void *data
+  , bool ordered
+  , const char *const *splits
+  , const size_t *splitsizes
+  , size_t nsplits
+) {
+  ParallelScanner scanner(this, callback, data, ordered);
+  SophiaReturnCode rc;
+
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (0 == nthreads) nthreads = 1;
+  if (1 < nthreads && !IsThreadSafe()) return SOPHIA_NOT_THREAD_SAFE_ERROR;
+
+  if (splits) {
+    rc = scanner.Split(
+        start
+      , startsize
+      , end
+      , endsize
+      , splits
+      , splitsizes
+      , nsplits
+    );
+  } else {
+    size_t n = 1 < nthreads ? nthreads * PARALLEL_SCAN_SHARDS_PER_THREAD : 1;
+    rc = scanner.Split(start, startsize, end, endsize, n);
+  }
+  if (SOPHIA_SUCCESS != rc) return rc;
+
+  return scanner.Run(nthreads);
+}
+
+SophiaReturnCode
+Sophia::Count(size_t *n) {
+  OperationTimer timer(instruments, tracer);
+  SophiaReturnCode rc = DoCount(n);
+  timer.Record(SOPHIA_OP_COUNT, 0, rc);
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::DoCount(size_t *n) {
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+
+  {
+    ScopedLock guard(RWLock(), false);
+    if (counting && counted) {
+      *n = count;
+      return SOPHIA_SUCCESS;
+    }
+  }
+
+  return Recount(n);
+}
+
+SophiaReturnCode
+Sophia::EstimateCount(size_t *n) {
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+
+  if (counting) {
+    ScopedLock guard(RWLock(), false);
+    *n = count;
+    return SOPHIA_SUCCESS;
+  }
+
+  return Count(n);
+}
+
+SophiaReturnCode
+Sophia::Recount(size_t *n) {
+  size_t count = 0;
+  list_node_t *cursor_node = NULL;
+
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  // repairing the tracked count is a write
+  ScopedLock guard(RWLock(), counting);
+
+  void *cursor = sp_cursor(db, SPGT, NULL, 0);
+  if (NULL == cursor) {
+    return SOPHIA_DB_ERROR;
+  }
+
+  SophiaReturnCode rc = cursors.Add(cursor, &cursor_node);
+  if (SOPHIA_SUCCESS != rc) return rc;
+  while (sp_fetch(cursor)) {
+    const char *key = sp_key(cursor);
+    if (key && !IsReservedKey(key, sp_keysize(cursor))) {
+      count++;
+    }
+  }
+
+  // remove and destroy the cursor
+  cursors.Remove(cursor_node);
+  if (n) *n = count;
+
+  if (counting) {
+    this->count = count;
+    counted = true;
+    if (!read_only) SaveCount(false);
+  }
+
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::Clear() {
+  return DeleteRange(NULL, 0, NULL, 0);
+}
+
+SophiaReturnCode
+Sophia::DeleteRange(
+    const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+  , DeleteRangeProgress progress
+  , void *data
+  , size_t chunk_size
+) {
+  SophiaReturnCode rc = SOPHIA_SUCCESS;
+  WriteBatch batch;
+  const char *from = start;
+  size_t fromsize = startsize;
+  sporder order = SPGTE;
+  char *resume = NULL;
+  size_t resumecapacity = 0;
+  size_t deleted = 0;
+  bool done = false;
+
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (0 == chunk_size) chunk_size = 1;
+
+  while (!done) {
+    // readers get a turn between chunks
+    ScopedLock guard(RWLock(), true);
+
+    void *cursor = sp_cursor(db, order, from, fromsize);
+    if (NULL == cursor) {
+      rc = SOPHIA_DB_ERROR;
+      break;
+    }
+    list_node_t *cursor_node;
+    if (SOPHIA_SUCCESS != (rc = cursors.Add(cursor, &cursor_node))) break;
+
+    // copy a chunk of keys out of the cursor
+    done = true;
+    while (sp_fetch(cursor)) {
+      const char *key = sp_key(cursor);
+      size_t keysize = sp_keysize(cursor);
+
+      if (IsReservedKey(key, keysize)) continue;
+      if (end && CompareKeys(key, keysize, end, endsize) >= 0) break;
+      if (SOPHIA_SUCCESS != (rc = batch.Delete(key, keysize))) break;
+      if (chunk_size != batch.Count()) continue;
+
+      // the next chunk resumes after this key
+      if (keysize > resumecapacity) {
+        char *ptr = (char *) realloc(resume, keysize);
+        if (!ptr) {
+          rc = SOPHIA_ALLOC_ERROR;
+          break;
+        }
+        resume = ptr;
+        resumecapacity = keysize;
+      }
+      memcpy(resume, key, keysize);
+      from = resume;
+      fromsize = keysize;
+      order = SPGT;
+      done = false;
+      break;
+    }
+
+    // writes are refused while a cursor is open
+    cursors.Remove(cursor_node);
+    if (SOPHIA_SUCCESS != rc) break;
+
+    if (batch.Count()) {
+      if (SOPHIA_SUCCESS != (rc = Commit(batch, true))) break;
+      deleted += batch.Count();
+      batch.Clear();
+      guard.Unlock();
+      if (progress) progress(deleted, data);
+    }
+  }
+
+  if (resume) free(resume);
+  return rc;
+}
+
+SophiaReturnCode
+Sophia::DeleteRange(const char *start, const char *end) {
+  size_t startsize = start ? strlen(start) + 1 : 0;
+  size_t endsize = end ? strlen(end) + 1 : 0;
+  return DeleteRange(start, startsize, end, endsize);
+}
+
+SophiaReturnCode
+Sophia::ExportSnapshot(
+    const char *path
+  , const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+  , size_t block_size
+) {
+  SnapshotWriter writer(block_size);
+  IteratorResult result;
+  SophiaReturnCode rc;
+
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (SOPHIA_SUCCESS != (rc = writer.Open(path))) return rc;
+
+  Iterator it(this, SPGTE, start, startsize, end, endsize);
+  if (SOPHIA_SUCCESS != (rc = it.Begin())) return rc;
+  while (it.Next(&result)) {
+    rc = writer.Add(result.key, result.keysize, result.value, result.valuesize);
+    if (SOPHIA_SUCCESS != rc) break;
+  }
+  SophiaReturnCode endrc = it.End();
+  if (SOPHIA_SUCCESS != rc) return rc;
+  if (SOPHIA_SUCCESS != endrc) return endrc;
+
+  return writer.Finish();
+}
+
+SophiaReturnCode
+Sophia::ImportSnapshot(const char *path) {
+  SnapshotFile snapshot(path);
+  SophiaReturnCode rc;
+
+  if (SOPHIA_SUCCESS != (rc = snapshot.Open())) return rc;
+  if (SOPHIA_SUCCESS != (rc = snapshot.Verify())) return rc;
+
+  BulkLoader loader(this);
+  return loader.Load(&snapshot);
+}
+
+SophiaReturnCode
+Sophia::AddIndex(SecondaryIndex *index) {
+  if (!index->prefix) return SOPHIA_ALLOC_ERROR;
+  if (!scratch && !(scratch = new (std::nothrow) IndexScratch())) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+  for (size_t i = 0; i < nindexes; i++) {
+    if (index == indexes[i]) return SOPHIA_SUCCESS;
+  }
+
+  SecondaryIndex **grown = (SecondaryIndex **) realloc(
+      indexes
+    , (nindexes + 1) * sizeof(SecondaryIndex *)
+  );
+  if (!grown) return SOPHIA_ALLOC_ERROR;
+  indexes = grown;
+  indexes[nindexes++] = index;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::RemoveIndex(SecondaryIndex *index) {
+  for (size_t i = 0; i < nindexes; i++) {
+    if (index != indexes[i]) continue;
+    memmove(
+        indexes + i
+      , indexes + i + 1
+      , (nindexes - i - 1) * sizeof(SecondaryIndex *)
+    );
+    nindexes--;
+    break;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Sophia::RebuildIndex(
+    SecondaryIndex *index
+  , RebuildIndexProgress progress
+  , void *data
+  , size_t chunk_size
+) {
+  SophiaReturnCode rc = SOPHIA_SUCCESS;
+  WriteBatch batch;
+  IndexKeys keys;
+  char *entry = NULL;
+  size_t entrycapacity = 0;
+  char *resume = NULL;
+  size_t resumesize = 0;
+  size_t resumecapacity = 0;
+  char *decoded = NULL;
+  size_t decodedcapacity = 0;
+  size_t indexed = 0;
+  bool dropping = true;
+  bool done = false;
+
+  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (!index->prefix) return SOPHIA_ALLOC_ERROR;
+  if (0 == chunk_size) chunk_size = 1;
+
+  // drop the entries a chunk at a time, then index every
+  // record a chunk at a time
+  while (!done) {
+    // writers get a turn between chunks
+    ScopedLock guard(RWLock(), true);
+    size_t rows = 0;
+    bool more = false;
+
+    void *cursor = dropping
+      ? sp_cursor(db, SPGTE, index->prefix, index->prefixsize)
+      : sp_cursor(db, SPGT, resume, resumesize);
+    if (NULL == cursor) {
+      rc = SOPHIA_DB_ERROR;
+      break;
+    }
+    list_node_t *cursor_node;
+    if (SOPHIA_SUCCESS != (rc = cursors.Add(cursor, &cursor_node))) break;
+
+    while (SOPHIA_SUCCESS == rc && sp_fetch(cursor)) {
+      const char *key = sp_key(cursor);
+      size_t keysize = sp_keysize(cursor);
+
+      if (dropping) {
+        if (keysize < index->prefixsize
+         || 0 != memcmp(key, index->prefix, index->prefixsize)) {
+          break;
+        }
+        rc = batch.Delete(key, keysize);
+      } else {
+        if (IsReservedKey(key, keysize)) continue;
+
+        const char *value = sp_value(cursor);
+        size_t valuesize = sp_valuesize(cursor);
+        uint32_t stored = (uint32_t) keysize;
+        if (framed && !compressor->Decode(
+            value
+          , valuesize
+          , &decoded
+          , &decodedcapacity
+          , &value
+          , &valuesize
+        )) {
+          rc = SOPHIA_COMPRESSION_ERROR;
+          break;
+        }
+
+        keys.Clear();
+        if (!index->extractor(
+            key
+          , keysize
+          , value
+          , valuesize
+          , &keys
+          , index->data
+        )) {
+          rc = SOPHIA_INDEX_ERROR;
+          break;
+        }
+        if (keys.failed) {
+          rc = SOPHIA_ALLOC_ERROR;
+          break;
+        }
+
+        const char *at = keys.arena;
+        for (size_t k = 0; k < keys.count && SOPHIA_SUCCESS == rc; k++) {
+          size_t size;
+          size_t entrysize;
+          memcpy(&size, at, sizeof(size));
+          at += sizeof(size);
+          rc = IndexEntryKey(
+              index->prefix
+            , index->prefixsize
+            , at
+            , size
+            , key
+            , keysize
+            , &entry
+            , &entrycapacity
+            , &entrysize
+          );
+          if (SOPHIA_SUCCESS != rc) break;
+          rc = batch.Set(entry, entrysize, (char *) &stored, sizeof(stored));
+          at += size;
+        }
+      }
+      if (SOPHIA_SUCCESS != rc || ++rows < chunk_size) continue;
+      more = true;
+
+      // dropped entries are gone, records resume after this one
+      if (dropping) break;
+      if (keysize > resumecapacity) {
+        char *ptr = (char *) realloc(resume, keysize);
+        if (!ptr) {
+          rc = SOPHIA_ALLOC_ERROR;
+          break;
+        }
+        resume = ptr;
+        resumecapacity = keysize;
+      }
+      memcpy(resume, key, keysize);
+      resumesize = keysize;
+      break;
+    }
+
+    // writes are refused while a cursor is open
+    cursors.Remove(cursor_node);
+    if (SOPHIA_SUCCESS != rc) break;
+
+    if (batch.Count()) {
+      if (-1 == sp_begin(db)) {
+        rc = SOPHIA_DB_ERROR;
+        break;
+      }
+      if (SOPHIA_SUCCESS != (rc = Apply(batch, true))) {
+        sp_rollback(db);
+        break;
+      }
+      if (-1 == sp_commit(db)) {
+        rc = SOPHIA_DB_ERROR;
+        break;
+      }
+      batch.Clear();
+    }
+
+    if (!dropping && rows) {
+      indexed += rows;
+      guard.Unlock();
+      if (progress) progress(indexed, data);
+    }
+    if (!more) {
+      done = !dropping;
+      dropping = false;
+    }
+  }
+
+  free(decoded);
+  free(resume);
+  free(entry);
+  return rc;
+}
+
+const char *
+Sophia::Error(SophiaReturnCode rc) {
+  char *err = NULL;
+  switch (rc) {
+    case SOPHIA_SUCCESS:
+      return NULL;
+
+    case SOPHIA_ENV_ALLOC_ERROR:
+      return "Failed to allocate environment";
+    case SOPHIA_OPEN_ERROR:
+      return "Failed to open/create repository";
+    case SOPHIA_GC_ERROR:
+      return "Failed to enable GC";
+    case SOPHIA_MW_ERROR:
+      return "Failed to set merge watermark";
+    case SOPHIA_PAGE_ERROR:
+      return "Failed to set page size";
+    case SOPHIA_DESTROY_ERROR:
+      return "Failed to destroy environment";
+    case SOPHIA_CURSOR_ALREADY_OPEN_ERROR:
+      return "An existing cursor is open";
+
+    case SOPHIA_TRANSACTION_ALLOC_ERROR:
+      return "Failed to allocate transaction operation";
+    case SOPHIA_TRANSACTION_OPERATION_ERROR:
+      return "Failed to add operation to transaction stack";
+    case SOPHIA_TRANSACTION_NOT_OPEN_ERROR:
+      return "Transaction not open";
+
+    case SOPHIA_DATABASE_NOT_OPEN_ERROR:
+      return "Database not open";
+    case SOPHIA_ALLOC_ERROR:
+      return "Failed to allocate memory";
+    case SOPHIA_FILE_ERROR:
+      return "Failed to access file";
+    case SOPHIA_FORMAT_ERROR:
+      return "Malformed file";
+    case SOPHIA_THREAD_ERROR:
+      return "Failed to start thread";
+    case SOPHIA_WRITER_STOPPED_ERROR:
+      return "Writer not running";
+    case SOPHIA_POOL_STOPPED_ERROR:
+      return "Worker pool not running";
+    case SOPHIA_NOT_THREAD_SAFE_ERROR:
+      return "Database not in thread-safe mode";
+
+    case SOPHIA_WRONG_ENVIRONMENT_ERROR:
+      return "Transaction belongs to another environment";
+    case SOPHIA_COMPRESSION_ERROR:
+      return "Value compression error";
+    case SOPHIA_NOT_TRACING_ERROR:
+      return "Slow operation tracing not enabled";
+    case SOPHIA_CHECKSUM_ERROR:
+      return "Checksum mismatch";
+    case SOPHIA_INDEX_ERROR:
+      return "Index extractor refused a record";
+    case SOPHIA_READ_ONLY_ERROR:
+      return "Database opened read-only";
+
+    case SOPHIA_ENV_ERROR:
+      if (!env || !(err = sp_error(env))) {
+        return "Unknown environment error";
+      }
+      return err;
+    case SOPHIA_DB_ERROR:
+      if (!db || !(err = sp_error(db))) {
+        return "Unknown database error";
+      }
+      return err;
+  }
+  return NULL;
+}
+
+/**
+ * Get() value.
+ */
+
+Value::Value() {
+  data = NULL;
+  size = 0;
+  owned = false;
+  buffer = NULL;
+  capacity = 0;
+}
+
+Value::Value(char *buffer, size_t capacity)
+  : buffer(buffer)
+  , capacity(capacity) {
+  data = NULL;
+  size = 0;
+  owned = false;
+}
+
+Value::~Value() {
+  Reset();
+}
+
+const char *
+Value::Data() const {
+  return data;
+}
+
+size_t
+Value::Size() const {
+  return size;
+}
+
+char *
+Value::Release() {
+  char *ref = owned ? data : NULL;
+  owned = false;
+  data = NULL;
+  size = 0;
+  return ref;
+}
+
+void
+Value::Reset() {
+  if (owned) free(data);
+  owned = false;
+  data = NULL;
+  size = 0;
+}
+
+void
+Value::Assign(char *ref, size_t refsize) {
+  Reset();
+  size = refsize;
+
+  // copy into the caller's buffer when it fits so the
+  // caller never has to manage sophia's allocation; it has
+  // already been made, so this saves none
+  if (buffer && refsize <= capacity) {
+    memcpy(buffer, ref, refsize);
+    free(ref);
+    data = buffer;
+    return;
+  }
+
+  data = ref;
+  owned = true;
+}
+
+/**
+ * MultiGet() result.
+ */
+
+MultiGetResult::MultiGetResult() {
+  arena = NULL;
+  arenasize = 0;
+  arenacapacity = 0;
+  entries = NULL;
+  count = 0;
+  capacity = 0;
+}
+
+MultiGetResult::~MultiGetResult() {
+  if (arena) free(arena);
+  if (entries) free(entries);
+}
+
+size_t
+MultiGetResult::Count() const {
+  return count;
+}
+
+const char *
+MultiGetResult::Data(size_t i) const {
+  if (i >= count || !entries[i].found) return NULL;
+  return arena + entries[i].offset;
+}
+
+size_t
+MultiGetResult::Size(size_t i) const {
+  if (i >= count) return 0;
+  return entries[i].size;
+}
+
+void
+MultiGetResult::Reset() {
+  arenasize = 0;
+  count = 0;
+}
+
+SophiaReturnCode
+MultiGetResult::Prepare(size_t n) {
+  if (n > capacity) {
+    MultiGetEntry *grown = (MultiGetEntry *) realloc(
+        entries
+      , n * sizeof(MultiGetEntry)
+    );
+    if (!grown) return SOPHIA_ALLOC_ERROR;
+    entries = grown;
+    capacity = n;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    entries[i].offset = 0;
+    entries[i].size = 0;
+    entries[i].found = false;
+  }
+  count = n;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+MultiGetResult::Store(size_t i, const char *value, size_t valuesize) {
+  char *ptr = Reserve(i, valuesize);
+  if (!ptr) return SOPHIA_ALLOC_ERROR;
+  memcpy(ptr, value, valuesize);
+  return SOPHIA_SUCCESS;
+}
+
+char *
+MultiGetResult::Reserve(size_t i, size_t valuesize) {
+  if (!arena || arenasize + valuesize > arenacapacity) {
+    size_t grown = arenacapacity ? arenacapacity : 4096;
+    while (grown < arenasize + valuesize) grown *= 2;
+    char *ptr = (char *) realloc(arena, grown);
+    if (!ptr) return NULL;
+    arena = ptr;
+    arenacapacity = grown;
+  }
+
+  char *ptr = arena + arenasize;
+  entries[i].offset = arenasize;
+  entries[i].size = valuesize;
+  entries[i].found = true;
+  arenasize += valuesize;
+  return ptr;
+}
+
+/**
+ * Write batch.
+ */
+
+WriteBatch::WriteBatch() {
+  arena = NULL;
+  size = 0;
+  capacity = 0;
+  count = 0;
+}
+
+WriteBatch::~WriteBatch() {
+  if (arena) free(arena);
+}
+
+SophiaReturnCode
+WriteBatch::Set(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  return Append(WRITE_BATCH_SET, key, keysize, value, valuesize);
+}
+
+SophiaReturnCode
+WriteBatch::Set(const char *key, const char *value) {
+  size_t keysize = strlen(key) + 1;
+  size_t valuesize = strlen(value) + 1;
+  return Set(key, keysize, value, valuesize);
+}
+
+SophiaReturnCode
+WriteBatch::Delete(const char *key, size_t keysize) {
+  return Append(WRITE_BATCH_DELETE, key, keysize, NULL, 0);
+}
+
+SophiaReturnCode
+WriteBatch::Delete(const char *key) {
+  size_t keysize = strlen(key) + 1;
+  return Delete(key, keysize);
+}
+
+SophiaReturnCode
+WriteBatch::Reserve(size_t bytes) {
+  if (bytes <= capacity) return SOPHIA_SUCCESS;
+  char *ptr = (char *) realloc(arena, bytes);
+  if (!ptr) return SOPHIA_ALLOC_ERROR;
+  arena = ptr;
+  capacity = bytes;
+  return SOPHIA_SUCCESS;
+}
+
+void
+WriteBatch::Clear() {
+  size = 0;
+  count = 0;
+}
+
+size_t
+WriteBatch::Count() const {
+  return count;
+}
+
+size_t
+WriteBatch::Size() const {
+  return size;
+}
+
+SophiaReturnCode
+WriteBatch::Append(
+    int type
+  , const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  WriteBatchRecord record = { type, keysize, valuesize };
+  size_t needed = size + sizeof(WriteBatchRecord) + keysize + valuesize;
+
+  if (needed > capacity) {
+    size_t grown = capacity ? capacity : 4096;
+    while (grown < needed) grown *= 2;
+    SophiaReturnCode rc = Reserve(grown);
+    if (SOPHIA_SUCCESS != rc) return rc;
+  }
+
+  char *ptr = arena + size;
+  memcpy(ptr, &record, sizeof(WriteBatchRecord));
+  ptr += sizeof(WriteBatchRecord);
+  memcpy(ptr, key, keysize);
+  if (valuesize) memcpy(ptr + keysize, value, valuesize);
+
+  size = needed;
+  count++;
+  return SOPHIA_SUCCESS;
+}
+
+/**
+ * Index keys.
+ */
+
+IndexKeys::IndexKeys() {
+  arena = NULL;
+  size = 0;
+  capacity = 0;
+  count = 0;
+  failed = false;
+}
+
+IndexKeys::~IndexKeys() {
+  free(arena);
+}
+
+SophiaReturnCode
+IndexKeys::Add(const char *key, size_t keysize) {
+  size_t needed = size + sizeof(size_t) + keysize;
+
+  if (needed > capacity) {
+    size_t grown = capacity ? capacity : 256;
+    while (grown < needed) grown *= 2;
+    char *ptr = (char *) realloc(arena, grown);
+    if (!ptr) {
+      failed = true;
+      return SOPHIA_ALLOC_ERROR;
+    }
+    arena = ptr;
+    capacity = grown;
+  }
+
+  memcpy(arena + size, &keysize, sizeof(size_t));
+  memcpy(arena + size + sizeof(size_t), key, keysize);
+  size = needed;
+  count++;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+IndexKeys::Add(const char *key) {
+  return Add(key, strlen(key) + 1);
+}
+
+bool
+IndexKeys::Contains(const char *key, size_t keysize) const {
+  const char *at = arena;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t size;
+    memcpy(&size, at, sizeof(size));
+    at += sizeof(size);
+    if (size == keysize && 0 == memcmp(at, key, keysize)) return true;
+    at += size;
+  }
+  return false;
+}
+
+size_t
+IndexKeys::Count() const {
+  return count;
+}
+
+void
+IndexKeys::Clear() {
+  size = 0;
+  count = 0;
+  failed = false;
+}
+
+/**
+ * Secondary index.
+ */
+
+SecondaryIndex::SecondaryIndex(
+    const char *name
+  , IndexExtractor extractor
+  , void *data
+) : name(name), extractor(extractor), data(data) {
+  size_t namesize = strlen(name) + 1;
+
+  prefixsize = sizeof(INDEX_PREFIX) - 1 + namesize;
+  if ((prefix = (char *) malloc(prefixsize))) {
+    memcpy(prefix, INDEX_PREFIX, sizeof(INDEX_PREFIX) - 1);
+    memcpy(prefix + sizeof(INDEX_PREFIX) - 1, name, namesize);
+  }
+}
+
+SecondaryIndex::~SecondaryIndex() {
+  free(prefix);
+}
+
+const char *
+SecondaryIndex::Name() const {
+  return name;
+}
+
+/**
+ * Sophia transaction.
+ */
+
+Transaction::Transaction(Sophia *sp) : sp(sp) {
+  open = true;
+}
+
+Transaction::~Transaction() {}
+
+SophiaReturnCode
+Transaction::Begin() {
+  if (!sp->IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  batch.Clear();
+  open = true;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Transaction::Set(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  // cannot write to a committed/bad transaction
+  if (!open) return SOPHIA_TRANSACTION_NOT_OPEN_ERROR;
+  if (SOPHIA_SUCCESS != batch.Set(key, keysize, value, valuesize)) {
+    return SOPHIA_TRANSACTION_ALLOC_ERROR;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Transaction::Set(const char *key, const char *value) {
+  size_t keysize = strlen(key) + 1;
+  size_t valuesize = strlen(value) + 1;
+  return this->Set(key, keysize, value, valuesize);
+}
+
+SophiaReturnCode
+Transaction::Delete(const char *key, size_t keysize) {
+  // cannot write to a committed/bad transaction
+  if (!open) return SOPHIA_TRANSACTION_NOT_OPEN_ERROR;
+  if (SOPHIA_SUCCESS != batch.Delete(key, keysize)) {
+    return SOPHIA_TRANSACTION_ALLOC_ERROR;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+Transaction::Delete(const char *key) {
+  size_t keysize = strlen(key) + 1;
+  return Delete(key, keysize);
+}
+
+SophiaReturnCode
+Transaction::Commit() {
+  SophiaReturnCode rc;
+
+  if (!open) return SOPHIA_TRANSACTION_NOT_OPEN_ERROR;
+  if (!sp->IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+
+  rc = sp->Write(batch);
+  batch.Clear();
+  open = false;
+
+  return rc;
+}
+
+SophiaReturnCode
+Transaction::Rollback() {
+  // nothing reaches sophia before Commit()
+  batch.Clear();
+  open = false;
+
+  return SOPHIA_SUCCESS;
+}
+
+/**
+ * Iterator.
+ */
+
+Iterator::Iterator(Sophia *sp) : sp(sp) {
+  order = SPGT;
+  start = NULL;
+  startsize = 0;
+  endkey = NULL;
+  endsize = 0;
+  end_inclusive = false;
+  prefix = NULL;
+  prefixsize = 0;
+  cursor = NULL;
+  locked = NULL;
+  decoded = NULL;
+  decodedcapacity = 0;
+  metadata = false;
+}
+
+Iterator::Iterator(
+    Sophia *sp
+  , sporder order
+) : sp(sp), order(order) {
+  start = NULL;
+  startsize = 0;
+  endkey = NULL;
+  endsize = 0;
+  end_inclusive = false;
+  prefix = NULL;
+  prefixsize = 0;
+  cursor = NULL;
+  locked = NULL;
+  decoded = NULL;
+  decodedcapacity = 0;
+  metadata = false;
+}
+
+Iterator::Iterator(
+    Sophia *sp
+  , sporder order
+  , const char *start
+) : sp(sp), order(order), start(start) {
+  startsize = start ? strlen(start) + 1 : 0;
+  endkey = NULL;
+  endsize = 0;
+  end_inclusive = false;
+  prefix = NULL;
+  prefixsize = 0;
+  cursor = NULL;
+  locked = NULL;
+  decoded = NULL;
+  decodedcapacity = 0;
+  metadata = false;
+}
+
+Iterator::Iterator(
+    Sophia *sp
+  , sporder order
+  , const char *start
+  , size_t startsize
+) : sp(sp), order(order), start(start), startsize(startsize) {
+  endkey = NULL;
+  endsize = 0;
+  end_inclusive = false;
+  prefix = NULL;
+  prefixsize = 0;
+  cursor = NULL;
+  locked = NULL;
+  decoded = NULL;
+  decodedcapacity = 0;
+  metadata = false;
+}
+
+Iterator::Iterator(
+    Sophia *sp
+  , sporder order
+  , const char *start
+  , const char *end
+) : sp(sp), order(order), start(start), endkey(end) {
+  startsize = start ? strlen(start) + 1 : 0;
+  endsize = end ? strlen(end) + 1 : 0;
+  end_inclusive = false;
+  prefix = NULL;
+  prefixsize = 0;
+  cursor = NULL;
+  locked = NULL;
+  decoded = NULL;
+  decodedcapacity = 0;
+  metadata = false;
+}
+
+Iterator::Iterator(
+    Sophia *sp
+  , sporder order
+  , const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+) : sp(sp)
+  , order(order)
+  , start(start)
+  , startsize(startsize)
+  , endkey(end)
+  , endsize(endsize) {
+  end_inclusive = false;
+  prefix = NULL;
+  prefixsize = 0;
+  cursor = NULL;
+  locked = NULL;
+  decoded = NULL;
+  decodedcapacity = 0;
+  metadata = false;
+}
+
+Iterator::Iterator(
+    Sophia *sp
+  , sporder order
+  , const char *start
+  , size_t startsize
+  , bool start_inclusive
+  , const char *end
+  , size_t endsize
+  , bool end_inclusive
+) : sp(sp)
+  , start(start)
+  , startsize(startsize)
+  , endkey(end)
+  , endsize(endsize)
+  , end_inclusive(end_inclusive) {
+  if (SPGT == order || SPGTE == order) {
+    this->order = start_inclusive ? SPGTE : SPGT;
+  } else {
+    this->order = start_inclusive ? SPLTE : SPLT;
+  }
+  prefix = NULL;
+  prefixsize = 0;
+  cursor = NULL;
+  locked = NULL;
+  decoded = NULL;
+  decodedcapacity = 0;
+  metadata = false;
+}
+
+Iterator::~Iterator() {
+  End();
+  free(decoded);
+}
+
+SophiaReturnCode
+Iterator::Begin() {
+  SophiaReturnCode rc;
+
+  if (!sp->IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (cursor) return SOPHIA_CURSOR_ALREADY_OPEN_ERROR;
+
+  // writers wait for the cursor, which would refuse them
+  if ((locked = sp->RWLock())) pthread_rwlock_rdlock(locked);
+
+  cursor = sp_cursor(sp->db, order, start, startsize);
+  if (NULL == cursor) {
+    End();
+    return SOPHIA_DB_ERROR;
+  }
+  if (SOPHIA_SUCCESS != (rc = sp->cursors.Add(cursor, &cursor_node))) {
+    cursor = NULL;
+    End();
+    return rc;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+IteratorResult *
+Iterator::Next() {
+  return Next(&result) ? &result : NULL;
+}
+
+bool
+Iterator::Next(IteratorResult *result) {
+  OperationTimer timer(sp->instruments, sp->tracer);
+  bool found = Fetch(result);
+  timer.Record(
+      SOPHIA_OP_ITERATOR_NEXT
+    , found ? result->keysize + result->valuesize : 0
+    , SOPHIA_SUCCESS
+    , found ? result->key : NULL
+    , found ? result->keysize : 0
+    , found ? result->valuesize : 0
+  );
+  return found;
+}
+
+bool
+Iterator::Fetch(IteratorResult *result) {
+  const char *k;
+  const char *v;
+  size_t keysize;
+
+  if (NULL == cursor) return false;
+
+  // skip wrapper metadata
+  do {
+    if (0 == sp_fetch(cursor)) {
+      End();
+      return false;
+    }
+    k = sp_key(cursor);
+    keysize = sp_keysize(cursor);
+  } while (!metadata && IsReservedKey(k, keysize));
+
+  // TODO: could failure here ever indicate error?
+  if (!k || !(v = sp_value(cursor))) {
+    return false;
+  }
+
+  // don't go past end, and free the cursor as soon as we're there
+  if (PastEnd(k, keysize) || (prefix && (
+      keysize < prefixsize
+   || 0 != memcmp(k, prefix, prefixsize)
+  ))) {
+    End();
+    return false;
+  }
+
+  size_t valuesize = sp_valuesize(cursor);
+  if (sp->framed && !metadata && !sp->compressor->Decode(
+      v
+    , valuesize
+    , &decoded
+    , &decodedcapacity
+    , &v
+    , &valuesize
+  )) {
+    End();
+    return false;
+  }
+
+  result->key = k;
+  result->keysize = keysize;
+  result->value = v;
+  result->valuesize = valuesize;
+  return true;
+}
+
+bool
+Iterator::PastEnd(const char *key, size_t keysize) const {
+  if (!endkey) return false;
+  int cmp = CompareKeys(key, keysize, endkey, endsize);
+  if (SPLT == order || SPLTE == order) cmp = -cmp;
+  return cmp > 0 || (0 == cmp && !end_inclusive);
+}
+
+SophiaReturnCode
+Iterator::End() {
+  if (cursor) {
+    sp->cursors.Remove(cursor_node);
+    cursor = NULL;
+    cursor_node = NULL;
+  }
+  if (locked) {
+    pthread_rwlock_unlock(locked);
+    locked = NULL;
+  }
+  return SOPHIA_SUCCESS;
+}
+
+/**
+ * Prefix iterator.
+ */
+
+PrefixIterator::PrefixIterator(
+    Sophia *sp
+  , const char *prefix
+  , size_t prefixsize
+) : Iterator(sp, SPGTE, prefix, prefixsize) {
+  this->prefix = prefix;
+  this->prefixsize = prefixsize;
+}
+
+PrefixIterator::PrefixIterator(
+    Sophia *sp
+  , const char *prefix
+) : Iterator(sp, SPGTE, prefix, strlen(prefix)) {
+  this->prefix = prefix;
+  this->prefixsize = strlen(prefix);
+}
+
+/**
+ * Index iterator.
+ */
+
+IndexIterator::IndexIterator(
+    Sophia *sp
+  , SecondaryIndex *index
+  , const char *key
+  , size_t keysize
+  , bool values
+) : sp(sp)
+  , index(index)
+  , start(key)
+  , startsize(keysize)
+  , end(NULL)
+  , endsize(0)
+  , exact(true)
+  , values(values) {
+  entries = NULL;
+  bounds = NULL;
+  indexkey = NULL;
+  indexkeycapacity = 0;
+  value = NULL;
+}
+
+IndexIterator::IndexIterator(
+    Sophia *sp
+  , SecondaryIndex *index
+  , const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+  , bool values
+) : sp(sp)
+  , index(index)
+  , start(start)
+  , startsize(startsize)
+  , end(end)
+  , endsize(endsize)
+  , exact(false)
+  , values(values) {
+  entries = NULL;
+  bounds = NULL;
+  indexkey = NULL;
+  indexkeycapacity = 0;
+  value = NULL;
+}
+
+IndexIterator::~IndexIterator() {
+  End();
+  free(bounds);
+  free(indexkey);
+}
+
+SophiaReturnCode
+IndexIterator::Begin() {
+  if (!sp->IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (!index->prefix) return SOPHIA_ALLOC_ERROR;
+  End();
+
+  // escaped index keys sort like index keys, and an exact
+  // key ends where its entries do
+  size_t lowsize = index->prefixsize;
+  if (start) lowsize += EscapedIndexKeySize(start, startsize);
+  if (exact) lowsize += INDEX_KEY_END_SIZE;
+  size_t highsize = 0;
+  if (end) highsize = index->prefixsize + EscapedIndexKeySize(end, endsize);
+
+  free(bounds);
+  if (!(bounds = (char *) malloc(lowsize + highsize))) {
+    return SOPHIA_ALLOC_ERROR;
+  }
+  memcpy(bounds, index->prefix, index->prefixsize);
+  char *out = bounds + index->prefixsize;
+  if (start) out = EscapeIndexKey(start, startsize, out);
+  if (exact) {
+    *out++ = '\0';
+    *out++ = 0x01;
+  }
+  if (end) {
+    memcpy(out, index->prefix, index->prefixsize);
+    EscapeIndexKey(end, endsize, out + index->prefixsize);
+  }
+
+  entries = new (std::nothrow) Iterator(
+      sp
+    , SPGTE
+    , bounds
+    , lowsize
+    , end ? bounds + lowsize : NULL
+    , highsize
+  );
+  if (!entries) return SOPHIA_ALLOC_ERROR;
+  entries->metadata = true;
+  entries->prefix = bounds;
+  entries->prefixsize = exact ? lowsize : index->prefixsize;
+  return entries->Begin();
+}
+
+IndexResult *
+IndexIterator::Next() {
+  return Next(&result) ? &result : NULL;
+}
+
+bool
+IndexIterator::Next(IndexResult *result) {
+  IteratorResult row;
+  uint32_t keysize;
+
+  if (!entries) return false;
+  free(value);
+  value = NULL;
+
+  while (entries->Next(&row)) {
+    if (sizeof(keysize) != row.valuesize) continue;
+    memcpy(&keysize, row.value, sizeof(keysize));
+    size_t overhead = index->prefixsize + INDEX_KEY_END_SIZE + keysize;
+    if (row.keysize < overhead) continue;
+
+    const char *key = row.key + row.keysize - keysize;
+    const char *escaped = row.key + index->prefixsize;
+    size_t escapedsize = row.keysize - overhead;
+
+    // most index keys have no NUL to unescape
+    result->indexkey = escaped;
+    result->indexkeysize = escapedsize;
+    if (memchr(escaped, '\0', escapedsize)) {
+      if (escapedsize > indexkeycapacity) {
+        char *ptr = (char *) realloc(indexkey, escapedsize);
+        if (!ptr) {
+          End();
+          return false;
+        }
+        indexkey = ptr;
+        indexkeycapacity = escapedsize;
+      }
+      size_t n = 0;
+      for (size_t i = 0; i < escapedsize; i++) {
+        indexkey[n++] = escaped[i];
+        if ('\0' == escaped[i]) i++;
+      }
+      result->indexkey = indexkey;
+      result->indexkeysize = n;
+    }
+
+    result->key = key;
+    result->keysize = keysize;
+    result->value = NULL;
+    result->valuesize = 0;
+    if (!values) return true;
+
+    // the read lock is held, so the record is read as is
+    void *ref = NULL;
+    size_t valuesize = 0;
+    if (-1 == sp_get(sp->db, key, keysize, &ref, &valuesize)) {
+      End();
+      return false;
+    }
+    if (NULL == ref) continue;
+    value = (char *) ref;
+    if (sp->framed && !(value = sp->Unframe(value, &valuesize))) {
+      End();
+      return false;
+    }
+    result->value = value;
+    result->valuesize = valuesize;
+    return true;
+  }
+
+  return false;
+}
+
+SophiaReturnCode
+IndexIterator::End() {
+  if (entries) {
+    entries->End();
+    delete entries;
+    entries = NULL;
+  }
+  free(value);
+  value = NULL;
+  return SOPHIA_SUCCESS;
+}
+
+Iterator::Position
+Iterator::begin() {
+  if (NULL == cursor && SOPHIA_SUCCESS != Begin()) return end();
+  return Position(this, Next());
+}
+
+Iterator::Position
+Iterator::end() {
+  return Position(this, NULL);
+}
+
+/**
+ * Iterator position.
+ */
+
+Iterator::Position::Position(
+    Iterator *it
+  , IteratorResult *result
+) : it(it), result(result) {}
+
+const IteratorResult &
+Iterator::Position::operator*() const {
+  return *result;
+}
+
+const IteratorResult *
+Iterator::Position::operator->() const {
+  return result;
+}
+
+Iterator::Position &
+Iterator::Position::operator++() {
+  result = it->Next();
+  return *this;
+}
+
+bool
+Iterator::Position::operator!=(const Position &other) const {
+  return result != other.result;
+}
+
+bool
+Iterator::Position::operator==(const Position &other) const {
+  return result == other.result;
+}
+
+/**
+ * Stack space a keyspace key is built in before falling
+ * back to the heap.
+ */
+
+#define KEYSPACE_KEY_SIZE 256
+
+/**
+ * Key prefixed with a keyspace.  `data` is `NULL` when
+ * it can't be allocated.
+ */
+
+class KeyspaceKey {
+  public:
+
+    KeyspaceKey(
+        const char *prefix
+      , size_t prefixsize
+      , const char *key
+      , size_t keysize
+    ) {
+      size = prefixsize + keysize;
+      heap = size > sizeof(stack) ? (char *) malloc(size) : NULL;
+      data = size > sizeof(stack) ? heap : stack;
+      if (!data) return;
+      memcpy(data, prefix, prefixsize);
+      if (keysize) memcpy(data + prefixsize, key, keysize);
+    }
+
+    ~KeyspaceKey() {
+      free(heap);
+    }
+
+    char *data;
+    size_t size;
+
+  private:
+
+    char stack[KEYSPACE_KEY_SIZE];
+    char *heap;
+};
+
+/**
+ * Database::Count() scan callback.
+ */
+
+static bool
+KeyspaceCount(const IteratorResult *, void *data) {
+  (*(size_t *) data)++;
+  return true;
+}
+
+/**
+ * Database.
+ */
+
+Database::Database(Sophia *sp, const char *name, size_t size) : sp(sp) {
+  prefixsize = size;
+  prefix = (char *) malloc(size);
+  limit = (char *) malloc(size);
+  if (!prefix || !limit) return;
+  memcpy(prefix, name, size);
+  memcpy(limit, name, size);
+  limit[size - 1] = '\1';
+}
+
+Database::~Database() {
+  free(prefix);
+  free(limit);
+}
+
+const char *
+Database::Name() {
+  return prefix;
+}
+
+SophiaReturnCode
+Database::Set(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  KeyspaceKey k(prefix, prefixsize, key, keysize);
+  if (!k.data) return SOPHIA_ALLOC_ERROR;
+  return sp->Set(k.data, k.size, value, valuesize);
+}
+
+SophiaReturnCode
+Database::Set(const char *key, const char *value) {
+  size_t keysize = strlen(key) + 1;
+  size_t valuesize = strlen(value) + 1;
+  return Set(key, keysize, value, valuesize);
+}
+
+char *
+Database::Get(const char *key, size_t keysize) {
+  KeyspaceKey k(prefix, prefixsize, key, keysize);
+  if (!k.data) return NULL;
+  return sp->Get(k.data, k.size);
+}
+
+char *
+Database::Get(const char *key) {
+  size_t keysize = strlen(key) + 1;
+  return Get(key, keysize);
+}
+
+SophiaReturnCode
+Database::Get(const char *key, size_t keysize, Value &value) {
+  KeyspaceKey k(prefix, prefixsize, key, keysize);
+  if (!k.data) {
+    value.Reset();
+    return SOPHIA_ALLOC_ERROR;
+  }
+  return sp->Get(k.data, k.size, value);
+}
+
+SophiaReturnCode
+Database::Get(const char *key, Value &value) {
+  size_t keysize = strlen(key) + 1;
+  return Get(key, keysize, value);
+}
+
+SophiaReturnCode
+Database::Delete(const char *key, size_t keysize) {
+  KeyspaceKey k(prefix, prefixsize, key, keysize);
+  if (!k.data) return SOPHIA_ALLOC_ERROR;
+  return sp->Delete(k.data, k.size);
+}
+
+SophiaReturnCode
+Database::Delete(const char *key) {
+  size_t keysize = strlen(key) + 1;
+  return Delete(key, keysize);
+}
+
+SophiaReturnCode
+Database::MultiGet(
+    const char **keys
+  , const size_t *keysizes
+  , size_t count
+  , MultiGetResult &result
+) {
+  SophiaReturnCode rc;
+  size_t total = 0;
+
+  for (size_t i = 0; i < count; i++) total += prefixsize + keysizes[i];
+
+  // one block: the prefixed keys, then their pointers and sizes
+  size_t n = count ? count : 1;
+  char *arena = (char *) malloc(
+      total
+    + n * sizeof(const char *)
+    + n * sizeof(size_t)
+  );
+  if (!arena) {
+    result.Reset();
+    return SOPHIA_ALLOC_ERROR;
+  }
+  const char **prefixed = (const char **) (arena + total);
+  size_t *sizes = (size_t *) (prefixed + n);
+
+  char *ptr = arena;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(ptr, prefix, prefixsize);
+    memcpy(ptr + prefixsize, keys[i], keysizes[i]);
+    prefixed[i] = ptr;
+    sizes[i] = prefixsize + keysizes[i];
+    ptr += sizes[i];
+  }
+
+  rc = sp->MultiGet(prefixed, sizes, count, result);
+  free(arena);
+  return rc;
+}
+
+SophiaReturnCode
+Database::MultiGet(const char **keys, size_t count, MultiGetResult &result) {
+  SophiaReturnCode rc;
+  size_t *keysizes = (size_t *) malloc((count ? count : 1) * sizeof(size_t));
+  if (!keysizes) return SOPHIA_ALLOC_ERROR;
+  for (size_t i = 0; i < count; i++) keysizes[i] = strlen(keys[i]) + 1;
+  rc = MultiGet(keys, keysizes, count, result);
+  free(keysizes);
+  return rc;
+}
+
+SophiaReturnCode
+Database::Set(
+    Transaction *transaction
+  , const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  if (transaction->sp != sp) return SOPHIA_WRONG_ENVIRONMENT_ERROR;
+  KeyspaceKey k(prefix, prefixsize, key, keysize);
+  if (!k.data) return SOPHIA_ALLOC_ERROR;
+  return transaction->Set(k.data, k.size, value, valuesize);
+}
+
+SophiaReturnCode
+Database::Delete(
+    Transaction *transaction
+  , const char *key
+  , size_t keysize
+) {
+  if (transaction->sp != sp) return SOPHIA_WRONG_ENVIRONMENT_ERROR;
+  KeyspaceKey k(prefix, prefixsize, key, keysize);
+  if (!k.data) return SOPHIA_ALLOC_ERROR;
+  return transaction->Delete(k.data, k.size);
+}
+
+SophiaReturnCode
+Database::Scan(
+    const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+  , ScanCallback callback
+  , void *data
+) {
+  KeyspaceKey from(prefix, prefixsize, start, start ? startsize : 0);
+  KeyspaceKey to(
+      end ? prefix : limit
+    , prefixsize
+    , end
+    , end ? endsize : 0
+  );
+  IteratorResult result;
+
+  if (!from.data || !to.data) return SOPHIA_ALLOC_ERROR;
+
+  Iterator it(
+      sp
+    , SPGTE
+    , from.data
+    , from.size
+    , true
+    , to.data
+    , to.size
+    , false
+  );
+  SophiaReturnCode rc = it.Begin();
+  if (SOPHIA_SUCCESS != rc) return rc;
+
+  while (it.Next(&result)) {
+    result.key += prefixsize;
+    result.keysize -= prefixsize;
+    if (!callback(&result, data)) break;
+  }
+
+  return it.End();
+}
+
+SophiaReturnCode
+Database::Count(size_t *n) {
+  *n = 0;
+  return Scan(NULL, 0, NULL, 0, KeyspaceCount, n);
+}
+
+SophiaReturnCode
+Database::Clear() {
+  return sp->DeleteRange(prefix, prefixsize, limit, prefixsize);
+}
+
+/**
+ * Environment.
+ */
+
+Environment::Environment(const char *path) : sp(path) {
+  handles = list_new();
+  pthread_mutex_init(&mutex, NULL);
+}
+
+Environment::~Environment() {
+  sp.Close();
+  if (handles) {
+    list_node_t *node;
+    while ((node = list_lpop(handles))) {
+      delete (Database *) node->val;
+      free(node);
+    }
+    list_destroy(handles);
+  }
+  pthread_mutex_destroy(&mutex);
+}
+
+SophiaReturnCode
+Environment::Open(
+    bool create_if_missing
+  , bool read_only
+  , int page_size
+  , int merge_watermark
+  , bool gc
+) {
+  return sp.Open(
+      create_if_missing
+    , read_only
+    , page_size
+    , merge_watermark
+    , gc
+  );
+}
+
+SophiaReturnCode
+Environment::Close() {
+  return sp.Close();
+}
+
+bool
+Environment::IsOpen() {
+  return sp.IsOpen();
+}
+
+Sophia *
+Environment::Engine() {
+  return &sp;
+}
+
+Database *
+Environment::Handle(const char *name) {
+  Database *db = NULL;
+  size_t size = strlen(name) + 1;
+
+  if (1 == size || !handles) return NULL;
+
+  pthread_mutex_lock(&mutex);
+
+  for (list_node_t *node = handles->head; node && !db; node = node->next) {
+    Database *handle = (Database *) node->val;
+    if (size == handle->prefixsize
+     && 0 == memcmp(handle->prefix, name, size)) {
+      db = handle;
+    }
+  }
+
+  if (!db && (db = new (std::nothrow) Database(&sp, name, size))) {
+    list_node_t *node = db->prefix && db->limit ? list_node_new(db) : NULL;
+    if (node) {
+      list_rpush(handles, node);
+    } else {
+      delete db;
+      db = NULL;
+    }
+  }
+
+  pthread_mutex_unlock(&mutex);
+  return db;
+}
+
+/**
+ * Current time in seconds.
+ */
+
+static double
+Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * GroupCommitWriter queue: a batch of writes and the
+ * callback of each.
+ */
+
+struct GroupCommitQueue {
+  WriteBatch batch;
+  GroupCommitCallback *callbacks;
+  void **data;
+  size_t capacity;
+};
+
+/**
+ * A caller waiting for its write to commit.
+ */
+
+typedef struct {
+  pthread_mutex_t *mutex;
+  SophiaReturnCode rc;
+  bool done;
+} GroupCommitWait;
+
+/**
+ * GroupCommitWriter callback of waiting callers.
+ */
+
+static void
+GroupCommitWake(SophiaReturnCode rc, void *data) {
+  GroupCommitWait *wait = (GroupCommitWait *) data;
+  pthread_mutex_lock(wait->mutex);
+  wait->rc = rc;
+  wait->done = true;
+  pthread_mutex_unlock(wait->mutex);
+}
+
+/**
+ * Group-commit writer.
+ */
+
+GroupCommitWriter::GroupCommitWriter(
+    Sophia *sp
+  , size_t batch_size
+  , unsigned int linger_us
+) : sp(sp), batch_size(batch_size), linger_us(linger_us) {
+  if (0 == this->batch_size) this->batch_size = 1;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&wake, NULL);
+  pthread_cond_init(&space, NULL);
+  pthread_cond_init(&committed, NULL);
+  running = false;
+  stopping = false;
+  pending = new GroupCommitQueue();
+  committing = new GroupCommitQueue();
+  batches = 0;
+  writes = 0;
+}
+
+GroupCommitWriter::~GroupCommitWriter() {
+  Stop();
+  GroupCommitQueue *queues[] = { pending, committing };
+  for (int i = 0; i < 2; i++) {
+    free(queues[i]->callbacks);
+    free(queues[i]->data);
+    delete queues[i];
+  }
+  pthread_cond_destroy(&committed);
+  pthread_cond_destroy(&space);
+  pthread_cond_destroy(&wake);
+  pthread_mutex_destroy(&mutex);
+}
+
+SophiaReturnCode
+GroupCommitWriter::Start() {
+  if (!sp->IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (running) return SOPHIA_SUCCESS;
+
+  stopping = false;
+  if (0 != pthread_create(&thread, NULL, Main, this)) {
+    return SOPHIA_THREAD_ERROR;
+  }
+  running = true;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+GroupCommitWriter::Stop() {
+  if (!running) return SOPHIA_SUCCESS;
+
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_signal(&wake);
+  pthread_cond_broadcast(&space);
+  pthread_mutex_unlock(&mutex);
+
+  pthread_join(thread, NULL);
+  running = false;
+  return SOPHIA_SUCCESS;
+}
+
+SophiaReturnCode
+GroupCommitWriter::Set(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  return Enqueue(key, keysize, value, valuesize, NULL, NULL);
+}
+
+SophiaReturnCode
+GroupCommitWriter::Set(const char *key, const char *value) {
+  size_t keysize = strlen(key) + 1;
+  size_t valuesize = strlen(value) + 1;
+  return Set(key, keysize, value, valuesize);
+}
+
+SophiaReturnCode
+GroupCommitWriter::Set(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+  , GroupCommitCallback callback
+  , void *data
+) {
+  return Enqueue(key, keysize, value, valuesize, callback, data);
+}
+
+SophiaReturnCode
+GroupCommitWriter::Delete(const char *key, size_t keysize) {
+  return Enqueue(key, keysize, NULL, 0, NULL, NULL);
+}
 
-static void
-DestroyCursor(void *node) {
-  if (node) sp_destroy(node);
+SophiaReturnCode
+GroupCommitWriter::Delete(const char *key) {
+  size_t keysize = strlen(key) + 1;
+  return Delete(key, keysize);
 }
 
-Sophia::Sophia(const char *path) : path(path) {
-  env = NULL;
-  db = NULL;
-  // cursor = NULL;
-  cursors = list_new();
-  cursors->free = DestroyCursor;
-  open = false;
+SophiaReturnCode
+GroupCommitWriter::Delete(
+    const char *key
+  , size_t keysize
+  , GroupCommitCallback callback
+  , void *data
+) {
+  return Enqueue(key, keysize, NULL, 0, callback, data);
 }
 
-Sophia::~Sophia() {
-  if (cursors) list_destroy(cursors);
-  if (db) sp_destroy(db);
-  if (env) sp_destroy(env);
+size_t
+GroupCommitWriter::Batches() {
+  pthread_mutex_lock(&mutex);
+  size_t n = batches;
+  pthread_mutex_unlock(&mutex);
+  return n;
 }
 
-bool
-Sophia::IsOpen() {
-  return open;
+size_t
+GroupCommitWriter::Writes() {
+  pthread_mutex_lock(&mutex);
+  size_t n = writes;
+  pthread_mutex_unlock(&mutex);
+  return n;
 }
 
 SophiaReturnCode
-Sophia::Open(
-    bool create_if_missing
-  , bool read_only
-  , int page_size
-  , int merge_watermark
-  , bool gc
+GroupCommitWriter::Enqueue(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+  , GroupCommitCallback callback
+  , void *data
 ) {
-  uint32_t flags = 0;
+  SophiaReturnCode rc;
+  GroupCommitWait wait = { &mutex, SOPHIA_SUCCESS, false };
 
-  if (!(env = sp_env())) {
-    return SOPHIA_ENV_ALLOC_ERROR;
+  if (!callback) {
+    callback = GroupCommitWake;
+    data = &wait;
   }
 
-  if (create_if_missing) flags |= SPO_CREAT;
+  pthread_mutex_lock(&mutex);
 
-  if (read_only) {
-    flags |= SPO_RDONLY;
-  } else {
-    flags |= SPO_RDWR;
+  // wait for the writer to take the full batch
+  while (!stopping && pending->batch.Count() >= batch_size) {
+    pthread_cond_wait(&space, &mutex);
   }
-
-  if (-1 == sp_ctl(env, SPDIR, flags, path)) {
-    free(env);
-    return SOPHIA_OPEN_ERROR;
+  if (!running || stopping) {
+    pthread_mutex_unlock(&mutex);
+    return SOPHIA_WRITER_STOPPED_ERROR;
   }
 
-  if (gc && -1 == sp_ctl(env, SPGC, 1)) {
-    free(env);
-    return SOPHIA_GC_ERROR;
+  size_t n = pending->batch.Count();
+  if (n == pending->capacity) {
+    size_t capacity = n ? n * 2 : 64;
+    GroupCommitCallback *callbacks = (GroupCommitCallback *) realloc(
+        pending->callbacks
+      , capacity * sizeof(GroupCommitCallback)
+    );
+    if (callbacks) pending->callbacks = callbacks;
+    void **datas = (void **) realloc(pending->data, capacity * sizeof(void *));
+    if (datas) pending->data = datas;
+    if (!callbacks || !datas) {
+      pthread_mutex_unlock(&mutex);
+      return SOPHIA_ALLOC_ERROR;
+    }
+    pending->capacity = capacity;
   }
 
-  if (-1 == sp_ctl(env, SPMERGEWM, merge_watermark)) {
-    free(env);
-    return SOPHIA_MW_ERROR;
+  rc = value
+    ? pending->batch.Set(key, keysize, value, valuesize)
+    : pending->batch.Delete(key, keysize);
+  if (SOPHIA_SUCCESS != rc) {
+    pthread_mutex_unlock(&mutex);
+    return rc;
   }
+  pending->callbacks[n] = callback;
+  pending->data[n] = data;
 
-  if (-1 == sp_ctl(env, SPPAGE, page_size)) {
-    free(env);
-    return SOPHIA_PAGE_ERROR;
+  // the writer waits for the first write, then for a full batch
+  if (0 == n || batch_size == n + 1) pthread_cond_signal(&wake);
+
+  if (&wait == data) {
+    while (!wait.done) pthread_cond_wait(&committed, &mutex);
+    rc = wait.rc;
   }
 
-  if (!(db = sp_open(env))) {
-    free(env);
-    return SOPHIA_ENV_ERROR;
+  pthread_mutex_unlock(&mutex);
+  return rc;
+}
+
+void
+GroupCommitWriter::Run() {
+  pthread_mutex_lock(&mutex);
+
+  for (;;) {
+    while (!stopping && 0 == pending->batch.Count()) {
+      pthread_cond_wait(&wake, &mutex);
+    }
+    if (0 == pending->batch.Count()) break;
+
+    // linger for a fuller batch
+    if (linger_us && !stopping && pending->batch.Count() < batch_size) {
+      struct timeval now;
+      struct timespec deadline;
+      gettimeofday(&now, NULL);
+      long usec = now.tv_usec + (long) linger_us;
+      deadline.tv_sec = now.tv_sec + usec / 1000000;
+      deadline.tv_nsec = (usec % 1000000) * 1000;
+      while (!stopping && pending->batch.Count() < batch_size) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&wake, &mutex, &deadline)) {
+          break;
+        }
+      }
+    }
+
+    GroupCommitQueue *queue = pending;
+    pending = committing;
+    committing = queue;
+    pthread_cond_broadcast(&space);
+    pthread_mutex_unlock(&mutex);
+
+    size_t n = queue->batch.Count();
+    SophiaReturnCode rc = sp->Write(queue->batch);
+    queue->batch.Clear();
+
+    pthread_mutex_lock(&mutex);
+    batches++;
+    writes += n;
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i = 0; i < n; i++) queue->callbacks[i](rc, queue->data[i]);
+
+    pthread_mutex_lock(&mutex);
+    pthread_cond_broadcast(&committed);
   }
 
-  open = true;
+  pthread_mutex_unlock(&mutex);
+}
 
-  return SOPHIA_SUCCESS;
+void *
+GroupCommitWriter::Main(void *writer) {
+  ((GroupCommitWriter *) writer)->Run();
+  return NULL;
 }
 
-SophiaReturnCode
-Sophia::Close() {
-  // noop if we're already closed
-  if (!open) return SOPHIA_SUCCESS;
+/**
+ * AsyncSophia::GetAsync() result.
+ */
 
-  if (cursors) list_destroy(cursors);
-  cursors = NULL;
+AsyncGetResult::AsyncGetResult() {
+  rc = SOPHIA_SUCCESS;
+  value = NULL;
+  valuesize = 0;
+}
 
-  if (db && -1 == sp_destroy(db)) {
-    return SOPHIA_DESTROY_ERROR;
-  }
-  db = NULL;
+AsyncGetResult::AsyncGetResult(
+    SophiaReturnCode rc
+  , char *value
+  , size_t valuesize
+) : rc(rc), value(value), valuesize(valuesize) {}
 
-  if (env && -1 == sp_destroy(env)) {
-    return SOPHIA_DESTROY_ERROR;
-  }
-  env = NULL;
+AsyncGetResult::AsyncGetResult(AsyncGetResult &&other) {
+  rc = other.rc;
+  valuesize = other.valuesize;
+  value = other.Release();
+}
 
-  open = false;
+AsyncGetResult &
+AsyncGetResult::operator=(AsyncGetResult &&other) {
+  if (this == &other) return *this;
+  free(value);
+  rc = other.rc;
+  valuesize = other.valuesize;
+  value = other.Release();
+  return *this;
+}
 
-  return SOPHIA_SUCCESS;
+AsyncGetResult::~AsyncGetResult() {
+  free(value);
 }
 
-SophiaReturnCode
-Sophia::Set(
-    const char *key
+char *
+AsyncGetResult::Release() {
+  char *ref = value;
+  value = NULL;
+  valuesize = 0;
+  return ref;
+}
+
+/**
+ * AsyncSophia operation types.
+ */
+
+typedef enum {
+    ASYNC_GET = 0
+  , ASYNC_SET = 1
+  , ASYNC_DELETE = 2
+  , ASYNC_MULTIGET = 3
+  , ASYNC_SCAN = 4
+} AsyncTaskType;
+
+/**
+ * Queued AsyncSophia operation.  Keys and values point
+ * into `buffer`, which holds copies of the caller's.
+ */
+
+struct AsyncTask {
+  AsyncTaskType type;
+  char *buffer;
+
+  // get/set/delete key, scan start
+  const char *key;
+  size_t keysize;
+
+  // set value, scan end
+  const char *value;
+  size_t valuesize;
+
+  // multiget
+  const char **keys;
+  size_t *keysizes;
+  size_t count;
+  MultiGetResult *result;
+
+  // scan
+  ScanCallback scan;
+  void *scandata;
+
+  // completion
+  AsyncCallback callback;
+  AsyncGetCallback getcallback;
+  void *data;
+  bool promised;
+  std::promise<SophiaReturnCode> status;
+  std::promise<AsyncGetResult> got;
+};
+
+/**
+ * Create a task of `type` over copies of `key` of `keysize`
+ * and `value` of `valuesize`, either of which may be `NULL`.
+ */
+
+static AsyncTask *
+NewAsyncTask(
+    AsyncTaskType type
+  , const char *key
   , size_t keysize
   , const char *value
   , size_t valuesize
 ) {
-  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
-  if (-1 == sp_set(db, key, keysize, value, valuesize)) {
-    return SOPHIA_DB_ERROR;
+  AsyncTask *task = new (std::nothrow) AsyncTask();
+  if (!task) return NULL;
+
+  if (!(task->buffer = (char *) malloc(keysize + valuesize + 1))) {
+    delete task;
+    return NULL;
   }
-  return SOPHIA_SUCCESS;
+  if (key) memcpy(task->buffer, key, keysize);
+  if (value) memcpy(task->buffer + keysize, value, valuesize);
+
+  task->type = type;
+  task->key = key ? task->buffer : NULL;
+  task->keysize = keysize;
+  task->value = value ? task->buffer + keysize : NULL;
+  task->valuesize = valuesize;
+  task->keys = NULL;
+  task->keysizes = NULL;
+  task->count = 0;
+  task->result = NULL;
+  task->scan = NULL;
+  task->scandata = NULL;
+  task->callback = NULL;
+  task->getcallback = NULL;
+  task->data = NULL;
+  task->promised = false;
+  return task;
 }
 
-SophiaReturnCode
-Sophia::Set(const char *key, const char *value) {
-  size_t keysize = strlen(key) + 1;
-  size_t valuesize = strlen(value) + 1;
-  return Set(key, keysize, value, valuesize);
+/**
+ * Create a MultiGet task over copies of `count` `keys` of
+ * `keysizes`.
+ */
+
+static AsyncTask *
+NewAsyncMultiGetTask(
+    const char **keys
+  , const size_t *keysizes
+  , size_t count
+  , MultiGetResult *result
+) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; i++) bytes += keysizes[i];
+
+  // key pointers, then key sizes, then key bytes
+  size_t header = count * (sizeof(char *) + sizeof(size_t));
+  AsyncTask *task = NewAsyncTask(ASYNC_MULTIGET, NULL, header + bytes, NULL, 0);
+  if (!task) return NULL;
+
+  task->keys = (const char **) task->buffer;
+  task->keysizes = (size_t *) (task->buffer + count * sizeof(char *));
+  char *ptr = task->buffer + header;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(ptr, keys[i], keysizes[i]);
+    task->keys[i] = ptr;
+    task->keysizes[i] = keysizes[i];
+    ptr += keysizes[i];
+  }
+  task->keysize = 0;
+  task->count = count;
+  task->result = result;
+  return task;
 }
 
-char *
-Sophia::Get(const char *key, size_t keysize) {
-  void *ref = NULL;
-  char *value = NULL;
-  size_t valuesize;
+/**
+ * Free `task`.
+ */
 
-  if (!IsOpen()) return NULL;
+static void
+DeleteAsyncTask(AsyncTask *task) {
+  free(task->buffer);
+  delete task;
+}
 
-  if (-1 == sp_get(db, key, keysize, &ref, &valuesize)) {
-    return NULL;
+/**
+ * Run `task` against `sp` and complete it.
+ */
+
+static void
+RunAsyncTask(Sophia *sp, AsyncTask *task) {
+  SophiaReturnCode rc = SOPHIA_SUCCESS;
+
+  switch (task->type) {
+    case ASYNC_GET: {
+      Value value;
+      AsyncGetResult result;
+      result.rc = sp->Get(task->key, task->keysize, value);
+      result.valuesize = value.Size();
+      result.value = value.Release();
+      if (task->getcallback) {
+        task->getcallback(std::move(result), task->data);
+      } else {
+        task->got.set_value(std::move(result));
+      }
+      return;
+    }
+
+    case ASYNC_SET:
+      rc = sp->Set(task->key, task->keysize, task->value, task->valuesize);
+      break;
+
+    case ASYNC_DELETE:
+      rc = sp->Delete(task->key, task->keysize);
+      break;
+
+    case ASYNC_MULTIGET:
+      rc = sp->MultiGet(task->keys, task->keysizes, task->count, *task->result);
+      break;
+
+    case ASYNC_SCAN: {
+      IteratorResult row;
+      Iterator it(
+          sp
+        , SPGTE
+        , task->key
+        , task->keysize
+        , true
+        , task->value
+        , task->valuesize
+        , false
+      );
+      if (SOPHIA_SUCCESS != (rc = it.Begin())) break;
+      while (it.Next(&row)) {
+        if (!task->scan(&row, task->scandata)) break;
+      }
+      rc = it.End();
+      break;
+    }
   }
 
-  if (NULL == ref) return NULL;
+  if (task->callback) {
+    task->callback(rc, task->data);
+  } else if (task->promised) {
+    task->status.set_value(rc);
+  }
+}
 
-  value = (char *) ref;
-  return value;
+/**
+ * Async facade.
+ */
+
+AsyncSophia::AsyncSophia(
+    Sophia *sp
+  , size_t threads
+  , size_t queue_size
+) : sp(sp) {
+  nthreads = threads ? threads : 1;
+  capacity = queue_size ? queue_size : 1;
+  this->threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  queue = (AsyncTask **) malloc(capacity * sizeof(AsyncTask *));
+  head = 0;
+  count = 0;
+  running = false;
+  stopping = false;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&ready, NULL);
+  pthread_cond_init(&space, NULL);
 }
 
-char *
-Sophia::Get(const char *key) {
-  size_t keysize = strlen(key) + 1;
-  return Get(key, keysize);
+AsyncSophia::~AsyncSophia() {
+  Stop();
+  pthread_cond_destroy(&space);
+  pthread_cond_destroy(&ready);
+  pthread_mutex_destroy(&mutex);
+  free(queue);
+  free(threads);
 }
 
 SophiaReturnCode
-Sophia::Delete(const char *key, size_t keysize) {
-  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
-  if (-1 == sp_delete(db, key, keysize)) {
-    return SOPHIA_DB_ERROR;
+AsyncSophia::Start() {
+  if (!threads || !queue) return SOPHIA_ALLOC_ERROR;
+  if (!sp->IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  if (1 < nthreads && !sp->IsThreadSafe()) return SOPHIA_NOT_THREAD_SAFE_ERROR;
+  if (running) return SOPHIA_SUCCESS;
+
+  stopping = false;
+  for (size_t i = 0; i < nthreads; i++) {
+    if (0 != pthread_create(&threads[i], NULL, Main, this)) {
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_broadcast(&ready);
+      pthread_mutex_unlock(&mutex);
+      while (i--) pthread_join(threads[i], NULL);
+      return SOPHIA_THREAD_ERROR;
+    }
   }
+
+  running = true;
   return SOPHIA_SUCCESS;
 }
 
 SophiaReturnCode
-Sophia::Delete(const char *key) {
+AsyncSophia::Stop() {
+  if (!running) return SOPHIA_SUCCESS;
+
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&ready);
+  pthread_cond_broadcast(&space);
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+  running = false;
+  return SOPHIA_SUCCESS;
+}
+
+std::future<AsyncGetResult>
+AsyncSophia::GetAsync(const char *key, size_t keysize) {
+  return ValueFuture(NewAsyncTask(ASYNC_GET, key, keysize, NULL, 0));
+}
+
+std::future<AsyncGetResult>
+AsyncSophia::GetAsync(const char *key) {
   size_t keysize = strlen(key) + 1;
-  return Delete(key, keysize);
+  return GetAsync(key, keysize);
 }
 
 SophiaReturnCode
-Sophia::Count(size_t *n) {
-  size_t count = 0;
-  list_node_t *cursor_node = NULL;
+AsyncSophia::GetAsync(
+    const char *key
+  , size_t keysize
+  , AsyncGetCallback callback
+  , void *data
+) {
+  AsyncTask *task = NewAsyncTask(ASYNC_GET, key, keysize, NULL, 0);
+  if (!task) return SOPHIA_ALLOC_ERROR;
 
-  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+  task->getcallback = callback;
+  task->data = data;
+  SophiaReturnCode rc = Enqueue(task);
+  if (SOPHIA_SUCCESS != rc) DeleteAsyncTask(task);
+  return rc;
+}
 
-  void *cursor = sp_cursor(db, SPGT, NULL, 0);
-  if (NULL == cursor) {
-    return SOPHIA_DB_ERROR;
-  }
+std::future<SophiaReturnCode>
+AsyncSophia::SetAsync(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+) {
+  return StatusFuture(NewAsyncTask(
+      ASYNC_SET
+    , key
+    , keysize
+    , value
+    , valuesize
+  ));
+}
 
-  cursor_node = list_node_new(cursor);
-  list_rpush(cursors, cursor_node);
-  while (sp_fetch(cursor)) {
-    if (sp_key(cursor)) {
-      count++;
-    }
-  }
+std::future<SophiaReturnCode>
+AsyncSophia::SetAsync(const char *key, const char *value) {
+  size_t keysize = strlen(key) + 1;
+  size_t valuesize = strlen(value) + 1;
+  return SetAsync(key, keysize, value, valuesize);
+}
 
-  // remove and destroy the cursor
-  list_remove(cursors, cursor_node);
-  *n = count;
+SophiaReturnCode
+AsyncSophia::SetAsync(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+  , AsyncCallback callback
+  , void *data
+) {
+  return Notify(
+      NewAsyncTask(ASYNC_SET, key, keysize, value, valuesize)
+    , callback
+    , data
+  );
+}
+
+std::future<SophiaReturnCode>
+AsyncSophia::DeleteAsync(const char *key, size_t keysize) {
+  return StatusFuture(NewAsyncTask(ASYNC_DELETE, key, keysize, NULL, 0));
+}
+
+std::future<SophiaReturnCode>
+AsyncSophia::DeleteAsync(const char *key) {
+  size_t keysize = strlen(key) + 1;
+  return DeleteAsync(key, keysize);
+}
+
+SophiaReturnCode
+AsyncSophia::DeleteAsync(
+    const char *key
+  , size_t keysize
+  , AsyncCallback callback
+  , void *data
+) {
+  return Notify(
+      NewAsyncTask(ASYNC_DELETE, key, keysize, NULL, 0)
+    , callback
+    , data
+  );
+}
+
+std::future<SophiaReturnCode>
+AsyncSophia::MultiGetAsync(
+    const char **keys
+  , const size_t *keysizes
+  , size_t count
+  , MultiGetResult &result
+) {
+  return StatusFuture(NewAsyncMultiGetTask(keys, keysizes, count, &result));
+}
 
-  return SOPHIA_SUCCESS;
+SophiaReturnCode
+AsyncSophia::MultiGetAsync(
+    const char **keys
+  , const size_t *keysizes
+  , size_t count
+  , MultiGetResult &result
+  , AsyncCallback callback
+  , void *data
+) {
+  return Notify(
+      NewAsyncMultiGetTask(keys, keysizes, count, &result)
+    , callback
+    , data
+  );
 }
 
-/**
- * Internal store for key/size.
- */
+std::future<SophiaReturnCode>
+AsyncSophia::ScanAsync(
+    const char *start
+  , size_t startsize
+  , const char *end
+  , size_t endsize
+  , ScanCallback callback
+  , void *data
+) {
+  AsyncTask *task = NewAsyncTask(
+      ASYNC_SCAN
+    , start
+    , start ? startsize : 0
+    , end
+    , end ? endsize : 0
+  );
+  if (task) {
+    task->scan = callback;
+    task->scandata = data;
+  }
+  return StatusFuture(task);
+}
 
-typedef struct {
-  const char *key;
-  size_t size;
-} ClearKey;
+std::future<SophiaReturnCode>
+AsyncSophia::StatusFuture(AsyncTask *task) {
+  if (!task) {
+    std::promise<SophiaReturnCode> failed;
+    failed.set_value(SOPHIA_ALLOC_ERROR);
+    return failed.get_future();
+  }
 
-SophiaReturnCode
-Sophia::Clear() {
-  SophiaReturnCode rc;
-  size_t count;
-  void *cursor = NULL;
-  list_node_t *cursor_node = NULL;
+  task->promised = true;
+  std::future<SophiaReturnCode> future = task->status.get_future();
+  SophiaReturnCode rc = Enqueue(task);
+  if (SOPHIA_SUCCESS != rc) {
+    task->status.set_value(rc);
+    DeleteAsyncTask(task);
+  }
+  return future;
+}
 
-  if (!IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
+std::future<AsyncGetResult>
+AsyncSophia::ValueFuture(AsyncTask *task) {
+  if (!task) {
+    std::promise<AsyncGetResult> promise;
+    promise.set_value(AsyncGetResult(SOPHIA_ALLOC_ERROR, NULL, 0));
+    return promise.get_future();
+  }
 
-  rc = Count(&count);
+  std::future<AsyncGetResult> future = task->got.get_future();
+  SophiaReturnCode rc = Enqueue(task);
   if (SOPHIA_SUCCESS != rc) {
-    return rc;
+    task->got.set_value(AsyncGetResult(rc, NULL, 0));
+    DeleteAsyncTask(task);
   }
+  return future;
+}
 
-  cursor = sp_cursor(db, SPGT, NULL, 0);
-  if (NULL == cursor) return SOPHIA_DB_ERROR;
-  cursor_node = list_node_new(cursor);
-  list_rpush(cursors, cursor_node);
+SophiaReturnCode
+AsyncSophia::Notify(AsyncTask *task, AsyncCallback callback, void *data) {
+  if (!task) return SOPHIA_ALLOC_ERROR;
 
-  ClearKey keys[count];
-  int i = 0;
-  while (sp_fetch(cursor)) {
-    keys[i].key = sp_key(cursor);
-    keys[i].size = sp_keysize(cursor);
-    i++;
-  }
+  task->callback = callback;
+  task->data = data;
+  SophiaReturnCode rc = Enqueue(task);
+  if (SOPHIA_SUCCESS != rc) DeleteAsyncTask(task);
+  return rc;
+}
 
-  // remove and destroy the cursor
-  list_remove(cursors, cursor_node);
+SophiaReturnCode
+AsyncSophia::Enqueue(AsyncTask *task) {
+  pthread_mutex_lock(&mutex);
 
-  for (int i = 0; i < (int) count; i++) {
-    rc = Delete(keys[i].key, keys[i].size);
-    if (SOPHIA_SUCCESS != rc) return rc;
+  while (running && !stopping && count == capacity) {
+    pthread_cond_wait(&space, &mutex);
+  }
+  if (!running || stopping) {
+    pthread_mutex_unlock(&mutex);
+    return SOPHIA_POOL_STOPPED_ERROR;
   }
 
+  queue[(head + count) % capacity] = task;
+  count++;
+  pthread_cond_signal(&ready);
+  pthread_mutex_unlock(&mutex);
   return SOPHIA_SUCCESS;
 }
 
-const char *
-Sophia::Error(SophiaReturnCode rc) {
-  char *err = NULL;
-  switch (rc) {
-    case SOPHIA_SUCCESS:
-      return NULL;
+void
+AsyncSophia::Run() {
+  pthread_mutex_lock(&mutex);
 
-    case SOPHIA_ENV_ALLOC_ERROR:
-      return "Failed to allocate environment";
-    case SOPHIA_OPEN_ERROR:
-      return "Failed to open/create repository";
-    case SOPHIA_GC_ERROR:
-      return "Failed to enable GC";
-    case SOPHIA_MW_ERROR:
-      return "Failed to set merge watermark";
-    case SOPHIA_PAGE_ERROR:
-      return "Failed to set page size";
-    case SOPHIA_DESTROY_ERROR:
-      return "Failed to destroy environment";
-    case SOPHIA_CURSOR_ALREADY_OPEN_ERROR:
-      return "An existing cursor is open";
+  for (;;) {
+    while (!stopping && 0 == count) pthread_cond_wait(&ready, &mutex);
+    if (0 == count) break;
 
-    case SOPHIA_TRANSACTION_ALLOC_ERROR:
-      return "Failed to allocate transaction operation";
-    case SOPHIA_TRANSACTION_OPERATION_ERROR:
-      return "Failed to add operation to transaction stack";
-    case SOPHIA_TRANSACTION_NOT_OPEN_ERROR:
-      return "Transaction not open";
+    AsyncTask *task = queue[head];
+    head = (head + 1) % capacity;
+    count--;
+    pthread_cond_signal(&space);
+    pthread_mutex_unlock(&mutex);
 
-    case SOPHIA_DATABASE_NOT_OPEN_ERROR:
-      return "Database not open";
+    RunAsyncTask(sp, task);
+    DeleteAsyncTask(task);
 
-    case SOPHIA_ENV_ERROR:
-      if (!env || !(err = sp_error(env))) {
-        return "Unknown environment error";
-      }
-      return err;
-    case SOPHIA_DB_ERROR:
-      if (!db || !(err = sp_error(db))) {
-        return "Unknown database error";
-      }
-      return err;
+    pthread_mutex_lock(&mutex);
   }
+
+  pthread_mutex_unlock(&mutex);
+}
+
+void *
+AsyncSophia::Main(void *async) {
+  ((AsyncSophia *) async)->Run();
   return NULL;
 }
 
 /**
- * Operation list `free` callback.
+ * Bulk file.
  */
 
-static void
-DestroyOperation(void *node) {
-  TransactionOperation *operation = (TransactionOperation *) node;
-  if (operation->key) free(operation->key);
-  if (operation->value) free(operation->value);
-  delete operation;
+BulkFile::BulkFile(const char *path) : path(path) {
+  map = NULL;
+  mapsize = 0;
+  offset = 0;
+}
+
+BulkFile::~BulkFile() {
+  Close();
 }
 
+SophiaReturnCode
+BulkFile::Open() {
+  struct stat st;
+  int fd;
 
-/**
- * Sophia transaction.
- */
+  Close();
+  if (-1 == (fd = open(path, O_RDONLY))) return SOPHIA_FILE_ERROR;
+  if (-1 == fstat(fd, &st)) {
+    close(fd);
+    return SOPHIA_FILE_ERROR;
+  }
 
-Transaction::Transaction(Sophia *sp) : sp(sp) {
-  operations = list_new();
-  operations->free = DestroyOperation;
+  mapsize = st.st_size;
+  offset = 0;
+  if (0 == mapsize) {
+    close(fd);
+    return SOPHIA_SUCCESS;
+  }
+
+  void *ptr = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == ptr) {
+    mapsize = 0;
+    return SOPHIA_FILE_ERROR;
+  }
+
+  map = (char *) ptr;
+  madvise(map, mapsize, MADV_SEQUENTIAL);
+  return SOPHIA_SUCCESS;
 }
 
-Transaction::~Transaction() {
-  if (operations) {
-    list_destroy(operations);
+int
+BulkFile::Next(
+    const char **key
+  , size_t *keysize
+  , const char **value
+  , size_t *valuesize
+) {
+  uint32_t sizes[2];
+
+  if (offset == mapsize) return 0;
+  if (mapsize - offset < sizeof(sizes)) return -1;
+
+  memcpy(sizes, map + offset, sizeof(sizes));
+  if (mapsize - offset - sizeof(sizes) < (size_t) sizes[0] + sizes[1]) {
+    return -1;
   }
+
+  *key = map + offset + sizeof(sizes);
+  *keysize = sizes[0];
+  *value = *key + sizes[0];
+  *valuesize = sizes[1];
+  offset += sizeof(sizes) + sizes[0] + sizes[1];
+  return 1;
 }
 
-SophiaReturnCode
-Transaction::Begin() {
-  if (!sp->IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
-  if (-1 == sp_begin(sp->db)) return SOPHIA_DB_ERROR;
-  return SOPHIA_SUCCESS;
+void
+BulkFile::Close() {
+  if (map) munmap(map, mapsize);
+  map = NULL;
+  mapsize = 0;
+  offset = 0;
 }
 
 SophiaReturnCode
-Transaction::Set(
-    const char *key
+BulkFile::Write(
+    FILE *file
+  , const char *key
   , size_t keysize
   , const char *value
   , size_t valuesize
 ) {
-  TransactionOperation *operation = new TransactionOperation;
-  operation->type = TRANSACTION_OPERATION_SET;
-  operation->key = strdup(key);
-  operation->keysize = keysize;
-  operation->value = strdup(value);
-  operation->valuesize = valuesize;
-  return AddOperation(operation);
+  uint32_t sizes[2] = { (uint32_t) keysize, (uint32_t) valuesize };
+  if (1 != fwrite(sizes, sizeof(sizes), 1, file)
+   || keysize != fwrite(key, 1, keysize, file)
+   || valuesize != fwrite(value, 1, valuesize, file)) {
+    return SOPHIA_FILE_ERROR;
+  }
+  return SOPHIA_SUCCESS;
 }
 
-SophiaReturnCode
-Transaction::Set(const char *key, const char *value) {
-  size_t keysize = strlen(key) + 1;
-  size_t valuesize = strlen(value) + 1;
-  return this->Set(key, keysize, value, valuesize);
-}
+/**
+ * Snapshot file.
+ */
 
-SophiaReturnCode
-Transaction::Delete(const char *key, size_t keysize) {
-  TransactionOperation *operation = new TransactionOperation;
-  operation->type = TRANSACTION_OPERATION_DELETE;
-  operation->key = strdup(key);
-  operation->keysize = keysize;
-  operation->value = NULL;
-  operation->valuesize = -1;
-  return AddOperation(operation);
+SnapshotFile::SnapshotFile(const char *path) : path(path) {
+  map = NULL;
+  mapsize = 0;
+  index = NULL;
+  blocks = 0;
+  records = 0;
+  bytes = 0;
+  block = 0;
+  offset = 0;
+  blockend = 0;
 }
 
-SophiaReturnCode
-Transaction::Delete(const char *key) {
-  size_t keysize = strlen(key) + 1;
-  return Delete(key, keysize);
+SnapshotFile::~SnapshotFile() {
+  Close();
 }
 
 SophiaReturnCode
-Transaction::AddOperation(TransactionOperation *operation) {
-  // cannot write to a committed/bad transaction
-  if (!operations) return SOPHIA_TRANSACTION_NOT_OPEN_ERROR;
+SnapshotFile::Open() {
+  SnapshotFooter footer;
+  struct stat st;
+  int fd;
+
+  Close();
+  if (-1 == (fd = open(path, O_RDONLY))) return SOPHIA_FILE_ERROR;
+  if (-1 == fstat(fd, &st)) {
+    close(fd);
+    return SOPHIA_FILE_ERROR;
+  }
+  if ((size_t) st.st_size < 8 + sizeof(footer)) {
+    close(fd);
+    return SOPHIA_FORMAT_ERROR;
+  }
+
+  mapsize = st.st_size;
+  void *ptr = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == ptr) {
+    mapsize = 0;
+    return SOPHIA_FILE_ERROR;
+  }
+  map = (char *) ptr;
+  madvise(map, mapsize, MADV_SEQUENTIAL);
+
+  memcpy(&footer, map + mapsize - sizeof(footer), sizeof(footer));
+  if (0 != memcmp(map, SNAPSHOT_MAGIC, 8)
+   || 0 != memcmp(footer.magic, SNAPSHOT_MAGIC, sizeof(footer.magic))) {
+    Close();
+    return SOPHIA_FORMAT_ERROR;
+  }
+  uint32_t checksum = Crc32c(
+      0
+    , (const char *) &footer
+    , offsetof(SnapshotFooter, checksum)
+  );
+  if (checksum != footer.checksum) {
+    Close();
+    return SOPHIA_CHECKSUM_ERROR;
+  }
 
-  list_node_t *node = list_node_new(operation);
-  if (!node) return SOPHIA_TRANSACTION_ALLOC_ERROR;
+  // the index fills the space between the blocks and footer
+  size_t indexend = mapsize - sizeof(footer);
+  if (footer.index < 8
+   || footer.index > indexend
+   || footer.blocks != (indexend - footer.index) / sizeof(SnapshotBlock)
+   || 0 != (indexend - footer.index) % sizeof(SnapshotBlock)) {
+    Close();
+    return SOPHIA_FORMAT_ERROR;
+  }
+  index = map + footer.index;
+  if (footer.index_checksum != Crc32c(0, index, indexend - footer.index)) {
+    Close();
+    return SOPHIA_CHECKSUM_ERROR;
+  }
 
-  list_rpush(operations, node);
+  blocks = footer.blocks;
+  records = footer.records;
+  bytes = footer.bytes;
+  for (size_t i = 0; i < blocks; i++) {
+    SnapshotBlock entry;
+    memcpy(&entry, index + i * sizeof(entry), sizeof(entry));
+    if (entry.offset < 8 || entry.offset + entry.size > footer.index) {
+      Close();
+      return SOPHIA_FORMAT_ERROR;
+    }
+  }
   return SOPHIA_SUCCESS;
 }
 
 SophiaReturnCode
-Transaction::Commit() {
-  list_node_t *node;
-  list_iterator_t *iterator = list_iterator_new(operations, LIST_HEAD);
+SnapshotFile::Verify() {
+  if (!index) return SOPHIA_FORMAT_ERROR;
 
-  while ((node = list_iterator_next(iterator))) {
-    TransactionOperation *operation = (TransactionOperation *) node->val;
-    int rc;
+  for (size_t i = 0; i < blocks; i++) {
+    SnapshotBlock entry;
+    uint32_t sizes[2];
+    size_t found = 0;
 
-    if (TRANSACTION_OPERATION_SET == operation->type) {
-      rc = sp->Set(
-          operation->key
-        , operation->keysize
-        , operation->value
-        , operation->valuesize
-      );
-    } else {
-      rc = sp->Delete(
-          operation->key
-        , operation->keysize
-      );
+    memcpy(&entry, index + i * sizeof(entry), sizeof(entry));
+    const char *data = map + entry.offset;
+    if (entry.checksum != Crc32c(0, data, entry.size)) {
+      return SOPHIA_CHECKSUM_ERROR;
     }
 
-    if (SOPHIA_SUCCESS != rc) {
-      list_iterator_destroy(iterator);
-      list_destroy(operations);
-      operations = NULL;
-      return SOPHIA_DB_ERROR;
+    // a writer bug could still leave records overrunning
+    for (size_t at = 0; at < entry.size; found++) {
+      if (entry.size - at < sizeof(sizes)) return SOPHIA_FORMAT_ERROR;
+      memcpy(sizes, data + at, sizeof(sizes));
+      at += sizeof(sizes);
+      if (entry.size - at < (size_t) sizes[0] + sizes[1]) {
+        return SOPHIA_FORMAT_ERROR;
+      }
+      at += (size_t) sizes[0] + sizes[1];
     }
+    if (found != entry.records) return SOPHIA_FORMAT_ERROR;
   }
-
-  list_iterator_destroy(iterator);
-  list_destroy(operations);
-  operations = NULL;
-
-  if (-1 == sp_commit(sp->db)) {
-    return SOPHIA_DB_ERROR;
-  }
-
   return SOPHIA_SUCCESS;
 }
 
-SophiaReturnCode
-Transaction::Rollback() {
-  if (-1 == sp_rollback(sp->db)) {
-    return SOPHIA_DB_ERROR;
+int
+SnapshotFile::Next(
+    const char **key
+  , size_t *keysize
+  , const char **value
+  , size_t *valuesize
+) {
+  uint32_t sizes[2];
+
+  if (!map) return -1;
+  while (offset == blockend) {
+    SnapshotBlock entry;
+    if (block == blocks) return 0;
+    memcpy(&entry, index + block * sizeof(entry), sizeof(entry));
+    offset = entry.offset;
+    blockend = entry.offset + entry.size;
+    block++;
   }
 
-  if (operations) {
-    list_destroy(operations);
-    operations = NULL;
+  if (blockend - offset < sizeof(sizes)) return -1;
+  memcpy(sizes, map + offset, sizeof(sizes));
+  if (blockend - offset - sizeof(sizes) < (size_t) sizes[0] + sizes[1]) {
+    return -1;
   }
 
-  return SOPHIA_SUCCESS;
+  *key = map + offset + sizeof(sizes);
+  *keysize = sizes[0];
+  *value = *key + sizes[0];
+  *valuesize = sizes[1];
+  offset += sizeof(sizes) + sizes[0] + sizes[1];
+  return 1;
 }
 
-/**
- * Iterator.
- */
-
-Iterator::Iterator(Sophia *sp) : sp(sp) {
-  order = SPGT;
-  start = NULL;
-  startsize = 0;
-  end = NULL;
-  endsize = 0;
-  cursor = NULL;
+void
+SnapshotFile::Close() {
+  if (map) munmap(map, mapsize);
+  map = NULL;
+  mapsize = 0;
+  index = NULL;
+  blocks = 0;
+  records = 0;
+  bytes = 0;
+  block = 0;
+  offset = 0;
+  blockend = 0;
 }
 
-Iterator::Iterator(
-    Sophia *sp
-  , sporder order
-) : sp(sp), order(order) {
-  start = NULL;
-  startsize = 0;
-  end = NULL;
-  endsize = 0;
-  cursor = NULL;
+size_t
+SnapshotFile::Blocks() const {
+  return blocks;
 }
 
-Iterator::Iterator(
-    Sophia *sp
-  , sporder order
-  , const char *start
-) : sp(sp), order(order), start(start) {
-  startsize = start ? strlen(start) + 1 : 0;
-  end = NULL;
-  endsize = 0;
-  cursor = NULL;
+size_t
+SnapshotFile::Records() const {
+  return records;
 }
 
-Iterator::Iterator(
-    Sophia *sp
-  , sporder order
-  , const char *start
-  , size_t startsize
-) : sp(sp), order(order), start(start), startsize(startsize) {
-  end = NULL;
-  endsize = 0;
-  cursor = NULL;
+size_t
+SnapshotFile::Bytes() const {
+  return bytes;
 }
 
-Iterator::Iterator(
-    Sophia *sp
-  , sporder order
-  , const char *start
-  , const char *end
-) : sp(sp), order(order), start(start), end(end) {
-  startsize = start ? strlen(start) + 1 : 0;
-  endsize = strlen(end) + 1;
-  end = NULL;
-  endsize = 0;
-  cursor = NULL;
-}
+/**
+ * Bulk loader.
+ */
 
-Iterator::Iterator(
+BulkLoader::BulkLoader(
     Sophia *sp
-  , sporder order
-  , const char *start
-  , size_t startsize
-  , const char *end
-  , size_t endsize
+  , size_t batch_size
+  , int merge_watermark
 ) : sp(sp)
-  , order(order)
-  , start(start)
-  , startsize(startsize)
-  , end(end)
-  , endsize(endsize) {
-  cursor = NULL;
-}
-
-Iterator::~Iterator() {
-  if (cursor) {
-    list_remove(sp->cursors, cursor_node);
-    cursor = NULL;
-    cursor_node = NULL;
-  }
+  , batch_size(batch_size ? batch_size : 1)
+  , merge_watermark(merge_watermark) {
+  records = 0;
+  bytes = 0;
+  seconds = 0;
 }
 
 SophiaReturnCode
-Iterator::Begin() {
-  if (!sp->IsOpen()) return SOPHIA_DATABASE_NOT_OPEN_ERROR;
-  cursor = sp_cursor(sp->db, order, start, startsize);
-  if (NULL == cursor) return SOPHIA_DB_ERROR;
-  cursor_node = list_node_new(cursor);
-  list_rpush(sp->cursors, cursor_node);
-  return SOPHIA_SUCCESS;
-}
-
-IteratorResult *
-Iterator::Next() {
+BulkLoader::Load(BulkSource *source) {
+  SophiaReturnCode rc;
+  bool was_open = sp->IsOpen();
+  bool create_if_missing = sp->create_if_missing;
+  bool read_only = sp->read_only;
+  int page_size = sp->page_size;
+  int previous_watermark = sp->merge_watermark;
+  bool gc = sp->gc;
+  const char *key;
+  const char *value;
   size_t keysize;
   size_t valuesize;
-  const char *k;
-  const char *v;
-  IteratorResult *result = NULL;
+  int more;
+  double start = Now();
 
-  if (0 == sp_fetch(cursor)) return NULL;
+  records = 0;
+  bytes = 0;
+  seconds = 0;
 
-  // TODO: could failure here ever indicate error?
-  if (!(k = sp_key(cursor)) || !(v = sp_value(cursor))) {
-    return NULL;
+  if (read_only) return SOPHIA_READ_ONLY_ERROR;
+
+  // merges and gc only slow an ingest down; reopen without them
+  if (was_open && SOPHIA_SUCCESS != (rc = sp->Close())) return rc;
+  rc = sp->Open(create_if_missing, false, page_size, merge_watermark, false);
+  more = 0;
+
+  // a failed reopen skips the load, but still restores below
+  batch.Clear();
+  while (SOPHIA_SUCCESS == rc) {
+    more = source->Next(&key, &keysize, &value, &valuesize);
+    if (1 != more) break;
+    rc = batch.Set(key, keysize, value, valuesize);
+    if (SOPHIA_SUCCESS != rc) break;
+    records++;
+    bytes += keysize + valuesize;
+
+    if (batch.Count() == batch_size) {
+      rc = sp->Write(batch);
+      batch.Clear();
+      if (SOPHIA_SUCCESS != rc) break;
+    }
   }
 
-  keysize = sp_keysize(cursor);
-  valuesize = sp_valuesize(cursor);
+  if (-1 == more) rc = SOPHIA_FORMAT_ERROR;
+  if (SOPHIA_SUCCESS == rc && batch.Count()) rc = sp->Write(batch);
+  batch.Clear();
+  seconds = Now() - start;
 
-  // don't go past end
-  if (end && 0 == strcmp(end, k)) {
-    return NULL;
+  // restore the caller's options
+  SophiaReturnCode closerc = sp->Close();
+  if (SOPHIA_SUCCESS == rc) rc = closerc;
+  sp->create_if_missing = create_if_missing;
+  sp->read_only = read_only;
+  sp->merge_watermark = previous_watermark;
+  sp->gc = gc;
+  if (was_open) {
+    closerc = sp->Open(
+        create_if_missing
+      , read_only
+      , page_size
+      , previous_watermark
+      , gc
+    );
+    if (SOPHIA_SUCCESS == rc) rc = closerc;
   }
 
-  result = new IteratorResult;
-  result->key = k;
-  result->value = v;
-  return result;
+  return rc;
 }
 
 SophiaReturnCode
-Iterator::End() {
-  if (cursor) {
-    list_remove(sp->cursors, cursor_node);
-    cursor = NULL;
-  }
-  return SOPHIA_SUCCESS;
+BulkLoader::Load(const char *file) {
+  BulkFile source(file);
+  SophiaReturnCode rc = source.Open();
+  if (SOPHIA_SUCCESS != rc) return rc;
+  return Load(&source);
+}
+
+size_t
+BulkLoader::Records() const {
+  return records;
+}
+
+size_t
+BulkLoader::Bytes() const {
+  return bytes;
+}
+
+double
+BulkLoader::Seconds() const {
+  return seconds;
+}
+
+double
+BulkLoader::RecordsPerSecond() const {
+  return seconds > 0 ? records / seconds : 0;
+}
+
+double
+BulkLoader::BytesPerSecond() const {
+  return seconds > 0 ? bytes / seconds : 0;
 }
 
 } // namespace sophia
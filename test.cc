@@ -1,9 +1,13 @@
 
 #include "sophia-cc.h"
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 using namespace sophia;
 
@@ -77,6 +81,116 @@ TEST(Sophia, Get) {
   delete sp;
 }
 
+TEST(Sophia, GetValue) {
+  Sophia *sp = new Sophia("testdb");
+  Value value;
+
+  // shouldn't segfault
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->Get("foo", value));
+  assert(NULL == value.Data());
+
+  SOPHIA_ASSERT(sp->Open());
+
+  for (int i = 0; i < 100; i++) {
+    char key[100];
+    char expected[100];
+    sprintf(key, "key%03d", i);
+    sprintf(expected, "value%03d", i);
+    SOPHIA_ASSERT(sp->Get(key, value));
+    assert(strlen(expected) + 1 == value.Size());
+    assert(0 == strcmp(expected, value.Data()));
+  }
+
+  SOPHIA_ASSERT(sp->Get("asdf", value));
+  assert(NULL == value.Data());
+  assert(0 == value.Size());
+
+  // binary values keep their size
+  const char binary[] = { 'a', '\0', 'b', '\0', 'c' };
+  SOPHIA_ASSERT(sp->Set("binary", 7, binary, sizeof(binary)));
+  SOPHIA_ASSERT(sp->Get("binary", value));
+  assert(sizeof(binary) == value.Size());
+  assert(0 == memcmp(binary, value.Data(), sizeof(binary)));
+
+  // reuses the caller's buffer
+  char buffer[16];
+  Value buffered(buffer, sizeof(buffer));
+  SOPHIA_ASSERT(sp->Get("key001", buffered));
+  assert(buffer == buffered.Data());
+  assert(0 == strcmp("value001", buffer));
+  assert(NULL == buffered.Release());
+
+  // larger values fall back to sophia's allocation
+  char large[64];
+  memset(large, 'x', sizeof(large));
+  SOPHIA_ASSERT(sp->Set("large", 6, large, sizeof(large)));
+  SOPHIA_ASSERT(sp->Get("large", buffered));
+  assert(buffer != buffered.Data());
+  assert(sizeof(large) == buffered.Size());
+  char *released = buffered.Release();
+  assert(NULL == buffered.Data());
+  assert(0 == memcmp(large, released, sizeof(large)));
+  free(released);
+
+  SOPHIA_ASSERT(sp->Delete("binary", 7));
+  SOPHIA_ASSERT(sp->Delete("large", 6));
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Sophia, MultiGet) {
+  Sophia *sp = new Sophia("testdb");
+  MultiGetResult result;
+  const char *keys[] = {
+      "key050"
+    , "asdf"
+    , "key001"
+    , "key099"
+    , "key050"
+    , "key002"
+    , "lkjh"
+  };
+  size_t count = sizeof(keys) / sizeof(keys[0]);
+
+  // shouldn't segfault
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->MultiGet(keys, count, result));
+
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->MultiGet(keys, count, result));
+  assert(count == result.Count());
+
+  assert(0 == strcmp("value050", result.Data(0)));
+  assert(9 == result.Size(0));
+  assert(NULL == result.Data(1));
+  assert(0 == strcmp("value001", result.Data(2)));
+  assert(0 == strcmp("value099", result.Data(3)));
+  assert(0 == strcmp("value050", result.Data(4)));
+  assert(0 == strcmp("value002", result.Data(5)));
+  assert(NULL == result.Data(6));
+  assert(NULL == result.Data(count));
+
+  // every key, in reverse, through the same result
+  const char *all[100];
+  char storage[100][16];
+  for (int i = 0; i < 100; i++) {
+    sprintf(storage[i], "key%03d", 99 - i);
+    all[i] = storage[i];
+  }
+  SOPHIA_ASSERT(sp->MultiGet(all, 100, result));
+  assert(100 == result.Count());
+  for (int i = 0; i < 100; i++) {
+    char value[100];
+    sprintf(value, "value%03d", 99 - i);
+    assert(0 == strcmp(value, result.Data(i)));
+  }
+
+  SOPHIA_ASSERT(sp->MultiGet(all, 0, result));
+  assert(0 == result.Count());
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
 TEST(Sophia, Delete) {
   Sophia *sp = new Sophia("testdb");
   // shouldn't segfault
@@ -133,268 +247,2591 @@ TEST(Sophia, Clear) {
   delete sp;
 }
 
-TEST(Sophia, Count) {
+static void
+CountProgress(size_t deleted, void *data) {
+  size_t *calls = (size_t *) data;
+  assert(deleted > 0);
+  (*calls)++;
+}
+
+TEST(Sophia, DeleteRange) {
   Sophia *sp = new Sophia("testdb");
-  size_t count;
+  size_t calls = 0;
 
   // shouldn't segfault
-  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->Count(&count));
-
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->DeleteRange("a", "b"));
   SOPHIA_ASSERT(sp->Open());
 
-  for (int i = 0; i < 5000; i++) {
+  for (int i = 0; i < 100; i++) {
     char key[100];
     char value[100];
-    sprintf(key, "key%05d", i);
-    sprintf(value, "value%05d", i);
+    sprintf(key, "key%03d", i);
+    sprintf(value, "value%03d", i);
     SOPHIA_ASSERT(sp->Set(key, value));
   }
 
-  SOPHIA_ASSERT(sp->Count(&count));
-  assert(5000 == count);
+  // [key010, key050) in chunks of 7
+  SOPHIA_ASSERT(sp->DeleteRange(
+      "key010"
+    , 7
+    , "key050"
+    , 7
+    , CountProgress
+    , &calls
+    , 7
+  ));
+  assert(6 == calls);
+
+  for (int i = 0; i < 100; i++) {
+    char key[100];
+    sprintf(key, "key%03d", i);
+    char *value = sp->Get(key);
+    if (i >= 10 && i < 50) {
+      assert(NULL == value);
+    } else {
+      assert(value);
+      free(value);
+    }
+  }
+
+  // open ends
+  SOPHIA_ASSERT(sp->DeleteRange(NULL, "key005"));
+  SOPHIA_ASSERT(sp->DeleteRange("key095", NULL));
+  assert(NULL == sp->Get("key000"));
+  assert(NULL == sp->Get("key004"));
+  char *value = sp->Get("key005");
+  assert(0 == strcmp("value005", value));
+  free(value);
+  assert(NULL == sp->Get("key099"));
 
+  SOPHIA_ASSERT(sp->Clear());
   SOPHIA_ASSERT(sp->Close());
   delete sp;
 }
 
-/**
- * Iterator tests.
- */
+static bool
+CollectRow(const IteratorResult *result, void *data) {
+  int *rows = (int *) data;
+  char key[100];
+  sprintf(key, "key%03d", 10 + (*rows)++);
+  assert(0 == strcmp(key, result->key));
+  assert(strlen(key) + 1 == result->keysize);
+  return 5 != *rows;
+}
 
-TEST(Iterator, Begin) {
+TEST(Sophia, ScanPrefix) {
   Sophia *sp = new Sophia("testdb");
-  Iterator *it = NULL;
-  IteratorResult *res = NULL;
+  int rows = 0;
 
-  it = new Iterator(sp);
-  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == it->Begin());
-  delete it;
+  // shouldn't segfault
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->ScanPrefix(
+      "key"
+    , 3
+    , CollectRow
+    , &rows
+  ));
 
   SOPHIA_ASSERT(sp->Open());
+  for (int i = 0; i < 20; i++) {
+    char key[100];
+    sprintf(key, "key%03d", i);
+    SOPHIA_ASSERT(sp->Set(key, "value"));
+  }
 
-  // test reverse
+  // stops when asked
+  SOPHIA_ASSERT(sp->ScanPrefix("key01", 5, CollectRow, &rows));
+  assert(5 == rows);
 
-  it = new Iterator(sp, SPLT);
-  SOPHIA_ASSERT(it->Begin());
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
 
-  res = it->Next();
-  assert(0 == strcmp("key04999", res->key));
-  assert(0 == strcmp("value04999", res->value));
-  delete res;
+TEST(Sophia, Count) {
+  Sophia *sp = new Sophia("testdb");
+  size_t count;
 
-  SOPHIA_ASSERT(it->End());
-  delete it;
+  // shouldn't segfault
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->Count(&count));
 
-  // test start
+  SOPHIA_ASSERT(sp->Open());
 
-  it = new Iterator(sp, SPGT, "key03999");
-  SOPHIA_ASSERT(it->Begin());
+  for (int i = 0; i < 5000; i++) {
+    char key[100];
+    char value[100];
+    sprintf(key, "key%05d", i);
+    sprintf(value, "value%05d", i);
+    SOPHIA_ASSERT(sp->Set(key, value));
+  }
 
-  res = it->Next();
-  assert(0 == strcmp("key04000", res->key));
-  assert(0 == strcmp("value04000", res->value));
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(5000 == count);
 
-  delete res;
-  SOPHIA_ASSERT(it->End());
-  delete it;
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
 
-  // test start/end
+TEST(Sophia, TrackCount) {
+  Sophia *sp = new Sophia("testdb");
+  size_t base;
+  size_t count;
 
-  it = new Iterator(sp, SPGT, "key03999", "key04001");
-  SOPHIA_ASSERT(it->Begin());
+  sp->TrackCount();
+  // shouldn't segfault
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->EstimateCount(&count));
 
-  res = it->Next();
-  assert(0 == strcmp("key04000", res->key));
-  assert(0 == strcmp("value04000", res->value));
-  delete res;
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Count(&base));
 
-  assert(NULL == it->Next());
-  SOPHIA_ASSERT(it->End());
-  delete it;
+  for (int i = 0; i < 100; i++) {
+    char key[100];
+    sprintf(key, "track%03d", i);
+    SOPHIA_ASSERT(sp->Set(key, "value"));
+    // overwrites don't count
+    SOPHIA_ASSERT(sp->Set(key, "value"));
+  }
+  SOPHIA_ASSERT(sp->Delete("track000"));
+  SOPHIA_ASSERT(sp->Delete("asdf"));
 
-  // test end
+  Transaction *t = new Transaction(sp);
+  SOPHIA_ASSERT(t->Begin());
+  SOPHIA_ASSERT(t->Set("track000", "value"));
+  SOPHIA_ASSERT(t->Set("track100", "value"));
+  SOPHIA_ASSERT(t->Delete("track100"));
+  SOPHIA_ASSERT(t->Delete("track001"));
+  SOPHIA_ASSERT(t->Delete("track001"));
+  SOPHIA_ASSERT(t->Commit());
+  delete t;
 
-  it = new Iterator(sp, SPGT, NULL, "key00002");
-  SOPHIA_ASSERT(it->Begin());
-  res = it->Next();
-  assert(0 == strcmp("key00000", res->key));
-  assert(0 == strcmp("value00000", res->value));
-  delete res;
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(base + 99 == count);
+  SOPHIA_ASSERT(sp->EstimateCount(&count));
+  assert(base + 99 == count);
+  SOPHIA_ASSERT(sp->Recount(&count));
+  assert(base + 99 == count);
 
-  res = it->Next();
-  assert(0 == strcmp("key00001", res->key));
-  assert(0 == strcmp("value00001", res->value));
-  delete res;
+  // the count survives a clean shutdown
+  SOPHIA_ASSERT(sp->Close());
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->EstimateCount(&count));
+  assert(base + 99 == count);
 
-  assert(NULL == it->Next());
-  SOPHIA_ASSERT(it->End());
-  delete it;
+  // scans never see the count's reserved key
+  sp->TrackCount(false);
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(base + 99 == count);
+  sp->TrackCount();
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(base + 99 == count);
+  SOPHIA_ASSERT(sp->Close());
+
+  // untracked writes leave the saved count stale
+  sp->TrackCount(false);
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Set("track100", "value"));
+  SOPHIA_ASSERT(sp->Set("track101", "value"));
+  SOPHIA_ASSERT(sp->Close());
+  sp->TrackCount();
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(base + 101 == count);
+  SOPHIA_ASSERT(sp->EstimateCount(&count));
+  assert(base + 101 == count);
+  SOPHIA_ASSERT(sp->Delete("track100"));
+  SOPHIA_ASSERT(sp->Delete("track101"));
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(base + 99 == count);
 
   SOPHIA_ASSERT(sp->Close());
   delete sp;
 }
 
-TEST(Iterator, Next) {
+TEST(Sophia, TrackCountUncleanShutdown) {
   Sophia *sp = new Sophia("testdb");
-  Iterator *it = NULL;
-  Iterator *it2 = NULL;
-  IteratorResult *res = NULL;
-  int i = 0;
+  size_t base;
+  size_t count;
+  int status;
 
+  sp->TrackCount();
   SOPHIA_ASSERT(sp->Open());
-  it = new Iterator(sp, SPGT, "key00100", "key00500");
-
-  assert(0 == it->Begin());
-
-  i = 100;
-  while ((res = it->Next())) {
-    i++;
-    char key[100];
-    char value[100];
-    sprintf(key, "key%05d", i);
-    sprintf(value, "value%05d", i);
-
-    assert(0 == strcmp(key, res->key));
-    assert(0 == strcmp(value, res->value));
+  SOPHIA_ASSERT(sp->Count(&base));
+  SOPHIA_ASSERT(sp->Close());
 
-    delete res;
+  // crash without closing, leaving the saved count stale
+  pid_t pid = fork();
+  assert(-1 != pid);
+  if (0 == pid) {
+    if (SOPHIA_SUCCESS != sp->Open()) _exit(1);
+    for (int i = 100; i < 150; i++) {
+      char key[100];
+      sprintf(key, "track%03d", i);
+      if (SOPHIA_SUCCESS != sp->Set(key, "value")) _exit(1);
+    }
+    _exit(0);
   }
+  assert(pid == waitpid(pid, &status, 0));
+  assert(0 == WEXITSTATUS(status));
 
-  assert(499 == i);
-  SOPHIA_ASSERT(it->End());
-  delete it;
-
-  // multiple iterators
-
-  it = new Iterator(sp, SPGT, "key00000", "key00100");
-  it2 = new Iterator(sp, SPLT, "key00100", "key00000");
-
-  SOPHIA_ASSERT(it->Begin());
-  SOPHIA_ASSERT(it2->Begin());
-
-  res = it->Next();
-  assert(0 == strcmp("key00001", res->key));
-  assert(0 == strcmp("value00001", res->value));
-  delete res;
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->EstimateCount(&count));
+  assert(base == count);
 
-  res = it2->Next();
-  assert(0 == strcmp("key00099", res->key));
-  assert(0 == strcmp("value00099", res->value));
-  delete res;
+  // the unclean shutdown forces a rescan
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(base + 50 == count);
+  SOPHIA_ASSERT(sp->EstimateCount(&count));
+  assert(base + 50 == count);
 
-  SOPHIA_ASSERT(it->End());
-  SOPHIA_ASSERT(it2->End());
+  SOPHIA_ASSERT(sp->DeleteRange("track", "tracl"));
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(base - 99 == count);
 
   SOPHIA_ASSERT(sp->Close());
   delete sp;
 }
 
 /**
- * Transaction tests.
+ * Sophia::ThreadSafe() worker state.
  */
 
-TEST(Transaction, Begin) {
-  Sophia *sp = new Sophia("testdb");
-
-  Transaction *t = new Transaction(sp);
-
-  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == t->Begin());
+typedef struct {
+  Sophia *sp;
+  int id;
+  int failures;
+} ThreadSafeWorker;
 
-  SOPHIA_ASSERT(sp->Open());
-  SOPHIA_ASSERT(sp->Clear());
+/**
+ * Set and read back keys `threadN:000`.. while scanning
+ * them every 100 writes.
+ */
 
-  SOPHIA_ASSERT(t->Begin());
-  SOPHIA_ASSERT(t->Rollback());
-  delete t;
+static void *
+ThreadSafeWork(void *data) {
+  ThreadSafeWorker *worker = (ThreadSafeWorker *) data;
+  Sophia *sp = worker->sp;
+  char key[32];
+  char value[32];
+  char prefix[32];
+
+  sprintf(prefix, "thread%d:", worker->id);
+  for (int i = 0; i < 500; i++) {
+    sprintf(key, "thread%d:%03d", worker->id, i);
+    sprintf(value, "value%03d", i);
+    if (SOPHIA_SUCCESS != sp->Set(key, value)) worker->failures++;
+
+    char *res = sp->Get(key);
+    if (!res || 0 != strcmp(value, res)) worker->failures++;
+    free(res);
+
+    if (0 == i % 100) {
+      int rows = 0;
+      PrefixIterator it(sp, prefix);
+      if (SOPHIA_SUCCESS != it.Begin()) worker->failures++;
+      while (it.Next()) rows++;
+      if (i + 1 != rows) worker->failures++;
+    }
+  }
 
-  SOPHIA_ASSERT(sp->Close());
-  delete sp;
+  return NULL;
 }
 
-TEST(Transaction, Set) {
+TEST(Sophia, ThreadSafe) {
   Sophia *sp = new Sophia("testdb");
-  Transaction *t = new Transaction(sp);
+  pthread_t threads[8];
+  ThreadSafeWorker workers[8];
+
+  sp->ThreadSafe();
   SOPHIA_ASSERT(sp->Open());
-  SOPHIA_ASSERT(t->Begin());
 
-  for (int i = 0; i < 5000; i++) {
-    char key[100];
-    char value[100];
-    sprintf(key, "key%05d", i);
-    sprintf(value, "value%05d", i);
-    SOPHIA_ASSERT(t->Set(key, value));
+  for (int i = 0; i < 8; i++) {
+    workers[i].sp = sp;
+    workers[i].id = i;
+    workers[i].failures = 0;
+    int rc = pthread_create(&threads[i], NULL, ThreadSafeWork, &workers[i]);
+    assert(0 == rc);
+  }
+  for (int i = 0; i < 8; i++) {
+    assert(0 == pthread_join(threads[i], NULL));
+    assert(0 == workers[i].failures);
   }
 
-  SOPHIA_ASSERT(t->Commit());
-  delete t;
-
-  size_t count;
-  SOPHIA_ASSERT(sp->Count(&count));
-  assert(5000 == count);
+  int rows = 0;
+  PrefixIterator it(sp, "thread");
+  for (const IteratorResult &res : it) {
+    assert(0 == strncmp("thread", res.key, 6));
+    rows++;
+  }
+  assert(4000 == rows);
+  assert(0 == sp->cursors.Count());
 
+  SOPHIA_ASSERT(sp->DeleteRange("thread", "threae"));
   SOPHIA_ASSERT(sp->Close());
   delete sp;
 }
 
-TEST(Transaction, Delete) {
+TEST(Sophia, Cache) {
   Sophia *sp = new Sophia("testdb");
   Transaction *t = new Transaction(sp);
-  SOPHIA_ASSERT(sp->Open());
-  SOPHIA_ASSERT(t->Begin());
+  ValueCacheStats stats;
+  MultiGetResult result;
+  Value v;
+  char *value;
 
-  for (int i = 0; i < 5000; i += 2) {
-    char key[100];
-    sprintf(key, "key%05d", i);
-    SOPHIA_ASSERT(t->Delete(key));
+  SOPHIA_ASSERT(sp->Cache(1 << 20));
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Set("cache:a", "1"));
+  SOPHIA_ASSERT(sp->Set("cache:b", "2"));
+
+  // the second read is a hit
+  for (int i = 0; i < 2; i++) {
+    value = sp->Get("cache:a");
+    assert(0 == strcmp("1", value));
+    free(value);
   }
+  sp->CacheStats(&stats);
+  assert(1 == stats.hits);
+  assert(1 == stats.misses);
+  assert(1 == stats.entries);
+
+  // writes invalidate
+  SOPHIA_ASSERT(sp->Set("cache:a", "3"));
+  value = sp->Get("cache:a");
+  assert(0 == strcmp("3", value));
+  free(value);
+
+  SOPHIA_ASSERT(sp->Delete("cache:a"));
+  assert(NULL == sp->Get("cache:a"));
 
+  SOPHIA_ASSERT(sp->Get("cache:b", v));
+  SOPHIA_ASSERT(t->Begin());
+  SOPHIA_ASSERT(t->Set("cache:b", "4"));
   SOPHIA_ASSERT(t->Commit());
-  delete t;
+  for (int i = 0; i < 2; i++) {
+    SOPHIA_ASSERT(sp->Get("cache:b", v));
+    assert(0 == strcmp("4", v.Data()));
+  }
 
-  size_t count;
-  SOPHIA_ASSERT(sp->Count(&count));
-  assert(2500 == count);
+  // MultiGet is served from and fills the cache
+  const char *keys[] = { "cache:c", "cache:b", "cache:a", "cache:c" };
+  SOPHIA_ASSERT(sp->Set("cache:c", "5"));
+  for (int i = 0; i < 2; i++) {
+    SOPHIA_ASSERT(sp->MultiGet(keys, 4, result));
+    assert(0 == strcmp("5", result.Data(0)));
+    assert(0 == strcmp("4", result.Data(1)));
+    assert(NULL == result.Data(2));
+    assert(0 == strcmp("5", result.Data(3)));
+  }
+  sp->CacheStats(&stats);
+  assert(0 == stats.evictions);
+  assert(stats.hits >= 4);
+
+  // a small budget evicts
+  SOPHIA_ASSERT(sp->Cache(4096, 1));
+  for (int i = 0; i < 200; i++) {
+    char key[32];
+    sprintf(key, "cache:%03d", i);
+    SOPHIA_ASSERT(sp->Set(key, key));
+    value = sp->Get(key);
+    assert(0 == strcmp(key, value));
+    free(value);
+  }
+  sp->CacheStats(&stats);
+  assert(4096 == stats.capacity);
+  assert(stats.bytes <= stats.capacity);
+  assert(stats.evictions > 0);
+  assert(200 == stats.entries + stats.evictions);
 
+  SOPHIA_ASSERT(sp->Cache(0));
+  sp->CacheStats(&stats);
+  assert(0 == stats.entries);
+
+  SOPHIA_ASSERT(sp->DeleteRange("cache:", "cache;"));
   SOPHIA_ASSERT(sp->Close());
+  delete t;
   delete sp;
 }
 
-TEST(Transaction, Commit) {
+TEST(Sophia, Filter) {
   Sophia *sp = new Sophia("testdb");
   Transaction *t = new Transaction(sp);
+  BloomFilterStats stats;
+  MultiGetResult result;
+  char key[32];
+  char *value;
+
+  // built from the keys left by earlier tests
+  SOPHIA_ASSERT(sp->Filter(20000));
   SOPHIA_ASSERT(sp->Open());
+  for (int i = 0; i < 5000; i++) {
+    sprintf(key, "key%05d", i);
+    value = sp->Get(key);
+    assert(value);
+    free(value);
+  }
+
+  SOPHIA_ASSERT(sp->Set("filter:a", "1"));
+  SOPHIA_ASSERT(t->Begin());
+  SOPHIA_ASSERT(t->Set("filter:b", "2"));
+  SOPHIA_ASSERT(t->Commit());
+
+  for (int i = 0; i < 1000; i++) {
+    sprintf(key, "filter:missing%d", i);
+    assert(NULL == sp->Get(key));
+  }
+  sp->FilterStats(&stats);
+  assert(6000 == stats.lookups);
+  assert(1000 == stats.negatives + stats.false_positives);
+  assert(stats.false_positive_rate < 0.05);
+  assert(stats.expected_false_positive_rate < 0.05);
+  assert(stats.bytes == stats.bits / 8);
+
+  const char *keys[] = { "filter:b", "filter:x", "filter:a" };
+  SOPHIA_ASSERT(sp->MultiGet(keys, 3, result));
+  assert(0 == strcmp("2", result.Data(0)));
+  assert(NULL == result.Data(1));
+  assert(0 == strcmp("1", result.Data(2)));
+
+  // a clean close leaves a sidecar for the next open
+  SOPHIA_ASSERT(sp->Close());
+  assert(0 == access("testdb.filter", F_OK));
+  SOPHIA_ASSERT(sp->Open());
+  value = sp->Get("filter:a");
+  assert(0 == strcmp("1", value));
+  free(value);
+  SOPHIA_ASSERT(sp->Close());
+
+  // writes without the filter make the sidecar stale
+  SOPHIA_ASSERT(sp->Filter(0));
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Set("filter:c", "3"));
+  SOPHIA_ASSERT(sp->Close());
+  SOPHIA_ASSERT(sp->Filter(20000));
+  SOPHIA_ASSERT(sp->Open());
+  value = sp->Get("filter:c");
+  assert(0 == strcmp("3", value));
+  free(value);
+
+  SOPHIA_ASSERT(sp->DeleteRange("filter:", "filter;"));
+  SOPHIA_ASSERT(sp->Filter(0));
+  sp->FilterStats(&stats);
+  assert(0 == stats.bits);
+  SOPHIA_ASSERT(sp->Close());
+  delete t;
+  delete sp;
+}
+
+/**
+ * Run-length codec for the compression tests.
+ */
+
+static size_t
+RunLengthBound(size_t size, void *data) {
+  (void) data;
+  return 2 * size;
+}
+
+static size_t
+RunLengthCompress(
+    const char *src
+  , size_t size
+  , char *dst
+  , size_t capacity
+  , const char *dictionary
+  , size_t dictionarysize
+  , void *data
+) {
+  size_t n = 0;
+  (void) dictionary;
+  (void) dictionarysize;
+  (void) data;
+  for (size_t i = 0; i < size; n += 2) {
+    size_t run = 1;
+    while (i + run < size && run < 255 && src[i + run] == src[i]) run++;
+    if (n + 2 > capacity) return 0;
+    dst[n] = (char) run;
+    dst[n + 1] = src[i];
+    i += run;
+  }
+  return n;
+}
+
+static bool
+RunLengthDecompress(
+    const char *src
+  , size_t size
+  , char *dst
+  , size_t rawsize
+  , const char *dictionary
+  , size_t dictionarysize
+  , void *data
+) {
+  size_t n = 0;
+  (void) dictionary;
+  (void) dictionarysize;
+  (void) data;
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    size_t run = (unsigned char) src[i];
+    if (n + run > rawsize) return false;
+    memset(dst + n, src[i + 1], run);
+    n += run;
+  }
+  return n == rawsize;
+}
+
+static const CompressionCodec RunLengthCodec = {
+    3
+  , RunLengthBound
+  , RunLengthCompress
+  , RunLengthDecompress
+  , NULL
+};
+
+TEST(Sophia, Compression) {
+  Sophia *sp = new Sophia("testcompress");
+  ValueCompressionStats stats;
+  MultiGetResult result;
+  WriteBatch batch;
+  IteratorResult *res;
+  char big[4096];
+  char key[32];
+  char *value;
+  Value v;
+
+  for (size_t i = 0; i < sizeof(big) - 1; i++) {
+    big[i] = "the quick brown fox "[i % 20];
+  }
+  big[sizeof(big) - 1] = '\0';
+
+  // values without headers can't take compression
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Set("plain", "1"));
+  assert(SOPHIA_COMPRESSION_ERROR == sp->Compression());
+  SOPHIA_ASSERT(sp->Close());
+  SOPHIA_ASSERT(sp->Compression());
+  assert(SOPHIA_COMPRESSION_ERROR == sp->Open());
+  SOPHIA_ASSERT(sp->Compression(false));
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->Close());
+
+  SOPHIA_ASSERT(sp->Compression(true, 16));
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Set("big", big));
+  SOPHIA_ASSERT(sp->Set("small", "tiny"));
+  SOPHIA_ASSERT(batch.Set("batch:a", big));
+  SOPHIA_ASSERT(batch.Set("batch:b", "0123456789abcdef0123456789abcdef"));
+  SOPHIA_ASSERT(sp->Write(batch));
+
+  sp->CompressionStats(&stats);
+  assert(4 == stats.values);
+  assert(3 == stats.compressed);
+  assert(stats.ratio > 10);
+  size_t stored = stats.stored_bytes;
+
+  value = sp->Get("big");
+  assert(0 == strcmp(big, value));
+  free(value);
+  SOPHIA_ASSERT(sp->Get("small", v));
+  assert(5 == v.Size());
+  assert(0 == strcmp("tiny", v.Data()));
+
+  const char *keys[] = { "small", "batch:a", "missing", "big" };
+  SOPHIA_ASSERT(sp->MultiGet(keys, 4, result));
+  assert(0 == strcmp("tiny", result.Data(0)));
+  assert(0 == strcmp(big, result.Data(1)));
+  assert(NULL == result.Data(2));
+  assert(0 == strcmp(big, result.Data(3)));
+
+  Iterator *it = new Iterator(sp);
+  SOPHIA_ASSERT(it->Begin());
+  res = it->Next();
+  assert(0 == strcmp("batch:a", res->key));
+  assert(sizeof(big) == res->valuesize);
+  assert(0 == strcmp(big, res->value));
+  res = it->Next();
+  assert(0 == strcmp("0123456789abcdef0123456789abcdef", res->value));
+  res = it->Next();
+  assert(0 == strcmp(big, res->value));
+  res = it->Next();
+  assert(0 == strcmp("tiny", res->value));
+  assert(NULL == it->Next());
+  delete it;
+
+  // a dictionary lets small values share content
+  assert(SOPHIA_COMPRESSION_ERROR == sp->CompressionDictionary(big, 0));
+  SOPHIA_ASSERT(sp->CompressionDictionary(big, 200));
+  SOPHIA_ASSERT(sp->CompressionDictionary(big, 200));
+  assert(SOPHIA_COMPRESSION_ERROR == sp->CompressionDictionary(big, 100));
+  for (int i = 0; i < 100; i++) {
+    sprintf(key, "dict%03d", i);
+    SOPHIA_ASSERT(sp->Set(key, strlen(key) + 1, big + i % 20 + 40, 40));
+  }
+  sp->CompressionStats(&stats);
+  assert(103 == stats.compressed);
+  assert(stats.stored_bytes - stored < 100 * 20);
+  assert(200 == stats.dictionary_bytes);
+  SOPHIA_ASSERT(sp->Close());
+
+  // headers stay after compression is turned off
+  SOPHIA_ASSERT(sp->Compression(false));
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Set("late", "raw"));
+  SOPHIA_ASSERT(sp->Get("dict042", v));
+  assert(40 == v.Size());
+  assert(0 == memcmp(big + 42 % 20 + 40, v.Data(), 40));
+  value = sp->Get("late");
+  assert(0 == strcmp("raw", value));
+  free(value);
+  SOPHIA_ASSERT(sp->Close());
+
+  CompressionCodec reserved = RunLengthCodec;
+  reserved.id = 1;
+  assert(SOPHIA_COMPRESSION_ERROR == sp->RegisterCodec(&reserved));
+  SOPHIA_ASSERT(sp->Compression(true, 16, &RunLengthCodec));
+  SOPHIA_ASSERT(sp->Open());
+  memset(big, 'z', sizeof(big) - 1);
+  SOPHIA_ASSERT(sp->Set("runs", big));
+  sp->CompressionStats(&stats);
+  assert(stats.raw_bytes > 10 * stats.stored_bytes);
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+
+  // values of an unknown codec can't be read
+  sp = new Sophia("testcompress");
+  SOPHIA_ASSERT(sp->Open());
+  assert(NULL == sp->Get("runs"));
+  assert(SOPHIA_COMPRESSION_ERROR == sp->Get("runs", v));
+  SOPHIA_ASSERT(sp->RegisterCodec(&RunLengthCodec));
+  SOPHIA_ASSERT(sp->Get("runs", v));
+  assert(0 == strcmp(big, v.Data()));
+
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Sophia, Stats) {
+  Sophia *sp = new Sophia("testdb");
+  const char *keys[] = { "stats:a", "stats:b" };
+  SophiaStats stats;
+  MultiGetResult result;
+  WriteBatch batch;
+  char *value;
+  size_t n;
+  Value v;
+
+  SOPHIA_ASSERT(sp->Instrument());
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->Set("stats:a", "1"));
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Set("stats:a", "1"));
+  SOPHIA_ASSERT(sp->Set("stats:b", "22"));
+  value = sp->Get("stats:a");
+  free(value);
+  SOPHIA_ASSERT(sp->Get("stats:b", v));
+  assert(NULL == sp->Get("stats:missing"));
+  SOPHIA_ASSERT(sp->MultiGet(keys, 2, result));
+  SOPHIA_ASSERT(batch.Set("stats:c", "3"));
+  SOPHIA_ASSERT(sp->Write(batch));
+  SOPHIA_ASSERT(sp->Delete("stats:c"));
+  SOPHIA_ASSERT(sp->Count(&n));
+
+  PrefixIterator *it = new PrefixIterator(sp, "stats:");
+  SOPHIA_ASSERT(it->Begin());
+  while (it->Next()) {}
+  delete it;
+
+  sp->Stats(&stats);
+#ifdef SOPHIA_STATS
+  OperationStats *set = &stats.operations[SOPHIA_OP_SET];
+  OperationStats *get = &stats.operations[SOPHIA_OP_GET];
+  char text[65536];
+  assert(stats.enabled);
+  assert(3 == set->count);
+  assert(31 == set->bytes);
+  assert(1 == set->errors);
+  assert(1 == set->error_codes[ErrorSlot(SOPHIA_DATABASE_NOT_OPEN_ERROR)]);
+  assert(3 == get->count);
+  assert(35 == get->bytes);
+  assert(0 == get->errors);
+  assert(1 == stats.operations[SOPHIA_OP_MULTIGET].count);
+  assert(1 == stats.operations[SOPHIA_OP_WRITE].count);
+  assert(1 == stats.operations[SOPHIA_OP_DELETE].count);
+  assert(1 == stats.operations[SOPHIA_OP_COUNT].count);
+  assert(3 == stats.operations[SOPHIA_OP_ITERATOR_NEXT].count);
+
+  uint64_t bucketed = 0;
+  for (size_t i = 0; i < SOPHIA_LATENCY_BUCKETS; i++) {
+    bucketed += get->buckets[i];
+  }
+  assert(3 == bucketed);
+  assert(get->min <= get->p50 && get->p50 <= get->p99);
+  assert(get->p99 <= get->p999 && get->p999 <= get->max);
+  assert(get->sum >= get->max);
+  assert(16 == LatencyBucketFloor(16) && 18 == LatencyBucketFloor(17));
+
+  n = StatsJSON(&stats, text, sizeof(text));
+  assert(n == strlen(text));
+  assert(strstr(text, "\"set\":{\"count\":3,\"bytes\":31,\"errors\":1"));
+  assert(strstr(text, "\"error_codes\":{\"-11\":1}"));
+
+  n = StatsPrometheus(&stats, text, sizeof(text));
+  assert(n == strlen(text));
+  assert(strstr(text, "\nsophia_operations_total{op=\"set\"} 3\n"));
+  assert(strstr(text, "{op=\"set\",code=\"-11\"} 1\n"));
+  assert(strstr(text, "{op=\"get\",le=\"+Inf\"} 3\n"));
+
+  // cut short like snprintf
+  char small[16];
+  assert(n == StatsPrometheus(&stats, small, sizeof(small)));
+  assert(15 == strlen(small));
+#else
+  assert(!stats.enabled);
+#endif
+
+  SOPHIA_ASSERT(sp->Instrument(false));
+  sp->Stats(&stats);
+  assert(!stats.enabled);
+  assert(0 == stats.operations[SOPHIA_OP_SET].count);
+
+  SOPHIA_ASSERT(sp->Delete("stats:a"));
+  SOPHIA_ASSERT(sp->Delete("stats:b"));
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Sophia, Trace) {
+  Sophia *sp = new Sophia("testdb");
+  SlowOperation operations[8];
+  size_t n;
+  Value v;
+
+  SOPHIA_ASSERT(sp->Open());
+  assert(SOPHIA_NOT_TRACING_ERROR == sp->TraceLog("testdb.trace"));
+  assert(0 == sp->SlowOperations(operations, 8));
+
+  // nothing is that slow
+  SOPHIA_ASSERT(sp->Trace(true, UINT64_MAX));
+  SOPHIA_ASSERT(sp->Set("trace:a", "1"));
+  assert(0 == sp->SlowOperations(operations, 8));
+
+  // everything is
+  SOPHIA_ASSERT(sp->Trace(true, 0, 4));
+  SOPHIA_ASSERT(sp->Set("trace:a", "1"));
+  SOPHIA_ASSERT(sp->Get("trace:a", v));
+  SOPHIA_ASSERT(sp->Delete("trace:a"));
+
+  n = sp->SlowOperations(operations, 8);
+#ifdef SOPHIA_STATS
+  char text[256];
+  assert(3 == n);
+  assert(SOPHIA_OP_SET == operations[0].op);
+  assert(0 == operations[0].sequence);
+  assert(8 == operations[0].keysize && 2 == operations[0].valuesize);
+  assert(0 == memcmp("trace:a", operations[0].key, 8));
+  assert(0 == operations[0].cursors);
+  assert(SOPHIA_OP_GET == operations[1].op);
+  assert(2 == operations[1].valuesize);
+  assert(SOPHIA_OP_DELETE == operations[2].op);
+  assert(operations[2].time >= operations[0].time);
+
+  // the ring keeps the latest 4, and Next() sees its own
+  // cursor until it reaches the end
+  SOPHIA_ASSERT(sp->Set("trace:b", "22"));
+  Iterator *it = new Iterator(sp);
+  SOPHIA_ASSERT(it->Begin());
+  while (it->Next()) {}
+  delete it;
+  n = sp->SlowOperations(operations, 8);
+  assert(4 == n);
+  assert(operations[3].sequence == operations[0].sequence + 3);
+  assert(SOPHIA_OP_ITERATOR_NEXT == operations[3].op);
+  assert(1 == operations[2].cursors && 0 == operations[3].cursors);
+  assert(1 == sp->SlowOperations(operations, 1));
+  assert(SOPHIA_OP_ITERATOR_NEXT == operations[0].op);
+
+  // long and binary keys are cut and escaped
+  operations[0].keysize = 30;
+  memcpy(operations[0].key, "a\"b\\\n", 5);
+  n = SlowOperationText(&operations[0], text, sizeof(text));
+  assert(n == strlen(text));
+  assert(strstr(text, " op=iterator_next "));
+  assert(strstr(text, " keysize=30 valuesize=0 cursors=0 "));
+  assert(strstr(text, "key=\"a\\x22b\\x5c\\x0a"));
+  assert('.' == text[n - 4] && '"' == text[n - 1]);
+
+  // disabling stops the log after a last flush
+  unlink("testdb.trace");
+  SOPHIA_ASSERT(sp->Trace(true, 0));
+  SOPHIA_ASSERT(sp->TraceLog("testdb.trace", 1));
+  SOPHIA_ASSERT(sp->Delete("trace:b"));
+  SOPHIA_ASSERT(sp->Trace(false));
+  FILE *file = fopen("testdb.trace", "r");
+  assert(file);
+  assert(fgets(text, sizeof(text), file));
+  assert(0 == strncmp("seq=0 ", text, 6));
+  assert(strstr(text, " op=delete "));
+  assert(strstr(text, " key=\"trace:b\\x00\"\n"));
+  assert(!fgets(text, sizeof(text), file));
+  fclose(file);
+  unlink("testdb.trace");
+#else
+  assert(0 == n);
+#endif
+
+  SOPHIA_ASSERT(sp->Trace(false));
+  assert(0 == sp->SlowOperations(operations, 8));
+  SOPHIA_ASSERT(sp->Delete("trace:b"));
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+/**
+ * Flip the byte at `offset` of the file at `path`, from
+ * the end when negative.
+ */
+
+static void
+FlipByte(const char *path, long offset) {
+  FILE *file = fopen(path, "r+b");
+  assert(file);
+  assert(0 == fseek(file, offset, offset < 0 ? SEEK_END : SEEK_SET));
+  int c = fgetc(file);
+  assert(EOF != c);
+  assert(0 == fseek(file, -1, SEEK_CUR));
+  assert(EOF != fputc(c ^ 0xff, file));
+  fclose(file);
+}
+
+TEST(Sophia, Snapshot) {
+  Sophia *sp = new Sophia("testdb");
+  const char *keys[] = { "snap:a", "snap:b", "snap:c", "snap:d", "snap:e" };
+  const char *path = "testdb.snapshot";
+  const char *key;
+  const char *value;
+  size_t keysize;
+  size_t valuesize;
+  char *found;
+
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->ExportSnapshot(path));
+  SOPHIA_ASSERT(sp->Open());
+  for (int i = 0; i < 5; i++) SOPHIA_ASSERT(sp->Set(keys[i], keys[i]));
+  SOPHIA_ASSERT(sp->Set("snaq", "outside"));
+
+  // small blocks, so the range spans several
+  SOPHIA_ASSERT(sp->ExportSnapshot(path, "snap:", 6, "snap;", 6, 50));
+  assert(0 != access("testdb.snapshot.tmp", F_OK));
+
+  SnapshotFile *snapshot = new SnapshotFile(path);
+  assert(SOPHIA_FORMAT_ERROR == snapshot->Verify());
+  SOPHIA_ASSERT(snapshot->Open());
+  assert(5 == snapshot->Records());
+  assert(5 * 14 == snapshot->Bytes());
+  assert(3 == snapshot->Blocks());
+  SOPHIA_ASSERT(snapshot->Verify());
+  for (int i = 0; i < 5; i++) {
+    assert(1 == snapshot->Next(&key, &keysize, &value, &valuesize));
+    assert(7 == keysize && 0 == strcmp(keys[i], key));
+    assert(7 == valuesize && 0 == strcmp(keys[i], value));
+  }
+  assert(0 == snapshot->Next(&key, &keysize, &value, &valuesize));
+  delete snapshot;
+
+  // restore into an emptied range
+  SOPHIA_ASSERT(sp->DeleteRange("snap:", "snap;"));
+  assert(NULL == sp->Get("snap:c"));
+  SOPHIA_ASSERT(sp->ImportSnapshot(path));
+  assert(sp->IsOpen());
+  for (int i = 0; i < 5; i++) {
+    found = sp->Get(keys[i]);
+    assert(found && 0 == strcmp(keys[i], found));
+    free(found);
+  }
+
+  // a damaged block is caught before anything is loaded
+  SOPHIA_ASSERT(sp->DeleteRange("snap:", "snap;"));
+  FlipByte(path, 20);
+  assert(SOPHIA_CHECKSUM_ERROR == sp->ImportSnapshot(path));
+  assert(NULL == sp->Get("snap:a"));
+
+  // and so is a damaged footer or a truncated file
+  SOPHIA_ASSERT(sp->ExportSnapshot(path));
+  FlipByte(path, -20);
+  assert(SOPHIA_CHECKSUM_ERROR == sp->ImportSnapshot(path));
+  SOPHIA_ASSERT(sp->ExportSnapshot(path));
+  assert(0 == truncate(path, 8));
+  assert(SOPHIA_FORMAT_ERROR == sp->ImportSnapshot(path));
+  assert(SOPHIA_FILE_ERROR == sp->ImportSnapshot("testdb.missing"));
+
+  // an empty range still makes a valid file
+  SOPHIA_ASSERT(sp->ExportSnapshot(path, "snap:", 6, "snap;", 6));
+  snapshot = new SnapshotFile(path);
+  SOPHIA_ASSERT(snapshot->Open());
+  assert(0 == snapshot->Records() && 0 == snapshot->Blocks());
+  SOPHIA_ASSERT(snapshot->Verify());
+  assert(0 == snapshot->Next(&key, &keysize, &value, &valuesize));
+  delete snapshot;
+
+  unlink(path);
+  SOPHIA_ASSERT(sp->Delete("snaq"));
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+/**
+ * Sophia::ParallelScan() visitor state.
+ */
+
+typedef struct {
+  pthread_mutex_t mutex;
+  bool seen[1000];
+  size_t shards[1000];
+  size_t rows;
+  size_t limit;
+  char last[32];
+  bool ordered;
+  pthread_t caller;
+  int failures;
+} ParallelScanVisit;
+
+/**
+ * Check and count a row of `pscan:NNNN` keys with
+ * 1000-byte values filled with the key's last digit.
+ */
+
+static bool
+ParallelScanVisitor(const IteratorResult *result, size_t shard, void *data) {
+  ParallelScanVisit *visit = (ParallelScanVisit *) data;
+  int i = atoi(result->key + 6);
+  bool more;
+
+  pthread_mutex_lock(&visit->mutex);
+  if (visit->seen[i]) visit->failures++;
+  if (1000 != result->valuesize) visit->failures++;
+  if (result->key[9] != result->value[999]) visit->failures++;
+  if (visit->ordered) {
+    if (!pthread_equal(visit->caller, pthread_self())) visit->failures++;
+    if (0 <= strcmp(visit->last, result->key)) visit->failures++;
+    strcpy(visit->last, result->key);
+  }
+  visit->seen[i] = true;
+  visit->shards[i] = shard;
+  more = ++visit->rows != visit->limit;
+  pthread_mutex_unlock(&visit->mutex);
+  return more;
+}
+
+/**
+ * Reset `visit` for a scan.
+ */
+
+static void
+ParallelScanReset(ParallelScanVisit *visit, bool ordered, size_t limit) {
+  memset(visit->seen, 0, sizeof(visit->seen));
+  memset(visit->shards, 0, sizeof(visit->shards));
+  visit->rows = 0;
+  visit->limit = limit;
+  visit->last[0] = '\0';
+  visit->ordered = ordered;
+  visit->caller = pthread_self();
+  visit->failures = 0;
+}
+
+TEST(Sophia, ParallelScan) {
+  Sophia *sp = new Sophia("testdb");
+  ParallelScanVisit visit;
+  WriteBatch batch;
+  char key[32];
+  char value[1000];
+
+  pthread_mutex_init(&visit.mutex, NULL);
+  ParallelScanReset(&visit, false, 0);
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->ParallelScan(
+      NULL, 0, NULL, 0, 1, ParallelScanVisitor, &visit));
+  SOPHIA_ASSERT(sp->Open());
+  assert(SOPHIA_NOT_THREAD_SAFE_ERROR == sp->ParallelScan(
+      NULL, 0, NULL, 0, 4, ParallelScanVisitor, &visit));
+  SOPHIA_ASSERT(sp->Close());
+  sp->ThreadSafe();
+  SOPHIA_ASSERT(sp->Open());
+
+  for (int i = 0; i < 1000; i++) {
+    sprintf(key, "pscan:%04d", i);
+    memset(value, key[9], sizeof(value));
+    SOPHIA_ASSERT(batch.Set(key, strlen(key) + 1, value, sizeof(value)));
+  }
+  SOPHIA_ASSERT(sp->Write(batch));
+
+  // unordered, over interpolated shards
+  SOPHIA_ASSERT(sp->ParallelScan(
+      "pscan:", 7, "pscan;", 7, 4, ParallelScanVisitor, &visit));
+  assert(1000 == visit.rows && 0 == visit.failures);
+  size_t shards = 0;
+  for (int i = 1; i < 1000; i++) {
+    assert(visit.shards[i - 1] <= visit.shards[i]);
+    if (visit.shards[i - 1] != visit.shards[i]) shards++;
+  }
+  assert(shards > 4);
+
+  // ordered on the calling thread, through the chunks
+  ParallelScanReset(&visit, true, 0);
+  SOPHIA_ASSERT(sp->ParallelScan(
+      "pscan:", 7, "pscan;", 7, 4, ParallelScanVisitor, &visit, true));
+  assert(1000 == visit.rows && 0 == visit.failures);
+
+  // stopped early
+  ParallelScanReset(&visit, true, 10);
+  SOPHIA_ASSERT(sp->ParallelScan(
+      "pscan:", 7, "pscan;", 7, 4, ParallelScanVisitor, &visit, true));
+  assert(10 == visit.rows && 0 == visit.failures);
+  assert(visit.seen[9] && !visit.seen[10]);
+  ParallelScanReset(&visit, false, 10);
+  SOPHIA_ASSERT(sp->ParallelScan(
+      "pscan:", 7, "pscan;", 7, 4, ParallelScanVisitor, &visit));
+  assert(10 <= visit.rows && 1000 > visit.rows);
+
+  // given splits, skipping those out of order or range
+  const char *splits[] = { "pscan:0500", "pscan:0250", "pscan:0750", "z" };
+  size_t splitsizes[] = { 11, 11, 11, 2 };
+  ParallelScanReset(&visit, true, 0);
+  SOPHIA_ASSERT(sp->ParallelScan(
+      "pscan:0100"
+    , 11
+    , "pscan:0900"
+    , 11
+    , 2
+    , ParallelScanVisitor
+    , &visit
+    , true
+    , splits
+    , splitsizes
+    , 4
+  ));
+  assert(800 == visit.rows && 0 == visit.failures);
+  assert(!visit.seen[99] && visit.seen[100]);
+  assert(visit.seen[899] && !visit.seen[900]);
+  assert(0 == visit.shards[499] && 1 == visit.shards[500]);
+  assert(1 == visit.shards[749] && 2 == visit.shards[750]);
+
+  // one thread, to the end of the database
+  ParallelScanReset(&visit, false, 0);
+  SOPHIA_ASSERT(sp->ParallelScan(
+      "pscan:0990", 11, NULL, 0, 1, ParallelScanVisitor, &visit));
+  assert(10 == visit.rows && 0 == visit.failures);
+  assert(0 == sp->cursors.Count());
+
+  SOPHIA_ASSERT(sp->DeleteRange("pscan:", "pscan;"));
+  SOPHIA_ASSERT(sp->Close());
+  pthread_mutex_destroy(&visit.mutex);
+  delete sp;
+}
+
+/**
+ * Index the comma-separated fields after the first of
+ * a value, refusing values without any.
+ */
+
+static bool
+IndexFields(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+  , IndexKeys *keys
+  , void *data
+) {
+  const char *end = value + valuesize;
+  const char *field = (const char *) memchr(value, ',', valuesize);
+
+  (void) key;
+  (void) keysize;
+  (void) data;
+  if (!field) return false;
+  if (end > value && '\0' == end[-1]) end--;
+  while (field++ < end) {
+    const char *next = (const char *) memchr(field, ',', end - field);
+    if (!next) next = end;
+    if (SOPHIA_SUCCESS != keys->Add(field, next - field)) return false;
+    field = next;
+  }
+  return true;
+}
+
+/**
+ * Index the first comma-separated field of a value.
+ */
+
+static bool
+IndexFirstField(
+    const char *key
+  , size_t keysize
+  , const char *value
+  , size_t valuesize
+  , IndexKeys *keys
+  , void *data
+) {
+  const char *comma = (const char *) memchr(value, ',', valuesize);
+
+  (void) key;
+  (void) keysize;
+  (void) data;
+  return comma && SOPHIA_SUCCESS == keys->Add(value, comma - value);
+}
+
+/**
+ * Join the keys of the entries `it` finds with spaces.
+ */
+
+static void
+IndexKeysFound(IndexIterator *it, char *out) {
+  IndexResult *result;
+
+  out[0] = '\0';
+  assert(SOPHIA_SUCCESS == it->Begin());
+  while ((result = it->Next())) {
+    if (out[0]) strcat(out, " ");
+    strcat(out, result->key);
+  }
+  assert(SOPHIA_SUCCESS == it->End());
+}
+
+/**
+ * RebuildIndex() progress counter.
+ */
+
+static void
+CountIndexed(size_t indexed, void *data) {
+  *(size_t *) data = indexed;
+}
+
+TEST(Sophia, SecondaryIndex) {
+  Sophia *sp = new Sophia("testindex");
+  SecondaryIndex cities("cities", IndexFields);
+  SecondaryIndex names("names", IndexFirstField);
+  IndexResult *result;
+  char found[64];
+  size_t n;
+
+  IndexIterator paris(sp, &cities, "paris", 5);
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == paris.Begin());
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->AddIndex(&cities));
+  SOPHIA_ASSERT(sp->AddIndex(&cities));
+  assert(0 == strcmp("cities", cities.Name()));
+
+  SOPHIA_ASSERT(sp->Set("u1", "ana,paris"));
+  SOPHIA_ASSERT(sp->Set("u2", "bob,rome,paris"));
+  SOPHIA_ASSERT(sp->Set("u3", "cy,oslo"));
+
+  // entries sort by key within an index key, with records
+  SOPHIA_ASSERT(paris.Begin());
+  assert((result = paris.Next()));
+  assert(5 == result->indexkeysize);
+  assert(0 == memcmp("paris", result->indexkey, 5));
+  assert(0 == strcmp("u1", result->key) && 3 == result->keysize);
+  assert(0 == strcmp("ana,paris", result->value));
+  assert((result = paris.Next()) && 0 == strcmp("u2", result->key));
+  assert(0 == strcmp("bob,rome,paris", result->value));
+  assert(NULL == paris.Next());
+  SOPHIA_ASSERT(paris.End());
+
+  // replaced and deleted records take their entries along
+  IndexIterator rome(sp, &cities, "rome", 4);
+  SOPHIA_ASSERT(sp->Set("u1", "ana,rome"));
+  IndexKeysFound(&paris, found);
+  assert(0 == strcmp("u2", found));
+  IndexKeysFound(&rome, found);
+  assert(0 == strcmp("u1 u2", found));
+  SOPHIA_ASSERT(sp->Delete("u2"));
+  IndexKeysFound(&paris, found);
+  assert(0 == strcmp("", found));
+  IndexKeysFound(&rome, found);
+  assert(0 == strcmp("u1", found));
+
+  // a transaction only indexes the last write of each key
+  Transaction t(sp);
+  SOPHIA_ASSERT(t.Set("u4", "dan,lima"));
+  SOPHIA_ASSERT(t.Set("u4", "dan,oslo"));
+  SOPHIA_ASSERT(t.Delete("u3"));
+  SOPHIA_ASSERT(t.Set("u5", 3, "eve,a\0b", 8));
+  SOPHIA_ASSERT(t.Commit());
+  IndexIterator lima(sp, &cities, "lima", 4);
+  IndexKeysFound(&lima, found);
+  assert(0 == strcmp("", found));
+  IndexIterator oslo(sp, &cities, "oslo", 4);
+  IndexKeysFound(&oslo, found);
+  assert(0 == strcmp("u4", found));
+
+  // NULs in index keys, which an exact key doesn't prefix
+  IndexIterator a(sp, &cities, "a", 1);
+  IndexKeysFound(&a, found);
+  assert(0 == strcmp("", found));
+  IndexIterator ab(sp, &cities, "a\0b", 3);
+  IndexKeysFound(&ab, found);
+  assert(0 == strcmp("u5", found));
+
+  // ranges, without reading records
+  IndexIterator range(sp, &cities, "a", 1, "p", 1, false);
+  SOPHIA_ASSERT(range.Begin());
+  assert((result = range.Next()) && 0 == strcmp("u5", result->key));
+  assert(3 == result->indexkeysize);
+  assert(0 == memcmp("a\0b", result->indexkey, 3));
+  assert(NULL == result->value && 0 == result->valuesize);
+  assert((result = range.Next()) && 0 == strcmp("u4", result->key));
+  assert(NULL == range.Next());
+  SOPHIA_ASSERT(range.End());
+  IndexIterator all(sp, &cities, NULL, 0, NULL, 0);
+  IndexKeysFound(&all, found);
+  assert(0 == strcmp("u5 u4 u1", found));
+
+  // refused records aren't written, entries aren't counted
+  assert(SOPHIA_INDEX_ERROR == sp->Set("u6", "nofields"));
+  assert(NULL == sp->Get("u6"));
+  SOPHIA_ASSERT(sp->Count(&n));
+  assert(3 == n);
+
+  // an index added late is built by a rebuild
+  SOPHIA_ASSERT(sp->AddIndex(&names));
+  IndexIterator ana(sp, &names, "ana", 3);
+  IndexKeysFound(&ana, found);
+  assert(0 == strcmp("", found));
+  size_t indexed = 0;
+  SOPHIA_ASSERT(sp->RebuildIndex(&names, CountIndexed, &indexed, 2));
+  assert(3 == indexed);
+  IndexKeysFound(&ana, found);
+  assert(0 == strcmp("u1", found));
+  SOPHIA_ASSERT(sp->RebuildIndex(&cities));
+  IndexKeysFound(&all, found);
+  assert(0 == strcmp("u5 u4 u1", found));
+
+  // removed indexes go stale, skipping records now gone,
+  // and cleared records drop their entries
+  SOPHIA_ASSERT(sp->RemoveIndex(&names));
+  SOPHIA_ASSERT(sp->Delete("u1"));
+  IndexKeysFound(&ana, found);
+  assert(0 == strcmp("", found));
+  IndexIterator stale(sp, &names, "ana", 3, false);
+  IndexKeysFound(&stale, found);
+  assert(0 == strcmp("u1", found));
+  SOPHIA_ASSERT(sp->Clear());
+  IndexKeysFound(&all, found);
+  assert(0 == strcmp("", found));
+  assert(0 == sp->cursors.Count());
+
+  SOPHIA_ASSERT(sp->RemoveIndex(&cities));
+  SOPHIA_ASSERT(sp->RebuildIndex(&names));
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+/**
+ * Iterator tests.
+ */
+
+TEST(Iterator, Begin) {
+  Sophia *sp = new Sophia("testdb");
+  Iterator *it = NULL;
+  IteratorResult *res = NULL;
+
+  it = new Iterator(sp);
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == it->Begin());
+  delete it;
+
+  SOPHIA_ASSERT(sp->Open());
+
+  // test reverse
+
+  it = new Iterator(sp, SPLT);
+  SOPHIA_ASSERT(it->Begin());
+  assert(SOPHIA_CURSOR_ALREADY_OPEN_ERROR == it->Begin());
+
+  res = it->Next();
+  assert(0 == strcmp("key04999", res->key));
+  assert(0 == strcmp("value04999", res->value));
+
+  SOPHIA_ASSERT(it->End());
+  delete it;
+
+  // test start
+
+  it = new Iterator(sp, SPGT, "key03999");
+  SOPHIA_ASSERT(it->Begin());
+
+  res = it->Next();
+  assert(0 == strcmp("key04000", res->key));
+  assert(0 == strcmp("value04000", res->value));
+
+  SOPHIA_ASSERT(it->End());
+  delete it;
+
+  // test start/end
+
+  it = new Iterator(sp, SPGT, "key03999", "key04001");
+  SOPHIA_ASSERT(it->Begin());
+
+  res = it->Next();
+  assert(0 == strcmp("key04000", res->key));
+  assert(0 == strcmp("value04000", res->value));
+
+  assert(NULL == it->Next());
+  SOPHIA_ASSERT(it->End());
+  delete it;
+
+  // test end
+
+  it = new Iterator(sp, SPGT, NULL, "key00002");
+  SOPHIA_ASSERT(it->Begin());
+  res = it->Next();
+  assert(0 == strcmp("key00000", res->key));
+  assert(0 == strcmp("value00000", res->value));
+
+  res = it->Next();
+  assert(0 == strcmp("key00001", res->key));
+  assert(0 == strcmp("value00001", res->value));
+
+  assert(NULL == it->Next());
+  SOPHIA_ASSERT(it->End());
+  delete it;
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Iterator, Next) {
+  Sophia *sp = new Sophia("testdb");
+  Iterator *it = NULL;
+  Iterator *it2 = NULL;
+  IteratorResult *res = NULL;
+  int i = 0;
+
+  SOPHIA_ASSERT(sp->Open());
+  it = new Iterator(sp, SPGT, "key00100", "key00500");
+
+  assert(0 == it->Begin());
+
+  i = 100;
+  while ((res = it->Next())) {
+    i++;
+    char key[100];
+    char value[100];
+    sprintf(key, "key%05d", i);
+    sprintf(value, "value%05d", i);
+
+    assert(0 == strcmp(key, res->key));
+    assert(0 == strcmp(value, res->value));
+
+  }
+
+  assert(499 == i);
+  SOPHIA_ASSERT(it->End());
+  delete it;
+
+  // multiple iterators
+
+  it = new Iterator(sp, SPGT, "key00000", "key00100");
+  it2 = new Iterator(sp, SPLT, "key00100", "key00000");
+
+  SOPHIA_ASSERT(it->Begin());
+  SOPHIA_ASSERT(it2->Begin());
+
+  res = it->Next();
+  assert(0 == strcmp("key00001", res->key));
+  assert(0 == strcmp("value00001", res->value));
+
+  res = it2->Next();
+  assert(0 == strcmp("key00099", res->key));
+  assert(0 == strcmp("value00099", res->value));
+
+  SOPHIA_ASSERT(it->End());
+  SOPHIA_ASSERT(it2->End());
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Iterator, Result) {
+  Sophia *sp = new Sophia("testdb");
+  Iterator *it = NULL;
+  IteratorResult res;
+  int i = 0;
+
+  SOPHIA_ASSERT(sp->Open());
+
+  // caller-owned result
+  it = new Iterator(sp, SPGT, "key00100");
+  assert(false == it->Next(&res));
+  SOPHIA_ASSERT(it->Begin());
+  assert(it->Next(&res));
+  assert(0 == strcmp("key00101", res.key));
+  assert(9 == res.keysize);
+  assert(0 == strcmp("value00101", res.value));
+  assert(11 == res.valuesize);
+
+  // iterator-owned result is reused
+  IteratorResult *a = it->Next();
+  IteratorResult *b = it->Next();
+  assert(a == b);
+  assert(0 == strcmp("key00103", b->key));
+  SOPHIA_ASSERT(it->End());
+  delete it;
+
+  // range-for
+  it = new Iterator(sp, SPGT, "key04989");
+  i = 4989;
+  for (const IteratorResult &row : *it) {
+    i++;
+    char key[100];
+    sprintf(key, "key%05d", i);
+    assert(0 == strcmp(key, row.key));
+    assert(strlen(key) + 1 == row.keysize);
+  }
+  assert(4999 == i);
+  SOPHIA_ASSERT(it->End());
+  delete it;
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Iterator, Range) {
+  Sophia *sp = new Sophia("testdb");
+  Iterator *it = NULL;
+  IteratorResult *res = NULL;
+
+  SOPHIA_ASSERT(sp->Open());
+
+  // stops at an end key which doesn't exist
+  it = new Iterator(sp, SPGT, "key04990", "key04995x");
+  SOPHIA_ASSERT(it->Begin());
+  for (int i = 4991; i <= 4995; i++) {
+    char key[100];
+    sprintf(key, "key%05d", i);
+    res = it->Next();
+    assert(0 == strcmp(key, res->key));
+  }
+  assert(NULL == it->Next());
+  // the cursor is already gone, so writes go through
+  SOPHIA_ASSERT(sp->Set("key04995x", "value"));
+  SOPHIA_ASSERT(sp->Delete("key04995x"));
+  SOPHIA_ASSERT(it->End());
+  delete it;
+
+  // inclusive bounds
+  it = new Iterator(sp, SPGT, "key00010", 9, true, "key00012", 9, true);
+  SOPHIA_ASSERT(it->Begin());
+  assert(0 == strcmp("key00010", it->Next()->key));
+  assert(0 == strcmp("key00011", it->Next()->key));
+  assert(0 == strcmp("key00012", it->Next()->key));
+  assert(NULL == it->Next());
+  delete it;
+
+  // exclusive bounds, reversed
+  it = new Iterator(sp, SPLTE, "key00012", 9, false, "key00010", 9, false);
+  SOPHIA_ASSERT(it->Begin());
+  assert(0 == strcmp("key00011", it->Next()->key));
+  assert(NULL == it->Next());
+  delete it;
+
+  // reversed, end key missing
+  it = new Iterator(sp, SPLT, "key00003", "key00000x");
+  SOPHIA_ASSERT(it->Begin());
+  assert(0 == strcmp("key00002", it->Next()->key));
+  assert(0 == strcmp("key00001", it->Next()->key));
+  assert(NULL == it->Next());
+  delete it;
+
+  // binary keys compare by size too
+  const char a[] = { 'b', 'i', 'n', '\0', 'a' };
+  const char b[] = { 'b', 'i', 'n', '\0', 'b' };
+  const char c[] = { 'b', 'i', 'n', '\0', 'b', '\0' };
+  SOPHIA_ASSERT(sp->Set(a, sizeof(a), "a", 2));
+  SOPHIA_ASSERT(sp->Set(b, sizeof(b), "b", 2));
+  SOPHIA_ASSERT(sp->Set(c, sizeof(c), "c", 2));
+  it = new Iterator(sp, SPGTE, a, sizeof(a), c, sizeof(c));
+  SOPHIA_ASSERT(it->Begin());
+  assert(0 == strcmp("a", it->Next()->value));
+  assert(0 == strcmp("b", it->Next()->value));
+  assert(NULL == it->Next());
+  delete it;
+  SOPHIA_ASSERT(sp->Delete(a, sizeof(a)));
+  SOPHIA_ASSERT(sp->Delete(b, sizeof(b)));
+  SOPHIA_ASSERT(sp->Delete(c, sizeof(c)));
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Iterator, Prefix) {
+  Sophia *sp = new Sophia("testdb");
+  IteratorResult *res = NULL;
+  int i = 0;
+
+  SOPHIA_ASSERT(sp->Open());
+
+  PrefixIterator *it = new PrefixIterator(sp, "key0419");
+  SOPHIA_ASSERT(it->Begin());
+  while ((res = it->Next())) {
+    char key[100];
+    sprintf(key, "key0419%d", i++);
+    assert(0 == strcmp(key, res->key));
+    assert(0 == memcmp("key0419", res->key, 7));
+  }
+  assert(10 == i);
+  // stopped at the first key without the prefix
+  SOPHIA_ASSERT(sp->Set("key0419x", "value"));
+  SOPHIA_ASSERT(sp->Delete("key0419x"));
+  delete it;
+
+  it = new PrefixIterator(sp, "nope");
+  SOPHIA_ASSERT(it->Begin());
+  assert(NULL == it->Next());
+  delete it;
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+/**
+ * Transaction tests.
+ */
+
+TEST(Transaction, Begin) {
+  Sophia *sp = new Sophia("testdb");
+
+  Transaction *t = new Transaction(sp);
+
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == t->Begin());
+
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Clear());
+
+  SOPHIA_ASSERT(t->Begin());
+  SOPHIA_ASSERT(t->Rollback());
+  delete t;
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Transaction, Set) {
+  Sophia *sp = new Sophia("testdb");
+  Transaction *t = new Transaction(sp);
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(t->Begin());
+
+  for (int i = 0; i < 5000; i++) {
+    char key[100];
+    char value[100];
+    sprintf(key, "key%05d", i);
+    sprintf(value, "value%05d", i);
+    SOPHIA_ASSERT(t->Set(key, value));
+  }
+
+  SOPHIA_ASSERT(t->Commit());
+  delete t;
+
+  size_t count;
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(5000 == count);
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Transaction, Delete) {
+  Sophia *sp = new Sophia("testdb");
+  Transaction *t = new Transaction(sp);
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(t->Begin());
+
+  for (int i = 0; i < 5000; i += 2) {
+    char key[100];
+    sprintf(key, "key%05d", i);
+    SOPHIA_ASSERT(t->Delete(key));
+  }
+
+  SOPHIA_ASSERT(t->Commit());
+  delete t;
+
+  size_t count;
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(2500 == count);
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Transaction, Commit) {
+  Sophia *sp = new Sophia("testdb");
+  Transaction *t = new Transaction(sp);
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(t->Begin());
+
+  size_t sets = 0;
+  size_t dels = 0;
+
+  for (int i = 0; i < 10000; i++) {
+    char key[100];
+    char value[100];
+    sprintf(key, "key%05d", i);
+    sprintf(value, "value%05d", i);
+
+    int n = (rand() % 3) + 1;
+    if (2 == n) {
+      SOPHIA_ASSERT(t->Delete(key));
+      dels++;
+    } else {
+      SOPHIA_ASSERT(t->Set(key, value));
+      sets++;
+    }
+  }
+
+  SOPHIA_ASSERT(t->Commit());
+
+  size_t count;
+  SOPHIA_ASSERT(sp->Count(&count));
+  assert(sets == count);
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+/**
+ * WriteBatch tests.
+ */
+
+TEST(WriteBatch, Set) {
+  Sophia *sp = new Sophia("testdb");
+  WriteBatch batch;
+
+  assert(0 == batch.Count());
+  SOPHIA_ASSERT(batch.Set("batch-a", "1"));
+  SOPHIA_ASSERT(batch.Set("batch-b", "2"));
+
+  // binary keys and values keep their sizes
+  const char key[] = { 'b', '\0', 'k' };
+  const char value[] = { 'v', '\0', 'a', 'l' };
+  SOPHIA_ASSERT(batch.Set(key, sizeof(key), value, sizeof(value)));
+  assert(3 == batch.Count());
+
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == sp->Write(batch));
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Write(batch));
+
+  Value result;
+  SOPHIA_ASSERT(sp->Get("batch-a", result));
+  assert(0 == strcmp("1", result.Data()));
+  SOPHIA_ASSERT(sp->Get(key, sizeof(key), result));
+  assert(sizeof(value) == result.Size());
+  assert(0 == memcmp(value, result.Data(), sizeof(value)));
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(WriteBatch, Delete) {
+  Sophia *sp = new Sophia("testdb");
+  WriteBatch batch;
+  const char key[] = { 'b', '\0', 'k' };
+
+  SOPHIA_ASSERT(batch.Delete("batch-a"));
+  SOPHIA_ASSERT(batch.Delete("batch-b"));
+  SOPHIA_ASSERT(batch.Delete(key, sizeof(key)));
+
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(sp->Write(batch));
+  assert(NULL == sp->Get("batch-a"));
+  assert(NULL == sp->Get("batch-b"));
+  assert(NULL == sp->Get(key, sizeof(key)));
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(WriteBatch, Clear) {
+  WriteBatch batch;
+
+  assert(SOPHIA_SUCCESS == batch.Reserve(1024));
+  assert(SOPHIA_SUCCESS == batch.Set("foo", "bar"));
+  assert(1 == batch.Count());
+  assert(0 < batch.Size());
+
+  batch.Clear();
+  assert(0 == batch.Count());
+  assert(0 == batch.Size());
+
+  // grows past the reserved size
+  for (int i = 0; i < 1000; i++) {
+    char key[100];
+    sprintf(key, "key%05d", i);
+    assert(SOPHIA_SUCCESS == batch.Delete(key));
+  }
+  assert(1000 == batch.Count());
+}
+
+/**
+ * BulkLoader tests.
+ */
+
+class CountingSource : public BulkSource {
+  public:
+    CountingSource(int n) : i(0), n(n) {}
+
+    int
+    Next(
+        const char **key
+      , size_t *keysize
+      , const char **value
+      , size_t *valuesize
+    ) {
+      if (i == n) return 0;
+      sprintf(k, "bulk%05d", i);
+      sprintf(v, "value%05d", i);
+      *key = k;
+      *keysize = strlen(k) + 1;
+      *value = v;
+      *valuesize = strlen(v) + 1;
+      i++;
+      return 1;
+    }
+
+  private:
+    int i;
+    int n;
+    char k[32];
+    char v[32];
+};
+
+TEST(BulkLoader, Load) {
+  Sophia *sp = new Sophia("testdb");
+  CountingSource source(1000);
+  BulkLoader loader(sp, 64);
+
+  // loads into a closed db, leaving it closed
+  SOPHIA_ASSERT(loader.Load(&source));
+  assert(1000 == loader.Records());
+  assert(false == sp->IsOpen());
+
+  SOPHIA_ASSERT(sp->Open());
+  for (int i = 0; i < 1000; i++) {
+    char key[32];
+    char value[32];
+    sprintf(key, "bulk%05d", i);
+    sprintf(value, "value%05d", i);
+    char *actual = sp->Get(key);
+    assert(0 == strcmp(value, actual));
+    free(actual);
+  }
+
+  // a read-only db is left alone
+  SOPHIA_ASSERT(sp->Close());
+  SOPHIA_ASSERT(sp->Open(false, true));
+  assert(SOPHIA_READ_ONLY_ERROR == loader.Load(&source));
+  assert(true == sp->IsOpen());
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(BulkLoader, File) {
+  Sophia *sp = new Sophia("testdb");
+  BulkLoader loader(sp, 10);
+  FILE *file = fopen("testdb.records", "wb");
+  assert(file);
+
+  for (int i = 0; i < 100; i++) {
+    char key[32];
+    char value[32];
+    sprintf(key, "bulk%05d", i);
+    sprintf(value, "file%05d", i);
+    SOPHIA_ASSERT(BulkFile::Write(
+        file
+      , key
+      , strlen(key) + 1
+      , value
+      , strlen(value) + 1
+    ));
+  }
+  fclose(file);
+
+  assert(SOPHIA_FILE_ERROR == loader.Load("testdb.missing"));
+
+  // an open db is reopened afterwards
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(loader.Load("testdb.records"));
+  assert(true == sp->IsOpen());
+  assert(100 == loader.Records());
+  assert(0 < loader.Bytes());
+
+  char *actual = sp->Get("bulk00042");
+  assert(0 == strcmp("file00042", actual));
+  free(actual);
+
+  // truncated records are rejected
+  assert(0 == truncate("testdb.records", 10));
+  assert(SOPHIA_FORMAT_ERROR == loader.Load("testdb.records"));
+  assert(true == sp->IsOpen());
+
+  for (int i = 0; i < 1000; i++) {
+    char key[32];
+    sprintf(key, "bulk%05d", i);
+    SOPHIA_ASSERT(sp->Delete(key));
+  }
+
+  unlink("testdb.records");
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+/**
+ * Environment tests.
+ */
+
+static bool
+CollectKeys(const IteratorResult *result, void *data) {
+  strcat((char *) data, result->key);
+  strcat((char *) data, ",");
+  return true;
+}
+
+TEST(Environment, Handle) {
+  Environment *env = new Environment("testenv");
+  Sophia *sp = env->Engine();
+  MultiGetResult result;
+  char keys[100] = "";
+  size_t n;
+
+  Database *users = env->Handle("users");
+  Database *posts = env->Handle("posts");
+  assert(users && posts && users != posts);
+  assert(users == env->Handle("users"));
+  assert(NULL == env->Handle(""));
+  assert(0 == strcmp("users", users->Name()));
+
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == users->Set("a", "1"));
+  SOPHIA_ASSERT(env->Open());
+
+  // same keys, separate keyspaces
+  SOPHIA_ASSERT(users->Set("a", "user a"));
+  SOPHIA_ASSERT(users->Set("b", "user b"));
+  SOPHIA_ASSERT(posts->Set("a", "post a"));
+
+  char *value = users->Get("a");
+  assert(0 == strcmp("user a", value));
+  free(value);
+  Value v;
+  SOPHIA_ASSERT(posts->Get("a", v));
+  assert(0 == strcmp("post a", v.Data()));
+  assert(NULL == posts->Get("b"));
+
+  const char *lookup[] = { "b", "c", "a" };
+  SOPHIA_ASSERT(users->MultiGet(lookup, 3, result));
+  assert(0 == strcmp("user b", result.Data(0)));
+  assert(NULL == result.Data(1));
+  assert(0 == strcmp("user a", result.Data(2)));
+
+  SOPHIA_ASSERT(users->Scan(NULL, 0, NULL, 0, CollectKeys, keys));
+  assert(0 == strcmp("a,b,", keys));
+  keys[0] = '\0';
+  SOPHIA_ASSERT(users->Scan("b", 2, NULL, 0, CollectKeys, keys));
+  assert(0 == strcmp("b,", keys));
+
+  SOPHIA_ASSERT(users->Count(&n));
+  assert(2 == n);
+  SOPHIA_ASSERT(users->Delete("a"));
+  SOPHIA_ASSERT(users->Count(&n));
+  assert(1 == n);
+
+  SOPHIA_ASSERT(users->Clear());
+  SOPHIA_ASSERT(users->Count(&n));
+  assert(0 == n);
+  SOPHIA_ASSERT(posts->Count(&n));
+  assert(1 == n);
+
+  SOPHIA_ASSERT(posts->Clear());
+  SOPHIA_ASSERT(env->Close());
+  delete env;
+}
+
+TEST(Environment, Transaction) {
+  Environment *env = new Environment("testenv");
+  Sophia *sp = env->Engine();
+  Sophia *other = new Sophia("testdb");
+  Database *accounts = env->Handle("accounts");
+  Database *ledger = env->Handle("ledger");
+  Transaction *t = new Transaction(sp);
+  Transaction *foreign = new Transaction(other);
+
+  SOPHIA_ASSERT(env->Open());
+  SOPHIA_ASSERT(accounts->Set("alice", "10"));
+
+  // one commit over both keyspaces
+  SOPHIA_ASSERT(t->Begin());
+  SOPHIA_ASSERT(accounts->Set(t, "alice", 6, "5", 2));
+  SOPHIA_ASSERT(ledger->Set(t, "1", 2, "alice -5", 9));
+  assert(NULL == ledger->Get("1"));
+  SOPHIA_ASSERT(t->Commit());
+
+  char *value = accounts->Get("alice");
+  assert(0 == strcmp("5", value));
+  free(value);
+  value = ledger->Get("1");
+  assert(0 == strcmp("alice -5", value));
+  free(value);
+
+  SOPHIA_ASSERT(t->Begin());
+  SOPHIA_ASSERT(ledger->Delete(t, "1", 2));
+  SOPHIA_ASSERT(t->Rollback());
+  value = ledger->Get("1");
+  assert(value);
+  free(value);
+
+  int rc = ledger->Delete(foreign, "1", 2);
+  assert(SOPHIA_WRONG_ENVIRONMENT_ERROR == rc);
+
+  SOPHIA_ASSERT(accounts->Clear());
+  SOPHIA_ASSERT(ledger->Clear());
+  SOPHIA_ASSERT(env->Close());
+  delete foreign;
+  delete t;
+  delete other;
+  delete env;
+}
+
+/**
+ * TypedDB tests.
+ */
+
+TEST(TypedDB, Integers) {
+  Sophia *sp = new Sophia("testtyped");
+  TypedDB<int32_t, int64_t> db(sp);
+  int32_t key;
+  int64_t value;
+  bool found;
+
+  SOPHIA_ASSERT(sp->Open());
+
+  // inserted out of order, negatives included
+  for (int i = 0; i < 100; i++) {
+    int32_t k = ((i * 37) % 100 - 50) * 1000;
+    SOPHIA_ASSERT(db.Set(k, (int64_t) k * -3));
+  }
+
+  SOPHIA_ASSERT(db.Get(-7000, &value, &found));
+  assert(found && 21000 == value);
+  SOPHIA_ASSERT(db.Get(1, &value, &found));
+  assert(!found);
+
+  TypedIterator<int32_t, int64_t> it(sp);
+  SOPHIA_ASSERT(it.Begin());
+  int32_t expected = -50000;
+  while (it.Next(&key, &value)) {
+    assert(expected == key);
+    assert((int64_t) key * -3 == value);
+    expected += 1000;
+  }
+  SOPHIA_ASSERT(it.End());
+  assert(50000 == expected);
+
+  // numeric ranges sort numerically
+  TypedIterator<int32_t, int64_t> range(sp, SPGTE, -2000, 3000);
+  SOPHIA_ASSERT(range.Begin());
+  int rows = 0;
+  while (range.Next(&key, &value)) {
+    assert(-2000 + rows * 1000 == key);
+    rows++;
+  }
+  SOPHIA_ASSERT(range.End());
+  assert(5 == rows);
+
+  // bytes which aren't an int64_t
+  SOPHIA_ASSERT(sp->Set("\x80\0\0\x01", 4, "bad", 4));
+  assert(SOPHIA_FORMAT_ERROR == db.Get(1, &value, &found));
+  assert(!found);
+
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(TypedDB, Floats) {
+  Sophia *sp = new Sophia("testtyped");
+  TypedDB<double, float> db(sp);
+  double keys[] = {
+    3.5, -1e9, 0.0, -0.25, 1e-300, -INFINITY, 42.0, INFINITY
+  };
+  double sorted[] = {
+    -INFINITY, -1e9, -0.25, 0.0, 1e-300, 3.5, 42.0, INFINITY
+  };
+  double key;
+  float value;
+
+  SOPHIA_ASSERT(sp->Open());
+  for (int i = 0; i < 8; i++) SOPHIA_ASSERT(db.Set(keys[i], (float) i));
+
+  TypedIterator<double, float> it(sp);
+  SOPHIA_ASSERT(it.Begin());
+  int rows = 0;
+  while (it.Next(&key, &value)) {
+    assert(sorted[rows] == key);
+    assert(keys[(int) value] == key);
+    rows++;
+  }
+  SOPHIA_ASSERT(it.End());
+  assert(8 == rows);
+
   SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(TypedDB, Tuples) {
+  typedef std::tuple<std::string, uint16_t> Key;
+  Sophia *sp = new Sophia("testtyped");
+  TypedDB<Key, std::string, DefaultCodec<Key>, BytesCodec> db(sp);
+  Transaction *t = new Transaction(sp);
+  Key keys[] = {
+      Key("b", 0)
+    , Key("a", 10)
+    , Key(std::string("a\0z", 3), 0)
+    , Key("ab", 1)
+    , Key("a", 2)
+  };
+  Key sorted[] = {
+      Key("a", 2)
+    , Key("a", 10)
+    , Key(std::string("a\0z", 3), 0)
+    , Key("ab", 1)
+    , Key("b", 0)
+  };
+  Key key;
+  std::string value;
+  bool found;
+
+  SOPHIA_ASSERT(sp->Open());
   SOPHIA_ASSERT(t->Begin());
+  for (int i = 0; i < 5; i++) {
+    SOPHIA_ASSERT(db.Set(t, keys[i], std::get<0>(keys[i]) + "!"));
+  }
+  SOPHIA_ASSERT(t->Commit());
 
-  size_t sets = 0;
-  size_t dels = 0;
+  SOPHIA_ASSERT(db.Get(Key(std::string("a\0z", 3), 0), &value, &found));
+  assert(found && std::string("a\0z!", 4) == value);
 
-  for (int i = 0; i < 10000; i++) {
-    char key[100];
-    char value[100];
-    sprintf(key, "key%05d", i);
-    sprintf(value, "value%05d", i);
+  TypedIterator<Key, std::string, DefaultCodec<Key>, BytesCodec> it(sp);
+  SOPHIA_ASSERT(it.Begin());
+  int rows = 0;
+  while (it.Next(&key, &value)) {
+    assert(sorted[rows] == key);
+    rows++;
+  }
+  SOPHIA_ASSERT(it.End());
+  assert(5 == rows);
 
-    int n = (rand() % 3) + 1;
-    if (2 == n) {
-      SOPHIA_ASSERT(t->Delete(key));
-      dels++;
-    } else {
-      SOPHIA_ASSERT(t->Set(key, value));
-      sets++;
+  SOPHIA_ASSERT(db.Delete(Key("ab", 1)));
+  SOPHIA_ASSERT(db.Get(Key("ab", 1), &value, &found));
+  assert(!found);
+
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->Close());
+  delete t;
+  delete sp;
+}
+
+/**
+ * FixedKeyDB tests.
+ */
+
+TEST(FixedKeyDB, Get) {
+  Sophia *sp = new Sophia("testtyped");
+  FixedKeyDB<8> db(sp);
+  MultiGetResult result;
+  char key[8];
+  char keys[3 * 8];
+  char value[16];
+  Value v;
+
+  FixedKeyDB<8>::Pack(0x0102030405060708ULL, key);
+  assert(0 == memcmp("\1\2\3\4\5\6\7\10", key, 8));
+  assert(0x0102030405060708ULL == FixedKeyDB<8>::Unpack(key));
+  char wide[16];
+  FixedKeyDB<16>::Pack(42, wide);
+  assert(42 == FixedKeyDB<16>::Unpack(wide));
+  assert(0 == memcmp("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0*", wide, 16));
+
+  SOPHIA_ASSERT(sp->Open());
+  for (uint64_t id = 0; id < 100; id++) {
+    FixedKeyDB<8>::Pack(id, key);
+    sprintf(value, "id%03d", (int) id);
+    SOPHIA_ASSERT(db.Set(key, value, strlen(value) + 1));
+  }
+
+  FixedKeyDB<8>::Pack(42, key);
+  char *found = db.Get(key);
+  assert(0 == strcmp("id042", found));
+  free(found);
+  SOPHIA_ASSERT(db.Delete(key));
+  SOPHIA_ASSERT(db.Get(key, v));
+  assert(NULL == v.Data());
+
+  FixedKeyDB<8>::Pack(7, keys);
+  FixedKeyDB<8>::Pack(42, keys + 8);
+  FixedKeyDB<8>::Pack(99, keys + 16);
+  SOPHIA_ASSERT(db.MultiGet(keys, 3, result));
+  assert(0 == strcmp("id007", result.Data(0)));
+  assert(NULL == result.Data(1));
+  assert(0 == strcmp("id099", result.Data(2)));
+
+  // cached fixed-width keys hit, and don't collide
+  ValueCacheStats stats;
+  SOPHIA_ASSERT(sp->Cache(1 << 20));
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint64_t id = 0; id < 100; id++) {
+      if (42 == id) continue;
+      FixedKeyDB<8>::Pack(id, key);
+      sprintf(value, "id%03d", (int) id);
+      SOPHIA_ASSERT(db.Get(key, v));
+      assert(0 == strcmp(value, v.Data()));
     }
   }
+  sp->CacheStats(&stats);
+  assert(99 == stats.hits);
+  SOPHIA_ASSERT(sp->Cache(0));
 
-  SOPHIA_ASSERT(t->Commit());
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
 
-  size_t count;
-  SOPHIA_ASSERT(sp->Count(&count));
-  assert(sets == count);
+TEST(FixedKeyDB, Iterator) {
+  Sophia *sp = new Sophia("testtyped");
+  FixedKeyDB<8> db(sp);
+  IteratorResult result;
+  char start[8];
+  char end[8];
+  char key[8];
+
+  SOPHIA_ASSERT(sp->Open());
+  for (uint64_t id = 0; id < 1000; id += 10) {
+    FixedKeyDB<8>::Pack(id, key);
+    SOPHIA_ASSERT(db.Set(key, "", 1));
+  }
+
+  // ids sort numerically, across byte boundaries
+  FixedKeyDB<8>::Pack(250, start);
+  FixedKeyDB<8>::Pack(300, end);
+  FixedKeyIterator<8> it(sp, SPGTE, start, end);
+  SOPHIA_ASSERT(it.Begin());
+  uint64_t expected = 250;
+  while (it.Next(&result)) {
+    assert(8 == result.keysize);
+    assert(expected == FixedKeyDB<8>::Unpack(result.key));
+    expected += 10;
+  }
+  SOPHIA_ASSERT(it.End());
+  assert(300 == expected);
+
+  FixedKeyIterator<8> down(sp, SPLTE, end, start);
+  SOPHIA_ASSERT(down.Begin());
+  expected = 300;
+  while (down.Next(&result)) {
+    assert(expected == FixedKeyDB<8>::Unpack(result.key));
+    expected -= 10;
+  }
+  SOPHIA_ASSERT(down.End());
+  assert(250 == expected);
+
+  int rows = 0;
+  FixedKeyIterator<8> all(sp);
+  SOPHIA_ASSERT(all.Begin());
+  while (all.Next(&result)) rows++;
+  SOPHIA_ASSERT(all.End());
+  assert(100 == rows);
+
+  SOPHIA_ASSERT(sp->Clear());
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+/**
+ * GroupCommitWriter tests.
+ */
+
+/**
+ * GroupCommitWriter worker state.
+ */
 
+typedef struct {
+  GroupCommitWriter *writer;
+  int id;
+  int failures;
+} GroupCommitWorker;
+
+/**
+ * Set keys `groupN:000`.., waiting for each commit.
+ */
+
+static void *
+GroupCommitWork(void *data) {
+  GroupCommitWorker *worker = (GroupCommitWorker *) data;
+  char key[32];
+
+  for (int i = 0; i < 200; i++) {
+    sprintf(key, "group%d:%03d", worker->id, i);
+    if (SOPHIA_SUCCESS != worker->writer->Set(key, key)) worker->failures++;
+  }
+
+  return NULL;
+}
+
+/**
+ * Count successful commits.
+ */
+
+static void
+CountCommit(SophiaReturnCode rc, void *data) {
+  if (SOPHIA_SUCCESS == rc) (*(int *) data)++;
+}
+
+TEST(GroupCommitWriter, Set) {
+  Sophia *sp = new Sophia("testdb");
+  GroupCommitWriter writer(sp, 64, 1000);
+  pthread_t threads[8];
+  GroupCommitWorker workers[8];
+
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == writer.Start());
+  SOPHIA_ASSERT(sp->Open());
+  assert(SOPHIA_WRITER_STOPPED_ERROR == writer.Set("group", "group"));
+  SOPHIA_ASSERT(writer.Start());
+
+  for (int i = 0; i < 8; i++) {
+    workers[i].writer = &writer;
+    workers[i].id = i;
+    workers[i].failures = 0;
+    int rc = pthread_create(&threads[i], NULL, GroupCommitWork, &workers[i]);
+    assert(0 == rc);
+  }
+  for (int i = 0; i < 8; i++) {
+    assert(0 == pthread_join(threads[i], NULL));
+    assert(0 == workers[i].failures);
+  }
+
+  SOPHIA_ASSERT(writer.Stop());
+  assert(1600 == writer.Writes());
+  // concurrent writes share commits
+  assert(writer.Batches() < writer.Writes());
+
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 200; j++) {
+      char key[32];
+      sprintf(key, "group%d:%03d", i, j);
+      char *value = sp->Get(key);
+      assert(value);
+      assert(0 == strcmp(key, value));
+      free(value);
+    }
+  }
+
+  SOPHIA_ASSERT(sp->DeleteRange("group", "grouq"));
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(GroupCommitWriter, Callback) {
+  Sophia *sp = new Sophia("testdb");
+  GroupCommitWriter writer(sp, 100, 0);
+  int commits = 0;
+  char key[32];
+
+  SOPHIA_ASSERT(sp->Open());
+  SOPHIA_ASSERT(writer.Start());
+
+  for (int i = 0; i < 1000; i++) {
+    sprintf(key, "group:%04d", i);
+    SOPHIA_ASSERT(writer.Set(key, 11, key, 11, CountCommit, &commits));
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    sprintf(key, "group:%04d", i);
+    SOPHIA_ASSERT(writer.Delete(key, 11, CountCommit, &commits));
+  }
+
+  // queued writes are committed before Stop() returns
+  SOPHIA_ASSERT(writer.Stop());
+  assert(1500 == commits);
+  assert(SOPHIA_WRITER_STOPPED_ERROR == writer.Delete("group:0001"));
+
+  int rows = 0;
+  PrefixIterator it(sp, "group:");
+  for (const IteratorResult &res : it) {
+    assert(1 == (res.key[9] - '0') % 2);
+    rows++;
+  }
+  assert(500 == rows);
+
+  SOPHIA_ASSERT(sp->DeleteRange("group", "grouq"));
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+/**
+ * AsyncSophia tests.
+ */
+
+/**
+ * Count rows seen by a scan.
+ */
+
+static bool
+CountScanned(const IteratorResult *result, void *data) {
+  (*(int *) data) += result->keysize ? 1 : 0;
+  return true;
+}
+
+/**
+ * Count successful operations.
+ */
+
+static void
+CountAsync(SophiaReturnCode rc, void *data) {
+  if (SOPHIA_SUCCESS == rc) __sync_fetch_and_add((int *) data, 1);
+}
+
+/**
+ * Count found values.
+ */
+
+static void
+CountAsyncGet(AsyncGetResult result, void *data) {
+  if (SOPHIA_SUCCESS == result.rc && result.value) {
+    __sync_fetch_and_add((int *) data, 1);
+  }
+}
+
+TEST(AsyncSophia, Future) {
+  Sophia *sp = new Sophia("testdb");
+  sp->ThreadSafe();
+  SOPHIA_ASSERT(sp->Open());
+  AsyncSophia async(sp, 4, 16);
+  SOPHIA_ASSERT(async.Start());
+
+  SOPHIA_ASSERT(async.SetAsync("async:a", "1").get());
+  SOPHIA_ASSERT(async.SetAsync("async:b", 8, "22", 2).get());
+  SOPHIA_ASSERT(async.SetAsync("async:c", "3").get());
+
+  AsyncGetResult result = async.GetAsync("async:b").get();
+  SOPHIA_ASSERT(result.rc);
+  assert(2 == result.valuesize);
+  assert(0 == memcmp("22", result.value, 2));
+  free(result.Release());
+  assert(NULL == result.value);
+
+  result = async.GetAsync("async:z").get();
+  SOPHIA_ASSERT(result.rc);
+  assert(NULL == result.value);
+
+  // a result dropped unread frees its value
+  async.GetAsync("async:a");
+
+  const char *keys[] = { "async:c", "async:z", "async:a" };
+  size_t keysizes[] = { 8, 8, 8 };
+  MultiGetResult values;
+  SOPHIA_ASSERT(async.MultiGetAsync(keys, keysizes, 3, values).get());
+  assert(0 == strcmp("3", values.Data(0)));
+  assert(NULL == values.Data(1));
+  assert(0 == strcmp("1", values.Data(2)));
+
+  int rows = 0;
+  std::future<SophiaReturnCode> scan = async.ScanAsync(
+      "async:"
+    , 6
+    , "async:c"
+    , 8
+    , CountScanned
+    , &rows
+  );
+  SOPHIA_ASSERT(scan.get());
+  assert(2 == rows);
+
+  SOPHIA_ASSERT(async.DeleteAsync("async:a").get());
+  SOPHIA_ASSERT(async.DeleteAsync("async:b").get());
+  SOPHIA_ASSERT(async.DeleteAsync("async:c").get());
+  assert(NULL == sp->Get("async:a"));
+
+  SOPHIA_ASSERT(async.Stop());
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(AsyncSophia, Callback) {
+  Sophia *sp = new Sophia("testdb");
+  sp->ThreadSafe();
+  SOPHIA_ASSERT(sp->Open());
+  AsyncSophia async(sp, 4, 16);
+  SOPHIA_ASSERT(async.Start());
+  int sets = 0;
+  int gets = 0;
+  int deletes = 0;
+  char key[32];
+
+  for (int i = 0; i < 1000; i++) {
+    sprintf(key, "async:%04d", i);
+    SOPHIA_ASSERT(async.SetAsync(key, 11, key, 11, CountAsync, &sets));
+  }
+  // queued operations run before Stop() returns
+  SOPHIA_ASSERT(async.Stop());
+  assert(1000 == sets);
+
+  SOPHIA_ASSERT(async.Start());
+  for (int i = 0; i < 1000; i++) {
+    sprintf(key, "async:%04d", i);
+    SOPHIA_ASSERT(async.GetAsync(key, 11, CountAsyncGet, &gets));
+    SOPHIA_ASSERT(async.DeleteAsync(key, 11, CountAsync, &deletes));
+  }
+  SOPHIA_ASSERT(async.Stop());
+  assert(1000 == deletes);
+  assert(0 < gets);
+
+  int rows = 0;
+  SOPHIA_ASSERT(sp->ScanPrefix("async:", 6, CountScanned, &rows));
+  assert(0 == rows);
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(AsyncSophia, Stopped) {
+  Sophia *sp = new Sophia("testdb");
+  AsyncSophia single(sp, 1);
+  AsyncSophia pool(sp, 4);
+  int calls = 0;
+
+  assert(SOPHIA_DATABASE_NOT_OPEN_ERROR == single.Start());
+  SOPHIA_ASSERT(sp->Open());
+  assert(SOPHIA_NOT_THREAD_SAFE_ERROR == pool.Start());
+
+  assert(SOPHIA_POOL_STOPPED_ERROR == single.SetAsync("async", "a").get());
+  assert(SOPHIA_POOL_STOPPED_ERROR == single.GetAsync("async").get().rc);
+  assert(SOPHIA_POOL_STOPPED_ERROR == single.DeleteAsync(
+      "async"
+    , 6
+    , CountAsync
+    , &calls
+  ));
+  assert(0 == calls);
+
+  // a single worker doesn't need ThreadSafe()
+  SOPHIA_ASSERT(single.Start());
+  SOPHIA_ASSERT(single.SetAsync("async", "a").get());
+  SOPHIA_ASSERT(single.DeleteAsync("async").get());
+  SOPHIA_ASSERT(single.Stop());
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+#ifdef SOPHIA_COROUTINES
+
+/**
+ * Coroutine tests.
+ */
+
+/**
+ * Write, read back, commit and scan `co:` keys inline.
+ */
+
+static co::Task
+InlineCoroutine(Sophia *sp, int *done) {
+  SOPHIA_ASSERT(co_await co::Set(sp, "co:a", 5, "1", 2));
+
+  AsyncGetResult result = co_await co::Get(sp, "co:a", 5);
+  SOPHIA_ASSERT(result.rc);
+  assert(0 == strcmp("1", result.value));
+
+  Transaction t(sp);
+  SOPHIA_ASSERT(t.Begin());
+  SOPHIA_ASSERT(t.Set("co:b", "2"));
+  SOPHIA_ASSERT(co_await co::Commit(&t));
+
+  int rows = 0;
+  PrefixIterator it(sp, "co:");
+  for (const IteratorResult *row : co::Scan(&it)) {
+    assert(0 == strncmp("co:", row->key, 3));
+    rows++;
+  }
+  assert(2 == rows);
+
+  SOPHIA_ASSERT(co_await co::Delete(sp, "co:a", 5));
+  SOPHIA_ASSERT(co_await co::Delete(sp, "co:b", 5));
+  (*done)++;
+}
+
+/**
+ * Write and read back `co:N` through an AsyncSophia.
+ */
+
+static co::Task
+AsyncCoroutine(Sophia *sp, AsyncSophia *async, int id, int *done) {
+  char key[32];
+  sprintf(key, "co:%03d", id);
+
+  SOPHIA_ASSERT(co_await co::Set(async, key, 7, key, 7));
+  AsyncGetResult result = co_await co::Get(async, key, 7);
+  SOPHIA_ASSERT(result.rc);
+  assert(0 == strcmp(key, result.value));
+
+  __sync_fetch_and_add(done, 1);
+}
+
+/**
+ * Await a stopped AsyncSophia.
+ */
+
+static co::Task
+StoppedCoroutine(AsyncSophia *async, int *done) {
+  assert(SOPHIA_POOL_STOPPED_ERROR == (co_await co::Get(async, "co", 3)).rc);
+  assert(SOPHIA_POOL_STOPPED_ERROR == co_await co::Delete(async, "co", 3));
+  (*done)++;
+}
+
+TEST(Coroutine, Inline) {
+  Sophia *sp = new Sophia("testdb");
+  int done = 0;
+
+  SOPHIA_ASSERT(sp->Open());
+  // never suspends, so it has finished on return
+  InlineCoroutine(sp, &done);
+  assert(1 == done);
+
+  SOPHIA_ASSERT(sp->Close());
+  delete sp;
+}
+
+TEST(Coroutine, Async) {
+  Sophia *sp = new Sophia("testdb");
+  sp->ThreadSafe();
+  SOPHIA_ASSERT(sp->Open());
+  AsyncSophia async(sp, 4, 1024);
+  int done = 0;
+
+  StoppedCoroutine(&async, &done);
+  assert(1 == done);
+
+  done = 0;
+  SOPHIA_ASSERT(async.Start());
+  for (int i = 0; i < 100; i++) AsyncCoroutine(sp, &async, i, &done);
+  for (int i = 0; i < 5000 && 100 != __sync_fetch_and_add(&done, 0); i++) {
+    usleep(1000);
+  }
+  assert(100 == done);
+  SOPHIA_ASSERT(async.Stop());
+
+  SOPHIA_ASSERT(sp->DeleteRange("co:", "co;"));
   SOPHIA_ASSERT(sp->Close());
   delete sp;
 }
 
+#endif
+
 int
 main(void) {
   srand(time(0));
@@ -402,15 +2839,33 @@ main(void) {
   SUITE("Sophia");
   RUN_TEST(Sophia, Set);
   RUN_TEST(Sophia, Get);
+  RUN_TEST(Sophia, GetValue);
+  RUN_TEST(Sophia, MultiGet);
   RUN_TEST(Sophia, Delete);
   RUN_TEST(Sophia, Error);
   RUN_TEST(Sophia, IsOpen);
   RUN_TEST(Sophia, Clear);
+  RUN_TEST(Sophia, DeleteRange);
+  RUN_TEST(Sophia, ScanPrefix);
   RUN_TEST(Sophia, Count);
+  RUN_TEST(Sophia, TrackCount);
+  RUN_TEST(Sophia, TrackCountUncleanShutdown);
+  RUN_TEST(Sophia, ThreadSafe);
+  RUN_TEST(Sophia, Cache);
+  RUN_TEST(Sophia, Filter);
+  RUN_TEST(Sophia, Compression);
+  RUN_TEST(Sophia, Stats);
+  RUN_TEST(Sophia, Trace);
+  RUN_TEST(Sophia, Snapshot);
+  RUN_TEST(Sophia, ParallelScan);
+  RUN_TEST(Sophia, SecondaryIndex);
 
   SUITE("Iterator");
   RUN_TEST(Iterator, Begin);
   RUN_TEST(Iterator, Next);
+  RUN_TEST(Iterator, Result);
+  RUN_TEST(Iterator, Range);
+  RUN_TEST(Iterator, Prefix);
 
   SUITE("Transaction");
   RUN_TEST(Transaction, Begin);
@@ -418,5 +2873,42 @@ main(void) {
   RUN_TEST(Transaction, Delete);
   RUN_TEST(Transaction, Commit);
 
+  SUITE("WriteBatch");
+  RUN_TEST(WriteBatch, Set);
+  RUN_TEST(WriteBatch, Delete);
+  RUN_TEST(WriteBatch, Clear);
+
+  SUITE("BulkLoader");
+  RUN_TEST(BulkLoader, Load);
+  RUN_TEST(BulkLoader, File);
+
+  SUITE("Environment");
+  RUN_TEST(Environment, Handle);
+  RUN_TEST(Environment, Transaction);
+
+  SUITE("TypedDB");
+  RUN_TEST(TypedDB, Integers);
+  RUN_TEST(TypedDB, Floats);
+  RUN_TEST(TypedDB, Tuples);
+
+  SUITE("FixedKeyDB");
+  RUN_TEST(FixedKeyDB, Get);
+  RUN_TEST(FixedKeyDB, Iterator);
+
+  SUITE("GroupCommitWriter");
+  RUN_TEST(GroupCommitWriter, Set);
+  RUN_TEST(GroupCommitWriter, Callback);
+
+  SUITE("AsyncSophia");
+  RUN_TEST(AsyncSophia, Future);
+  RUN_TEST(AsyncSophia, Callback);
+  RUN_TEST(AsyncSophia, Stopped);
+
+#ifdef SOPHIA_COROUTINES
+  SUITE("Coroutine");
+  RUN_TEST(Coroutine, Inline);
+  RUN_TEST(Coroutine, Async);
+#endif
+
   printf("\n");
 }